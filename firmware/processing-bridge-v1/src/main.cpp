@@ -28,12 +28,38 @@ typedef struct {
 typedef enum _serial_mode_t {
 	MODE_NONE,
 	MODE_STATE,
-	MODE_CONF
+	MODE_CONF,
+	MODE_TIME,
+	MODE_PROBE,
+	MODE_ONSET,
+	MODE_THERMAL
 } serial_mode_t;
 
 void set(state_t*, uint8_t, uint8_t, bool, bool);
+void beginCommand(uint8_t);
 void write(const state_t*, uint8_t);
 void drive(const bool*);
+void driveOnset(const bool*, unsigned long);
+void setOnsetMode(bool);
+void scanOnset(const bool*, unsigned long);
+void releaseOnset(const bool*, uint8_t);
+uint8_t onsetCohort(uint8_t);
+void setOnsetCohort(uint8_t, uint8_t);
+unsigned long segmentLen(uint8_t);
+bool thermalCycle(uint8_t, bool);
+bool thermalSkipping(uint8_t);
+void thermalPulse(uint8_t, unsigned long, uint8_t);
+void thermalCohort(uint8_t);
+void setThermalBudget(uint8_t);
+void updateThermal();
+void reportThermal();
+void armProbe();
+void reportProbe();
+void spiBeginFrame();
+void spiQueue(uint8_t);
+void spiEndFrame();
+void spiKick();
+void spiNext();
 
 // There are three NCV7718 chips on each board, hence we have three state_t structs
 // We init them off by setting en = 0 and dir = 0 for each
@@ -49,11 +75,117 @@ bool bstates[TOTAL_BRIDGES];
 serial_mode_t mode = MODE_NONE;
 int serial_byte_count = 0;
 
+// Latency probe variables
+//
+// The same probe as the v6 master: 0x88 <tag> marks the next state frame and we answer
+// "probe <tag> <receipt> <apply> <spi>" once its change reached the chips, and 0x86 <tag>
+// answers "time <tag> <micros> <micros>" so the host can put those on its own clock.
+
+unsigned long time_query_us = 0;
+int16_t probe_tag = -1;
+int16_t probe_applied_tag = -1;
+unsigned long probe_receipt_us = 0, probe_apply_us = 0;
+volatile bool probe_spi_armed = false;
+volatile bool probe_spi_done = false;
+volatile uint8_t probe_spi_index = 0;
+volatile unsigned long probe_spi_us = 0;
+
+// Immediate onset variables
+//
+// The same immediate onset mode as the v6 master, 0x8A 1 starts every newly enabled
+// tapper's cycle right away instead of waiting for the global one, 0x8A 0 switches back.
+// Tappers that start together share a cohort and each tapper stores its cohort in 4 bits,
+// every write() carries all cohorts' phase changes since the last one.
+
+#define ONSET_COHORTS 8
+#define ONSET_NONE 0x0F
+#define ONSET_MERGE_US 2000
+
+typedef struct {
+	unsigned long next; // micros() of its next phase change
+	uint8_t phase; // numbered like phase
+	uint8_t members;
+	uint8_t pulses; // pulse phases so far, for the thermal governor's dither
+} cohort_t;
+
+bool onset_mode = false;
+cohort_t cohorts[ONSET_COHORTS];
+// Cohort of every tapper, two per byte low nibble first, ONSET_NONE for none
+uint8_t onset_cohorts[(TOTAL_BRIDGES + 1) / 2];
+bool onset_scan = false;
+bool onset_dirty = false;
+
+// Thermal governor variables
+//
+// The same governor as the v6 master: after 0x8B <budget> (percent, 0 for off) every
+// tapper keeps a first order estimate of its heat and sits out cycles while it's over the
+// budget duty cycle, and changes to which tappers are throttled are reported as
+// "thermal <throttled> <skipped> <mask>". The mask has four hex digits per board, its
+// two bytes laid out like in a state frame.
+
+#define THERMAL_TICK_MS 128
+#define THERMAL_SHIFT 5
+#define THERMAL_UNIT_US 16384
+#define THERMAL_FULL ((THERMAL_TICK_MS * 1000L << THERMAL_SHIFT) / THERMAL_UNIT_US)
+#define THERMAL_REPORT_MS 250
+
+uint8_t thermal_budget = 0;
+uint8_t thermal_limit = 0, thermal_release = 0;
+uint8_t thermal_heat[TOTAL_BRIDGES];
+uint8_t thermal_ticks = 0;
+// Pulse phases of the global cycle so far, for the dither
+uint8_t thermal_pulses = 0;
+// One bit per tapper: sitting out its current cycle, and throttled
+uint8_t thermal_skip[(TOTAL_BRIDGES + 7) / 8];
+uint8_t thermal_hot[(TOTAL_BRIDGES + 7) / 8];
+uint8_t thermal_hot_count = 0;
+uint32_t thermal_skipped = 0;
+bool thermal_changed = false;
+unsigned long thermal_tick_ms = 0, thermal_report_ms = 0;
+
 // Pulse configuration variables
 
 uint32_t tmpUpPulseLen = 0, tmpInterPulseLen = 0, tmpDownPulseLen = 0, tmpPauseLen = 0;
 uint32_t upPulseLen = 500, interPulseLen = 500, downPulseLen = 500, pauseLen = 500;
 
+// SPI transmit engine
+//
+// write() doesn't shift the bytes out itself. It queues them as one CS frame (all chips
+// in the chain under SS_PIN) and returns, and the SPI transfer complete interrupt feeds
+// the next byte to the hardware and raises SS_PIN after the frame's last one, which
+// latches the chips. So serial keeps being handled while the frame shifts out.
+//
+// The interrupt may start on a frame that is still being queued and just stalls if it
+// catches up with the encoder, spiQueue() picks it up again.
+
+// Byte queue, the uint8_t indices wrap around it by themselves
+#define SPI_QUEUE_SIZE 256
+// CS frames in flight, must be a power of two
+#define SPI_FRAMES 4
+
+typedef struct {
+	uint8_t end; // queue index just past the frame's last byte, once it's closed
+	bool closed;
+} spi_frame_t;
+
+volatile uint8_t spi_queue[SPI_QUEUE_SIZE];
+volatile uint8_t spi_head = 0, spi_tail = 0;
+volatile spi_frame_t spi_frames[SPI_FRAMES];
+volatile uint8_t spi_frame_head = 0, spi_frame_tail = 0;
+// SS_PIN is low for the frame at spi_frame_tail
+volatile bool spi_selected = false;
+// A byte is shifting, the interrupt will call spiNext()
+volatile bool spi_busy = false;
+
+volatile uint8_t* ss_port;
+uint8_t ss_mask;
+
+// NCV7718 enable and current control bits for three bridges, indexed by their en / dir
+// bits. Each bridge takes two bits, enabled bridges set both EN bits, the CC bits are 01
+// for dir 1 and 10 for dir 0
+const uint8_t NCV_EN_BITS[8] = {0x00, 0x03, 0x0C, 0x0F, 0x30, 0x33, 0x3C, 0x3F};
+const uint8_t NCV_CC_BITS[8] = {0x2A, 0x29, 0x26, 0x25, 0x1A, 0x19, 0x16, 0x15};
+
 void setup() {
 	// Clear the states array
 	for (int i = 0; i < NCV_CHIPS; i++) {
@@ -71,13 +203,21 @@ void setup() {
 	digitalWrite(NCV_EN_PIN, HIGH); // enabled (active high)
 	digitalWrite(SS_PIN, HIGH); // not selected (active low)
 
+	// The engine raises SS_PIN from its interrupt, digitalWrite() is too slow there
+	ss_port = portOutputRegister(digitalPinToPort(SS_PIN));
+	ss_mask = digitalPinToBitMask(SS_PIN);
+
 	// Configure SPI
 	SPI.begin();
 	SPI.beginTransaction(SPISettings(5e6, MSBFIRST, SPI_MODE1));
+	// From here on the SPI interrupt owns SPIF, SPI.transfer() must not be used
+	SPCR |= _BV(SPIE);
+
+	setOnsetMode(false);
 
 	Serial.begin(115200);
 
-	Serial.println("ready");
+	Serial.println(F("ready"));
 }
 
 void loop() {
@@ -86,13 +226,13 @@ void loop() {
 		uint8_t incomingByte = Serial.read();
 		
 		if (SERIAL_DEBUG) {
-			Serial.print("serial_byte_count: ");
+			Serial.print(F("serial_byte_count: "));
 			Serial.println(serial_byte_count);
 		}
 
 		switch(mode) {
 			case MODE_CONF: {
-				if (SERIAL_DEBUG) Serial.println("Conf started");
+				if (SERIAL_DEBUG) Serial.println(F("Conf started"));
 
 				switch(serial_byte_count) {
 					case 0: {
@@ -134,14 +274,14 @@ void loop() {
 						downPulseLen = tmpDownPulseLen;
 						pauseLen = tmpPauseLen;
 						if (SERIAL_DEBUG) {
-							Serial.println("Conf done");
-							Serial.print("  >upPulseLen: ");
+							Serial.println(F("Conf done"));
+							Serial.print(F("  >upPulseLen: "));
 							Serial.println(upPulseLen);
-							Serial.print("  >interPulseLen: ");
+							Serial.print(F("  >interPulseLen: "));
 							Serial.println(interPulseLen);
-							Serial.print("  >downPulseLen: ");
+							Serial.print(F("  >downPulseLen: "));
 							Serial.println(downPulseLen);
-							Serial.print("  >pauseLen: ");
+							Serial.print(F("  >pauseLen: "));
 							Serial.println(pauseLen);
 							Serial.println();
 						}
@@ -156,15 +296,15 @@ void loop() {
 			}
 
 			case MODE_STATE: {
-				if (SERIAL_DEBUG) Serial.println("State started");
+				if (SERIAL_DEBUG) Serial.println(F("State started"));
 				if (incomingByte == 0x82) {
 					if (SERIAL_DEBUG) {
 						if (SERIAL_DEBUG) {
-							Serial.println("State done");
+							Serial.println(F("State done"));
 							for (int i = 0; i < TOTAL_BRIDGES; i++) {
-								if (i % 3 == 0) Serial.print("  >");
+								if (i % 3 == 0) Serial.print(F("  >"));
 								Serial.print(bstates[(i / BRIDGE_PER_BOARD) * BRIDGE_PER_BOARD + (i % BRIDGE_PER_BOARD) / 3 + (i%3)*3]);
-								Serial.print(" ");
+								Serial.print(F(" "));
 								if (i % 3 == 2) Serial.println();
 								if (i % 9 == 8) Serial.println();
 							}
@@ -172,6 +312,12 @@ void loop() {
 					}
 
 					// We just latch as we go, there's not really risk to that
+					if (probe_tag >= 0 && probe_applied_tag < 0) {
+						probe_apply_us = micros();
+						probe_applied_tag = probe_tag;
+					}
+					probe_tag = -1;
+					onset_scan = onset_mode;
 					mode = MODE_NONE;
 					break;
 				}
@@ -190,48 +336,139 @@ void loop() {
 				serial_byte_count++;
 				break;
 			}
+			case MODE_TIME: {
+				if ((incomingByte & 0x80) != 0) {
+					// Not a valid tag, must be a command
+					beginCommand(incomingByte);
+					break;
+				}
+
+				Serial.print(F("time "));
+				Serial.print(incomingByte);
+				Serial.print(' ');
+				Serial.print(time_query_us);
+				Serial.print(' ');
+				Serial.println(time_query_us);
+				mode = MODE_NONE;
+				break;
+			}
+			case MODE_PROBE: {
+				if ((incomingByte & 0x80) != 0) {
+					// Not a valid tag, must be a command
+					beginCommand(incomingByte);
+					break;
+				}
+
+				probe_tag = incomingByte;
+				mode = MODE_NONE;
+				break;
+			}
+			case MODE_ONSET: {
+				if ((incomingByte & 0x80) != 0) {
+					// Not a valid mode, must be a command
+					beginCommand(incomingByte);
+					break;
+				}
+
+				setOnsetMode(incomingByte != 0);
+				mode = MODE_NONE;
+				break;
+			}
+			case MODE_THERMAL: {
+				if ((incomingByte & 0x80) != 0) {
+					// Not a valid budget, must be a command
+					beginCommand(incomingByte);
+					break;
+				}
+
+				setThermalBudget(incomingByte);
+				mode = MODE_NONE;
+				break;
+			}
 			default:
 			case MODE_NONE: {
-				if (SERIAL_DEBUG) Serial.println("None start");
-				serial_byte_count = 0;
-				switch(incomingByte) {
-					case 0x80: {
-						if (SERIAL_DEBUG) Serial.println("  >Conf");
-						mode = MODE_CONF;
-
-						tmpUpPulseLen = 0;
-						tmpInterPulseLen = 0;
-						tmpDownPulseLen = 0;
-						tmpPauseLen = 0;
-						break;
-					}
-					case 0x81: {
-						if (SERIAL_DEBUG) Serial.println("  >State");
-						mode = MODE_STATE;
-						break;
-					}
-					default: {
-						if (SERIAL_DEBUG) Serial.println("  >?");
-						mode = MODE_NONE;
-						break;
-					}
-				}
+				beginCommand(incomingByte);
 				break;
 			}
 		}		
 	}
 
+	updateThermal();
+
 	drive(bstates);
+
+	if (probe_spi_done) reportProbe();
+}
+
+// Interpret a byte received outside of any frame as the start of a new command
+void beginCommand(uint8_t incomingByte) {
+	if (SERIAL_DEBUG) Serial.println(F("None start"));
+	serial_byte_count = 0;
+	switch(incomingByte) {
+		case 0x80: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Conf"));
+			mode = MODE_CONF;
+
+			tmpUpPulseLen = 0;
+			tmpInterPulseLen = 0;
+			tmpDownPulseLen = 0;
+			tmpPauseLen = 0;
+			break;
+		}
+		case 0x81: {
+			if (SERIAL_DEBUG) Serial.println(F("  >State"));
+			mode = MODE_STATE;
+			if (probe_tag >= 0) probe_receipt_us = micros();
+			break;
+		}
+		case 0x86: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Time"));
+			time_query_us = micros();
+			mode = MODE_TIME;
+			break;
+		}
+		case 0x88: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Probe"));
+			mode = MODE_PROBE;
+			break;
+		}
+		case 0x8A: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Onset"));
+			mode = MODE_ONSET;
+			break;
+		}
+		case 0x8B: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Thermal"));
+			mode = MODE_THERMAL;
+			break;
+		}
+		default: {
+			if (SERIAL_DEBUG) Serial.println(F("  >?"));
+			mode = MODE_NONE;
+			break;
+		}
+	}
 }
 
 void drive(const bool* bstates) {
+	if (onset_mode) {
+		driveOnset(bstates, micros());
+		return;
+	}
+
 	unsigned long cur_time = micros()/10;
 	unsigned long period = upPulseLen+interPulseLen+downPulseLen+pauseLen;
 	unsigned long cur_period = cur_time % period;
 
 	if (cur_period >= 0 && cur_period < upPulseLen && phase != 1) {
 		// pulse fwd
-		for (int i = 0; i < TOTAL_BRIDGES; i++) set(states, NCV_CHIPS, i, bstates[i], false);
+		thermal_pulses++;
+		for (int i = 0; i < TOTAL_BRIDGES; i++) {
+			bool on = thermalCycle(i, bstates[i]);
+			if (on) thermalPulse(i, upPulseLen*10, thermal_pulses);
+			set(states, NCV_CHIPS, i, on, false);
+		}
+		armProbe();
 		write(states, NCV_CHIPS);
 		phase = 1;
 	} else if (cur_period >= upPulseLen && cur_period < upPulseLen+interPulseLen && phase != 2) {
@@ -241,7 +478,13 @@ void drive(const bool* bstates) {
 		phase = 2;
 	} else if (cur_period >= upPulseLen+interPulseLen && cur_period < upPulseLen+interPulseLen+downPulseLen && phase != 3) {
 		// pulse back
-		for (int i = 0; i < TOTAL_BRIDGES; i++) set(states, NCV_CHIPS, i, bstates[i], true);
+		thermal_pulses++;
+		for (int i = 0; i < TOTAL_BRIDGES; i++) {
+			bool on = bstates[i] && !thermalSkipping(i);
+			if (on) thermalPulse(i, downPulseLen*10, thermal_pulses);
+			set(states, NCV_CHIPS, i, on, true);
+		}
+		armProbe();
 		write(states, NCV_CHIPS);
 		phase = 3;
 	} else if (cur_period >= upPulseLen+interPulseLen+downPulseLen && cur_period < period && phase != 0) {
@@ -254,6 +497,255 @@ void drive(const bool* bstates) {
 	phase = phase % 4;
 }
 
+// Immediate onset version of drive(), every cohort runs its own cycle
+void driveOnset(const bool* bstates, unsigned long now) {
+	unsigned long period = upPulseLen+interPulseLen+downPulseLen+pauseLen;
+
+	for (uint8_t c = 0; c < ONSET_COHORTS && period > 0; c++) {
+		cohort_t* cohort = &cohorts[c];
+		while (cohort->members > 0 && (long)(now - cohort->next) >= 0) {
+			cohort->phase = (cohort->phase + 1) % 4;
+			cohort->next += segmentLen(cohort->phase);
+			onset_dirty = true;
+
+			if (cohort->phase == 1) {
+				// A new cycle, tappers that were disabled during the last one leave and
+				// waiting ones may join
+				releaseOnset(bstates, c);
+				onset_scan = true;
+			}
+			if (cohort->phase == 1 || cohort->phase == 3) thermalCohort(c);
+		}
+	}
+
+	if (onset_scan) scanOnset(bstates, now);
+
+	// Changes wait while the last write is still going out and then share the next one
+	if (!onset_dirty || spi_frame_tail != spi_frame_head) return;
+
+	for (int i = 0; i < TOTAL_BRIDGES; i++) {
+		uint8_t c = onsetCohort(i);
+		uint8_t p = c == ONSET_NONE ? 0 : cohorts[c].phase;
+		set(states, NCV_CHIPS, i, (p == 1 || p == 3) && !thermalSkipping(i), p == 3);
+	}
+	armProbe();
+	write(states, NCV_CHIPS);
+	onset_dirty = false;
+}
+
+// Switch immediate onset on or off, either way starting over from the current bstates
+void setOnsetMode(bool on) {
+	onset_mode = on;
+	for (int c = 0; c < ONSET_COHORTS; c++) cohorts[c].members = 0;
+	memset(onset_cohorts, 0xFF, sizeof(onset_cohorts));
+	onset_scan = on;
+	// Bridges a global pulse left energized have to be rewritten even if no tapper joins a
+	// cohort, so have driveOnset() write right away, and drive() its current phase
+	onset_dirty = true;
+	memset(thermal_skip, 0, sizeof(thermal_skip));
+	phase = -1;
+}
+
+// Put enabled tappers that don't follow a cohort into one that has just started, or
+// start a new one
+void scanOnset(const bool* bstates, unsigned long now) {
+	onset_scan = false;
+
+	uint8_t fresh = ONSET_NONE;
+	for (uint8_t c = 0; c < ONSET_COHORTS; c++) {
+		if (cohorts[c].members > 0 && cohorts[c].phase == 1 &&
+				(long)(cohorts[c].next - now) > (long)(upPulseLen*10) - ONSET_MERGE_US) {
+			fresh = c;
+			break;
+		}
+	}
+
+	for (int i = 0; i < TOTAL_BRIDGES; i++) {
+		if (!bstates[i] || onsetCohort(i) != ONSET_NONE) continue;
+
+		if (fresh == ONSET_NONE) {
+			for (uint8_t c = 0; c < ONSET_COHORTS && fresh == ONSET_NONE; c++) {
+				if (cohorts[c].members == 0) fresh = c;
+			}
+			// All taken, wait for one to start its next cycle
+			if (fresh == ONSET_NONE) return;
+
+			cohorts[fresh].phase = 1;
+			cohorts[fresh].next = now + segmentLen(1);
+			onset_dirty = true;
+		}
+
+		setOnsetCohort(i, fresh);
+		cohorts[fresh].members++;
+		if (thermalCycle(i, true)) thermalPulse(i, segmentLen(1), cohorts[fresh].pulses);
+	}
+}
+
+// Let the disabled tappers of a cohort go
+void releaseOnset(const bool* bstates, uint8_t c) {
+	for (int i = 0; i < TOTAL_BRIDGES; i++) {
+		if (!bstates[i] && onsetCohort(i) == c) {
+			setOnsetCohort(i, ONSET_NONE);
+			cohorts[c].members--;
+		}
+	}
+}
+
+uint8_t onsetCohort(uint8_t i) {
+	uint8_t b = onset_cohorts[i >> 1];
+	return i & 1 ? b >> 4 : b & 0x0F;
+}
+
+void setOnsetCohort(uint8_t i, uint8_t c) {
+	uint8_t* b = &onset_cohorts[i >> 1];
+	*b = i & 1 ? (*b & 0x0F) | c << 4 : (*b & 0xF0) | c;
+}
+
+// Length of a phase in micros
+unsigned long segmentLen(uint8_t p) {
+	switch (p) {
+		case 1: return upPulseLen*10;
+		case 2: return interPulseLen*10;
+		case 3: return downPulseLen*10;
+		default: return pauseLen*10;
+	}
+}
+
+// Start tapper i's cycle, returns false if it's disabled or too hot to pulse in it
+bool thermalCycle(uint8_t i, bool enabled) {
+	uint8_t bit = 1 << (i & 7);
+	thermal_skip[i >> 3] &= ~bit;
+	if (!enabled || thermal_budget == 0) return enabled;
+	if (thermal_heat[i] < thermal_limit) return true;
+
+	thermal_skip[i >> 3] |= bit;
+	thermal_skipped++;
+	if (!(thermal_hot[i >> 3] & bit)) {
+		thermal_hot[i >> 3] |= bit;
+		thermal_hot_count++;
+		thermal_changed = true;
+	}
+	return false;
+}
+
+// True if tapper i sits out its current cycle
+bool thermalSkipping(uint8_t i) {
+	return thermal_skip[i >> 3] & (1 << (i & 7));
+}
+
+// Heat tapper i up by a pulse of len micros, the n-th pulse phase of its cycle's clock
+void thermalPulse(uint8_t i, unsigned long len, uint8_t n) {
+	if (thermal_budget == 0) return;
+	// Golden ratio steps through the dither, so every tapper's rounding errors cancel out
+	// within a few pulses
+	uint8_t dither = (n + i) * 159;
+	uint16_t heat = thermal_heat[i] + ((len / (THERMAL_UNIT_US / 256) + dither) >> 8);
+	thermal_heat[i] = heat > 0xFF ? 0xFF : heat;
+}
+
+// Account for the pulse the tappers following cohort c just started, starting their cycle
+// if it's an up pulse
+void thermalCohort(uint8_t c) {
+	if (thermal_budget == 0) return;
+	cohorts[c].pulses++;
+	uint8_t p = cohorts[c].phase;
+	for (int i = 0; i < TOTAL_BRIDGES; i++) {
+		if (onsetCohort(i) != c) continue;
+		if (p == 1 ? !thermalCycle(i, true) : thermalSkipping(i)) continue;
+		thermalPulse(i, segmentLen(p), cohorts[c].pulses);
+	}
+}
+
+void setThermalBudget(uint8_t budget) {
+	if (budget > 100) budget = 100;
+	if (thermal_budget == 0 && budget > 0) {
+		// No idea how warm they are, start from cold
+		memset(thermal_heat, 0, sizeof(thermal_heat));
+		thermal_skipped = 0;
+		thermal_tick_ms = millis();
+	}
+	if (budget == 0) {
+		memset(thermal_skip, 0, sizeof(thermal_skip));
+		memset(thermal_hot, 0, sizeof(thermal_hot));
+		thermal_hot_count = 0;
+	}
+
+	thermal_budget = budget;
+	thermal_limit = THERMAL_FULL * budget / 100;
+	thermal_release = thermal_limit - thermal_limit / 8;
+	reportThermal();
+}
+
+// Let every tapper cool off by a tick's worth once every THERMAL_TICK_MS, and report
+// changes to which ones are throttled
+void updateThermal() {
+	if (thermal_budget == 0) return;
+
+	unsigned long now = millis();
+	if (now - thermal_tick_ms >= THERMAL_TICK_MS) {
+		thermal_tick_ms += THERMAL_TICK_MS;
+		thermal_ticks++;
+		for (int i = 0; i < TOTAL_BRIDGES; i++) {
+			thermal_heat[i] -= (thermal_heat[i] + ((thermal_ticks + i) & ((1 << THERMAL_SHIFT) - 1))) >> THERMAL_SHIFT;
+
+			uint8_t bit = 1 << (i & 7);
+			if ((thermal_hot[i >> 3] & bit) && thermal_heat[i] < thermal_release) {
+				thermal_hot[i >> 3] &= ~bit;
+				thermal_hot_count--;
+				thermal_changed = true;
+			}
+		}
+	}
+
+	if (thermal_changed && now - thermal_report_ms >= THERMAL_REPORT_MS) reportThermal();
+}
+
+void reportThermal() {
+	Serial.print(F("thermal "));
+	Serial.print(thermal_hot_count);
+	Serial.print(' ');
+	Serial.print(thermal_skipped);
+	Serial.print(' ');
+	for (int board = 0; board < NUM_BOARDS; board++) {
+		// Bridges 0-6 in the first byte and 7-8 in the second, like a state frame
+		uint16_t bits = 0;
+		for (int i = 0; i < BRIDGE_PER_BOARD; i++) {
+			uint8_t t = board*BRIDGE_PER_BOARD + i;
+			if (thermal_hot[t >> 3] & (1 << (t & 7))) bits |= 1 << i;
+		}
+		uint8_t bytes[2] = {(uint8_t)(bits & 0x7F), (uint8_t)(bits >> 7)};
+		for (int k = 0; k < 2; k++) {
+			if (bytes[k] < 0x10) Serial.print('0');
+			Serial.print(bytes[k], HEX);
+		}
+	}
+	Serial.println();
+	thermal_changed = false;
+	thermal_report_ms = millis();
+}
+
+// Have the SPI engine stamp the first byte of the write() about to be queued, if a probed
+// frame is waiting for one
+void armProbe() {
+	if (probe_applied_tag < 0 || probe_spi_armed || probe_spi_done) return;
+	probe_spi_index = spi_head;
+	probe_spi_armed = true;
+}
+
+// Answer a probe once its frame made it onto SPI
+void reportProbe() {
+	Serial.print(F("probe "));
+	Serial.print(probe_applied_tag);
+	Serial.print(' ');
+	Serial.print(probe_receipt_us);
+	Serial.print(' ');
+	Serial.print(probe_apply_us);
+	Serial.print(' ');
+	Serial.println(probe_spi_us);
+	probe_applied_tag = -1;
+	probe_spi_done = false;
+}
+
 // Helper function if you want to set the en and dir for a particular hbridge manually
 // e.g set(states, num_states, 3, 1, 1); would set the 3rd hbridge to en=1 dir=1
 void set(state_t* states, uint8_t num_states, uint8_t position, bool en, bool dir) {
@@ -269,35 +761,89 @@ void set(state_t* states, uint8_t num_states, uint8_t position, bool en, bool di
 	states[state_index].dir |= (dir << offset);
 }
 
-// Write a state array out over SPI
+// Queue a state array to be written out over SPI, returns before it is sent
 void write(const state_t* states, uint8_t num_states) {
-	// assert the slave select
-	digitalWrite(SS_PIN, LOW);
+	spiBeginFrame();
 
 	// For each NCV7718
 	for (int i = num_states-1; i >= 0; i--) {
-		// tmp variable to compute the actual SPI data to send. See datasheet for protocol details
-		uint8_t ncvEn = 0;
-		uint8_t ncvCC = 0;
-
-		for (int j = 0; j < 3; j++) {
-			// We bit shift our state struct into the target format
-			if ((states[i].en & (1 << j)) != 0) {
-				ncvEn |= (1 << j*2) | (1 << (j*2 +1));
-			}
+		// The actual SPI data to send. See datasheet for protocol details
+		uint8_t ncvEn = NCV_EN_BITS[states[i].en & 0b111];
+		uint8_t ncvCC = NCV_CC_BITS[states[i].dir & 0b111];
+
+		// Send 16 bits over SPI as per NCV7718 docs (we're ignoring the extra features and return values for now)
+		spiQueue(0 << 7 | 0 << 6 | 0 << 5 | ((ncvEn >> 1) & 0x1F));
+		spiQueue(((ncvEn & 0x01) << 7) | ((ncvCC & 0x3F) << 1) | 0);
+	}
+
+	spiEndFrame();
+}
+
+// Open a CS frame, waits if all frame slots are in flight
+void spiBeginFrame() {
+	while ((uint8_t)(spi_frame_head - spi_frame_tail) >= SPI_FRAMES) {}
+
+	spi_frames[spi_frame_head & (SPI_FRAMES-1)].closed = false;
+	spi_frame_head++;
+}
+
+// Append a byte to the open frame, waits if the queue is full
+void spiQueue(uint8_t b) {
+	while ((uint8_t)(spi_head + 1) == spi_tail) {}
+
+	spi_queue[spi_head] = b;
+	spi_head++;
+	spiKick();
+}
+
+// Close the open frame, SS_PIN goes high once its last byte is out
+void spiEndFrame() {
+	volatile spi_frame_t* frame = &spi_frames[(spi_frame_head - 1) & (SPI_FRAMES-1)];
+	frame->end = spi_head;
+	frame->closed = true;
+	spiKick();
+}
 
-			if ((states[i].dir & (1 << j)) != 0) {
-				ncvCC |= (1 << j*2) | (0 << (j*2 +1));
-			} else {
-				ncvCC |= (0 << j*2) | (1 << (j*2 +1));
+// Restart the engine if it's idle or stalled
+void spiKick() {
+	noInterrupts();
+	if (!spi_busy) spiNext();
+	interrupts();
+}
+
+// Send the next byte or finish the current frame, only ever called with interrupts off
+void spiNext() {
+	spi_busy = false;
+
+	while (spi_frame_tail != spi_frame_head) {
+		volatile spi_frame_t* frame = &spi_frames[spi_frame_tail & (SPI_FRAMES-1)];
+
+		if (!spi_selected) {
+			*ss_port &= ~ss_mask;
+			spi_selected = true;
+		}
+
+		if (spi_tail != (frame->closed ? frame->end : spi_head)) {
+			if (probe_spi_armed && spi_tail == probe_spi_index) {
+				probe_spi_us = micros();
+				probe_spi_armed = false;
+				probe_spi_done = true;
 			}
+			SPDR = spi_queue[spi_tail];
+			spi_tail++;
+			spi_busy = true;
+			return;
 		}
+		// Caught up with the encoder, spiQueue() kicks us again
+		if (!frame->closed) return;
 
-		// Send 16 bits over SPI as per NCV7718 docs (we're ignoring the extra features and return values for now)
-		SPI.transfer(0 << 7 | 0 << 6 | 0 << 5 | ((ncvEn >> 1) & 0x1F));
-		SPI.transfer(((ncvEn & 0x01) << 7) | ((ncvCC & 0x3F) << 1) | 0);
+		// deassert the slave select, which latches the chips
+		*ss_port |= ss_mask;
+		spi_selected = false;
+		spi_frame_tail++;
 	}
+}
 
-	// deassert the slave select
-	digitalWrite(SS_PIN, HIGH);
-}
\ No newline at end of file
+ISR(SPI_STC_vect) {
+	spiNext();
+}
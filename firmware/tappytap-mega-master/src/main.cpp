@@ -0,0 +1,140 @@
+// Mega 2560 master for several tappytap-pio daisy chains at once
+#include <Arduino.h>
+
+// Chains on Serial1, Serial2 and Serial3
+#define NUM_CHAINS 3
+// The host link has to carry all chains' bytes, so it runs well above the chains
+#define HOST_BAUD 500000
+// tappytap-pio boards run their UART at 38400 off the internal 8MHz clock
+#define CHAIN_BAUD 38400
+#define LATCH_BYTE 0x40
+
+#define SERIAL_DEBUG false
+
+// Boards on each chain, in the order the host sends them. Bytes for boards past the
+// last chain's share go to the last chain.
+const uint8_t CHAIN_BOARDS[NUM_CHAINS] = {3, 3, 3};
+
+// One daisy chain hanging off a hardware UART
+typedef struct {
+	HardwareSerial* port;
+	// UART status register and its transmit complete bit, set once the last stop bit is out
+	volatile uint8_t* ucsra;
+	uint8_t txc;
+	// Index of the chain's first board in the host frame
+	uint8_t first_board;
+	bool written;
+} chain_t;
+
+uint8_t chainFor(uint16_t);
+bool chainsIdle();
+void latchChains();
+
+chain_t chains[NUM_CHAINS] = {
+	{&Serial1, &UCSR1A, _BV(TXC1), 0, false},
+	{&Serial2, &UCSR2A, _BV(TXC2), 0, false},
+	{&Serial3, &UCSR3A, _BV(TXC3), 0, false},
+};
+
+// Counter of received bytes in the current host frame, -1 until the first [mark2]
+int16_t daisy_counter = -1;
+
+// The host's latch byte arrived, the chains latch together once they're all drained
+bool latch_pending = false;
+
+void setup() {
+	uint8_t first_board = 0;
+	for (uint8_t i = 0; i < NUM_CHAINS; i++) {
+		chains[i].first_board = first_board;
+		first_board += CHAIN_BOARDS[i];
+		chains[i].port->begin(CHAIN_BAUD);
+	}
+
+	Serial.begin(HOST_BAUD);
+}
+
+void loop() {
+	// Serial protocol:
+	//
+	// The host sends the same frames as for tappytap-v2-master (the "daisy" layout of the
+	// host tools): 3 bytes per board, [mark2] (0x80) on the very first byte and a [mark1]
+	// latch byte (0x40) at the end.
+	//
+	// The frame is cut into one slice per chain. Each byte is passed on to its chain's
+	// UART as soon as it arrives and the hardware serial interrupts shift all chains out
+	// in parallel, so a frame takes as long as the longest slice instead of the whole
+	// array. The first byte of every slice gets [mark2] so the chain's first board knows
+	// the update starts there.
+	//
+	// tappytap-pio boards that have seen a latch byte hold their new states until the
+	// next one. We hold the host's latch until every chain has shifted out its slice and
+	// then send it to all chains back to back, so the chains latch together instead of
+	// each one as soon as its own slice is through. Host bytes that arrive meanwhile wait
+	// in the receive buffer so they can't end up in front of the latch.
+
+	if (latch_pending) {
+		if (!chainsIdle()) return;
+		latchChains();
+	}
+
+	if (Serial.available() > 0) {
+		// Read uart 
+		uint8_t incomingByte = Serial.read();
+
+		// We use the 7th bit [mark1] as a latch command
+		if ((incomingByte & LATCH_BYTE) != 0) {
+			if (SERIAL_DEBUG) Serial.println("L");
+			latch_pending = true;
+			return;
+		}
+
+		// We use the MSB [mark2] as a marker for the start of a new command, reset the counter then
+		if ((incomingByte & 0x80) != 0) daisy_counter = 0;
+		if (daisy_counter < 0) return;
+
+		uint16_t board_num = daisy_counter / 3;
+		chain_t* chain = &chains[chainFor(board_num)];
+
+		if (board_num == chain->first_board && daisy_counter % 3 == 0) {
+			incomingByte |= 0x80;
+		} else {
+			incomingByte &= ~0x80;
+		}
+
+		// Queued for the UDRE interrupt, only blocks if a slice outgrows the TX buffer
+		chain->port->write(incomingByte);
+		chain->written = true;
+
+		daisy_counter++;
+	}
+}
+
+// Chain that a board of the host frame is on
+uint8_t chainFor(uint16_t board_num) {
+	for (uint8_t i = NUM_CHAINS - 1; i > 0; i--) {
+		if (board_num >= chains[i].first_board) return i;
+	}
+	return 0;
+}
+
+// True once every chain has shifted out everything queued for it, including the byte in
+// the shift register
+bool chainsIdle() {
+	for (uint8_t i = 0; i < NUM_CHAINS; i++) {
+		if (!chains[i].written) continue;
+		if (chains[i].port->availableForWrite() < SERIAL_TX_BUFFER_SIZE - 1) return false;
+		if ((*chains[i].ucsra & chains[i].txc) == 0) return false;
+	}
+	return true;
+}
+
+// Send the latch to all chains back to back. Their TX buffers are empty so each write
+// goes straight into the UART and the chains start latching within a few us of each other
+void latchChains() {
+	for (uint8_t i = 0; i < NUM_CHAINS; i++) {
+		chains[i].port->write(LATCH_BYTE);
+		chains[i].written = true;
+	}
+
+	latch_pending = false;
+}
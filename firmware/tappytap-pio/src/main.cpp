@@ -15,6 +15,11 @@ typedef struct {
 void set(state_t*, uint8_t, uint8_t, bool, bool);
 void write(const state_t*, uint8_t);
 void copyTriple(uint8_t*, uint8_t, uint8_t);
+void spiBeginFrame();
+void spiQueue(uint8_t);
+void spiEndFrame();
+void spiKick();
+void spiNext();
 
 void displayByte(state_t*, uint8_t, uint8_t);
 
@@ -34,6 +39,47 @@ state_t states[3] = {
 // Counter of received bytes
 uint8_t daisy_counter = -1;
 
+// Set once we've seen a latch byte, from then on new states are held until the next one
+bool latch_mode = false;
+
+// SPI transmit engine
+//
+// write() doesn't shift the bytes out itself. It queues them as one CS frame (all chips
+// in the chain under SS_PIN) and returns, and the SPI transfer complete interrupt feeds
+// the next byte to the hardware and raises SS_PIN after the frame's last one, which
+// latches the chips. So serial keeps being handled while the frame shifts out.
+//
+// The interrupt may start on a frame that is still being queued and just stalls if it
+// catches up with the encoder, spiQueue() picks it up again.
+
+// Byte queue, the uint8_t indices wrap around it by themselves
+#define SPI_QUEUE_SIZE 256
+// CS frames in flight, must be a power of two
+#define SPI_FRAMES 4
+
+typedef struct {
+	uint8_t end; // queue index just past the frame's last byte, once it's closed
+	bool closed;
+} spi_frame_t;
+
+volatile uint8_t spi_queue[SPI_QUEUE_SIZE];
+volatile uint8_t spi_head = 0, spi_tail = 0;
+volatile spi_frame_t spi_frames[SPI_FRAMES];
+volatile uint8_t spi_frame_head = 0, spi_frame_tail = 0;
+// SS_PIN is low for the frame at spi_frame_tail
+volatile bool spi_selected = false;
+// A byte is shifting, the interrupt will call spiNext()
+volatile bool spi_busy = false;
+
+volatile uint8_t* ss_port;
+uint8_t ss_mask;
+
+// NCV7718 enable and current control bits for three bridges, indexed by their en / dir
+// bits. Each bridge takes two bits, enabled bridges set both EN bits, the CC bits are 01
+// for dir 1 and 10 for dir 0
+const uint8_t NCV_EN_BITS[8] = {0x00, 0x03, 0x0C, 0x0F, 0x30, 0x33, 0x3C, 0x3F};
+const uint8_t NCV_CC_BITS[8] = {0x2A, 0x29, 0x26, 0x25, 0x1A, 0x19, 0x16, 0x15};
+
 void setup() {
 	// Set relevant pin modes
 	pinMode(SS_PIN, OUTPUT);
@@ -42,9 +88,15 @@ void setup() {
 	digitalWrite(NCV_EN_PIN, HIGH); // enabled (active high)
 	digitalWrite(SS_PIN, HIGH); // not selected (active low)
 
+	// The engine raises SS_PIN from its interrupt, digitalWrite() is too slow there
+	ss_port = portOutputRegister(digitalPinToPort(SS_PIN));
+	ss_mask = digitalPinToBitMask(SS_PIN);
+
 	// Configure SPI
 	SPI.begin();
 	SPI.setDataMode(SPI_MODE1);
+	// From here on the SPI interrupt owns SPIF, SPI.transfer() must not be used
+	SPCR |= _BV(SPIE);
 
 	// I believe this is the fastest safe UART speed for the built in 8MHz clock, see here http://wormfood.net/avrbaudcalc.php
 	Serial.begin(38400);
@@ -79,11 +131,24 @@ void loop() {
 	// you would send:
 	// 0x81 (contains mark + en1 for first board) 0x80 (dir1=1 for first board) 0x00 (nothing set for dir4-9)
 	// 0x00 (no mark + nothing set for en1-6) 0x40 (set en9) + 0x20 (set dir9=1)
+	//
+	// A byte with bit 6 set (0x40, [x] is always 0 in state bytes) is a latch, as for
+	// tappytap-v2-master. It is passed down the chain straight away and every board writes
+	// the states it was sent on receiving it. A board only starts holding its states for
+	// the latch once it has seen one, so hosts that never send latches keep working.
 
 	if (Serial.available() > 0) {
 		// Read uart 
 		uint8_t incomingByte = Serial.read();
 
+		if ((incomingByte & 0x40) != 0) {
+			// Forward first so the boards down the chain latch as close to us as possible
+			Serial.write(incomingByte);
+			latch_mode = true;
+			write(states, 3);
+			return;
+		}
+
 		// We use the MSB as a marker for the start of a new command, reset the counter then
 		if ((incomingByte & 0x80) != 0) daisy_counter = 0;
 
@@ -104,8 +169,9 @@ void loop() {
 			copyTriple(&states[1].dir, incomingByte, 0);
 			copyTriple(&states[2].dir, incomingByte, 3);
 
-			// Now we have all the data so we write it out over SPI to the NCV7718
-			write(states, 3);
+			// Now we have all the data so we write it out over SPI to the NCV7718, or wait
+			// for the latch if the host sends them
+			if (!latch_mode) write(states, 3);
 		} else if(daisy_counter == 3) {
 			// The next byte after the three for this chip will be daisy chained to the next board and will be the "first" byte for 
 			// that board. As such it need to have a mark bit set on it. So we add that bit and send it
@@ -145,35 +211,84 @@ void set(state_t* states, uint8_t num_states, uint8_t position, bool en, bool di
 	states[state_index].dir |= (dir << offset);
 }
 
-// Write a state array out over SPI
+// Queue a state array to be written out over SPI, returns before it is sent
 void write(const state_t* states, uint8_t num_states) {
-	// assert the slave select
-	digitalWrite(SS_PIN, LOW);
+	spiBeginFrame();
 
 	// For each NCV7718
 	for (int i = num_states-1; i >= 0; i--) {
-		// tmp variable to compute the actual SPI data to send. See datasheet for protocol details
-		uint8_t ncvEn = 0;
-		uint8_t ncvCC = 0;
-
-		for (int j = 0; j < 3; j++) {
-			// We bit shift our state struct into the target format
-			if ((states[i].en & (1 << j)) != 0) {
-				ncvEn |= (1 << j*2) | (1 << (j*2 +1));
-			}
-
-			if ((states[i].dir & (1 << j)) != 0) {
-				ncvCC |= (1 << j*2) | (0 << (j*2 +1));
-			} else {
-				ncvCC |= (0 << j*2) | (1 << (j*2 +1));
-			}
-		}
+		// The actual SPI data to send. See datasheet for protocol details
+		uint8_t ncvEn = NCV_EN_BITS[states[i].en & 0b111];
+		uint8_t ncvCC = NCV_CC_BITS[states[i].dir & 0b111];
 
 		// Send 16 bits over SPI as per NCV7718 docs (we're ignoring the extra features and return values for now)
-		SPI.transfer(0 << 7 | 0 << 6 | 0 << 5 | (ncvEn >> 1) & 0x1F);
-		SPI.transfer((ncvEn & 0x01) << 7 | (ncvCC & 0x3F) << 1 | 0);
+		spiQueue(0 << 7 | 0 << 6 | 0 << 5 | ((ncvEn >> 1) & 0x1F));
+		spiQueue(((ncvEn & 0x01) << 7) | ((ncvCC & 0x3F) << 1) | 0);
+	}
+
+	spiEndFrame();
+}
+
+// Open a CS frame, waits if all frame slots are in flight
+void spiBeginFrame() {
+	while ((uint8_t)(spi_frame_head - spi_frame_tail) >= SPI_FRAMES) {}
+
+	spi_frames[spi_frame_head & (SPI_FRAMES-1)].closed = false;
+	spi_frame_head++;
+}
+
+// Append a byte to the open frame, waits if the queue is full
+void spiQueue(uint8_t b) {
+	while ((uint8_t)(spi_head + 1) == spi_tail) {}
+
+	spi_queue[spi_head] = b;
+	spi_head++;
+	spiKick();
+}
+
+// Close the open frame, SS_PIN goes high once its last byte is out
+void spiEndFrame() {
+	volatile spi_frame_t* frame = &spi_frames[(spi_frame_head - 1) & (SPI_FRAMES-1)];
+	frame->end = spi_head;
+	frame->closed = true;
+	spiKick();
+}
+
+// Restart the engine if it's idle or stalled
+void spiKick() {
+	noInterrupts();
+	if (!spi_busy) spiNext();
+	interrupts();
+}
+
+// Send the next byte or finish the current frame, only ever called with interrupts off
+void spiNext() {
+	spi_busy = false;
+
+	while (spi_frame_tail != spi_frame_head) {
+		volatile spi_frame_t* frame = &spi_frames[spi_frame_tail & (SPI_FRAMES-1)];
+
+		if (!spi_selected) {
+			*ss_port &= ~ss_mask;
+			spi_selected = true;
+		}
+
+		if (spi_tail != (frame->closed ? frame->end : spi_head)) {
+			SPDR = spi_queue[spi_tail];
+			spi_tail++;
+			spi_busy = true;
+			return;
+		}
+		// Caught up with the encoder, spiQueue() kicks us again
+		if (!frame->closed) return;
+
+		// deassert the slave select, which latches the chips
+		*ss_port |= ss_mask;
+		spi_selected = false;
+		spi_frame_tail++;
 	}
+}
 
-	// deassert the slave select
-	digitalWrite(SS_PIN, HIGH);
-}
\ No newline at end of file
+ISR(SPI_STC_vect) {
+	spiNext();
+}
@@ -16,6 +16,15 @@
 
 #define SERIAL_DEBUG false
 
+// Static RAM is about 1 KB plus ~116 bytes per board (states, heat, onset and skip bits),
+// so an Uno's 2 KB runs out of stack past 8 boards, use a Mega 2560 for more
+#if defined(__AVR_ATmega328P__) && NUM_BOARDS > 8
+#error "More than 8 boards don't fit in the ATmega328P's RAM, build for a Mega 2560"
+#endif
+
+// Reported in reply to 0x89, bump it whenever the serial protocol changes
+#define FIRMWARE_VERSION "v6.2"
+
 // Slave select PIN for SPI (attached to all the NCV7718 chips) (active low)
 #define SS_PIN 10
 // Enable PIN for all the NCV7718 chips (active high)
@@ -38,12 +47,47 @@ typedef struct {
 typedef enum _serial_mode_t {
 	MODE_NONE,
 	MODE_STATE,
-	MODE_CONF
+	MODE_CONF,
+	MODE_SEQ,
+	MODE_TIME,
+	MODE_SYNC,
+	MODE_PROBE,
+	MODE_ONSET,
+	MODE_THERMAL
 } serial_mode_t;
 
 void set(state_t*, uint8_t, uint16_t, bool, bool);
 void write(const state_t*, uint8_t);
 void drive(const bool*);
+void driveOnset(const bool*, unsigned long);
+void setOnsetMode(bool);
+void scanOnset(const bool*, unsigned long);
+void releaseOnset(const bool*, uint8_t);
+uint8_t onsetCohort(uint16_t);
+void setOnsetCohort(uint16_t, uint8_t);
+unsigned long segmentLen(uint8_t);
+bool thermalCycle(uint16_t, bool);
+bool thermalSkipping(uint16_t);
+void thermalPulse(uint16_t, unsigned long, uint8_t);
+void thermalCohort(uint8_t);
+void setThermalBudget(uint8_t);
+void updateThermal();
+void reportThermal();
+void beginCommand(uint8_t);
+void ackFrame(bool);
+void reportCredit();
+void updateLinkStats();
+void armProbe();
+void reportProbe();
+void reportInfo();
+uint32_t stateHash();
+unsigned long syncedMicros(unsigned long);
+void spiBeginFrame(uint8_t);
+void spiQueue(uint8_t);
+void spiEndFrame();
+void spiKick();
+void spiGuard();
+void spiNext();
 
 // There are three NCV7718 chips on each board, hence we have three state_t structs
 // We init them off by setting en = 0 and dir = 0 for each
@@ -51,6 +95,15 @@ state_t states[NCV_CHIPS];
 
 uint8_t HB_REG_ADDRESSES[NUM_REGISTERS] = {HB_ACT_1_CTRL_ADDR, HB_ACT_2_CTRL_ADDR, HB_ACT_3_CTRL_ADDR};
 
+// HB_ACT_CTRL data byte for two bridges, indexed by their en bits | dir bits << 2.
+// Enabled bridges get 0b1001 or 0b0110 in their nibble depending on direction
+const uint8_t HB_DATA_BYTES[16] = {
+	0x00, 0x06, 0x60, 0x66,
+	0x00, 0x09, 0x60, 0x69,
+	0x00, 0x06, 0x90, 0x96,
+	0x00, 0x09, 0x90, 0x99
+};
+
 int phase = 0;
 
 // The high level one off state as seen graphically in processing
@@ -61,11 +114,225 @@ bool bstates[TOTAL_BRIDGES];
 serial_mode_t mode = MODE_NONE;
 int serial_byte_count = 0;
 
+// Flow control variables
+//
+// The host can tag the next conf or state frame with a sequence number by sending
+// 0x83 <seq> (seq < 0x80) in front of it. Once that frame is latched we answer with
+// "ack <seq> <consumed>", or "nak <seq> <consumed>" if it arrived with the wrong
+// number of bytes. <consumed> is a running count (mod 2^16) of the bytes we have
+// pulled out of the UART. Together with the window advertised in reply to 0x84
+// ("window <consumed> <size>") it tells the host exactly how many bytes may still
+// be sitting in our receive buffer, so it can stream without ever overrunning it.
+// Frames longer than the window get intermediate "credit <consumed>" updates.
+
+// Usable space in the HardwareSerial receive ring (one slot is always kept empty)
+#define RX_WINDOW (SERIAL_RX_BUFFER_SIZE - 1)
+// While flow control is in use, report credit at least this often during long frames
+#define CREDIT_REPORT_BYTES (RX_WINDOW / 2)
+#define LINK_BAUD 115200
+#define LINK_STATS_MS 1000
+
+bool flow_control = false;
+int16_t frame_seq = -1;
+uint16_t rx_consumed = 0, rx_reported = 0;
+
+// Link statistics, reported in reply to 0x85 as "stats <frames> <bad_frames> <util>"
+uint32_t rx_frames = 0, rx_bad_frames = 0;
+uint32_t rx_stats_bytes = 0;
+unsigned long rx_stats_start = 0;
+uint8_t link_util = 0; // percent of the link capacity used over the last LINK_STATS_MS
+
+// Clock sync variables
+//
+// drive() runs the pulse period off a time base the host can steer, so several masters
+// on one host pulse in phase even though they booted at different times and their clocks
+// run at slightly different rates. The host asks for our micros() with 0x86 <tag>
+// ("time <tag> <micros> <synced>", micros taken when we read the 0x86), fits offset and
+// rate against its own clock, and sends back 0x87 + 12 bytes: ref, base (LE uint32 us)
+// and rate (LE int32 in units of 2^-24). From then on
+//
+//   synced = base + (micros - ref) * (1 + rate / 2^24)
+//
+// which reads the host's clock. Without a 0x87 synced is just micros().
+
+// A rate further off than this can't be a real resonator. It's what we get if a host
+// that was cut off in the middle of a 0x87 flushes us with filler, see 0x89
+#define SYNC_MAX_RATE ((1L << 24) / 100)
+
+uint32_t sync_ref = 0, sync_base = 0;
+int32_t sync_rate = 0;
+uint8_t sync_frame[12];
+unsigned long time_query_us = 0;
+
+// Resync variables
+//
+// Opening the port usually resets us, but a host that keeps DTR up across reconnects
+// (see docs/README-v6.md) finds us still running with its old conf and states. It sends
+// 0x89 and we answer "info <version> <boards> <chips per board> <up> <inter> <down>
+// <pause> <state hash>", the hash being stateHash() of bstates, so it only has to resend
+// what differs. A host that died halfway through a frame may have left us in the middle
+// of it, so the host flushes it with 12 0x82 first. They close a state frame, fill up a
+// conf frame (which the info then shows as different) or a 0x87 (which is dropped for its
+// impossible rate), and are ignored otherwise.
+
+// Latency probe variables
+//
+// 0x88 <tag> (tag < 0x80) marks the next state frame. Once the change it carries has
+// reached the chips we answer "probe <tag> <receipt> <apply> <spi>", all micros(): when we
+// read the frame's 0x81, when we read its 0x82 (bstates holds the whole frame from then
+// on), and when the first byte of the first pulse write() after that went out on SPI.
+// The host maps them onto its own clock with 0x86, see tappy-probe.
+
+int16_t probe_tag = -1; // the next state frame is probed
+int16_t probe_applied_tag = -1; // the probed frame is in bstates, waiting for a pulse write
+unsigned long probe_receipt_us = 0, probe_apply_us = 0;
+// Set by drive() to the SPI queue index of the write's first byte, the engine stamps it
+volatile bool probe_spi_armed = false;
+volatile bool probe_spi_done = false;
+volatile uint8_t probe_spi_index = 0;
+volatile unsigned long probe_spi_us = 0;
+
+// Immediate onset variables
+//
+// By default every tapper pulses on the one global cycle, so a newly enabled tapper waits
+// for the next up phase, up to a whole period (80 ms with 20 ms segments). 0x8A 1 switches
+// to immediate onset, where a newly enabled tapper starts its own up/inter/down/pause
+// cycle right away, and 0x8A 0 switches back.
+//
+// Tappers that start together share a cohort, which keeps the cycle's phase and when it
+// changes next, so every tapper only stores which cohort it follows (4 bits). A tapper
+// enabled within ONSET_MERGE_US of a cohort's start joins it rather than starting another,
+// and a disabled one finishes its cycle before it leaves. Tappers enabled while all
+// ONSET_COHORTS are in use join the next one to start a cycle.
+//
+// Every cohort that changes phase is written out in one write(), and changes that come up
+// while the last write is still on SPI wait for it and share the next one, so at most one
+// write is ever queued. Each cohort still costs up to four writes per period where the
+// global cycle costs four in all, see docs/README-v6.md.
+
+#define ONSET_COHORTS 8
+#define ONSET_NONE 0x0F
+#define ONSET_MERGE_US 2000
+
+typedef struct {
+	unsigned long next; // micros() of its next phase change
+	uint8_t phase; // numbered like phase
+	uint8_t members;
+	uint8_t pulses; // pulse phases so far, for the thermal governor's dither
+} cohort_t;
+
+bool onset_mode = false;
+cohort_t cohorts[ONSET_COHORTS];
+// Cohort of every tapper, two per byte low nibble first, ONSET_NONE for none
+uint8_t onset_cohorts[(TOTAL_BRIDGES + 1) / 2];
+// Enabled tappers may be waiting for a cohort
+bool onset_scan = false;
+// A cohort changed phase since the last write()
+bool onset_dirty = false;
+
+// Thermal governor variables
+//
+// A solenoid heats up with the time it's energized and cools off over seconds, so the
+// conf has to keep the duty cycle of the busiest tapper safe and all the others run
+// slower than they could. 0x8B <budget> (1-100, percent) has every tapper keep track of
+// its own heat instead and skip cycles while it's over budget, 0x8B 0 turns that off.
+//
+// The model is first order: each up or down pulse adds its length in THERMAL_UNIT_US to
+// the tapper's heat, and every THERMAL_TICK_MS the heat loses 1/2^THERMAL_SHIFT of itself
+// (a time constant of ~4 s). A tapper energized all the time would settle at
+// THERMAL_FULL, so the budget is the duty cycle a tapper can keep up. One that is over it
+// when its cycle starts sits that cycle out, which holds hot tappers at the budget while
+// the rest keep the rate of the conf.
+//
+// Heat is one byte per tapper (THERMAL_FULL is 250), so a 5 ms pulse is less than a
+// unit. Pulses are measured in 1/256 units and rounded with an ordered dither that moves
+// on with every pulse phase, and the decay with one off the tick count, so short pulses
+// still add up and heat cools all the way rather than getting stuck on truncation.
+//
+// A tapper that sat out a cycle is throttled until it cools to 7/8 of the budget. When
+// that changes we report "thermal <throttled> <skipped> <mask>", at most once every
+// THERMAL_REPORT_MS: <skipped> counts the cycles sat out since the governor was turned
+// on and <mask> has two hex digits per chip, one bit per bridge like a state frame. 0x8B
+// is answered with the same line.
+
+#define THERMAL_TICK_MS 128
+#define THERMAL_SHIFT 5
+#define THERMAL_UNIT_US 16384
+#define THERMAL_FULL ((THERMAL_TICK_MS * 1000L << THERMAL_SHIFT) / THERMAL_UNIT_US)
+#define THERMAL_REPORT_MS 250
+
+uint8_t thermal_budget = 0;
+uint8_t thermal_limit = 0, thermal_release = 0;
+uint8_t thermal_heat[TOTAL_BRIDGES];
+uint8_t thermal_ticks = 0;
+// Pulse phases of the global cycle so far, for the dither
+uint8_t thermal_pulses = 0;
+// One bit per tapper: sitting out its current cycle, and throttled
+uint8_t thermal_skip[(TOTAL_BRIDGES + 7) / 8];
+uint8_t thermal_hot[(TOTAL_BRIDGES + 7) / 8];
+uint16_t thermal_hot_count = 0;
+uint32_t thermal_skipped = 0;
+bool thermal_changed = false;
+unsigned long thermal_tick_ms = 0, thermal_report_ms = 0;
+
 // Pulse configuration variables
 
 uint32_t tmpUpPulseLen = 0, tmpInterPulseLen = 0, tmpDownPulseLen = 0, tmpPauseLen = 0;
 uint32_t upPulseLen = 500, interPulseLen = 500, downPulseLen = 500, pauseLen = 500;
 
+// SPI transmit engine
+//
+// write() doesn't shift the bytes out itself. It queues them in CS frames (one board's
+// HB_ACT_CTRL register, held under that board's chip select) and returns, and the SPI
+// transfer complete interrupt feeds the next byte to the hardware. The 10us guard times
+// around each chip select edge run off a Timer1 one shot instead of delayMicroseconds().
+// So serial parsing and the encoding of the next frame go on while the last one shifts.
+//
+// The interrupt may start on a frame that is still being queued and just stalls if it
+// catches up with the encoder, spiQueue() picks it up again.
+
+// One write(), a command and a data byte per chip for each register of each board
+#define SPI_WRITE_LEN (NUM_BOARDS*NUM_REGISTERS*CHIPS_PER_BOARD*2)
+// Byte queue, the smallest power of two that holds a whole write() so it returns before
+// the chain shifts out, capped at the 256 the uint8_t indices can count
+#if SPI_WRITE_LEN < 64
+#define SPI_QUEUE_SIZE 64
+#elif SPI_WRITE_LEN < 128
+#define SPI_QUEUE_SIZE 128
+#else
+#define SPI_QUEUE_SIZE 256
+#endif
+// CS frames in flight, must be a power of two
+#define SPI_FRAMES 16
+// Guard time around chip select edges in Timer1 ticks (prescaler 8, 0.5us per tick)
+#define SPI_GUARD_TICKS 20
+
+typedef enum _spi_engine_state_t {
+	SPI_IDLE,  // chip select high and has been for long enough
+	SPI_SETUP, // chip select just went low, waiting out the guard before the first byte
+	SPI_SEND,  // shifting bytes, or stalled waiting for more
+	SPI_HOLD,  // last byte sent, waiting out the guard before chip select goes high
+	SPI_POST   // chip select just went high, waiting out the guard before the next frame
+} spi_engine_state_t;
+
+typedef struct {
+	volatile uint8_t* cs_port;
+	uint8_t cs_mask;
+	uint8_t end; // queue index just past the frame's last byte, once it's closed
+	bool closed;
+} spi_frame_t;
+
+volatile uint8_t spi_queue[SPI_QUEUE_SIZE];
+volatile uint8_t spi_head = 0, spi_tail = 0;
+volatile spi_frame_t spi_frames[SPI_FRAMES];
+volatile uint8_t spi_frame_head = 0, spi_frame_tail = 0;
+volatile spi_engine_state_t spi_state = SPI_IDLE;
+// A byte is shifting or a guard timer is running, an interrupt will call spiNext()
+volatile bool spi_busy = false;
+
+volatile uint8_t* CS_PORTS[NUM_BOARDS];
+uint8_t CS_MASKS[NUM_BOARDS];
+
 void setup() {
 	// Clear the states array
 	for (int i = 0; i < NCV_CHIPS; i++) {
@@ -82,23 +349,37 @@ void setup() {
 
 		pinMode(CS_PINS[i], OUTPUT);
 		digitalWrite(CS_PINS[i], HIGH);
+
+		// The engine flips chip selects from its interrupts, digitalWrite() is too slow there
+		CS_PORTS[i] = portOutputRegister(digitalPinToPort(CS_PINS[i]));
+		CS_MASKS[i] = digitalPinToBitMask(CS_PINS[i]);
 	}
 
 	// Configure SPI
 	SPI.begin();
 	SPI.beginTransaction(SPISettings(5e6, LSBFIRST, SPI_MODE1));
 	SPI.setClockDivider(SPI_CLOCK_DIV16);
+	// From here on the SPI interrupt owns SPIF, SPI.transfer() must not be used
+	SPCR |= _BV(SPIE);
+
+	// Timer1 in CTC mode, stopped until the engine starts a guard time
+	TCCR1A = 0;
+	TCCR1B = _BV(WGM12);
+	OCR1A = SPI_GUARD_TICKS - 1;
+	TIMSK1 = _BV(OCIE1A);
+
+	setOnsetMode(false);
 
 	Serial.begin(115200);
 
-	Serial.println("ready");
+	Serial.println(F("ready"));
 }
 
 void loop() {
 	// for (int i = 0; i < 36*2; i++) {
 	// 	set(states, NCV_CHIPS, i, 1, 0);
 	// }
-	// // Serial.println("NCV_CHIPS");
+	// // Serial.println(F("NCV_CHIPS"));
 	// // Serial.println(NCV_CHIPS, DEC);
 	// // Serial.println(states[7].en);
 	// // Serial.println(states[7].dir);
@@ -113,7 +394,7 @@ void loop() {
 	// // set(states, NCV_CHIPS, 38, 1, 1);
 	// // set(states, NCV_CHIPS, 44, 1, 1);
 
-	// // Serial.println("NCV_CHIPS");
+	// // Serial.println(F("NCV_CHIPS"));
 	// // Serial.println(NCV_CHIPS, DEC);
 	// // Serial.println(states[7].en);
 	// // Serial.println(states[7].dir);
@@ -124,15 +405,17 @@ void loop() {
 	if (Serial.available() > 0) {
 		// Read uart 
 		uint8_t incomingByte = Serial.read();
+		rx_consumed++;
+		rx_stats_bytes++;
 		
 		if (SERIAL_DEBUG) {
-			Serial.print("serial_byte_count: ");
+			Serial.print(F("serial_byte_count: "));
 			Serial.println(serial_byte_count);
 		}
 
 		switch(mode) {
 			case MODE_CONF: {
-				if (SERIAL_DEBUG) Serial.println("Conf started");
+				if (SERIAL_DEBUG) Serial.println(F("Conf started"));
 
 				switch(serial_byte_count) {
 					case 0: {
@@ -174,18 +457,19 @@ void loop() {
 						downPulseLen = tmpDownPulseLen;
 						pauseLen = tmpPauseLen;
 						if (SERIAL_DEBUG) {
-							Serial.println("Conf done");
-							Serial.print("  >upPulseLen: ");
+							Serial.println(F("Conf done"));
+							Serial.print(F("  >upPulseLen: "));
 							Serial.println(upPulseLen);
-							Serial.print("  >interPulseLen: ");
+							Serial.print(F("  >interPulseLen: "));
 							Serial.println(interPulseLen);
-							Serial.print("  >downPulseLen: ");
+							Serial.print(F("  >downPulseLen: "));
 							Serial.println(downPulseLen);
-							Serial.print("  >pauseLen: ");
+							Serial.print(F("  >pauseLen: "));
 							Serial.println(pauseLen);
 							Serial.println();
 						}
 
+						ackFrame(true);
 						mode = MODE_NONE;
 						break;
 					}
@@ -196,64 +480,174 @@ void loop() {
 			}
 
 			case MODE_STATE: {
-				if (SERIAL_DEBUG) Serial.println("State started");
+				if (SERIAL_DEBUG) Serial.println(F("State started"));
 				if (incomingByte == 0x82) {
 					// We just latch as we go, there's not really risk to that
+					bool ok = serial_byte_count == NCV_CHIPS;
+					ackFrame(ok);
+					if (probe_tag >= 0 && ok && probe_applied_tag < 0) {
+						probe_apply_us = micros();
+						probe_applied_tag = probe_tag;
+					}
+					probe_tag = -1;
+					onset_scan = onset_mode;
 					mode = MODE_NONE;
 					break;
 				}
 
-				int base_offset = serial_byte_count*BRIDGES_PER_CHIP;
-				for (int i = 0; i < BRIDGES_PER_CHIP; i++) {
-					bstates[base_offset+i] = (incomingByte & (1 << i)) > 0;
+				if ((incomingByte & 0x80) != 0) {
+					// State bytes never have the MSB set, so we lost the end of this
+					// frame. Reject it and treat the byte as the start of a new command
+					ackFrame(false);
+					probe_tag = -1;
+					onset_scan = onset_mode;
+					beginCommand(incomingByte);
+					break;
+				}
+
+				if (serial_byte_count < NCV_CHIPS) {
+					int base_offset = serial_byte_count*BRIDGES_PER_CHIP;
+					for (int i = 0; i < BRIDGES_PER_CHIP; i++) {
+						bstates[base_offset+i] = (incomingByte & (1 << i)) > 0;
+					}
 				}
 
 				serial_byte_count++;
 				break;
 			}
 
+			case MODE_SEQ: {
+				if ((incomingByte & 0x80) != 0) {
+					// Not a valid sequence number, must be a command
+					beginCommand(incomingByte);
+					break;
+				}
+
+				flow_control = true;
+				frame_seq = incomingByte;
+				mode = MODE_NONE;
+				break;
+			}
+
+			case MODE_TIME: {
+				if ((incomingByte & 0x80) != 0) {
+					// Not a valid tag, must be a command
+					beginCommand(incomingByte);
+					break;
+				}
+
+				Serial.print(F("time "));
+				Serial.print(incomingByte);
+				Serial.print(' ');
+				Serial.print(time_query_us);
+				Serial.print(' ');
+				Serial.println(syncedMicros(time_query_us));
+				mode = MODE_NONE;
+				break;
+			}
+
+			case MODE_SYNC: {
+				sync_frame[serial_byte_count++] = incomingByte;
+				if (serial_byte_count < (int)sizeof(sync_frame)) break;
+
+				// latches, all three together so drive() never sees half of it
+				uint32_t ref = 0, base = 0, rate = 0;
+				for (int i = 3; i >= 0; i--) {
+					ref = ref << 8 | sync_frame[i];
+					base = base << 8 | sync_frame[4 + i];
+					rate = rate << 8 | sync_frame[8 + i];
+				}
+				mode = MODE_NONE;
+				if ((int32_t)rate > SYNC_MAX_RATE || (int32_t)rate < -SYNC_MAX_RATE) break;
+				sync_ref = ref;
+				sync_base = base;
+				sync_rate = (int32_t)rate;
+				break;
+			}
+
+			case MODE_PROBE: {
+				if ((incomingByte & 0x80) != 0) {
+					// Not a valid tag, must be a command
+					beginCommand(incomingByte);
+					break;
+				}
+
+				probe_tag = incomingByte;
+				mode = MODE_NONE;
+				break;
+			}
+
+			case MODE_ONSET: {
+				if ((incomingByte & 0x80) != 0) {
+					// Not a valid mode, must be a command
+					beginCommand(incomingByte);
+					break;
+				}
+
+				setOnsetMode(incomingByte != 0);
+				mode = MODE_NONE;
+				break;
+			}
+
+			case MODE_THERMAL: {
+				if ((incomingByte & 0x80) != 0) {
+					// Not a valid budget, must be a command
+					beginCommand(incomingByte);
+					break;
+				}
+
+				setThermalBudget(incomingByte);
+				mode = MODE_NONE;
+				break;
+			}
+
 			default:
 			case MODE_NONE: {
-				if (SERIAL_DEBUG) Serial.println("None start");
-				serial_byte_count = 0;
-				switch(incomingByte) {
-					case 0x80: {
-						if (SERIAL_DEBUG) Serial.println("  >Conf");
-						mode = MODE_CONF;
-
-						tmpUpPulseLen = 0;
-						tmpInterPulseLen = 0;
-						tmpDownPulseLen = 0;
-						tmpPauseLen = 0;
-						break;
-					}
-					case 0x81: {
-						if (SERIAL_DEBUG) Serial.println("  >State");
-						mode = MODE_STATE;
-						break;
-					}
-					default: {
-						if (SERIAL_DEBUG) Serial.println("  >?");
-						mode = MODE_NONE;
-						break;
-					}
-				}
+				beginCommand(incomingByte);
 				break;
 			}
-		}		
+		}
+
+		if (flow_control && (uint16_t)(rx_consumed - rx_reported) >= CREDIT_REPORT_BYTES) {
+			reportCredit();
+		}
 	}
 
+	updateLinkStats();
+	updateThermal();
+
 	drive(bstates);
+
+	if (probe_spi_done) reportProbe();
 }
 
 void drive(const bool* bstates) {
-	unsigned long cur_time = micros()/10;
+	unsigned long now = micros();
+	// Move the reference along long before (now - sync_ref) could overflow an int32_t, in
+	// case the host stops sending 0x87
+	if ((int32_t)(now - sync_ref) > 0x40000000L) {
+		sync_base = syncedMicros(now);
+		sync_ref = now;
+	}
+
+	if (onset_mode) {
+		driveOnset(bstates, now);
+		return;
+	}
+
+	unsigned long cur_time = syncedMicros(now)/10;
 	unsigned long period = upPulseLen+interPulseLen+downPulseLen+pauseLen;
 	unsigned long cur_period = cur_time % period;
 
 	if (cur_period >= 0 && cur_period < upPulseLen && phase != 1) {
 		// pulse fwd
-		for (int i = 0; i < TOTAL_BRIDGES; i++) set(states, NCV_CHIPS, i, bstates[i], false);
+		thermal_pulses++;
+		for (int i = 0; i < TOTAL_BRIDGES; i++) {
+			bool on = thermalCycle(i, bstates[i]);
+			if (on) thermalPulse(i, upPulseLen*10, thermal_pulses);
+			set(states, NCV_CHIPS, i, on, false);
+		}
+		armProbe();
 		write(states, NCV_CHIPS);
 		phase = 1;
 	} else if (cur_period >= upPulseLen && cur_period < upPulseLen+interPulseLen && phase != 2) {
@@ -263,7 +657,13 @@ void drive(const bool* bstates) {
 		phase = 2;
 	} else if (cur_period >= upPulseLen+interPulseLen && cur_period < upPulseLen+interPulseLen+downPulseLen && phase != 3) {
 		// pulse back
-		for (int i = 0; i < TOTAL_BRIDGES; i++) set(states, NCV_CHIPS, i, bstates[i], true);
+		thermal_pulses++;
+		for (int i = 0; i < TOTAL_BRIDGES; i++) {
+			bool on = bstates[i] && !thermalSkipping(i);
+			if (on) thermalPulse(i, downPulseLen*10, thermal_pulses);
+			set(states, NCV_CHIPS, i, on, true);
+		}
+		armProbe();
 		write(states, NCV_CHIPS);
 		phase = 3;
 	} else if (cur_period >= upPulseLen+interPulseLen+downPulseLen && cur_period < period && phase != 0) {
@@ -276,6 +676,417 @@ void drive(const bool* bstates) {
 	phase = phase % 4;
 }
 
+// Immediate onset version of drive(), every cohort runs its own cycle
+void driveOnset(const bool* bstates, unsigned long now) {
+	unsigned long period = upPulseLen+interPulseLen+downPulseLen+pauseLen;
+
+	for (uint8_t c = 0; c < ONSET_COHORTS && period > 0; c++) {
+		cohort_t* cohort = &cohorts[c];
+		while (cohort->members > 0 && (long)(now - cohort->next) >= 0) {
+			cohort->phase = (cohort->phase + 1) % 4;
+			cohort->next += segmentLen(cohort->phase);
+			onset_dirty = true;
+
+			if (cohort->phase == 1) {
+				// A new cycle, tappers that were disabled during the last one leave and
+				// waiting ones may join
+				releaseOnset(bstates, c);
+				onset_scan = true;
+			}
+			if (cohort->phase == 1 || cohort->phase == 3) thermalCohort(c);
+		}
+	}
+
+	if (onset_scan) scanOnset(bstates, now);
+
+	// Changes wait while the last write is still going out and then share the next one
+	if (!onset_dirty || spi_frame_tail != spi_frame_head) return;
+
+	for (int i = 0; i < TOTAL_BRIDGES; i++) {
+		uint8_t c = onsetCohort(i);
+		uint8_t p = c == ONSET_NONE ? 0 : cohorts[c].phase;
+		set(states, NCV_CHIPS, i, (p == 1 || p == 3) && !thermalSkipping(i), p == 3);
+	}
+	armProbe();
+	write(states, NCV_CHIPS);
+	onset_dirty = false;
+}
+
+// Switch immediate onset on or off, either way starting over from the current bstates
+void setOnsetMode(bool on) {
+	onset_mode = on;
+	for (int c = 0; c < ONSET_COHORTS; c++) cohorts[c].members = 0;
+	memset(onset_cohorts, 0xFF, sizeof(onset_cohorts));
+	onset_scan = on;
+	// Bridges a global pulse left energized have to be rewritten even if no tapper joins a
+	// cohort, so have driveOnset() write right away, and drive() its current phase
+	onset_dirty = true;
+	memset(thermal_skip, 0, sizeof(thermal_skip));
+	phase = -1;
+}
+
+// Put enabled tappers that don't follow a cohort into one that has just started, or
+// start a new one
+void scanOnset(const bool* bstates, unsigned long now) {
+	onset_scan = false;
+
+	uint8_t fresh = ONSET_NONE;
+	for (uint8_t c = 0; c < ONSET_COHORTS; c++) {
+		if (cohorts[c].members > 0 && cohorts[c].phase == 1 &&
+				(long)(cohorts[c].next - now) > (long)(upPulseLen*10) - ONSET_MERGE_US) {
+			fresh = c;
+			break;
+		}
+	}
+
+	for (int i = 0; i < TOTAL_BRIDGES; i++) {
+		if (!bstates[i] || onsetCohort(i) != ONSET_NONE) continue;
+
+		if (fresh == ONSET_NONE) {
+			for (uint8_t c = 0; c < ONSET_COHORTS && fresh == ONSET_NONE; c++) {
+				if (cohorts[c].members == 0) fresh = c;
+			}
+			// All taken, wait for one to start its next cycle
+			if (fresh == ONSET_NONE) return;
+
+			cohorts[fresh].phase = 1;
+			cohorts[fresh].next = now + segmentLen(1);
+			onset_dirty = true;
+		}
+
+		setOnsetCohort(i, fresh);
+		cohorts[fresh].members++;
+		if (thermalCycle(i, true)) thermalPulse(i, segmentLen(1), cohorts[fresh].pulses);
+	}
+}
+
+// Let the disabled tappers of a cohort go
+void releaseOnset(const bool* bstates, uint8_t c) {
+	for (int i = 0; i < TOTAL_BRIDGES; i++) {
+		if (!bstates[i] && onsetCohort(i) == c) {
+			setOnsetCohort(i, ONSET_NONE);
+			cohorts[c].members--;
+		}
+	}
+}
+
+uint8_t onsetCohort(uint16_t i) {
+	uint8_t b = onset_cohorts[i >> 1];
+	return i & 1 ? b >> 4 : b & 0x0F;
+}
+
+void setOnsetCohort(uint16_t i, uint8_t c) {
+	uint8_t* b = &onset_cohorts[i >> 1];
+	*b = i & 1 ? (*b & 0x0F) | c << 4 : (*b & 0xF0) | c;
+}
+
+// Length of a phase in micros
+unsigned long segmentLen(uint8_t p) {
+	switch (p) {
+		case 1: return upPulseLen*10;
+		case 2: return interPulseLen*10;
+		case 3: return downPulseLen*10;
+		default: return pauseLen*10;
+	}
+}
+
+// Start tapper i's cycle, returns false if it's disabled or too hot to pulse in it
+bool thermalCycle(uint16_t i, bool enabled) {
+	uint8_t bit = 1 << (i & 7);
+	thermal_skip[i >> 3] &= ~bit;
+	if (!enabled || thermal_budget == 0) return enabled;
+	if (thermal_heat[i] < thermal_limit) return true;
+
+	thermal_skip[i >> 3] |= bit;
+	thermal_skipped++;
+	if (!(thermal_hot[i >> 3] & bit)) {
+		thermal_hot[i >> 3] |= bit;
+		thermal_hot_count++;
+		thermal_changed = true;
+	}
+	return false;
+}
+
+// True if tapper i sits out its current cycle
+bool thermalSkipping(uint16_t i) {
+	return thermal_skip[i >> 3] & (1 << (i & 7));
+}
+
+// Heat tapper i up by a pulse of len micros, the n-th pulse phase of its cycle's clock
+void thermalPulse(uint16_t i, unsigned long len, uint8_t n) {
+	if (thermal_budget == 0) return;
+	// Golden ratio steps through the dither, so every tapper's rounding errors cancel out
+	// within a few pulses
+	uint8_t dither = (n + i) * 159;
+	uint16_t heat = thermal_heat[i] + ((len / (THERMAL_UNIT_US / 256) + dither) >> 8);
+	thermal_heat[i] = heat > 0xFF ? 0xFF : heat;
+}
+
+// Account for the pulse the tappers following cohort c just started, starting their cycle
+// if it's an up pulse
+void thermalCohort(uint8_t c) {
+	if (thermal_budget == 0) return;
+	cohorts[c].pulses++;
+	uint8_t p = cohorts[c].phase;
+	for (int i = 0; i < TOTAL_BRIDGES; i++) {
+		if (onsetCohort(i) != c) continue;
+		if (p == 1 ? !thermalCycle(i, true) : thermalSkipping(i)) continue;
+		thermalPulse(i, segmentLen(p), cohorts[c].pulses);
+	}
+}
+
+void setThermalBudget(uint8_t budget) {
+	if (budget > 100) budget = 100;
+	if (thermal_budget == 0 && budget > 0) {
+		// No idea how warm they are, start from cold
+		memset(thermal_heat, 0, sizeof(thermal_heat));
+		thermal_skipped = 0;
+		thermal_tick_ms = millis();
+	}
+	if (budget == 0) {
+		memset(thermal_skip, 0, sizeof(thermal_skip));
+		memset(thermal_hot, 0, sizeof(thermal_hot));
+		thermal_hot_count = 0;
+	}
+
+	thermal_budget = budget;
+	thermal_limit = THERMAL_FULL * budget / 100;
+	thermal_release = thermal_limit - thermal_limit / 8;
+	reportThermal();
+}
+
+// Let every tapper cool off by a tick's worth once every THERMAL_TICK_MS, and report
+// changes to which ones are throttled
+void updateThermal() {
+	if (thermal_budget == 0) return;
+
+	unsigned long now = millis();
+	if (now - thermal_tick_ms >= THERMAL_TICK_MS) {
+		thermal_tick_ms += THERMAL_TICK_MS;
+		thermal_ticks++;
+		for (int i = 0; i < TOTAL_BRIDGES; i++) {
+			thermal_heat[i] -= (thermal_heat[i] + ((thermal_ticks + i) & ((1 << THERMAL_SHIFT) - 1))) >> THERMAL_SHIFT;
+
+			uint8_t bit = 1 << (i & 7);
+			if ((thermal_hot[i >> 3] & bit) && thermal_heat[i] < thermal_release) {
+				thermal_hot[i >> 3] &= ~bit;
+				thermal_hot_count--;
+				thermal_changed = true;
+			}
+		}
+	}
+
+	if (thermal_changed && now - thermal_report_ms >= THERMAL_REPORT_MS) reportThermal();
+}
+
+void reportThermal() {
+	Serial.print(F("thermal "));
+	Serial.print(thermal_hot_count);
+	Serial.print(' ');
+	Serial.print(thermal_skipped);
+	Serial.print(' ');
+	for (int chip = 0; chip < NCV_CHIPS; chip++) {
+		uint8_t b = 0;
+		for (int i = 0; i < BRIDGES_PER_CHIP; i++) {
+			uint16_t t = chip*BRIDGES_PER_CHIP + i;
+			if (thermal_hot[t >> 3] & (1 << (t & 7))) b |= 1 << i;
+		}
+		if (b < 0x10) Serial.print('0');
+		Serial.print(b, HEX);
+	}
+	Serial.println();
+	thermal_changed = false;
+	thermal_report_ms = millis();
+}
+
+// Interpret a byte received outside of any frame as the start of a new command
+void beginCommand(uint8_t incomingByte) {
+	if (SERIAL_DEBUG) Serial.println(F("None start"));
+	serial_byte_count = 0;
+	switch(incomingByte) {
+		case 0x80: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Conf"));
+			mode = MODE_CONF;
+
+			tmpUpPulseLen = 0;
+			tmpInterPulseLen = 0;
+			tmpDownPulseLen = 0;
+			tmpPauseLen = 0;
+			break;
+		}
+		case 0x81: {
+			if (SERIAL_DEBUG) Serial.println(F("  >State"));
+			mode = MODE_STATE;
+			if (probe_tag >= 0) probe_receipt_us = micros();
+			break;
+		}
+		case 0x83: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Seq"));
+			mode = MODE_SEQ;
+			break;
+		}
+		case 0x84: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Window"));
+			Serial.print(F("window "));
+			Serial.print(rx_consumed);
+			Serial.print(' ');
+			Serial.println(RX_WINDOW);
+			rx_reported = rx_consumed;
+			mode = MODE_NONE;
+			break;
+		}
+		case 0x85: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Stats"));
+			Serial.print(F("stats "));
+			Serial.print(rx_frames);
+			Serial.print(' ');
+			Serial.print(rx_bad_frames);
+			Serial.print(' ');
+			Serial.println(link_util);
+			mode = MODE_NONE;
+			break;
+		}
+		case 0x86: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Time"));
+			time_query_us = micros();
+			mode = MODE_TIME;
+			break;
+		}
+		case 0x87: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Sync"));
+			mode = MODE_SYNC;
+			break;
+		}
+		case 0x88: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Probe"));
+			mode = MODE_PROBE;
+			break;
+		}
+		case 0x89: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Info"));
+			reportInfo();
+			mode = MODE_NONE;
+			break;
+		}
+		case 0x8A: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Onset"));
+			mode = MODE_ONSET;
+			break;
+		}
+		case 0x8B: {
+			if (SERIAL_DEBUG) Serial.println(F("  >Thermal"));
+			mode = MODE_THERMAL;
+			break;
+		}
+		default: {
+			if (SERIAL_DEBUG) Serial.println(F("  >?"));
+			mode = MODE_NONE;
+			break;
+		}
+	}
+}
+
+// Count a completed frame and acknowledge it if the host tagged it with a sequence number
+void ackFrame(bool ok) {
+	if (ok) {
+		rx_frames++;
+	} else {
+		rx_bad_frames++;
+	}
+
+	if (frame_seq < 0) return;
+
+	if (ok) Serial.print(F("ack "));
+	else Serial.print(F("nak "));
+	Serial.print(frame_seq);
+	Serial.print(' ');
+	Serial.println(rx_consumed);
+	rx_reported = rx_consumed;
+	frame_seq = -1;
+}
+
+// Tell the host how far we've read so it can keep streaming a long frame
+void reportCredit() {
+	Serial.print(F("credit "));
+	Serial.println(rx_consumed);
+	rx_reported = rx_consumed;
+}
+
+// Have the SPI engine stamp the first byte of the write() about to be queued, if a probed
+// frame is waiting for one
+void armProbe() {
+	if (probe_applied_tag < 0 || probe_spi_armed || probe_spi_done) return;
+	probe_spi_index = spi_head;
+	probe_spi_armed = true;
+}
+
+// Answer a probe once its frame made it onto SPI
+void reportProbe() {
+	Serial.print(F("probe "));
+	Serial.print(probe_applied_tag);
+	Serial.print(' ');
+	Serial.print(probe_receipt_us);
+	Serial.print(' ');
+	Serial.print(probe_apply_us);
+	Serial.print(' ');
+	Serial.println(probe_spi_us);
+	probe_applied_tag = -1;
+	probe_spi_done = false;
+}
+
+// Tell a host that (re)connected what we're running, so it can pick up where the last one
+// left off instead of resetting us
+void reportInfo() {
+	Serial.print(F("info "));
+	Serial.print(F(FIRMWARE_VERSION));
+	Serial.print(' ');
+	Serial.print(NUM_BOARDS);
+	Serial.print(' ');
+	Serial.print(CHIPS_PER_BOARD);
+	Serial.print(' ');
+	Serial.print(upPulseLen);
+	Serial.print(' ');
+	Serial.print(interPulseLen);
+	Serial.print(' ');
+	Serial.print(downPulseLen);
+	Serial.print(' ');
+	Serial.print(pauseLen);
+	Serial.print(' ');
+	Serial.println(stateHash());
+}
+
+// 32 bit FNV-1a over bstates the way a state frame carries them, one byte per chip
+uint32_t stateHash() {
+	uint32_t hash = 2166136261UL;
+	for (int chip = 0; chip < NCV_CHIPS; chip++) {
+		uint8_t b = 0;
+		for (int i = 0; i < BRIDGES_PER_CHIP; i++) {
+			if (bstates[chip*BRIDGES_PER_CHIP + i]) b |= 1 << i;
+		}
+		hash = (hash ^ b) * 16777619UL;
+	}
+	return hash;
+}
+
+// Map a micros() value onto the host's time base, see 0x87
+unsigned long syncedMicros(unsigned long t) {
+	int32_t elapsed = t - sync_ref;
+	return sync_base + elapsed + (int32_t)(((int64_t)elapsed * sync_rate) >> 24);
+}
+
+// Recompute the link utilisation once every LINK_STATS_MS
+void updateLinkStats() {
+	unsigned long now = millis();
+	if (now - rx_stats_start < LINK_STATS_MS) return;
+
+	// 10 bits on the wire per byte (start + 8 data + stop)
+	uint32_t capacity = (uint32_t)LINK_BAUD / 10 * (now - rx_stats_start) / 1000;
+	link_util = min((uint32_t)100, rx_stats_bytes * 100 / capacity);
+
+	rx_stats_bytes = 0;
+	rx_stats_start = now;
+}
+
 // Helper function if you want to set the en and dir for a particular hbridge manually
 // e.g set(states, num_states, 3, 1, 1); would set the 3rd hbridge to en=1 dir=1
 void set(state_t* states, uint8_t num_states, uint16_t position, bool en, bool dir) {
@@ -291,17 +1102,15 @@ void set(state_t* states, uint8_t num_states, uint16_t position, bool en, bool d
 	states[state_index].dir |= (dir << offset);
 }
 
-// Write a state array out over SPI
+// Queue a state array to be written out over SPI, returns before it is sent
 void write(const state_t* states, uint8_t num_states) {
+	digitalWrite(DOUT_PIN, LOW);
 
 	for(int boardIx = 0; boardIx < NUM_BOARDS; boardIx++) {
 		
 		for(int reg = 0; reg < NUM_REGISTERS; reg++) {
 			//begin new SPI frame to transfer data for each chip's HB_ACT_CTRL_i reg
-			delayMicroseconds(10);
-			digitalWrite(DOUT_PIN, LOW);
-			digitalWrite(CS_PINS[boardIx], LOW);
-			delayMicroseconds(10);
+			spiBeginFrame(boardIx);
 			for (int addr_count = 0; addr_count < CHIPS_PER_BOARD; addr_count++) {
 				bool write = true; // HACK: true normally
 				bool labt = false;
@@ -310,28 +1119,117 @@ void write(const state_t* states, uint8_t num_states) {
 				if (addr_count == CHIPS_PER_BOARD-1) {
 					labt = true;
 				}
-				SPI.transfer(1 | labt << 1 | addr << 2 | write << 7);
+				spiQueue(1 | labt << 1 | addr << 2 | write << 7);
 			}
 			//set the states of each HB_ACT_CTRL_i register according to the states variable
 			for (int dataIx = 0; dataIx < CHIPS_PER_BOARD; dataIx++) {
-				uint8_t dataByte = 0;
-				for(int nibIx = 0; nibIx < 2; nibIx++) {
-					if ((states[dataIx + boardIx * CHIPS_PER_BOARD].en & (1 << (reg*2+nibIx))) == 0) {
-						dataByte &= ~(0b1111 << (nibIx*4));
-					} else {
-						if ((states[dataIx + boardIx * CHIPS_PER_BOARD].dir & (1 << (reg*2+nibIx))) != 0) {
-							dataByte |= 0b1001 << (nibIx*4);
-						} else {
-							dataByte |= 0b0110 << (nibIx*4);
-						}
-					}
-				}
-				SPI.transfer(dataByte);
+				const state_t* state = &states[dataIx + boardIx * CHIPS_PER_BOARD];
+				uint8_t shift = reg*2;
+				spiQueue(HB_DATA_BYTES[((state->en >> shift) & 0b11) | ((state->dir >> shift) & 0b11) << 2]);
 			}
-		delayMicroseconds(10);
-		digitalWrite(CS_PINS[boardIx], HIGH);
-		delayMicroseconds(10);			
+			spiEndFrame();
 		}
 		
 	}
-}
\ No newline at end of file
+}
+
+// Open a CS frame for a board, waits if all frame slots are in flight
+void spiBeginFrame(uint8_t boardIx) {
+	while ((uint8_t)(spi_frame_head - spi_frame_tail) >= SPI_FRAMES) {}
+
+	volatile spi_frame_t* frame = &spi_frames[spi_frame_head & (SPI_FRAMES-1)];
+	frame->cs_port = CS_PORTS[boardIx];
+	frame->cs_mask = CS_MASKS[boardIx];
+	frame->closed = false;
+	spi_frame_head++;
+}
+
+// Append a byte to the open frame, waits if the queue is full
+void spiQueue(uint8_t b) {
+	while ((uint8_t)(spi_head - spi_tail) >= SPI_QUEUE_SIZE - 1) {}
+
+	spi_queue[spi_head & (SPI_QUEUE_SIZE-1)] = b;
+	spi_head++;
+	spiKick();
+}
+
+// Close the open frame, its chip select goes high once its last byte is out
+void spiEndFrame() {
+	volatile spi_frame_t* frame = &spi_frames[(spi_frame_head - 1) & (SPI_FRAMES-1)];
+	frame->end = spi_head;
+	frame->closed = true;
+	spiKick();
+}
+
+// Restart the engine if it's idle or stalled
+void spiKick() {
+	noInterrupts();
+	if (!spi_busy) spiNext();
+	interrupts();
+}
+
+// Call spiNext() again after SPI_GUARD_TICKS
+void spiGuard() {
+	TCNT1 = 0;
+	TCCR1B = _BV(WGM12) | _BV(CS11);
+	spi_busy = true;
+}
+
+// Advance the engine by one step, only ever called with interrupts off
+void spiNext() {
+	spi_busy = false;
+
+	// The guard after the last chip select went high is over
+	if (spi_state == SPI_POST) spi_state = SPI_IDLE;
+	if (spi_frame_tail == spi_frame_head) return;
+
+	volatile spi_frame_t* frame = &spi_frames[spi_frame_tail & (SPI_FRAMES-1)];
+
+	switch (spi_state) {
+		case SPI_IDLE: {
+			*frame->cs_port &= ~frame->cs_mask;
+			spi_state = SPI_SETUP;
+			spiGuard();
+			break;
+		}
+		case SPI_SETUP:
+		case SPI_SEND: {
+			spi_state = SPI_SEND;
+			if (spi_tail != (frame->closed ? frame->end : spi_head)) {
+				if (probe_spi_armed && spi_tail == probe_spi_index) {
+					probe_spi_us = micros();
+					probe_spi_armed = false;
+					probe_spi_done = true;
+				}
+				SPDR = spi_queue[spi_tail & (SPI_QUEUE_SIZE-1)];
+				spi_tail++;
+				spi_busy = true;
+			} else if (frame->closed) {
+				spi_state = SPI_HOLD;
+				spiGuard();
+			}
+			// else we caught up with the encoder, spiQueue() kicks us again
+			break;
+		}
+		case SPI_HOLD: {
+			*frame->cs_port |= frame->cs_mask;
+			spi_frame_tail++;
+			spi_state = SPI_POST;
+			spiGuard();
+			break;
+		}
+		default: {
+			break;
+		}
+	}
+}
+
+ISR(SPI_STC_vect) {
+	spiNext();
+}
+
+ISR(TIMER1_COMPA_vect) {
+	// One shot, stop the timer again
+	TCCR1B = _BV(WGM12);
+	spiNext();
+}
@@ -0,0 +1,113 @@
+#include "capture.h"
+
+#include <string.h>
+#include <time.h>
+
+// Way more than one read() ever returns, anything bigger is a corrupt log
+#define MAX_RECORD (1 << 24)
+
+static const uint8_t MAGIC[8] = {'T', 'A', 'P', 'C', 'A', 'P', 0x01, 0x00};
+
+static void put_varint(FILE* f, uint64_t v) {
+	while (v >= 0x80) {
+		fputc((v & 0x7F) | 0x80, f);
+		v >>= 7;
+	}
+	fputc(v, f);
+}
+
+static bool get_varint(FILE* f, uint64_t* v) {
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = fgetc(f);
+		if (c == EOF) return false;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) return true;
+	}
+	return false;
+}
+
+static void put_le(FILE* f, uint64_t v, int bytes) {
+	for (int i = 0; i < bytes; i++) fputc((v >> (i * 8)) & 0xFF, f);
+}
+
+static bool get_le(FILE* f, uint64_t* v, int bytes) {
+	*v = 0;
+	for (int i = 0; i < bytes; i++) {
+		int c = fgetc(f);
+		if (c == EOF) return false;
+		*v |= (uint64_t)c << (i * 8);
+	}
+	return true;
+}
+
+bool capture_create(capture_t* cap, const char* path, int baud) {
+	cap->f = fopen(path, "wb");
+	if (!cap->f) return false;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	cap->baud = baud;
+	cap->wall_start_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	cap->start_ns = 0;
+	cap->last_ns = 0;
+	cap->started = false;
+
+	fwrite(MAGIC, 1, sizeof(MAGIC), cap->f);
+	put_le(cap->f, baud, 4);
+	put_le(cap->f, cap->wall_start_ns, 8);
+	return true;
+}
+
+void capture_write(capture_t* cap, capture_dir_t dir, int64_t t_ns, const uint8_t* data, size_t len) {
+	if (!cap->started) {
+		cap->start_ns = t_ns;
+		cap->last_ns = t_ns;
+		cap->started = true;
+	}
+
+	put_varint(cap->f, t_ns - cap->last_ns);
+	put_varint(cap->f, (uint64_t)len << 1 | dir);
+	fwrite(data, 1, len, cap->f);
+	cap->last_ns = t_ns;
+}
+
+bool capture_open(capture_t* cap, const char* path) {
+	cap->f = fopen(path, "rb");
+	if (!cap->f) return false;
+
+	uint8_t magic[sizeof(MAGIC)];
+	uint64_t baud, wall;
+	if (fread(magic, 1, sizeof(magic), cap->f) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+			!get_le(cap->f, &baud, 4) || !get_le(cap->f, &wall, 8)) {
+		fclose(cap->f);
+		cap->f = NULL;
+		return false;
+	}
+
+	cap->baud = baud;
+	cap->wall_start_ns = wall;
+	cap->start_ns = 0;
+	cap->last_ns = 0;
+	cap->started = true;
+	return true;
+}
+
+bool capture_read(capture_t* cap, capture_record_t* rec) {
+	uint64_t dt, len_dir;
+	if (!get_varint(cap->f, &dt) || !get_varint(cap->f, &len_dir) || (len_dir >> 1) > MAX_RECORD) return false;
+
+	rec->dir = (capture_dir_t)(len_dir & 1);
+	rec->data.resize(len_dir >> 1);
+	if (fread(rec->data.data(), 1, rec->data.size(), cap->f) != rec->data.size()) return false;
+
+	cap->last_ns += dt;
+	rec->t_ns = cap->last_ns;
+	return true;
+}
+
+void capture_close(capture_t* cap) {
+	if (cap->f) fclose(cap->f);
+	cap->f = NULL;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+// Timed log of a serial session, as written by tappy-record and read by tappy-replay.
+//
+//   header   "TAPCAP" 0x01 0x00, baud (LE uint32), wall clock at the start (LE int64 ns)
+//   records  varint ns since the previous record, varint len << 1 | direction, data
+//
+// A record is whatever one read() returned, stamped with CLOCK_MONOTONIC right after
+// the read. The varints keep a record of a 26 byte v6 frame at 29 bytes.
+
+typedef enum _capture_dir_t {
+	CAPTURE_TO_DEVICE = 0,
+	CAPTURE_FROM_DEVICE = 1
+} capture_dir_t;
+
+typedef struct {
+	FILE* f;
+	uint32_t baud;
+	int64_t wall_start_ns;
+	// Monotonic time of the first record when writing, time of the last record read
+	// relative to the first one when reading
+	int64_t start_ns;
+	int64_t last_ns;
+	bool started;
+} capture_t;
+
+typedef struct {
+	capture_dir_t dir;
+	int64_t t_ns; // since the first record
+	std::vector<uint8_t> data;
+} capture_record_t;
+
+bool capture_create(capture_t* cap, const char* path, int baud);
+void capture_write(capture_t* cap, capture_dir_t dir, int64_t t_ns, const uint8_t* data, size_t len);
+
+bool capture_open(capture_t* cap, const char* path);
+// False at the end of the log (or at a truncated record, e.g. the recorder was killed)
+bool capture_read(capture_t* cap, capture_record_t* rec);
+
+void capture_close(capture_t* cap);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Monotonic time in nanoseconds, the common time base of all the host tools
+static inline int64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,115 @@
+#include "clock_sync.h"
+
+#include <math.h>
+
+void sync_reset(clock_sync_t* sync, int window) {
+	sync->window = window < 2 ? 2 : window;
+	sync->has_best = false;
+	sync->best_rtt_ns = 0;
+	sync->has_local = false;
+	sync->last_local = 0;
+	sync->local_wraps = 0;
+	sync->points.clear();
+	sync->valid = false;
+	sync->fit_host_ns = 0;
+	sync->fit_local_us = 0;
+	sync->fit_rate = 1;
+	sync->fit_residual_us = 0;
+	sync->last_rtt_ns = 0;
+}
+
+void sync_add_sample(clock_sync_t* sync, int64_t sent_ns, int64_t received_ns, uint32_t local_us) {
+	if (sync->has_local && local_us < sync->last_local && sync->last_local - local_us > 0x80000000u) {
+		sync->local_wraps += 4294967296.0;
+	}
+	sync->has_local = true;
+	sync->last_local = local_us;
+
+	// The master stamps the query somewhere inside the round trip, the shorter that is the
+	// less it matters where
+	int64_t rtt = received_ns - sent_ns;
+	if (sync->has_best && rtt >= sync->best_rtt_ns) return;
+
+	sync->has_best = true;
+	sync->best_rtt_ns = rtt;
+	sync->best.host_ns = sent_ns + rtt / 2;
+	sync->best.local_us = sync->local_wraps + local_us;
+}
+
+bool sync_end_round(clock_sync_t* sync) {
+	if (!sync->has_best) return sync->valid;
+
+	sync->points.push_back(sync->best);
+	if ((int)sync->points.size() > sync->window) sync->points.pop_front();
+	sync->last_rtt_ns = sync->best_rtt_ns;
+	sync->has_best = false;
+
+	// Least squares around the newest point, which keeps the numbers small
+	const sync_point_t& last = sync->points.back();
+	size_t n = sync->points.size();
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	for (const sync_point_t& p : sync->points) {
+		double x = (p.host_ns - last.host_ns) / 1000.0;
+		double y = p.local_us - last.local_us;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	double rate = 1;
+	double denom = n * sxx - sx * sx;
+	if (n >= 2 && denom > 0) rate = (n * sxy - sx * sy) / denom;
+	double intercept = (sy - rate * sx) / n;
+
+	sync->fit_host_ns = last.host_ns;
+	sync->fit_local_us = last.local_us + intercept;
+	sync->fit_rate = rate;
+
+	sync->fit_residual_us = 0;
+	for (const sync_point_t& p : sync->points) {
+		double r = p.local_us - sync_local_at(sync, p.host_ns);
+		sync->fit_residual_us = fmax(sync->fit_residual_us, fabs(r));
+	}
+
+	sync->valid = n >= 2;
+	return sync->valid;
+}
+
+double sync_local_at(const clock_sync_t* sync, int64_t host_ns) {
+	return sync->fit_local_us + sync->fit_rate * (host_ns - sync->fit_host_ns) / 1000.0;
+}
+
+int64_t sync_host_at(const clock_sync_t* sync, double local_us) {
+	return sync->fit_host_ns + (int64_t)llround((local_us - sync->fit_local_us) / sync->fit_rate * 1000.0);
+}
+
+double sync_unwrap(const clock_sync_t* sync, int64_t host_ns, uint32_t local_us) {
+	double expected = sync_local_at(sync, host_ns);
+	uint32_t wrapped = (uint32_t)(uint64_t)fmod(expected, 4294967296.0);
+	return expected + (int32_t)(local_us - wrapped);
+}
+
+void sync_discipline(const clock_sync_t* sync, int64_t host_ns, sync_discipline_t* d) {
+	double local = sync_local_at(sync, host_ns);
+	d->ref = (uint32_t)(uint64_t)fmod(local, 4294967296.0);
+	d->base = sync_host_us(host_ns);
+	d->rate = (int32_t)lround((1.0 / sync->fit_rate - 1.0) * (1 << SYNC_RATE_SHIFT));
+}
+
+uint32_t sync_apply(const sync_discipline_t* d, uint32_t local_us) {
+	int32_t elapsed = (int32_t)(local_us - d->ref);
+	// >> of a negative value is arithmetic on every compiler we care about, like avr-gcc
+	return d->base + elapsed + (int32_t)(((int64_t)elapsed * d->rate) >> SYNC_RATE_SHIFT);
+}
+
+static void put_le32(uint8_t* p, uint32_t v) {
+	for (int i = 0; i < 4; i++) p[i] = (v >> (i * 8)) & 0xFF;
+}
+
+void sync_encode(const sync_discipline_t* d, uint8_t* frame) {
+	frame[0] = 0x87;
+	put_le32(frame + 1, d->ref);
+	put_le32(frame + 5, d->base);
+	put_le32(frame + 9, (uint32_t)d->rate);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+
+// Host side of the v6 clock sync (0x86 / 0x87, see docs/README-v6.md).
+//
+// Each round the host asks the master for its micros() a few times and keeps the answer
+// with the shortest round trip, stamped at the middle of that round trip. A least squares
+// line through the last rounds gives the master's offset and rate against the host clock,
+// and the discipline sent back makes the master's synced clock read the host clock, in
+// us mod 2^32. Every master on the host then runs its pulse period off the same clock.
+
+// Wire encoding of 0x87: ref, base (LE uint32 us) and rate (LE int32, 2^-24 units)
+#define SYNC_FRAME_LEN 13
+#define SYNC_RATE_SHIFT 24
+
+typedef struct {
+	uint32_t ref; // master micros() the discipline is anchored at
+	uint32_t base; // synced time at ref
+	int32_t rate; // synced us per micros() us, minus one, in 2^-24 units
+} sync_discipline_t;
+
+typedef struct {
+	int64_t host_ns; // middle of the round trip
+	double local_us; // master micros(), unwrapped
+} sync_point_t;
+
+typedef struct {
+	int window; // rounds in the fit
+
+	// Best sample of the round in progress
+	bool has_best;
+	int64_t best_rtt_ns;
+	sync_point_t best;
+
+	// micros() wraps every 71 minutes, keep counting past it
+	bool has_local;
+	uint32_t last_local;
+	double local_wraps;
+
+	std::deque<sync_point_t> points;
+
+	// The fit, local_us = fit_local_us + fit_rate * (host_ns - fit_host_ns) / 1000
+	bool valid;
+	int64_t fit_host_ns;
+	double fit_local_us;
+	double fit_rate;
+	// Largest distance of a point in the fit from the line, us
+	double fit_residual_us;
+	// Round trip of the last round's best sample
+	int64_t last_rtt_ns;
+} clock_sync_t;
+
+void sync_reset(clock_sync_t* sync, int window);
+
+// One answer to a time query: when it was sent, when the answer came back and the master's
+// micros() in it
+void sync_add_sample(clock_sync_t* sync, int64_t sent_ns, int64_t received_ns, uint32_t local_us);
+
+// Fit the best sample of this round in and start the next round. False until there are
+// enough rounds for a rate.
+bool sync_end_round(clock_sync_t* sync);
+
+// Master micros() expected at host_ns
+double sync_local_at(const clock_sync_t* sync, int64_t host_ns);
+
+// Host time of a master micros() value, unwrapped like the samples (the inverse of
+// sync_local_at)
+int64_t sync_host_at(const clock_sync_t* sync, double local_us);
+
+// A raw 32 bit micros() value from around host_ns, unwrapped onto the fit's count
+double sync_unwrap(const clock_sync_t* sync, int64_t host_ns, uint32_t local_us);
+
+// Discipline that makes the master's synced clock read the host clock from host_ns on
+void sync_discipline(const clock_sync_t* sync, int64_t host_ns, sync_discipline_t* d);
+
+// The master's synced clock for a micros() value, the same fixed point maths as the firmware
+uint32_t sync_apply(const sync_discipline_t* d, uint32_t local_us);
+
+// 0x87 + 12 bytes
+void sync_encode(const sync_discipline_t* d, uint8_t* frame);
+
+// The host clock in us mod 2^32, the time base every master is steered onto
+static inline uint32_t sync_host_us(int64_t host_ns) {
+	return (uint32_t)(uint64_t)(host_ns / 1000);
+}
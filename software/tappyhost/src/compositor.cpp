@@ -0,0 +1,404 @@
+#include "compositor.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+static comp_rect_t intersect(const comp_rect_t& a, const comp_rect_t& b) {
+	comp_rect_t r;
+	r.x0 = std::max(a.x0, b.x0);
+	r.y0 = std::max(a.y0, b.y0);
+	r.x1 = std::min(a.x1, b.x1);
+	r.y1 = std::min(a.y1, b.y1);
+	return r;
+}
+
+static bool empty(const comp_rect_t& r) {
+	return r.x0 >= r.x1 || r.y0 >= r.y1;
+}
+
+static comp_rect_t layer_rect(const comp_layer_t* layer) {
+	comp_rect_t r = {layer->x, layer->y, layer->x + layer->w, layer->y + layer->h};
+	return r;
+}
+
+static comp_rect_t tile_rect(const compositor_t* comp, int tx, int ty) {
+	comp_rect_t r = {tx * COMP_TILE, ty * COMP_TILE, std::min((tx + 1) * COMP_TILE, comp->width),
+		std::min((ty + 1) * COMP_TILE, comp->height)};
+	return r;
+}
+
+// Mark the tiles under a canvas rectangle for recomposition
+static void mark(compositor_t* comp, const comp_rect_t& canvas_rect) {
+	comp_rect_t all = {0, 0, comp->width, comp->height};
+	comp_rect_t r = intersect(canvas_rect, all);
+	if (empty(r)) return;
+
+	for (int ty = r.y0 / COMP_TILE; ty <= (r.y1 - 1) / COMP_TILE; ty++) {
+		for (int tx = r.x0 / COMP_TILE; tx <= (r.x1 - 1) / COMP_TILE; tx++) {
+			comp->dirty[ty * comp->tiles_x + tx] = 1;
+		}
+	}
+}
+
+static void mark_layer(compositor_t* comp, const comp_layer_t* layer) {
+	if (layer->visible) mark(comp, layer_rect(layer));
+}
+
+static bool below(const comp_layer_t* a, const comp_layer_t* b) {
+	return a->priority != b->priority ? a->priority < b->priority : a->order < b->order;
+}
+
+void comp_init(compositor_t* comp, int width, int height) {
+	comp->width = width;
+	comp->height = height;
+	comp->tiles_x = (width + COMP_TILE - 1) / COMP_TILE;
+	comp->tiles_y = (height + COMP_TILE - 1) / COMP_TILE;
+	comp->layers.clear();
+	comp->next_id = 1;
+	comp->next_order = 0;
+	comp->canvas.assign((size_t)width * height, 0);
+	comp->dirty.assign((size_t)comp->tiles_x * comp->tiles_y, 0);
+	comp->band.assign((size_t)width * COMP_TILE, 0);
+	comp->tile_gen.assign(comp->dirty.size(), 0);
+	comp->gen = 0;
+	comp->tiles_composed = 0;
+	comp->tiles_changed = 0;
+}
+
+void comp_free(compositor_t* comp) {
+	for (comp_layer_t* layer : comp->layers) delete layer;
+	comp->layers.clear();
+}
+
+comp_layer_t* comp_add_layer(compositor_t* comp, int x, int y, int w, int h, int priority, comp_blend_t blend, int64_t expires_ns) {
+	comp_layer_t* layer = new comp_layer_t();
+	layer->id = comp->next_id++;
+	layer->priority = priority;
+	layer->order = comp->next_order++;
+	layer->blend = blend;
+	layer->visible = true;
+	layer->expires_ns = expires_ns;
+	layer->x = x;
+	layer->y = y;
+	layer->w = std::max(w, 0);
+	layer->h = std::max(h, 0);
+	layer->cells.assign((size_t)layer->w * layer->h, 0);
+
+	comp->layers.insert(std::upper_bound(comp->layers.begin(), comp->layers.end(), layer, below), layer);
+	// An empty OR or XOR layer changes nothing, an empty override blanks its rectangle
+	if (blend == COMP_OVERRIDE) mark_layer(comp, layer);
+	return layer;
+}
+
+void comp_remove_layer(compositor_t* comp, comp_layer_t* layer) {
+	mark_layer(comp, layer);
+	comp->layers.erase(std::find(comp->layers.begin(), comp->layers.end(), layer));
+	delete layer;
+}
+
+comp_layer_t* comp_find_layer(const compositor_t* comp, int id) {
+	for (comp_layer_t* layer : comp->layers) {
+		if (layer->id == id) return layer;
+	}
+	return NULL;
+}
+
+void comp_draw(compositor_t* comp, comp_layer_t* layer, const comp_rect_t& r, const uint8_t* cells) {
+	comp_rect_t all = {0, 0, layer->w, layer->h};
+	comp_rect_t c = intersect(r, all);
+	if (empty(c)) return;
+
+	int src_w = r.x1 - r.x0;
+	for (int y = c.y0; y < c.y1; y++) {
+		const uint8_t* src = cells + (size_t)(y - r.y0) * src_w + (c.x0 - r.x0);
+		uint8_t* dst = &layer->cells[(size_t)y * layer->w + c.x0];
+		for (int x = 0; x < c.x1 - c.x0; x++) dst[x] = src[x] != 0;
+	}
+
+	comp_rect_t on_canvas = {layer->x + c.x0, layer->y + c.y0, layer->x + c.x1, layer->y + c.y1};
+	if (layer->visible) mark(comp, on_canvas);
+}
+
+void comp_fill(compositor_t* comp, comp_layer_t* layer, const comp_rect_t& r, uint8_t value) {
+	comp_rect_t all = {0, 0, layer->w, layer->h};
+	comp_rect_t c = intersect(r, all);
+	if (empty(c)) return;
+
+	for (int y = c.y0; y < c.y1; y++) memset(&layer->cells[(size_t)y * layer->w + c.x0], value != 0, c.x1 - c.x0);
+
+	comp_rect_t on_canvas = {layer->x + c.x0, layer->y + c.y0, layer->x + c.x1, layer->y + c.y1};
+	if (layer->visible) mark(comp, on_canvas);
+}
+
+void comp_set_mask(compositor_t* comp, comp_layer_t* layer, const uint8_t* mask) {
+	if (mask) {
+		layer->mask.resize(layer->cells.size());
+		for (size_t i = 0; i < layer->mask.size(); i++) layer->mask[i] = mask[i] != 0;
+	} else {
+		layer->mask.clear();
+	}
+	mark_layer(comp, layer);
+}
+
+void comp_move(compositor_t* comp, comp_layer_t* layer, int x, int y) {
+	if (x == layer->x && y == layer->y) return;
+	mark_layer(comp, layer);
+	layer->x = x;
+	layer->y = y;
+	mark_layer(comp, layer);
+}
+
+void comp_set_visible(compositor_t* comp, comp_layer_t* layer, bool visible) {
+	if (visible == layer->visible) return;
+	layer->visible = true;
+	mark_layer(comp, layer);
+	layer->visible = visible;
+}
+
+void comp_set_priority(compositor_t* comp, comp_layer_t* layer, int priority) {
+	if (priority == layer->priority) return;
+	comp->layers.erase(std::find(comp->layers.begin(), comp->layers.end(), layer));
+	layer->priority = priority;
+	comp->layers.insert(std::upper_bound(comp->layers.begin(), comp->layers.end(), layer, below), layer);
+	mark_layer(comp, layer);
+}
+
+void comp_set_blend(compositor_t* comp, comp_layer_t* layer, comp_blend_t blend) {
+	if (blend == layer->blend) return;
+	layer->blend = blend;
+	mark_layer(comp, layer);
+}
+
+// Blend n cells of a layer row onto dst. Cells and masks only hold 0 and 1, which keeps
+// the loops branch free so they vectorise.
+static void blend_row(comp_blend_t blend, const uint8_t* src, const uint8_t* mask, uint8_t* dst, int n) {
+	if (!mask) {
+		switch (blend) {
+			case COMP_OR: for (int i = 0; i < n; i++) dst[i] |= src[i]; break;
+			case COMP_XOR: for (int i = 0; i < n; i++) dst[i] ^= src[i]; break;
+			case COMP_OVERRIDE: memcpy(dst, src, n); break;
+		}
+		return;
+	}
+
+	switch (blend) {
+		case COMP_OR: for (int i = 0; i < n; i++) dst[i] |= src[i] & mask[i]; break;
+		case COMP_XOR: for (int i = 0; i < n; i++) dst[i] ^= src[i] & mask[i]; break;
+		case COMP_OVERRIDE: for (int i = 0; i < n; i++) dst[i] = mask[i] ? src[i] : dst[i]; break;
+	}
+}
+
+// Blend the part of every visible layer that falls into r onto out, a buffer of r's size
+static void compose_rect(const compositor_t* comp, const comp_rect_t& r, uint8_t* out) {
+	int w = r.x1 - r.x0;
+	memset(out, 0, (size_t)w * (r.y1 - r.y0));
+
+	for (const comp_layer_t* layer : comp->layers) {
+		if (!layer->visible) continue;
+		comp_rect_t c = intersect(r, layer_rect(layer));
+		if (empty(c)) continue;
+
+		for (int y = c.y0; y < c.y1; y++) {
+			size_t src = (size_t)(y - layer->y) * layer->w + (c.x0 - layer->x);
+			const uint8_t* mask = layer->mask.empty() ? NULL : &layer->mask[src];
+			blend_row(layer->blend, &layer->cells[src], mask, &out[(size_t)(y - r.y0) * w + (c.x0 - r.x0)], c.x1 - c.x0);
+		}
+	}
+}
+
+int comp_update(compositor_t* comp, int64_t now) {
+	for (size_t i = 0; i < comp->layers.size();) {
+		comp_layer_t* layer = comp->layers[i];
+		if (layer->expires_ns != 0 && layer->expires_ns <= now) {
+			comp_remove_layer(comp, layer);
+		} else {
+			i++;
+		}
+	}
+
+	int changed = 0;
+
+	for (int ty = 0; ty < comp->tiles_y; ty++) {
+		// Compose the span from the first to the last dirty tile of the row in one go, so
+		// a busy canvas doesn't pay for walking the layers once per tile
+		int tx0 = 0, tx1 = comp->tiles_x - 1;
+		const uint8_t* row_dirty = &comp->dirty[(size_t)ty * comp->tiles_x];
+		while (tx0 <= tx1 && !row_dirty[tx0]) tx0++;
+		while (tx1 >= tx0 && !row_dirty[tx1]) tx1--;
+		if (tx0 > tx1) continue;
+
+		comp_rect_t span = tile_rect(comp, tx0, ty);
+		span.x1 = tile_rect(comp, tx1, ty).x1;
+		int span_w = span.x1 - span.x0;
+		compose_rect(comp, span, comp->band.data());
+
+		for (int tx = tx0; tx <= tx1; tx++) {
+			size_t t = (size_t)ty * comp->tiles_x + tx;
+			if (comp->dirty[t]) comp->tiles_composed++;
+			comp->dirty[t] = 0;
+
+			comp_rect_t r = tile_rect(comp, tx, ty);
+			int w = r.x1 - r.x0;
+
+			bool differs = false;
+			for (int y = r.y0; y < r.y1; y++) {
+				uint8_t* dst = &comp->canvas[(size_t)y * comp->width + r.x0];
+				const uint8_t* src = &comp->band[(size_t)(y - span.y0) * span_w + (r.x0 - span.x0)];
+				if (memcmp(dst, src, w) != 0) {
+					memcpy(dst, src, w);
+					differs = true;
+				}
+			}
+
+			if (differs) {
+				comp->tile_gen[t] = ++comp->gen;
+				comp->tiles_changed++;
+				changed++;
+			}
+		}
+	}
+
+	return changed;
+}
+
+void comp_compose_all(const compositor_t* comp, uint8_t* out) {
+	memset(out, 0, comp->canvas.size());
+
+	for (const comp_layer_t* layer : comp->layers) {
+		if (!layer->visible) continue;
+		for (int ly = 0; ly < layer->h; ly++) {
+			for (int lx = 0; lx < layer->w; lx++) {
+				int x = layer->x + lx, y = layer->y + ly;
+				if (x < 0 || y < 0 || x >= comp->width || y >= comp->height) continue;
+
+				size_t i = (size_t)ly * layer->w + lx;
+				if (!layer->mask.empty() && !layer->mask[i]) continue;
+
+				uint8_t v = layer->cells[i];
+				uint8_t* dst = &out[(size_t)y * comp->width + x];
+				switch (layer->blend) {
+					case COMP_OR: *dst = *dst || v; break;
+					case COMP_XOR: *dst = *dst != v; break;
+					case COMP_OVERRIDE: *dst = v; break;
+				}
+			}
+		}
+	}
+}
+
+// Encoding
+
+static comp_rect_t encoder_rect(const comp_encoder_t* enc) {
+	comp_rect_t r = {enc->x, enc->y, enc->x + enc->layout->width, enc->y + enc->layout->height};
+	return r;
+}
+
+void comp_encoder_init(comp_encoder_t* enc, const compositor_t* comp, const layout_t* layout, int x, int y, pack_isa_t isa) {
+	enc->layout = layout;
+	enc->x = x;
+	enc->y = y;
+	enc->cells.assign((size_t)layout->width * layout->height, 0);
+	enc->packed.assign(layout->packed_len, 0);
+	enc->wire.assign(layout->frame_len, 0);
+	enc->tile_boards.assign((size_t)comp->tiles_x * comp->tiles_y, std::vector<int>());
+	enc->board_dirty.assign(layout->num_boards, 0);
+
+	comp_rect_t all = {0, 0, comp->width, comp->height};
+	for (int board = 0; board < layout->num_boards; board++) {
+		int bx, by;
+		layout_board_origin(*layout, board, &bx, &by);
+		comp_rect_t r = {x + bx, y + by, x + bx + layout->board_w, y + by + layout->board_h};
+		r = intersect(r, all);
+		if (empty(r)) continue;
+
+		for (int ty = r.y0 / COMP_TILE; ty <= (r.y1 - 1) / COMP_TILE; ty++) {
+			for (int tx = r.x0 / COMP_TILE; tx <= (r.x1 - 1) / COMP_TILE; tx++) {
+				enc->tile_boards[ty * comp->tiles_x + tx].push_back(board);
+			}
+		}
+	}
+
+	comp_rect_t r = intersect(encoder_rect(enc), all);
+	for (int cy = r.y0; cy < r.y1; cy++) {
+		memcpy(&enc->cells[(size_t)(cy - y) * layout->width + (r.x0 - x)], &comp->canvas[(size_t)cy * comp->width + r.x0], r.x1 - r.x0);
+	}
+	pack_encode(*layout, enc->cells.data(), enc->packed.data(), enc->wire.data(), isa);
+	enc->seen_gen = comp->gen;
+}
+
+// Repack the bitmap bytes holding cells [i0, i1) of the layout
+static void repack(comp_encoder_t* enc, size_t i0, size_t i1) {
+	size_t n = enc->cells.size();
+	for (size_t b = i0 / 8; b < (i1 + 7) / 8; b++) {
+		uint8_t v = 0;
+		for (size_t j = 0; j < 8 && b * 8 + j < n; j++) v |= (enc->cells[b * 8 + j] != 0) << j;
+		enc->packed[b] = v;
+	}
+}
+
+size_t comp_encode(comp_encoder_t* enc, const compositor_t* comp, pack_isa_t isa) {
+	if (comp->gen == enc->seen_gen) return 0;
+
+	const layout_t* layout = enc->layout;
+	comp_rect_t area = encoder_rect(enc);
+	comp_rect_t all = {0, 0, comp->width, comp->height};
+	comp_rect_t on_canvas = intersect(area, all);
+
+	// With most of the layout changed the SIMD kernels over everything beat picking out
+	// the changed boards
+	int covered = 0, changed = 0;
+	for (size_t t = 0; t < comp->tile_gen.size(); t++) {
+		if (enc->tile_boards[t].empty()) continue;
+		covered++;
+		if (comp->tile_gen[t] > enc->seen_gen) changed++;
+	}
+	if (changed * 2 > covered) {
+		for (int cy = on_canvas.y0; cy < on_canvas.y1; cy++) {
+			memcpy(&enc->cells[(size_t)(cy - enc->y) * layout->width + (on_canvas.x0 - enc->x)],
+				&comp->canvas[(size_t)cy * comp->width + on_canvas.x0], on_canvas.x1 - on_canvas.x0);
+		}
+		pack_encode(*layout, enc->cells.data(), enc->packed.data(), enc->wire.data(), isa);
+		enc->seen_gen = comp->gen;
+		return layout->frame_len;
+	}
+
+	bool any = false;
+
+	for (int ty = 0; ty < comp->tiles_y; ty++) {
+		for (int tx = 0; tx < comp->tiles_x; tx++) {
+			size_t t = (size_t)ty * comp->tiles_x + tx;
+			if (comp->tile_gen[t] <= enc->seen_gen || enc->tile_boards[t].empty()) continue;
+
+			comp_rect_t r = intersect(tile_rect(comp, tx, ty), area);
+			for (int cy = r.y0; cy < r.y1; cy++) {
+				size_t i0 = (size_t)(cy - enc->y) * layout->width + (r.x0 - enc->x);
+				memcpy(&enc->cells[i0], &comp->canvas[(size_t)cy * comp->width + r.x0], r.x1 - r.x0);
+				repack(enc, i0, i0 + (r.x1 - r.x0));
+			}
+
+			for (int board : enc->tile_boards[t]) enc->board_dirty[board] = 1;
+			any = true;
+		}
+	}
+	enc->seen_gen = comp->gen;
+	if (!any) return 0;
+
+	// Boards are laid out back to back, encode each run of changed ones in one go
+	size_t bytes = 0;
+	for (int board = 0; board < layout->num_boards;) {
+		if (!enc->board_dirty[board]) {
+			board++;
+			continue;
+		}
+		int end = board;
+		while (end < layout->num_boards && enc->board_dirty[end]) enc->board_dirty[end++] = 0;
+
+		size_t begin = layout->board_offset[board];
+		size_t stop = layout->board_offset[end - 1] + layout->board_len;
+		pack_frame_range(*layout, enc->packed.data(), enc->wire.data(), begin, stop, isa);
+		bytes += stop - begin;
+		board = end;
+	}
+	return bytes;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "layout.h"
+#include "pack.h"
+
+// Layered canvas for apps that show several things at once, say a background texture, a
+// few alerts and wherever the user touches.
+//
+// Every layer is a rectangle of on/off tappers placed on the canvas, with an optional
+// mask of the tappers it covers. Layers are stacked by priority (ties by creation order)
+// and each one is blended onto what is below it:
+//
+//   OR        on where the layer is on, the rest shows through
+//   XOR       the layer's on tappers flip what is below
+//   OVERRIDE  the layer decides, on or off, wherever its mask covers
+//
+// A layer can expire at a given time and is then removed by comp_update().
+//
+// The canvas is split into COMP_TILE x COMP_TILE tiles. Drawing, moving or removing a
+// layer only marks the tiles it touches, and comp_update() recomposes those tiles alone.
+// A comp_encoder_t keeps one layout's packed bitmap and wire frame in step with the
+// canvas, re-encoding just the boards under tiles whose cells actually changed.
+
+#define COMP_TILE 8
+
+typedef enum _comp_blend_t {
+	COMP_OR,
+	COMP_XOR,
+	COMP_OVERRIDE
+} comp_blend_t;
+
+typedef struct {
+	int x0, y0, x1, y1; // x1, y1 exclusive
+} comp_rect_t;
+
+typedef struct {
+	int id;
+	int priority;
+	uint64_t order;
+	comp_blend_t blend;
+	bool visible;
+	int64_t expires_ns; // 0 lives until removed
+
+	int x, y, w, h; // on the canvas, may hang over its edges
+	std::vector<uint8_t> cells; // w*h row-major, non zero meaning on
+	std::vector<uint8_t> mask; // w*h, non zero where the layer applies, empty for everywhere
+} comp_layer_t;
+
+typedef struct {
+	int width, height;
+	int tiles_x, tiles_y;
+
+	std::vector<comp_layer_t*> layers; // bottom to top
+	int next_id;
+	uint64_t next_order;
+
+	std::vector<uint8_t> canvas; // width*height
+	std::vector<uint8_t> dirty; // per tile, waiting to be recomposed
+	std::vector<uint8_t> band; // scratch, one row of tiles
+	// Per tile, the value of gen when its cells last changed
+	std::vector<uint64_t> tile_gen;
+	uint64_t gen;
+
+	// Counters
+	uint64_t tiles_composed, tiles_changed;
+} compositor_t;
+
+void comp_init(compositor_t* comp, int width, int height);
+void comp_free(compositor_t* comp);
+
+// New layer, all off and without a mask. expires_ns is a now_ns() time or 0.
+comp_layer_t* comp_add_layer(compositor_t* comp, int x, int y, int w, int h, int priority, comp_blend_t blend, int64_t expires_ns);
+void comp_remove_layer(compositor_t* comp, comp_layer_t* layer);
+comp_layer_t* comp_find_layer(const compositor_t* comp, int id);
+
+// Copy r.x1-r.x0 by r.y1-r.y0 cells (row-major) into the layer at r, in layer coordinates
+void comp_draw(compositor_t* comp, comp_layer_t* layer, const comp_rect_t& r, const uint8_t* cells);
+void comp_fill(compositor_t* comp, comp_layer_t* layer, const comp_rect_t& r, uint8_t value);
+// w*h mask, or NULL to cover the whole rectangle
+void comp_set_mask(compositor_t* comp, comp_layer_t* layer, const uint8_t* mask);
+void comp_move(compositor_t* comp, comp_layer_t* layer, int x, int y);
+void comp_set_visible(compositor_t* comp, comp_layer_t* layer, bool visible);
+void comp_set_priority(compositor_t* comp, comp_layer_t* layer, int priority);
+void comp_set_blend(compositor_t* comp, comp_layer_t* layer, comp_blend_t blend);
+
+// Remove layers that expired by now and recompose every dirty tile. Returns the number of
+// tiles whose cells changed.
+int comp_update(compositor_t* comp, int64_t now);
+
+// The whole stack composed from scratch into width*height cells, what comp_update() is
+// checked against
+void comp_compose_all(const compositor_t* comp, uint8_t* out);
+
+typedef struct {
+	const layout_t* layout;
+	int x, y; // the layout's top left tapper on the canvas
+
+	std::vector<uint8_t> cells; // the layout's part of the canvas
+	std::vector<uint8_t> packed;
+	std::vector<uint8_t> wire;
+
+	// Boards under each canvas tile
+	std::vector<std::vector<int> > tile_boards;
+	std::vector<uint8_t> board_dirty;
+	uint64_t seen_gen;
+} comp_encoder_t;
+
+// Encoder for the part of the canvas a layout covers, with the wire frame of the current
+// canvas in wire
+void comp_encoder_init(comp_encoder_t* enc, const compositor_t* comp, const layout_t* layout, int x, int y, pack_isa_t isa);
+
+// Bring wire up to date with tiles that changed since the last call. Returns the number of
+// wire bytes re-encoded, 0 if the frame is unchanged.
+size_t comp_encode(comp_encoder_t* enc, const compositor_t* comp, pack_isa_t isa);
@@ -0,0 +1,62 @@
+#include "fft.h"
+
+#include <math.h>
+
+bool fft_init(fft_t* fft, int n) {
+	if (n < 2 || (n & (n - 1)) != 0) return false;
+
+	fft->n = n;
+	fft->cos_table.resize(n / 2);
+	fft->sin_table.resize(n / 2);
+	for (int i = 0; i < n / 2; i++) {
+		fft->cos_table[i] = (float)cos(2 * M_PI * i / n);
+		fft->sin_table[i] = (float)-sin(2 * M_PI * i / n);
+	}
+
+	int bits = 0;
+	while ((1 << bits) < n) bits++;
+
+	fft->rev.resize(n);
+	for (int i = 0; i < n; i++) {
+		int r = 0;
+		for (int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+		fft->rev[i] = r;
+	}
+
+	return true;
+}
+
+void fft_forward(const fft_t* fft, float* re, float* im) {
+	const int n = fft->n;
+
+	for (int i = 0; i < n; i++) {
+		int r = fft->rev[i];
+		if (r > i) {
+			float t = re[i];
+			re[i] = re[r];
+			re[r] = t;
+			t = im[i];
+			im[i] = im[r];
+			im[r] = t;
+		}
+	}
+
+	for (int len = 2; len <= n; len <<= 1) {
+		int half = len / 2;
+		int step = n / len;
+
+		for (int i = 0; i < n; i += len) {
+			for (int j = 0; j < half; j++) {
+				float wr = fft->cos_table[j * step];
+				float wi = fft->sin_table[j * step];
+				float xr = re[i + j + half] * wr - im[i + j + half] * wi;
+				float xi = re[i + j + half] * wi + im[i + j + half] * wr;
+
+				re[i + j + half] = re[i + j] - xr;
+				im[i + j + half] = im[i + j] - xi;
+				re[i + j] += xr;
+				im[i + j] += xi;
+			}
+		}
+	}
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <vector>
+
+// In place radix-2 complex FFT with precomputed twiddles and bit reversal
+typedef struct {
+	int n;
+	std::vector<float> cos_table, sin_table;
+	std::vector<int> rev;
+} fft_t;
+
+// n must be a power of two
+bool fft_init(fft_t* fft, int n);
+void fft_forward(const fft_t* fft, float* re, float* im);
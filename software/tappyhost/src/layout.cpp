@@ -0,0 +1,305 @@
+#include "layout.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+// One tapper feeding one bit of the output
+typedef struct {
+	uint32_t src_bit;
+	uint8_t dst_bit;
+} bit_map_t;
+
+static const char* FORMAT_NAMES[] = {"v6", "bridge-v1", "daisy"};
+static const char* ORDER_NAMES[] = {"serpentine-columns", "serpentine-rows", "rows", "columns"};
+
+const char* layout_format_name(format_t format) {
+	return FORMAT_NAMES[format];
+}
+
+const char* layout_order_name(board_order_t order) {
+	return ORDER_NAMES[order];
+}
+
+bool layout_has_commands(format_t format) {
+	return format == FORMAT_V6 || format == FORMAT_BRIDGE_V1;
+}
+
+static board_order_t default_order(format_t format) {
+	switch (format) {
+		case FORMAT_V6: return ORDER_SERPENTINE_COLUMNS;
+		case FORMAT_BRIDGE_V1: return ORDER_SERPENTINE_ROWS;
+		default: return ORDER_ROWS;
+	}
+}
+
+bool layout_parse(const char* spec, layout_desc_t* desc) {
+	char format[32], order[32];
+	int bx, by;
+
+	int n = sscanf(spec, "%31[^:]:%dx%d:%31s", format, &bx, &by, order);
+	if (n < 3 || bx <= 0 || by <= 0) return false;
+
+	desc->boards_x = bx;
+	desc->boards_y = by;
+
+	bool found = false;
+	for (int i = 0; i < 3; i++) {
+		if (strcmp(format, FORMAT_NAMES[i]) == 0) {
+			desc->format = (format_t)i;
+			found = true;
+		}
+	}
+	if (!found) return false;
+
+	desc->order = default_order(desc->format);
+	if (n < 4) return true;
+
+	for (int i = 0; i < 4; i++) {
+		if (strcmp(order, ORDER_NAMES[i]) == 0) {
+			desc->order = (board_order_t)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+void layout_board_origin(const layout_t& layout, int board, int* x, int* y) {
+	int bx = layout.desc.boards_x;
+	int by = layout.desc.boards_y;
+	int col, row;
+
+	switch (layout.desc.order) {
+		case ORDER_SERPENTINE_COLUMNS: {
+			col = board / by;
+			row = board % by;
+			if (col % 2 == 0) row = by - row - 1;
+			break;
+		}
+		case ORDER_SERPENTINE_ROWS: {
+			row = board / bx;
+			col = board % bx;
+			if (row % 2 == 1) col = bx - col - 1;
+			break;
+		}
+		case ORDER_COLUMNS: {
+			col = board / by;
+			row = board % by;
+			break;
+		}
+		default:
+		case ORDER_ROWS: {
+			row = board / bx;
+			col = board % bx;
+			break;
+		}
+	}
+
+	*x = col * layout.board_w;
+	*y = row * layout.board_h;
+}
+
+// Where tapper (x, y) of a board ends up within that board's bytes
+static void board_bit(format_t format, int x, int y, int* byte, int* bit) {
+	switch (format) {
+		case FORMAT_V6: {
+			// Chips are 3x2 tiles, two per row of tiles
+			*byte = (y / 2) * 2 + x / 3;
+			*bit = x % 3 + (y % 2) * 3;
+			break;
+		}
+		case FORMAT_BRIDGE_V1: {
+			int bridge = x * 3 + y;
+			*byte = bridge < 7 ? 0 : 1;
+			*bit = bridge % 7;
+			break;
+		}
+		case FORMAT_DAISY: {
+			// Enable bits only, all directions are left at 0
+			int bridge = x * 3 + y;
+			*byte = bridge < 6 ? 0 : 1;
+			*bit = bridge < 6 ? bridge : bridge - 6;
+			break;
+		}
+	}
+}
+
+bool layout_compile(const layout_desc_t& desc, layout_t* layout) {
+	layout->desc = desc;
+
+	size_t header, trailer;
+	switch (desc.format) {
+		case FORMAT_V6: {
+			layout->board_w = 6;
+			layout->board_h = 6;
+			layout->board_len = 6;
+			header = 1;
+			trailer = 1;
+			break;
+		}
+		case FORMAT_BRIDGE_V1: {
+			layout->board_w = 3;
+			layout->board_h = 3;
+			layout->board_len = 2;
+			header = 1;
+			trailer = 1;
+			break;
+		}
+		case FORMAT_DAISY: {
+			layout->board_w = 3;
+			layout->board_h = 3;
+			layout->board_len = 3;
+			header = 0;
+			trailer = 1;
+			break;
+		}
+		default: {
+			return false;
+		}
+	}
+
+	layout->width = desc.boards_x * layout->board_w;
+	layout->height = desc.boards_y * layout->board_h;
+	layout->num_boards = desc.boards_x * desc.boards_y;
+	layout->frame_len = header + layout->num_boards * layout->board_len + trailer;
+	layout->stride = (layout->frame_len + 7) & ~(size_t)7;
+
+	// Whole 64 bit words plus a word of padding so kernels can over-read
+	size_t cells = (size_t)layout->width * layout->height;
+	layout->packed_len = (cells + 63) / 64 * 8 + 8;
+
+	layout->base.assign(layout->stride, 0);
+	layout->board_offset.resize(layout->num_boards);
+
+	std::vector<std::vector<bit_map_t> > bits(layout->frame_len);
+
+	for (int board = 0; board < layout->num_boards; board++) {
+		int ox, oy;
+		layout_board_origin(*layout, board, &ox, &oy);
+		layout->board_offset[board] = header + board * layout->board_len;
+
+		for (int y = 0; y < layout->board_h; y++) {
+			for (int x = 0; x < layout->board_w; x++) {
+				int byte = 0, bit = 0;
+				board_bit(desc.format, x, y, &byte, &bit);
+
+				bit_map_t m;
+				m.src_bit = (uint32_t)(oy + y) * layout->width + ox + x;
+				m.dst_bit = bit;
+				bits[layout->board_offset[board] + byte].push_back(m);
+			}
+		}
+	}
+
+	switch (desc.format) {
+		case FORMAT_V6:
+		case FORMAT_BRIDGE_V1: {
+			layout->base[0] = 0x81;
+			layout->base[layout->frame_len - 1] = 0x82;
+			break;
+		}
+		case FORMAT_DAISY: {
+			layout->base[0] |= 0x80;
+			layout->base[layout->frame_len - 1] = 0x40;
+			break;
+		}
+	}
+
+	// Merge tappers that are next to each other both in the bitmap and in the output byte
+	std::vector<std::vector<bit_map_t> > runs(layout->frame_len);
+	std::vector<std::vector<uint8_t> > lens(layout->frame_len);
+	int planes = 1;
+
+	for (size_t k = 0; k < layout->frame_len; k++) {
+		std::vector<bit_map_t>& b = bits[k];
+		std::sort(b.begin(), b.end(), [](const bit_map_t& l, const bit_map_t& r) {
+			return l.dst_bit < r.dst_bit;
+		});
+
+		for (size_t i = 0; i < b.size(); i++) {
+			bool extends = !runs[k].empty() &&
+				runs[k].back().src_bit + lens[k].back() == b[i].src_bit &&
+				runs[k].back().dst_bit + lens[k].back() == b[i].dst_bit;
+
+			if (extends) {
+				lens[k].back()++;
+			} else {
+				runs[k].push_back(b[i]);
+				lens[k].push_back(1);
+			}
+		}
+
+		planes = std::max(planes, (int)runs[k].size());
+	}
+
+	layout->planes = planes;
+	layout->src.assign(planes * layout->stride, 0);
+	layout->ctl.assign(planes * layout->stride, 0);
+
+	for (size_t k = 0; k < layout->frame_len; k++) {
+		for (size_t j = 0; j < runs[k].size(); j++) {
+			const bit_map_t& r = runs[k][j];
+			uint32_t mask = (1u << lens[k][j]) - 1;
+
+			layout->src[j * layout->stride + k] = r.src_bit / 8;
+			layout->ctl[j * layout->stride + k] = (r.src_bit % 8) | (uint32_t)r.dst_bit << 8 | mask << 16;
+		}
+	}
+
+	return true;
+}
+
+void layout_encode_reference(const layout_t& layout, const uint8_t* cells, uint8_t* out) {
+	memset(out, 0, layout.frame_len);
+
+	size_t o = 0;
+	if (layout.desc.format != FORMAT_DAISY) out[o++] = 0x81;
+
+	for (int board = 0; board < layout.num_boards; board++) {
+		int ox, oy;
+		layout_board_origin(layout, board, &ox, &oy);
+
+		switch (layout.desc.format) {
+			case FORMAT_V6: {
+				for (int chip = 0; chip < 6; chip++) {
+					int chip_x = ox + (chip % 2) * 3;
+					int chip_y = oy + (chip / 2) * 2;
+					for (int y = 0; y < 2; y++) {
+						for (int x = 0; x < 3; x++) {
+							if (cells[(chip_y + y) * layout.width + chip_x + x]) out[o + chip] |= 1 << (x + y * 3);
+						}
+					}
+				}
+				o += 6;
+				break;
+			}
+			case FORMAT_BRIDGE_V1: {
+				for (int x = 0; x < 3; x++) {
+					for (int y = 0; y < 3; y++) {
+						int bridge = x * 3 + y;
+						if (cells[(oy + y) * layout.width + ox + x]) out[o + bridge / 7] |= 1 << (bridge % 7);
+					}
+				}
+				o += 2;
+				break;
+			}
+			case FORMAT_DAISY: {
+				for (int x = 0; x < 3; x++) {
+					for (int y = 0; y < 3; y++) {
+						int bridge = x * 3 + y;
+						if (cells[(oy + y) * layout.width + ox + x]) out[o + bridge / 6] |= 1 << (bridge % 6);
+					}
+				}
+				o += 3;
+				break;
+			}
+		}
+	}
+
+	if (layout.desc.format == FORMAT_DAISY) {
+		out[0] |= 0x80;
+		out[o++] = 0x40;
+	} else {
+		out[o++] = 0x82;
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Wire formats understood by the different master firmwares
+typedef enum _format_t {
+	// firmware/v6: 6x6 boards made of six 3x2 chip tiles, one byte per chip
+	//   0x81 [chip bytes] 0x82
+	FORMAT_V6,
+	// firmware/processing-bridge-v1: 3x3 boards, bridges 1-7 in the first byte, 8-9 in the second
+	//   0x81 [2 bytes per board] 0x82
+	FORMAT_BRIDGE_V1,
+	// firmware/tappytap-v2-master (and tappytap-pio chains): 3x3 boards, en/dir bits over 3 bytes,
+	// [mark2] set on the very first byte and a [mark1] latch byte at the end
+	//   [3 bytes per board] 0x40
+	FORMAT_DAISY
+} format_t;
+
+// Order in which boards are chained, see the comment at the top of testerflexv6.pde
+typedef enum _board_order_t {
+	// Up the first column from the bottom, down the next one, ... (testerflexv6)
+	ORDER_SERPENTINE_COLUMNS,
+	// Along the first row from the left, back along the next one, ... (testerv1)
+	ORDER_SERPENTINE_ROWS,
+	ORDER_ROWS,
+	ORDER_COLUMNS
+} board_order_t;
+
+typedef struct {
+	format_t format;
+	board_order_t order;
+	int boards_x, boards_y;
+} layout_desc_t;
+
+// A layout compiled into index tables for the packing kernels.
+//
+// The kernels read a linear bitmap where tapper (x, y) is bit y*width + x (LSB first).
+// Every output byte k of the frame is
+//
+//   base[k] | for each plane j: ((load32(packed + src[j][k]) >> s) & m) << d
+//
+// with s, d and m unpacked from ctl[j][k]. Each plane entry is one horizontal run of
+// tappers that lands on consecutive bits of the output byte, so a 3x2 v6 chip tile is
+// two planes while bytes with fewer runs get padded with empty (m = 0) entries.
+typedef struct {
+	layout_desc_t desc;
+
+	int width, height; // tappers
+	int board_w, board_h; // tappers per board
+	int num_boards;
+
+	size_t frame_len; // bytes on the wire, including command bytes
+	size_t stride; // frame_len rounded up to a multiple of 8, the length of each plane
+	size_t packed_len; // bytes needed for a packed bitmap, including read padding
+	int planes;
+
+	std::vector<uint8_t> base;
+	std::vector<uint32_t> src; // planes*stride byte offsets into the packed bitmap
+	std::vector<uint32_t> ctl; // planes*stride: src shift | dst shift << 8 | mask << 16
+
+	// Output bytes [board_offset[i], board_offset[i] + board_len) hold board i
+	std::vector<uint32_t> board_offset;
+	uint32_t board_len;
+} layout_t;
+
+// Parse "<format>:<X>x<Y>[:<order>]", e.g. "v6:2x2" or "bridge-v1:3x3:serpentine-rows".
+// The order defaults to the one used by the matching processing sketch.
+bool layout_parse(const char* spec, layout_desc_t* desc);
+
+bool layout_compile(const layout_desc_t& desc, layout_t* layout);
+
+// Top left tapper of the i-th board in the chain
+void layout_board_origin(const layout_t& layout, int board, int* x, int* y);
+
+// Straightforward nested loop encoder in the style of pushStates(), used as the reference
+// the packing kernels are checked and benchmarked against. cells is row-major, one byte
+// per tapper, non zero meaning on.
+void layout_encode_reference(const layout_t& layout, const uint8_t* cells, uint8_t* out);
+
+const char* layout_format_name(format_t format);
+const char* layout_order_name(board_order_t order);
+
+// True if the format's masters take the 0x80... commands (conf, flow control, info, ...).
+// A daisy master reads every byte as state: 0x80 restarts the frame and 0x40 latches it,
+// so nothing but state frames may go to one.
+bool layout_has_commands(format_t format);
@@ -0,0 +1,176 @@
+#include "pack.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PACK_X86 1
+#include <immintrin.h>
+#endif
+
+// The kernels load the bitmap as little endian words, bit i of the grid being bit i%8 of byte i/8
+
+static const char* ISA_NAMES[] = {"scalar", "sse2", "avx2"};
+
+const char* pack_isa_name(pack_isa_t isa) {
+	return ISA_NAMES[isa];
+}
+
+bool pack_parse_isa(const char* name, pack_isa_t* isa) {
+	for (int i = 0; i < 3; i++) {
+		if (strcmp(name, ISA_NAMES[i]) == 0) {
+			*isa = (pack_isa_t)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool pack_isa_supported(pack_isa_t isa) {
+	switch (isa) {
+		case PACK_SCALAR: return true;
+#ifdef PACK_X86
+		case PACK_SSE2: return __builtin_cpu_supports("sse2");
+		case PACK_AVX2: return __builtin_cpu_supports("avx2");
+#endif
+		default: return false;
+	}
+}
+
+pack_isa_t pack_best_isa() {
+	if (pack_isa_supported(PACK_AVX2)) return PACK_AVX2;
+	if (pack_isa_supported(PACK_SSE2)) return PACK_SSE2;
+	return PACK_SCALAR;
+}
+
+// Cells to bitmap
+
+static size_t pack_cells_scalar(const uint8_t* cells, size_t n, uint8_t* packed, size_t i) {
+	for (; i + 8 <= n; i += 8) {
+		uint8_t b = 0;
+		for (int j = 0; j < 8; j++) b |= (cells[i+j] != 0) << j;
+		packed[i/8] = b;
+	}
+
+	if (i < n) {
+		uint8_t b = 0;
+		for (int j = 0; i + j < n; j++) b |= (cells[i+j] != 0) << j;
+		packed[i/8] = b;
+		i += 8;
+	}
+
+	return i;
+}
+
+#ifdef PACK_X86
+__attribute__((target("sse2")))
+static size_t pack_cells_sse2(const uint8_t* cells, size_t n, uint8_t* packed) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(cells + i));
+		uint16_t bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		memcpy(packed + i/8, &bits, 2);
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t pack_cells_avx2(const uint8_t* cells, size_t n, uint8_t* packed) {
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(cells + i));
+		uint32_t bits = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+		memcpy(packed + i/8, &bits, 4);
+	}
+
+	return i;
+}
+#endif
+
+void pack_cells(const layout_t& layout, const uint8_t* cells, uint8_t* packed, pack_isa_t isa) {
+	size_t n = (size_t)layout.width * layout.height;
+	size_t i = 0;
+
+#ifdef PACK_X86
+	if (isa == PACK_AVX2) i = pack_cells_avx2(cells, n, packed);
+	if (isa == PACK_SSE2) i = pack_cells_sse2(cells, n, packed);
+#endif
+
+	i = pack_cells_scalar(cells, n, packed, i);
+	memset(packed + i/8, 0, layout.packed_len - i/8);
+}
+
+// Bitmap to frame
+
+static void pack_frame_scalar(const layout_t& layout, const uint8_t* packed, uint8_t* out, size_t k, size_t end) {
+	const size_t stride = layout.stride;
+
+	for (; k < end; k++) {
+		uint32_t v = layout.base[k];
+
+		for (int j = 0; j < layout.planes; j++) {
+			uint32_t ctl = layout.ctl[j*stride + k];
+			uint32_t w;
+			memcpy(&w, packed + layout.src[j*stride + k], 4);
+			v |= ((w >> (ctl & 0xFF)) & (ctl >> 16)) << ((ctl >> 8) & 0xFF);
+		}
+
+		out[k] = v;
+	}
+}
+
+#ifdef PACK_X86
+__attribute__((target("avx2")))
+static size_t pack_frame_avx2(const layout_t& layout, const uint8_t* packed, uint8_t* out, size_t k, size_t end) {
+	const size_t stride = layout.stride;
+	const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+	// Low byte of each 32 bit lane to the bottom of its 128 bit half
+	const __m256i narrow = _mm256_setr_epi8(
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+	for (; k + 8 <= end; k += 8) {
+		__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&layout.base[k]));
+
+		for (int j = 0; j < layout.planes; j++) {
+			__m256i src = _mm256_loadu_si256((const __m256i*)&layout.src[j*stride + k]);
+			__m256i ctl = _mm256_loadu_si256((const __m256i*)&layout.ctl[j*stride + k]);
+			__m256i w = _mm256_i32gather_epi32((const int*)packed, src, 1);
+
+			w = _mm256_srlv_epi32(w, _mm256_and_si256(ctl, byte_mask));
+			w = _mm256_and_si256(w, _mm256_srli_epi32(ctl, 16));
+			w = _mm256_sllv_epi32(w, _mm256_and_si256(_mm256_srli_epi32(ctl, 8), byte_mask));
+			v = _mm256_or_si256(v, w);
+		}
+
+		v = _mm256_shuffle_epi8(v, narrow);
+		__m128i bytes = _mm_unpacklo_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		_mm_storel_epi64((__m128i*)(out + k), bytes);
+	}
+
+	return k;
+}
+#endif
+
+void pack_frame(const layout_t& layout, const uint8_t* packed, uint8_t* out, pack_isa_t isa) {
+	pack_frame_range(layout, packed, out, 0, layout.frame_len, isa);
+}
+
+void pack_frame_range(const layout_t& layout, const uint8_t* packed, uint8_t* out, size_t begin, size_t end, pack_isa_t isa) {
+	size_t k = begin;
+
+#ifdef PACK_X86
+	if (isa == PACK_AVX2) k = pack_frame_avx2(layout, packed, out, k, end);
+#endif
+
+	pack_frame_scalar(layout, packed, out, k, end);
+}
+
+void pack_encode(const layout_t& layout, const uint8_t* cells, uint8_t* packed, uint8_t* out, pack_isa_t isa) {
+	pack_cells(layout, cells, packed, isa);
+	pack_frame(layout, packed, out, isa);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "layout.h"
+
+// Instruction sets the packing kernels can use. SSE2 and AVX2 speed up turning one
+// byte per tapper into a bitmap, AVX2 additionally gathers the output bytes from the
+// bitmap 8 at a time. Everything else uses the portable scalar code.
+typedef enum _pack_isa_t {
+	PACK_SCALAR,
+	PACK_SSE2,
+	PACK_AVX2
+} pack_isa_t;
+
+// Fastest instruction set supported by the CPU we're running on
+pack_isa_t pack_best_isa();
+bool pack_isa_supported(pack_isa_t isa);
+const char* pack_isa_name(pack_isa_t isa);
+bool pack_parse_isa(const char* name, pack_isa_t* isa);
+
+// Turn a row-major grid of layout.width*layout.height tappers (one byte each, non zero
+// meaning on) into the linear bitmap the frame kernel reads. packed must hold
+// layout.packed_len bytes, the padding at the end is cleared.
+void pack_cells(const layout_t& layout, const uint8_t* cells, uint8_t* packed, pack_isa_t isa);
+
+// Encode a packed bitmap into layout.frame_len bytes of wire frame
+void pack_frame(const layout_t& layout, const uint8_t* packed, uint8_t* out, pack_isa_t isa);
+
+// Encode only bytes [begin, end) of the wire frame, e.g. the boards under a changed region
+void pack_frame_range(const layout_t& layout, const uint8_t* packed, uint8_t* out, size_t begin, size_t end, pack_isa_t isa);
+
+// Both of the above, packed is scratch space of layout.packed_len bytes
+void pack_encode(const layout_t& layout, const uint8_t* cells, uint8_t* packed, uint8_t* out, pack_isa_t isa);
@@ -0,0 +1,104 @@
+#include "serial_port.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+static speed_t baud_constant(int baud) {
+	switch (baud) {
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+#ifdef B500000
+		case 500000: return B500000;
+#endif
+#ifdef B1000000
+		case 1000000: return B1000000;
+#endif
+		default: return 0;
+	}
+}
+
+int serial_open(const char* path, int baud) {
+	if (strcmp(path, "-") == 0) return STDOUT_FILENO;
+
+	int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	// Capturing into a new file
+	if (fd < 0 && errno == ENOENT) fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (!isatty(fd)) {
+		// Captures start from scratch like they would in a new file
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(fd, 0) != 0) {
+			fprintf(stderr, "Can't truncate %s: %s\n", path, strerror(errno));
+		}
+		return fd;
+	}
+
+	speed_t speed = baud_constant(baud);
+	if (speed == 0) {
+		fprintf(stderr, "Unsupported baud rate %d\n", baud);
+		close(fd);
+		return -1;
+	}
+
+	struct termios tio;
+	if (tcgetattr(fd, &tio) != 0) {
+		fprintf(stderr, "Can't read settings of %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	tio.c_cflag |= CLOCAL | CREAD;
+	// Keep DTR up when we close the port. An Uno resets on DTR going up, which opening the
+	// port does, so without this every reconnect reboots the master (see link_handshake())
+	tio.c_cflag &= ~HUPCL;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+
+	if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+		fprintf(stderr, "Can't configure %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+bool serial_write_all(int fd, const uint8_t* data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n > 0) {
+			data += n;
+			len -= n;
+			continue;
+		}
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			fprintf(stderr, "Serial write failed: %s\n", strerror(errno));
+			return false;
+		}
+
+		struct pollfd p = {fd, POLLOUT, 0};
+		poll(&p, 1, 100);
+	}
+
+	return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Open a serial port raw 8N1 at the given baud rate, non blocking. Anything that isn't a
+// tty (a fifo, a file, "-" for stdout) is opened as is so frames can be captured or piped
+// into other tools. Returns the fd or -1 with an error printed.
+//
+// HUPCL is cleared so DTR stays up after close and the next open doesn't reset an Uno.
+// The first open after plugging it in still does.
+int serial_open(const char* path, int baud);
+
+// Write everything, waiting for room when the port is non blocking
+bool serial_write_all(int fd, const uint8_t* data, size_t len);
+
+// Seconds it takes to shift len bytes out at baud (10 bits per byte on the wire)
+static inline double serial_wire_time(size_t len, int baud) {
+	return len * 10.0 / baud;
+}
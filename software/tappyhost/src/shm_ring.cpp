@@ -0,0 +1,220 @@
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <new>
+
+static_assert(sizeof(shm_ring_slot_t) == 64, "slot header should be one cache line");
+
+// Not FUTEX_PRIVATE_FLAG, the waiter and the waker are different processes
+static int futex(std::atomic<uint32_t>* word, int op, uint32_t value, const struct timespec* timeout) {
+	return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value, timeout, NULL, 0);
+}
+
+static shm_ring_slot_t* slot_at(const shm_ring_t* ring, uint64_t n) {
+	const shm_ring_header_t* h = ring->header;
+	return reinterpret_cast<shm_ring_slot_t*>(ring->slots + (size_t)(n & (h->slots - 1)) * h->slot_size);
+}
+
+static void set_name(shm_ring_t* ring, const char* name) {
+	// shm_open() wants names like "/foo"
+	snprintf(ring->name, sizeof(ring->name), "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+static bool map(shm_ring_t* ring, int fd, size_t len) {
+	void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	ring->header = static_cast<shm_ring_header_t*>(p);
+	ring->slots = static_cast<uint8_t*>(p) + sizeof(shm_ring_header_t);
+	ring->map_len = len;
+	return true;
+}
+
+bool shm_ring_create(shm_ring_t* ring, const char* name, const char* layout_spec, size_t packed_len, int slots) {
+	if (slots < 2 || (slots & (slots - 1)) != 0) {
+		fprintf(stderr, "Ring slots must be a power of two, not %d\n", slots);
+		return false;
+	}
+	if (strlen(layout_spec) >= sizeof(ring->header->layout)) {
+		fprintf(stderr, "Layout spec %s is too long for the ring header\n", layout_spec);
+		return false;
+	}
+
+	set_name(ring, name);
+	ring->owner = true;
+
+	size_t slot_size = (sizeof(shm_ring_slot_t) + packed_len + 63) & ~(size_t)63;
+	size_t len = sizeof(shm_ring_header_t) + slots * slot_size;
+
+	// A ring left behind by a driver that died has the wrong layout or stale frames
+	shm_unlink(ring->name);
+	int fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 || ftruncate(fd, len) != 0) {
+		fprintf(stderr, "Can't create shared memory %s: %s\n", ring->name, strerror(errno));
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	if (!map(ring, fd, len)) return false;
+
+	// Fresh pages are zero, which is already a valid empty ring apart from the header
+	shm_ring_header_t* h = new (ring->header) shm_ring_header_t;
+	h->version = SHM_RING_VERSION;
+	memset(h->layout, 0, sizeof(h->layout));
+	strcpy(h->layout, layout_spec);
+	h->slots = slots;
+	h->slot_size = slot_size;
+	h->packed_len = packed_len;
+	h->head.store(0, std::memory_order_relaxed);
+	h->wake.store(0, std::memory_order_relaxed);
+	h->sleeping.store(0, std::memory_order_relaxed);
+	h->tail.store(0, std::memory_order_relaxed);
+	h->overruns.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < slots; i++) new (slot_at(ring, i)) shm_ring_slot_t();
+	std::atomic_thread_fence(std::memory_order_release);
+	h->magic = SHM_RING_MAGIC;
+
+	ring->head = ring->cached_tail = ring->tail = 0;
+	return true;
+}
+
+bool shm_ring_open(shm_ring_t* ring, const char* name) {
+	set_name(ring, name);
+	ring->owner = false;
+
+	int fd = shm_open(ring->name, O_RDWR, 0);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Can't open shared memory %s: %s\n", ring->name, strerror(errno));
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	if ((size_t)st.st_size < sizeof(shm_ring_header_t)) {
+		fprintf(stderr, "%s is too small for a frame ring\n", ring->name);
+		close(fd);
+		return false;
+	}
+	if (!map(ring, fd, st.st_size)) return false;
+
+	const shm_ring_header_t* h = ring->header;
+	if (h->magic != SHM_RING_MAGIC || h->version != SHM_RING_VERSION ||
+		sizeof(shm_ring_header_t) + (size_t)h->slots * h->slot_size > ring->map_len) {
+		fprintf(stderr, "%s isn't a version %d frame ring\n", ring->name, SHM_RING_VERSION);
+		shm_ring_close(ring);
+		return false;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	// Carry on where the other side of an earlier session left off
+	ring->head = h->head.load(std::memory_order_acquire);
+	ring->cached_tail = ring->tail = h->tail.load(std::memory_order_acquire);
+	return true;
+}
+
+void shm_ring_close(shm_ring_t* ring) {
+	if (ring->header) munmap(ring->header, ring->map_len);
+	ring->header = NULL;
+	if (ring->owner) shm_unlink(ring->name);
+}
+
+// Producer
+
+uint8_t* shm_ring_claim(shm_ring_t* ring) {
+	shm_ring_slot_t* slot = slot_at(ring, ring->head);
+	slot->seq.store(2 * ring->head + 1, std::memory_order_relaxed);
+	// The odd sequence number has to be visible before any of the new frame is
+	std::atomic_thread_fence(std::memory_order_release);
+	return reinterpret_cast<uint8_t*>(slot + 1);
+}
+
+bool shm_ring_publish(shm_ring_t* ring, int64_t t_ns) {
+	shm_ring_header_t* h = ring->header;
+	uint64_t n = ring->head;
+	shm_ring_slot_t* slot = slot_at(ring, n);
+
+	slot->t_ns = t_ns;
+	slot->seq.store(2 * n + 2, std::memory_order_release);
+	ring->head = n + 1;
+	h->head.store(n + 1, std::memory_order_release);
+
+	// Paired with shm_ring_wait(): either the consumer sees the new wake value before it
+	// sleeps, or we see it sleeping and wake it
+	h->wake.store((uint32_t)(n + 1), std::memory_order_seq_cst);
+	if (h->sleeping.load(std::memory_order_seq_cst)) futex(&h->wake, FUTEX_WAKE, 1, NULL);
+
+	// Frame n went into the slot of frame n - slots. Only look at the consumer's cache line
+	// when our last look says that might have been one it still wanted.
+	if (n - ring->cached_tail < h->slots) return true;
+	ring->cached_tail = h->tail.load(std::memory_order_acquire);
+	return n - ring->cached_tail < h->slots;
+}
+
+// Consumer
+
+bool shm_ring_peek(shm_ring_t* ring, shm_frame_t* frame, bool latest) {
+	shm_ring_header_t* h = ring->header;
+
+	while (true) {
+		uint64_t head = h->head.load(std::memory_order_acquire);
+		if (head <= ring->tail) return false;
+
+		// The producer may already be writing frame head over frame head - slots
+		uint64_t n = latest ? head - 1 : ring->tail;
+		uint64_t oldest = head >= h->slots ? head - h->slots + 1 : 0;
+		if (n < oldest) n = oldest;
+
+		shm_ring_slot_t* slot = slot_at(ring, n);
+		if (slot->seq.load(std::memory_order_acquire) != 2 * n + 2) continue; // lapped since we read head
+
+		if (!latest && n > ring->tail) {
+			h->overruns.store(h->overruns.load(std::memory_order_relaxed) + (n - ring->tail), std::memory_order_relaxed);
+		}
+		ring->tail = n;
+
+		frame->seq = n;
+		frame->t_ns = slot->t_ns;
+		frame->packed = reinterpret_cast<const uint8_t*>(slot + 1);
+		return true;
+	}
+}
+
+bool shm_ring_consume(shm_ring_t* ring, const shm_frame_t* frame) {
+	shm_ring_header_t* h = ring->header;
+
+	// Everything read from the frame has to come before the second look at the sequence
+	std::atomic_thread_fence(std::memory_order_acquire);
+	bool intact = slot_at(ring, frame->seq)->seq.load(std::memory_order_relaxed) == 2 * frame->seq + 2;
+	if (!intact) h->overruns.store(h->overruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+	ring->tail = frame->seq + 1;
+	h->tail.store(ring->tail, std::memory_order_release);
+	return intact;
+}
+
+bool shm_ring_wait(shm_ring_t* ring, int timeout_ms) {
+	shm_ring_header_t* h = ring->header;
+	if (h->head.load(std::memory_order_acquire) > ring->tail) return true;
+
+	h->sleeping.store(1, std::memory_order_seq_cst);
+	uint32_t wake = h->wake.load(std::memory_order_seq_cst);
+	if (h->head.load(std::memory_order_acquire) <= ring->tail) {
+		struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+		// Returns straight away if wake moved on since we read it
+		futex(&h->wake, FUTEX_WAIT, wake, timeout_ms < 0 ? NULL : &ts);
+	}
+	h->sleeping.store(0, std::memory_order_relaxed);
+
+	return h->head.load(std::memory_order_acquire) > ring->tail;
+}
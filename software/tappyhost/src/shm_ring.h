@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// Single producer, single consumer ring of packed frames in a named POSIX shared memory
+// segment, for local producers (visualizers, simulations, test rigs) that want to hand
+// frames to the serial driver without a socket in between.
+//
+// The segment starts with a header naming the layout, followed by a power of two number
+// of slots. Each slot holds one packed bitmap (layout.packed_len bytes, what pack_cells()
+// makes and pack_frame() reads), so the producer packs straight into the slot and the
+// consumer encodes straight out of it without either side copying the frame.
+//
+// The producer never waits. When the consumer falls a whole ring behind, the oldest
+// frames get overwritten: every slot carries a sequence number that is odd while the slot
+// is being written, and the consumer checks it before and after reading the frame, so it
+// notices frames it lost or that changed under it and counts them as overruns.
+//
+// A consumer with nothing to do sleeps on a futex in the header. The producer only makes
+// the wake syscall when the consumer said it's going to sleep, so publishing to a busy
+// consumer stays a handful of stores.
+
+#define SHM_RING_DEFAULT_NAME "/tappy-frames"
+#define SHM_RING_DEFAULT_SLOTS 8
+
+#define SHM_RING_MAGIC 0x47525054 // "TPRG"
+#define SHM_RING_VERSION 1
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "shared memory needs address free atomics");
+
+typedef struct {
+	uint32_t magic, version;
+	char layout[64]; // layout spec the frames are packed for, see layout_parse()
+	uint32_t slots; // power of two
+	uint32_t slot_size; // bytes per slot including its header, a multiple of 64
+	uint32_t packed_len;
+
+	// Producer side: frames published so far, and its low 32 bits for the futex
+	alignas(64) std::atomic<uint64_t> head;
+	std::atomic<uint32_t> wake;
+	std::atomic<uint32_t> sleeping;
+
+	// Consumer side: frames consumed or skipped so far, and how many of those were lost
+	alignas(64) std::atomic<uint64_t> tail;
+	std::atomic<uint64_t> overruns;
+} shm_ring_header_t;
+
+typedef struct {
+	// 2n+1 while frame n is being written into this slot, 2n+2 once it's published
+	std::atomic<uint64_t> seq;
+	int64_t t_ns; // whatever the producer stamped it with, usually now_ns()
+	uint8_t pad[48];
+	// packed_len bytes of packed bitmap follow
+} shm_ring_slot_t;
+
+typedef struct {
+	char name[64];
+	bool owner; // created the segment, unlinks it on close
+	shm_ring_header_t* header;
+	uint8_t* slots;
+	size_t map_len;
+
+	// Producer side
+	uint64_t head; // frame being written
+	uint64_t cached_tail;
+
+	// Consumer side
+	uint64_t tail;
+} shm_ring_t;
+
+typedef struct {
+	uint64_t seq; // frame number, counting from 0
+	int64_t t_ns;
+	const uint8_t* packed; // in the segment, valid until shm_ring_consume()
+} shm_frame_t;
+
+// Create (or replace) the segment for frames packed for layout_spec with packed_len
+// bytes each. Either side can create it, the other one opens it.
+bool shm_ring_create(shm_ring_t* ring, const char* name, const char* layout_spec, size_t packed_len, int slots);
+bool shm_ring_open(shm_ring_t* ring, const char* name);
+void shm_ring_close(shm_ring_t* ring);
+
+// Producer side. The slot for the next frame, to be filled with header->packed_len bytes
+// of packed bitmap.
+uint8_t* shm_ring_claim(shm_ring_t* ring);
+// Publish the claimed frame and wake the consumer if it's asleep. Returns false if this
+// overwrote a frame the consumer hasn't got to yet.
+bool shm_ring_publish(shm_ring_t* ring, int64_t t_ns);
+
+// Consumer side. Point frame at the oldest frame not consumed yet, or with latest at the
+// newest one, skipping the rest. Returns false if nothing new was published.
+bool shm_ring_peek(shm_ring_t* ring, shm_frame_t* frame, bool latest);
+// Done with the frame from shm_ring_peek(). Returns false if the producer overwrote it in
+// the meantime, then anything made from it has to be thrown away.
+bool shm_ring_consume(shm_ring_t* ring, const shm_frame_t* frame);
+// Sleep until a frame newer than the last one consumed is published, or timeout_ms
+// (-1 for forever). Returns true if there is one.
+bool shm_ring_wait(shm_ring_t* ring, int timeout_ms);
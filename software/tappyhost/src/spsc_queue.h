@@ -0,0 +1,76 @@
+#pragma once
+
+#include <sched.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <atomic>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// Capacity is rounded up to a power of two. Head and tail live on their own cache
+// lines so the two threads don't fight over them.
+template <typename T>
+class spsc_queue_t {
+public:
+	explicit spsc_queue_t(size_t capacity) : head(0), tail(0) {
+		size_t n = 1;
+		while (n < capacity) n <<= 1;
+		items.resize(n);
+		mask = n - 1;
+	}
+
+	// Producer side, returns false if the queue is full
+	bool try_push(const T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) > mask) return false;
+		items[t & mask] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, returns false if the queue is empty
+	bool try_pop(T* item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+		*item = items[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const {
+		return mask + 1;
+	}
+
+private:
+	std::vector<T> items;
+	size_t mask;
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+};
+
+// Backoff for threads polling a queue: spin briefly, then yield, then sleep in short
+// steps so an idle pipeline doesn't burn a core.
+typedef struct {
+	int spins;
+} backoff_t;
+
+static inline void backoff_reset(backoff_t* b) {
+	b->spins = 0;
+}
+
+static inline void backoff_wait(backoff_t* b) {
+	if (b->spins < 64) {
+		b->spins++;
+	} else if (b->spins < 128) {
+		b->spins++;
+		sched_yield();
+	} else {
+		struct timespec ts = {0, 50000};
+		nanosleep(&ts, NULL);
+	}
+}
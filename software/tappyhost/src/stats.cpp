@@ -0,0 +1,83 @@
+#include "stats.h"
+
+#include <string.h>
+
+static int bucket_of(int64_t v) {
+	if (v < (1 << HIST_SUB_BITS)) return v < 0 ? 0 : (int)v;
+
+	int msb = 63 - __builtin_clzll((uint64_t)v);
+	int shift = msb - HIST_SUB_BITS;
+	int b = ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & ((1 << HIST_SUB_BITS) - 1));
+	return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+// Midpoint of the values falling into bucket b
+static int64_t value_of(int b) {
+	if (b < (1 << HIST_SUB_BITS)) return b;
+
+	int shift = (b >> HIST_SUB_BITS) - 1;
+	int64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+	int64_t low = ((int64_t)(1 << HIST_SUB_BITS) + sub) << shift;
+	return low + ((int64_t)1 << shift) / 2;
+}
+
+void hist_reset(hist_t* h) {
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_add(hist_t* h, int64_t value) {
+	if (h->count == 0 || value < h->min) h->min = value;
+	if (h->count == 0 || value > h->max) h->max = value;
+	h->counts[bucket_of(value)]++;
+	h->count++;
+	h->sum += value;
+}
+
+void hist_merge(hist_t* into, const hist_t* from) {
+	if (from->count == 0) return;
+	if (into->count == 0 || from->min < into->min) into->min = from->min;
+	if (into->count == 0 || from->max > into->max) into->max = from->max;
+	for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += from->counts[i];
+	into->count += from->count;
+	into->sum += from->sum;
+}
+
+double hist_mean(const hist_t* h) {
+	return h->count ? h->sum / h->count : 0;
+}
+
+int64_t hist_percentile(const hist_t* h, double p) {
+	if (h->count == 0) return 0;
+
+	uint64_t target = (uint64_t)(p / 100.0 * h->count);
+	if (target >= h->count) target = h->count - 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen > target) {
+			int64_t v = value_of(i);
+			if (v < h->min) return h->min;
+			if (v > h->max) return h->max;
+			return v;
+		}
+	}
+	return h->max;
+}
+
+uint64_t hist_count_above(const hist_t* h, int64_t value) {
+	uint64_t n = 0;
+	for (int i = bucket_of(value) + 1; i < HIST_BUCKETS; i++) n += h->counts[i];
+	return n;
+}
+
+void hist_print(FILE* f, const char* name, const hist_t* h, double unit, const char* unit_name) {
+	fprintf(f, "%-14s n=%-8llu mean=%.1f%s p50=%.1f%s p90=%.1f%s p99=%.1f%s p99.9=%.1f%s max=%.1f%s\n",
+		name, (unsigned long long)h->count,
+		hist_mean(h) / unit, unit_name,
+		hist_percentile(h, 50) / unit, unit_name,
+		hist_percentile(h, 90) / unit, unit_name,
+		hist_percentile(h, 99) / unit, unit_name,
+		hist_percentile(h, 99.9) / unit, unit_name,
+		h->max / unit, unit_name);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Latency histogram with ~3% resolution from 1ns to ~30 minutes. Values go into 16 linear
+// sub buckets per power of two, which keeps recording a couple of instructions and the
+// whole thing small enough to keep one per pipeline stage or per probe stage.
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((42 - HIST_SUB_BITS) << HIST_SUB_BITS)
+
+typedef struct {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t count;
+	int64_t min, max;
+	double sum;
+} hist_t;
+
+void hist_reset(hist_t* h);
+void hist_add(hist_t* h, int64_t value);
+void hist_merge(hist_t* into, const hist_t* from);
+double hist_mean(const hist_t* h);
+// Approximate value at percentile p (0-100)
+int64_t hist_percentile(const hist_t* h, double p);
+// Approximate number of values above value
+uint64_t hist_count_above(const hist_t* h, int64_t value);
+
+// One line summary "<name> n=... mean=... p50=... p90=... p99=... p99.9=... max=..." in
+// the given unit (1000 for us, 1000000 for ms)
+void hist_print(FILE* f, const char* name, const hist_t* h, double unit, const char* unit_name);
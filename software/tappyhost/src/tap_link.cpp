@@ -0,0 +1,405 @@
+#include "tap_link.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "serial_port.h"
+
+#define LINK_TIMEOUT_NS 250000000LL
+#define WINDOW_REPLY_MS 500
+#define INFO_REPLY_MS 100
+// Longest frame body the last host could have left the master in the middle of (0x87)
+#define FLUSH_LEN 12
+
+bool link_open(tap_link_t* link, const char* path, int baud) {
+	link->fd = serial_open(path, baud);
+	if (link->fd < 0) return false;
+
+	link->baud = baud;
+	link->tty = isatty(link->fd);
+	link->failed = false;
+	link->resumed = false;
+	memset(&link->master, 0, sizeof(link->master));
+	link->enabled = false;
+	link->window = 0;
+	link->sent = 0;
+	link->consumed = 0;
+	link->sent_at_query = -1;
+	link->next_seq = 0;
+	link->last_state_seq = -1;
+	memset(link->seq_sent_ns, 0, sizeof(link->seq_sent_ns));
+	link->unacked = 0;
+	link->current.clear();
+	link->current_off = 0;
+	link->control.clear();
+	link->has_pending_state = false;
+	link->last_state.clear();
+	link->last_state_id = 0;
+	link->pending_state_id = 0;
+	link->sent_state_id = 0;
+	memset(link->seq_state_id, 0, sizeof(link->seq_state_id));
+	link->last_progress_ns = now_ns();
+	link->bytes_sent = 0;
+	link->frames_sent = 0;
+	link->frames_acked = 0;
+	link->naks = 0;
+	link->retries = 0;
+	hist_reset(&link->ack_latency);
+	link->master_frames = 0;
+	link->master_bad_frames = 0;
+	link->master_util = 0;
+	link->master_throttled = 0;
+	link->master_skipped = 0;
+	link->line_len = 0;
+	link->on_line = NULL;
+	link->on_line_ctx = NULL;
+	link->on_state_acked = NULL;
+	link->on_state_ctx = NULL;
+	return true;
+}
+
+void link_close(tap_link_t* link) {
+	if (link->fd > STDERR_FILENO) close(link->fd);
+	link->fd = -1;
+}
+
+static void write_raw(tap_link_t* link, const uint8_t* data, size_t len) {
+	if (link->failed) return;
+	if (!serial_write_all(link->fd, data, len)) link->failed = true;
+	link->sent += len;
+	link->bytes_sent += len;
+}
+
+static void query_window(tap_link_t* link) {
+	uint8_t cmd = 0x84;
+	write_raw(link, &cmd, 1);
+	link->sent_at_query = link->sent;
+	link->last_progress_ns = now_ns();
+}
+
+static int in_flight(const tap_link_t* link) {
+	return (uint16_t)(link->sent - link->consumed);
+}
+
+// Write as much of the queued frames as the master has room for
+static void pump(tap_link_t* link) {
+	while (true) {
+		if (link->current_off == link->current.size()) {
+			std::vector<uint8_t> next;
+			bool tagged = true;
+			bool is_state = false;
+
+			if (!link->control.empty()) {
+				next.swap(link->control.front());
+				link->control.pop_front();
+				// Untagged commands are queued with a 0 marker in front
+				tagged = next[0] != 0;
+				next.erase(next.begin());
+			} else if (link->has_pending_state) {
+				next.swap(link->pending_state);
+				link->has_pending_state = false;
+				is_state = true;
+			} else {
+				link->current.clear();
+				link->current_off = 0;
+				return;
+			}
+
+			link->current.clear();
+			link->current_off = 0;
+			if (tagged) {
+				int seq = link->next_seq;
+				link->next_seq = (link->next_seq + 1) % 0x80;
+				link->current.push_back(0x83);
+				link->current.push_back(seq);
+				link->seq_sent_ns[seq] = now_ns();
+				link->seq_state_id[seq] = is_state ? link->pending_state_id : 0;
+				link->unacked++;
+				if (is_state) {
+					link->last_state_seq = seq;
+					link->last_state = next;
+					link->sent_state_id = link->pending_state_id;
+				}
+			}
+			link->current.insert(link->current.end(), next.begin(), next.end());
+			link->frames_sent++;
+		}
+
+		int credit = link->window - in_flight(link);
+		if (credit <= 0) return;
+
+		size_t n = link->current.size() - link->current_off;
+		if ((size_t)credit < n) n = credit;
+		write_raw(link, &link->current[link->current_off], n);
+		link->current_off += n;
+	}
+}
+
+static void progress(tap_link_t* link, const char* consumed) {
+	link->consumed = (uint16_t)atoi(consumed);
+	link->last_progress_ns = now_ns();
+}
+
+static void handle_line(tap_link_t* link, char* line, int64_t t) {
+	char* argv[12];
+	int argc = 0;
+	char copy[sizeof(link->line)];
+	strcpy(copy, line);
+
+	for (char* tok = strtok(copy, " \r"); tok && argc < 12; tok = strtok(NULL, " \r")) argv[argc++] = tok;
+	if (argc == 0) return;
+
+	if (strcmp(argv[0], "window") == 0 && argc == 3) {
+		progress(link, argv[1]);
+		link->window = atoi(argv[2]);
+		if (link->sent_at_query >= 0) {
+			// The master read everything up to and including our query, so whatever it
+			// didn't count before that never made it and is no longer in flight
+			uint16_t lost = (uint16_t)(link->sent_at_query - link->consumed);
+			link->sent -= lost;
+			link->sent_at_query = -1;
+		}
+		link->enabled = true;
+	} else if (strcmp(argv[0], "credit") == 0 && argc == 2) {
+		progress(link, argv[1]);
+	} else if ((strcmp(argv[0], "ack") == 0 || strcmp(argv[0], "nak") == 0) && argc == 3) {
+		progress(link, argv[2]);
+		int seq = atoi(argv[1]) & 0x7F;
+		if (link->seq_sent_ns[seq] != 0) {
+			hist_add(&link->ack_latency, t - link->seq_sent_ns[seq]);
+			link->seq_sent_ns[seq] = 0;
+			link->unacked--;
+		}
+
+		if (argv[0][0] == 'a') {
+			link->frames_acked++;
+			if (link->seq_state_id[seq] && link->on_state_acked) link->on_state_acked(link->on_state_ctx, link->seq_state_id[seq], t);
+			link->seq_state_id[seq] = 0;
+		} else {
+			link->naks++;
+			link->retries++;
+			// Only the newest state matters, resend it unless something newer is queued
+			if (seq == link->last_state_seq && !link->has_pending_state) {
+				link->pending_state = link->last_state;
+				link->pending_state_id = link->sent_state_id;
+				link->has_pending_state = true;
+			}
+		}
+	} else if (strcmp(argv[0], "info") == 0 && argc == 9) {
+		link_master_t* m = &link->master;
+		snprintf(m->version, sizeof(m->version), "%s", argv[1]);
+		m->boards = atoi(argv[2]);
+		m->chips_per_board = atoi(argv[3]);
+		for (int i = 0; i < 4; i++) m->conf[i] = (uint16_t)atoi(argv[4 + i]);
+		m->state_hash = (uint32_t)strtoul(argv[8], NULL, 10);
+		m->valid = true;
+	} else if (strcmp(argv[0], "stats") == 0 && argc == 4) {
+		link->master_frames = atoi(argv[1]);
+		link->master_bad_frames = atoi(argv[2]);
+		link->master_util = atoi(argv[3]);
+	} else if (strcmp(argv[0], "thermal") == 0 && argc == 4) {
+		link->master_throttled = atoi(argv[1]);
+		link->master_skipped = (uint32_t)strtoul(argv[2], NULL, 10);
+	} else if (link->on_line) {
+		link->on_line(link->on_line_ctx, line, t);
+	}
+}
+
+static void read_input(tap_link_t* link) {
+	uint8_t buf[256];
+	while (true) {
+		ssize_t n = read(link->fd, buf, sizeof(buf));
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) link->failed = true;
+		if (n <= 0) return;
+
+		int64_t t = now_ns();
+		for (ssize_t i = 0; i < n; i++) {
+			if (buf[i] == '\n') {
+				link->line[link->line_len] = 0;
+				handle_line(link, link->line, t);
+				link->line_len = 0;
+			} else if (link->line_len < sizeof(link->line) - 1) {
+				link->line[link->line_len++] = buf[i];
+			}
+		}
+	}
+}
+
+// Wait up to timeout_ms for input and handle it
+static void wait_input(tap_link_t* link, int timeout_ms) {
+	struct pollfd p = {link->fd, POLLIN, 0};
+	if (poll(&p, 1, timeout_ms) <= 0) return;
+	// A tty that was hung up reads as empty forever, only poll tells
+	if (p.revents & (POLLERR | POLLHUP | POLLNVAL)) link->failed = true;
+	read_input(link);
+}
+
+static void query_info(tap_link_t* link) {
+	uint8_t cmd = 0x89;
+	link->master.valid = false;
+	write_raw(link, &cmd, 1);
+}
+
+bool link_handshake(tap_link_t* link, int timeout_ms) {
+	if (!link->tty) return false;
+
+	// If opening the port didn't reset the master it may still be halfway through a
+	// frame from the last host, flush that out before asking what it has. If it did
+	// reset, the bootloader gets these bytes, gives up on them and starts the firmware.
+	uint8_t flush[FLUSH_LEN];
+	memset(flush, 0x82, sizeof(flush));
+	write_raw(link, flush, sizeof(flush));
+	query_info(link);
+
+	// Wait for either the info or the boot message, carry on without them if neither
+	// comes (older firmware that didn't reset)
+	int64_t deadline = now_ns() + (int64_t)timeout_ms * 1000000;
+	link_line_cb_t on_line = link->on_line;
+	bool ready = false;
+
+	struct ready_ctx_t {
+		static void on(void* ctx, const char* line, int64_t) {
+			if (strncmp(line, "ready", 5) == 0) *(bool*)ctx = true;
+		}
+	};
+	void* on_line_ctx = link->on_line_ctx;
+	link->on_line = ready_ctx_t::on;
+	link->on_line_ctx = &ready;
+
+	while (!ready && !link->master.valid && !link->failed && now_ns() < deadline) wait_input(link, 10);
+	link->resumed = link->master.valid;
+
+	if (ready) {
+		// Freshly booted, still worth knowing its conf so we don't resend the same
+		query_info(link);
+		deadline = now_ns() + (int64_t)INFO_REPLY_MS * 1000000;
+		while (!link->master.valid && !link->failed && now_ns() < deadline) wait_input(link, 10);
+	}
+
+	link->on_line = on_line;
+	link->on_line_ctx = on_line_ctx;
+
+	query_window(link);
+	deadline = now_ns() + (int64_t)WINDOW_REPLY_MS * 1000000;
+	while (!link->enabled && !link->failed && now_ns() < deadline) wait_input(link, 10);
+
+	if (!link->enabled) link->sent_at_query = -1;
+	return link->enabled;
+}
+
+void link_send_control(tap_link_t* link, const uint8_t* frame, size_t len, bool tagged) {
+	if (len == LINK_CONF_LEN && frame[0] == 0x80) {
+		for (int i = 0; i < 4; i++) link->master.conf[i] = frame[1 + i*2] | frame[2 + i*2] << 8;
+	}
+
+	if (!link->enabled) {
+		write_raw(link, frame, len);
+		link->frames_sent++;
+		return;
+	}
+
+	std::vector<uint8_t> f;
+	f.reserve(len + 1);
+	f.push_back(tagged ? 1 : 0);
+	f.insert(f.end(), frame, frame + len);
+	link->control.push_back(f);
+	pump(link);
+}
+
+uint32_t link_send_state(tap_link_t* link, const uint8_t* frame, size_t len) {
+	link->master.state_hash = link_state_hash(frame, len);
+	uint32_t id = ++link->last_state_id;
+
+	if (!link->enabled) {
+		write_raw(link, frame, len);
+		link->frames_sent++;
+		return id;
+	}
+
+	link->pending_state.assign(frame, frame + len);
+	link->pending_state_id = id;
+	link->has_pending_state = true;
+	pump(link);
+	return id;
+}
+
+bool link_busy(const tap_link_t* link) {
+	return link->current_off < link->current.size() || !link->control.empty() || link->has_pending_state;
+}
+
+void link_poll(tap_link_t* link, int timeout_ms) {
+	if (!link->tty || link->failed) return;
+
+	wait_input(link, timeout_ms);
+
+	if (!link->enabled) return;
+
+	// Untagged commands never get acked, only wait on frames and on running out of credit
+	bool waiting = link->unacked > 0 || link_busy(link) || link->sent_at_query >= 0;
+	if (waiting && now_ns() - link->last_progress_ns > LINK_TIMEOUT_NS) {
+		// Bytes went missing on the way, work out how many and resend the latest state
+		link->retries++;
+		memset(link->seq_sent_ns, 0, sizeof(link->seq_sent_ns));
+		link->unacked = 0;
+		link->current.clear();
+		link->current_off = 0;
+		if (!link->has_pending_state && !link->last_state.empty()) {
+			link->pending_state = link->last_state;
+			link->pending_state_id = link->sent_state_id;
+			link->has_pending_state = true;
+		}
+		query_window(link);
+	}
+
+	pump(link);
+}
+
+int link_resync(tap_link_t* link, const uint8_t* conf, const uint8_t* state, size_t state_len) {
+	const link_master_t* m = &link->master;
+	int queued = 0;
+
+	if (conf) {
+		bool same = m->valid;
+		for (int i = 0; i < 4 && same; i++) same = m->conf[i] == (conf[1 + i*2] | conf[2 + i*2] << 8);
+		if (!same) {
+			link_send_control(link, conf, LINK_CONF_LEN, true);
+			queued |= LINK_RESYNC_CONF;
+		}
+	}
+
+	if (state && (!m->valid || m->state_hash != link_state_hash(state, state_len))) {
+		link_send_state(link, state, state_len);
+		queued |= LINK_RESYNC_STATE;
+	}
+
+	return queued;
+}
+
+uint32_t link_state_hash(const uint8_t* frame, size_t len) {
+	// Just the chip bytes between 0x81 and 0x82
+	if (len >= 2 && frame[0] == 0x81 && frame[len - 1] == 0x82) {
+		frame++;
+		len -= 2;
+	}
+
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) hash = (hash ^ frame[i]) * 16777619u;
+	return hash;
+}
+
+void link_encode_conf(uint8_t* frame, uint16_t up, uint16_t inter, uint16_t down, uint16_t pause) {
+	frame[0] = 0x80;
+	frame[1] = up & 0xFF;
+	frame[2] = up >> 8;
+	frame[3] = inter & 0xFF;
+	frame[4] = inter >> 8;
+	frame[5] = down & 0xFF;
+	frame[6] = down >> 8;
+	frame[7] = pause & 0xFF;
+	frame[8] = pause >> 8;
+}
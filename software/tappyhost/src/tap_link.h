@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+#include "stats.h"
+
+// Host side of the v6 master's credit based flow control, the same protocol TapLink
+// speaks in testerflexv6.pde (see docs/README-v6.md):
+//
+//  * every conf/state frame is tagged with 0x83 <seq> and acknowledged by the master
+//    with "ack <seq> <consumed>" once latched, or "nak ..." if it arrived damaged
+//  * <consumed> counts the bytes the master has read, so sent - consumed bytes are in
+//    flight and we never send more than the window it advertised in reply to 0x84
+//  * control frames (conf and other commands) are sent in order, state frames are latest
+//    wins, naks and timeouts resend the newest state
+//
+// If the master never answers the window query (older firmware, other formats, or not a
+// tty at all) everything is written straight through like the processing sketches do.
+//
+// A master that didn't reset when the port was opened answers 0x89 with its firmware
+// version, geometry, timing conf and a hash of its states. The handshake then skips the
+// wait for "ready" and link_resync() only sends what the master doesn't already have.
+
+typedef void (*link_line_cb_t)(void* ctx, const char* line, int64_t t_ns);
+typedef void (*link_state_cb_t)(void* ctx, uint32_t id, int64_t t_ns);
+
+#define LINK_RESYNC_CONF 1
+#define LINK_RESYNC_STATE 2
+
+// What the master holds as far as we know: its last "info" reply, kept up to date with
+// the conf and state frames we send it since
+typedef struct {
+	bool valid;
+	char version[16];
+	int boards, chips_per_board;
+	uint16_t conf[4]; // up, inter, down, pause in 10us units
+	uint32_t state_hash;
+} link_master_t;
+
+typedef struct {
+	int fd;
+	int baud;
+	bool tty;
+	// The port went away (unplugged, USB reset), only link_close() is left to do
+	bool failed;
+
+	// True if the handshake found the master running rather than booting
+	bool resumed;
+	link_master_t master;
+
+	// True once the master answered our window query
+	bool enabled;
+	int window;
+
+	// Bytes written and bytes the master has read, both mod 2^16
+	uint16_t sent, consumed;
+	// Value of sent right after the last window query, or -1 if none is pending
+	int32_t sent_at_query;
+
+	uint8_t next_seq;
+	int last_state_seq;
+	// When each tagged frame started going out, 0 once acknowledged
+	int64_t seq_sent_ns[128];
+	int unacked;
+
+	std::vector<uint8_t> current;
+	size_t current_off;
+	std::deque<std::vector<uint8_t> > control;
+	std::vector<uint8_t> pending_state, last_state;
+	bool has_pending_state;
+	// Ids link_send_state() handed out: the last one, the queued and the last sent state
+	// frame's, and the state frame each tagged frame carried (0 for control frames)
+	uint32_t last_state_id, pending_state_id, sent_state_id;
+	uint32_t seq_state_id[128];
+
+	int64_t last_progress_ns;
+
+	// Counters
+	uint64_t bytes_sent;
+	uint64_t frames_sent, frames_acked, naks, retries;
+	// Time from the first byte of a tagged frame leaving until its ack came back
+	hist_t ack_latency;
+	// Last "stats" line from the master
+	uint32_t master_frames, master_bad_frames, master_util;
+	// Last "thermal" line: tappers the master's thermal governor (0x8B) throttles, and
+	// cycles they sat out
+	int master_throttled;
+	uint32_t master_skipped;
+
+	char line[256];
+	size_t line_len;
+
+	// Called for every line from the master that isn't part of flow control
+	link_line_cb_t on_line;
+	void* on_line_ctx;
+	// Called when the master acks a state frame, with the id link_send_state() returned
+	// for it. Resent frames keep their id and may be acked more than once.
+	link_state_cb_t on_state_acked;
+	void* on_state_ctx;
+} tap_link_t;
+
+bool link_open(tap_link_t* link, const char* path, int baud);
+void link_close(tap_link_t* link);
+
+// Ask a master that kept running for its info, otherwise it was reset by opening the
+// port and we wait up to timeout_ms for "ready". Then ask for the window. Returns true if
+// the master does flow control. Only for masters that take commands, see
+// layout_has_commands(), the handshake bytes are garbage state to a daisy master.
+bool link_handshake(tap_link_t* link, int timeout_ms);
+
+// Queue the conf frame and/or the state frame (either may be NULL) unless the master
+// already has them. Returns LINK_RESYNC_* flags for what was queued.
+int link_resync(tap_link_t* link, const uint8_t* conf, const uint8_t* state, size_t state_len);
+
+// Hash the master reports for a state frame (0x81 ... 0x82), see stateHash() in the v6 firmware
+uint32_t link_state_hash(const uint8_t* frame, size_t len);
+
+// Queue a conf frame (0x80 ...) or any other command, these go out in order
+void link_send_control(tap_link_t* link, const uint8_t* frame, size_t len, bool tagged);
+// Queue a state frame, replacing any state frame that hasn't started going out yet.
+// Returns an id for the frame, counting up from 1.
+uint32_t link_send_state(tap_link_t* link, const uint8_t* frame, size_t len);
+
+// Handle input from the master, retry on timeouts and send whatever fits, waiting up to
+// timeout_ms for something to happen
+void link_poll(tap_link_t* link, int timeout_ms);
+
+// True while frames are queued or partially written
+bool link_busy(const tap_link_t* link);
+
+#define LINK_CONF_LEN 9
+
+// 0x80 conf frame, lengths in units of 10us like TapConf
+void link_encode_conf(uint8_t* frame, uint16_t up, uint16_t inter, uint16_t down, uint16_t pause);
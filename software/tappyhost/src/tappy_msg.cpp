@@ -0,0 +1,56 @@
+#include "tappy_msg.h"
+
+#include <string.h>
+
+static void put16(uint8_t* p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t* p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t* p) {
+	return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+void msg_encode_header(const msg_header_t* h, uint8_t* out) {
+	memset(out, 0, MSG_HEADER_LEN);
+	out[0] = MSG_MAGIC0;
+	out[1] = MSG_MAGIC1;
+	out[2] = MSG_VERSION;
+	out[3] = h->type;
+	out[4] = h->priority;
+	out[5] = h->flags;
+	put32(out + 8, h->len);
+	put32(out + 12, h->seq);
+	put32(out + 16, (uint64_t)h->t_ns);
+	put32(out + 20, (uint64_t)h->t_ns >> 32);
+	put16(out + 24, h->x);
+	put16(out + 26, h->y);
+	put16(out + 28, h->w);
+	put16(out + 30, h->h);
+}
+
+bool msg_decode_header(const uint8_t* in, msg_header_t* h) {
+	if (in[0] != MSG_MAGIC0 || in[1] != MSG_MAGIC1 || in[2] != MSG_VERSION) return false;
+
+	h->type = in[3];
+	h->priority = in[4];
+	h->flags = in[5];
+	h->len = get32(in + 8);
+	h->seq = get32(in + 12);
+	h->t_ns = (int64_t)(get32(in + 16) | (uint64_t)get32(in + 20) << 32);
+	h->x = get16(in + 24);
+	h->y = get16(in + 26);
+	h->w = get16(in + 28);
+	h->h = get16(in + 30);
+
+	return h->len <= MSG_MAX_PAYLOAD;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Messages apps send to tappyd, over UDP (one message per datagram) or a TCP/Unix stream
+// (messages back to back). Every message is a 32 byte little endian header followed by
+// len bytes of payload:
+//
+//   0  magic 'T' 'P'     12 seq (echoed in acks)
+//   2  version           16 t_ns, sender's CLOCK_MONOTONIC when sent (echoed in acks)
+//   3  type              24 x, y, w, h of the region a frame covers, in tappers
+//   4  priority          32 payload
+//   5  flags
+//   6  reserved
+//   8  len
+//
+// A frame's payload is w*h bytes row-major, non zero meaning on, or with MSG_FLAG_BITS
+// (w*h+7)/8 bytes of bitmap, tapper i being bit i%8 of byte i/8. A conf payload is the
+// four LE uint16 lengths of a 0x80 frame. Release gives up a region (w or h of 0 gives up
+// everything the client has drawn).
+
+#define MSG_MAGIC0 'T'
+#define MSG_MAGIC1 'P'
+#define MSG_VERSION 1
+#define MSG_HEADER_LEN 32
+#define MSG_MAX_PAYLOAD (1 << 20)
+#define MSG_CONF_LEN 8
+
+#define MSG_DEFAULT_PORT 7171
+#define MSG_DEFAULT_UNIX_PATH "/tmp/tappyd.sock"
+
+typedef enum _msg_type_t {
+	MSG_FRAME = 1,
+	MSG_CONF = 2,
+	MSG_RELEASE = 3,
+	// tappyd to client, sent once the message has been merged and handed to the writers
+	MSG_ACK = 4
+} msg_type_t;
+
+// Payload is a bitmap instead of one byte per tapper
+#define MSG_FLAG_BITS 0x01
+// Ask for an MSG_ACK
+#define MSG_FLAG_ACK 0x02
+
+typedef struct {
+	uint8_t type;
+	uint8_t priority;
+	uint8_t flags;
+	uint32_t len;
+	uint32_t seq;
+	int64_t t_ns;
+	uint16_t x, y, w, h;
+} msg_header_t;
+
+void msg_encode_header(const msg_header_t* h, uint8_t* out);
+
+// False if this isn't a header we understand
+bool msg_decode_header(const uint8_t* in, msg_header_t* h);
+
+// Payload length a frame header should carry for its region
+static inline size_t msg_frame_len(const msg_header_t* h) {
+	size_t n = (size_t)h->w * h->h;
+	return h->flags & MSG_FLAG_BITS ? (n + 7) / 8 : n;
+}
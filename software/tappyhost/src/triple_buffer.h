@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+
+// Hands the newest of a stream of values from one producer thread to one consumer thread
+// without either side ever waiting on the other. The producer fills its back buffer and
+// swaps it with the middle one, the consumer swaps its front buffer with the middle one
+// whenever that holds something it hasn't seen. Values the consumer was too slow for are
+// simply overwritten, which is what a latest wins frame stream wants.
+template <typename T>
+class triple_buffer_t {
+public:
+	triple_buffer_t() : back(0), middle(1), front(2) {}
+
+	// For setting the buffers up before the threads start
+	T& at(int i) {
+		return buffers[i];
+	}
+
+	// Producer side, the buffer to fill next
+	T& back_buffer() {
+		return buffers[back];
+	}
+
+	// Producer side, returns false if this replaced a value the consumer never took
+	bool publish() {
+		int old = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+		back = old & INDEX;
+		return !(old & FRESH);
+	}
+
+	// Consumer side, the newest published value or NULL if nothing new was published
+	// since the last call. The value stays valid until the next call.
+	T* take() {
+		if (!(middle.load(std::memory_order_acquire) & FRESH)) return NULL;
+		front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+		return &buffers[front];
+	}
+
+private:
+	enum { INDEX = 3, FRESH = 4 };
+
+	T buffers[3];
+	int back;
+	alignas(64) std::atomic<int> middle;
+	alignas(64) int front;
+};
@@ -0,0 +1,568 @@
+// Drive a tappy tap array from audio
+//
+//   tappy-audio [options] [input]
+//
+// Reads WAV (or headerless s16le with --raw) from a file or stdin ('-'), and every hop
+// samples runs a windowed FFT over the last block, sums the power into log spaced bands
+// and turns each band into an envelope (auto gain, attack/release). Band b lights a bar
+// in its own region of the array (a strip of columns by default), and the global TapConf
+// follows the sound: brighter audio taps faster, louder audio gets longer pulses.
+//
+// Everything runs on one thread. Files are played back in real time unless --fast is
+// given, in which case the tool reports how much faster than real time it keeps up.
+// Audio-to-tap latency is measured from the moment the newest sample of a block became
+// available until the master acked the frame it produced, or without flow control until
+// the frame's last byte left the serial port. Frames the link replaced with a newer one
+// before they went out are counted separately.
+
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <vector>
+
+#include "clock.h"
+#include "fft.h"
+#include "layout.h"
+#include "pack.h"
+#include "serial_port.h"
+#include "stats.h"
+#include "tap_link.h"
+
+// Limits on how often the timing conf is resent
+#define CONF_MIN_INTERVAL_NS 50000000LL
+#define CONF_MIN_CHANGE 0.05
+
+typedef enum _sample_format_t {
+	SAMPLE_U8,
+	SAMPLE_S16,
+	SAMPLE_S24,
+	SAMPLE_S32,
+	SAMPLE_F32
+} sample_format_t;
+
+typedef struct {
+	FILE* f;
+	int rate;
+	int channels;
+	sample_format_t format;
+	int bytes_per_sample;
+	std::vector<uint8_t> buf;
+} audio_input_t;
+
+typedef struct {
+	const char* input;
+	const char* port;
+	const char* layout_spec;
+	bool raw;
+	int raw_rate, raw_channels;
+	int block, hop;
+	int bands;
+	bool map_rows;
+	float fmin, fmax;
+	float range_db;
+	float attack_ms, release_ms;
+	float min_hz, max_hz;
+	bool fast;
+	bool drive_conf;
+	int baud;
+	pack_isa_t isa;
+} options_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int) {
+	stopping = 1;
+}
+
+// Input
+
+static uint32_t le32(const uint8_t* p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t le16(const uint8_t* p) {
+	return p[0] | p[1] << 8;
+}
+
+// Parse RIFF/WAVE chunks up to the start of the sample data. Works on pipes, nothing
+// is ever seeked.
+static bool read_wav_header(audio_input_t* in) {
+	uint8_t riff[12];
+	if (fread(riff, 1, 12, in->f) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) return false;
+
+	bool have_fmt = false;
+	while (true) {
+		uint8_t chunk[8];
+		if (fread(chunk, 1, 8, in->f) != 8) return false;
+		uint32_t len = le32(chunk + 4);
+
+		if (memcmp(chunk, "fmt ", 4) == 0) {
+			std::vector<uint8_t> fmt(len + (len & 1));
+			if (len < 16 || fread(fmt.data(), 1, fmt.size(), in->f) != fmt.size()) return false;
+
+			uint16_t tag = le16(&fmt[0]);
+			in->channels = le16(&fmt[2]);
+			in->rate = le32(&fmt[4]);
+			int bits = le16(&fmt[14]);
+			// WAVE_FORMAT_EXTENSIBLE keeps the real tag in the sub format GUID
+			if (tag == 0xFFFE && len >= 26) tag = le16(&fmt[24]);
+
+			if (tag == 3 && bits == 32) in->format = SAMPLE_F32;
+			else if (tag == 1 && bits == 8) in->format = SAMPLE_U8;
+			else if (tag == 1 && bits == 16) in->format = SAMPLE_S16;
+			else if (tag == 1 && bits == 24) in->format = SAMPLE_S24;
+			else if (tag == 1 && bits == 32) in->format = SAMPLE_S32;
+			else {
+				fprintf(stderr, "Unsupported WAV format %d with %d bits\n", tag, bits);
+				return false;
+			}
+			in->bytes_per_sample = bits / 8;
+			have_fmt = true;
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			return have_fmt && in->channels > 0 && in->rate > 0;
+		} else {
+			// Skip anything else
+			for (uint32_t i = 0; i < len + (len & 1); i++) {
+				if (fgetc(in->f) == EOF) return false;
+			}
+		}
+	}
+}
+
+// Read n frames mixed down to mono, returns how many were read
+static int read_samples(audio_input_t* in, float* out, int n) {
+	size_t frame_len = (size_t)in->bytes_per_sample * in->channels;
+	in->buf.resize(frame_len * n);
+
+	int frames = fread(in->buf.data(), frame_len, n, in->f);
+
+	for (int i = 0; i < frames; i++) {
+		float sum = 0;
+		for (int c = 0; c < in->channels; c++) {
+			const uint8_t* p = &in->buf[i * frame_len + c * in->bytes_per_sample];
+			switch (in->format) {
+				case SAMPLE_U8: sum += (p[0] - 128) / 128.0f; break;
+				case SAMPLE_S16: sum += (int16_t)le16(p) / 32768.0f; break;
+				case SAMPLE_S24: sum += (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) / 2147483648.0f; break;
+				case SAMPLE_S32: sum += (int32_t)le32(p) / 2147483648.0f; break;
+				case SAMPLE_F32: {
+					uint32_t bits = le32(p);
+					float v;
+					memcpy(&v, &bits, 4);
+					sum += v;
+					break;
+				}
+			}
+		}
+		out[i] = sum / in->channels;
+	}
+
+	return frames;
+}
+
+// Frames handed to the link and still waiting for their ack
+typedef struct {
+	uint32_t id;
+	int64_t available;
+} sent_frame_t;
+
+typedef struct {
+	std::deque<sent_frame_t> sent;
+	hist_t* audio_to_tap;
+	uint64_t replaced;
+} ack_ctx_t;
+
+static void on_state_acked(void* ctx, uint32_t id, int64_t t_ns) {
+	ack_ctx_t* a = (ack_ctx_t*)ctx;
+	// The master latches frames in order, anything older still waiting never made it
+	while (!a->sent.empty() && a->sent.front().id < id) {
+		a->replaced++;
+		a->sent.pop_front();
+	}
+	if (!a->sent.empty() && a->sent.front().id == id) {
+		hist_add(a->audio_to_tap, t_ns - a->sent.front().available);
+		a->sent.pop_front();
+	}
+}
+
+// Analysis
+
+typedef struct {
+	int lo, hi; // FFT bins [lo, hi)
+	float peak_db; // slowly decaying peak for auto gain
+	float level; // 0-1 envelope
+} band_t;
+
+static void make_bands(const options_t& opt, int rate, std::vector<band_t>* bands) {
+	bands->resize(opt.bands);
+	float fmax = std::min(opt.fmax, rate / 2.0f);
+	float bin_hz = (float)rate / opt.block;
+
+	int prev_hi = std::max(1, (int)(opt.fmin / bin_hz));
+	for (int b = 0; b < opt.bands; b++) {
+		float f_hi = opt.fmin * powf(fmax / opt.fmin, (float)(b + 1) / opt.bands);
+		band_t& band = (*bands)[b];
+		band.lo = prev_hi;
+		// Low bands are narrower than a bin, give each at least one
+		band.hi = std::max(band.lo + 1, std::min(opt.block / 2, (int)(f_hi / bin_hz)));
+		band.peak_db = -120;
+		band.level = 0;
+		prev_hi = band.hi;
+	}
+}
+
+// Draw each band as a bar in its strip of the array, low bands left (or top with --rows)
+static void render(const options_t& opt, const std::vector<band_t>& bands, int w, int h, uint8_t* cells) {
+	int n = bands.size();
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			int b, fill, pos;
+			if (opt.map_rows) {
+				b = y * n / h;
+				fill = (int)(bands[b].level * w + 0.5f);
+				pos = x;
+			} else {
+				b = x * n / w;
+				fill = (int)(bands[b].level * h + 0.5f);
+				pos = h - 1 - y;
+			}
+			cells[y * w + x] = pos < fill;
+		}
+	}
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-audio [options] [input]\n"
+		"\n"
+		"  input                WAV file, '-' for stdin (default)\n"
+		"  --raw RATE,CHANNELS  headerless s16le input\n"
+		"  --block N            FFT size (default 1024)\n"
+		"  --hop N              samples between frames (default 256)\n"
+		"  --bands N            bands, one region each (default: one per column)\n"
+		"  --rows               bands along rows instead of columns\n"
+		"  --freq LO,HI         band range in Hz (default 40,8000)\n"
+		"  --range DB           dynamic range of each band (default 30)\n"
+		"  --envelope A,R       attack and release in ms (default 5,80)\n"
+		"  --tap-rate LO,HI     tap frequency range driven by the sound (default 2,40)\n"
+		"  --no-conf            leave the pulse timing alone (always for daisy layouts)\n"
+		"  --fast               don't play files back in real time\n"
+		"  --layout SPEC        array layout (default v6:2x2), see README\n"
+		"  --port PATH          serial port, file or '-' for stdout (default: dry run)\n"
+		"  --baud N             (default 115200)\n"
+		"  --isa ISA            scalar, sse2 or avx2 (default: best supported)\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.input = "-";
+	opt.port = NULL;
+	opt.layout_spec = "v6:2x2";
+	opt.raw = false;
+	opt.raw_rate = 48000;
+	opt.raw_channels = 1;
+	opt.block = 1024;
+	opt.hop = 256;
+	opt.bands = 0;
+	opt.map_rows = false;
+	opt.fmin = 40;
+	opt.fmax = 8000;
+	opt.range_db = 30;
+	opt.attack_ms = 5;
+	opt.release_ms = 80;
+	opt.min_hz = 2;
+	opt.max_hz = 40;
+	opt.fast = false;
+	opt.drive_conf = true;
+	opt.baud = 115200;
+	opt.isa = pack_best_isa();
+
+	static struct option long_options[] = {
+		{"raw", required_argument, 0, 'r'},
+		{"block", required_argument, 0, 'B'},
+		{"hop", required_argument, 0, 'H'},
+		{"bands", required_argument, 0, 'n'},
+		{"rows", no_argument, 0, 'R'},
+		{"freq", required_argument, 0, 'F'},
+		{"range", required_argument, 0, 'd'},
+		{"envelope", required_argument, 0, 'e'},
+		{"tap-rate", required_argument, 0, 't'},
+		{"no-conf", no_argument, 0, 'C'},
+		{"fast", no_argument, 0, 'x'},
+		{"layout", required_argument, 0, 'l'},
+		{"port", required_argument, 0, 'p'},
+		{"baud", required_argument, 0, 'b'},
+		{"isa", required_argument, 0, 'I'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'r': {
+				opt.raw = true;
+				if (sscanf(optarg, "%d,%d", &opt.raw_rate, &opt.raw_channels) != 2) {
+					usage();
+					return 1;
+				}
+				break;
+			}
+			case 'B': opt.block = atoi(optarg); break;
+			case 'H': opt.hop = atoi(optarg); break;
+			case 'n': opt.bands = atoi(optarg); break;
+			case 'R': opt.map_rows = true; break;
+			case 'F': sscanf(optarg, "%f,%f", &opt.fmin, &opt.fmax); break;
+			case 'd': opt.range_db = atof(optarg); break;
+			case 'e': sscanf(optarg, "%f,%f", &opt.attack_ms, &opt.release_ms); break;
+			case 't': sscanf(optarg, "%f,%f", &opt.min_hz, &opt.max_hz); break;
+			case 'C': opt.drive_conf = false; break;
+			case 'x': opt.fast = true; break;
+			case 'l': opt.layout_spec = optarg; break;
+			case 'p': opt.port = optarg; break;
+			case 'b': opt.baud = atoi(optarg); break;
+			case 'I': {
+				if (!pack_parse_isa(optarg, &opt.isa) || !pack_isa_supported(opt.isa)) {
+					fprintf(stderr, "Unsupported isa %s\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+	if (optind < argc) opt.input = argv[optind];
+
+	layout_desc_t desc;
+	layout_t layout;
+	if (!layout_parse(opt.layout_spec, &desc) || !layout_compile(desc, &layout)) {
+		fprintf(stderr, "Bad layout %s\n", opt.layout_spec);
+		return 1;
+	}
+	if (opt.bands <= 0) opt.bands = std::min(32, opt.map_rows ? layout.height : layout.width);
+	// Daisy masters would take the conf bytes for state
+	if (!layout_has_commands(desc.format)) opt.drive_conf = false;
+
+	fft_t fft;
+	if (!fft_init(&fft, opt.block) || opt.hop <= 0 || opt.hop > opt.block) {
+		fprintf(stderr, "Block must be a power of two and hop at most a block\n");
+		return 1;
+	}
+
+	bool from_stdin = strcmp(opt.input, "-") == 0;
+	audio_input_t in;
+	in.f = from_stdin ? stdin : fopen(opt.input, "rb");
+	if (!in.f) {
+		fprintf(stderr, "Can't open %s\n", opt.input);
+		return 1;
+	}
+	if (opt.raw) {
+		in.rate = opt.raw_rate;
+		in.channels = opt.raw_channels;
+		in.format = SAMPLE_S16;
+		in.bytes_per_sample = 2;
+	} else if (!read_wav_header(&in)) {
+		fprintf(stderr, "Not a WAV file, use --raw for headerless input\n");
+		return 1;
+	}
+	// Piped audio arrives in real time already
+	bool paced = !from_stdin && !opt.fast;
+
+	tap_link_t link;
+	bool have_link = opt.port != NULL;
+	if (have_link) {
+		if (!link_open(&link, opt.port, opt.baud)) return 1;
+		if (link.tty && layout_has_commands(desc.format)) {
+			fprintf(stderr, "Waiting for master on %s\n", opt.port);
+			fprintf(stderr, "Flow control %s\n", link_handshake(&link, 3000) ? "on" : "off");
+		}
+	}
+
+	std::vector<band_t> bands;
+	make_bands(opt, in.rate, &bands);
+
+	double hop_s = (double)opt.hop / in.rate;
+	fprintf(stderr, "%d Hz %d ch -> %d bands on %dx%d tappers (%s), %.1f ms window, %.1f ms hop\n",
+		in.rate, in.channels, opt.bands, layout.width, layout.height, layout_format_name(desc.format),
+		1000.0 * opt.block / in.rate, 1000 * hop_s);
+
+	std::vector<float> window(opt.block), history(opt.block, 0), re(opt.block), im(opt.block), power(opt.block / 2);
+	for (int i = 0; i < opt.block; i++) window[i] = 0.5f - 0.5f * cosf(2 * (float)M_PI * i / opt.block);
+
+	std::vector<uint8_t> cells((size_t)layout.width * layout.height), last_cells;
+	std::vector<uint8_t> packed(layout.packed_len), wire(layout.frame_len);
+
+	float attack = 1 - expf(-(float)hop_s * 1000 / opt.attack_ms);
+	float release = 1 - expf(-(float)hop_s * 1000 / opt.release_ms);
+	// Peaks fall 10 dB per second so the auto gain follows quieter passages
+	float peak_decay = 10 * (float)hop_s;
+
+	// Frames can't usefully go out faster than the link carries them
+	int64_t min_frame_ns = (int64_t)(serial_wire_time(layout.frame_len, opt.baud) * 1.1e9);
+	int64_t last_frame = 0, last_conf = 0;
+	float conf_hz = 0, conf_duty = 0;
+
+	hist_t process, audio_to_tap;
+	hist_reset(&process);
+	hist_reset(&audio_to_tap);
+	uint64_t blocks = 0, frames = 0, confs = 0, late = 0;
+	ack_ctx_t acks;
+	acks.audio_to_tap = &audio_to_tap;
+	acks.replaced = 0;
+	if (have_link) {
+		link.on_state_acked = on_state_acked;
+		link.on_state_ctx = &acks;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	int64_t start = now_ns();
+	uint64_t samples = 0;
+
+	while (!stopping) {
+		// Shift the history along and read the next hop into its end
+		memmove(history.data(), history.data() + opt.hop, (opt.block - opt.hop) * sizeof(float));
+		int got = read_samples(&in, history.data() + opt.block - opt.hop, opt.hop);
+		if (got < opt.hop) break;
+		samples += got;
+
+		int64_t available = now_ns();
+		if (paced) {
+			// The newest sample of this hop "arrives" when playback reaches it
+			int64_t due = start + (int64_t)(samples * 1e9 / in.rate);
+			if (available < due) {
+				struct timespec ts = {(time_t)(due / 1000000000), (long)(due % 1000000000)};
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			} else if (available - due > (int64_t)(hop_s * 1e9)) {
+				late++;
+			}
+			available = std::max(available, due);
+		}
+
+		int64_t t0 = now_ns();
+		// Rate limits run on the audio clock so --fast produces the same frames
+		int64_t stream_t = start + (int64_t)(samples * 1e9 / in.rate);
+
+		for (int i = 0; i < opt.block; i++) {
+			re[i] = history[i] * window[i];
+			im[i] = 0;
+		}
+		fft_forward(&fft, re.data(), im.data());
+		for (int i = 0; i < opt.block / 2; i++) power[i] = re[i] * re[i] + im[i] * im[i];
+
+		double total = 0, weighted = 0, loudness = 0;
+		for (band_t& band : bands) {
+			double e = 1e-12;
+			for (int i = band.lo; i < band.hi; i++) e += power[i];
+			total += e;
+			weighted += e * (band.lo + band.hi) / 2;
+
+			float db = 10 * log10f((float)e);
+			band.peak_db = std::max(db, band.peak_db - peak_decay);
+			float target = std::min(1.0f, std::max(0.0f, (db - (band.peak_db - opt.range_db)) / opt.range_db));
+			band.level += (target - band.level) * (target > band.level ? attack : release);
+			loudness += band.level;
+		}
+		loudness /= bands.size();
+
+		render(opt, bands, layout.width, layout.height, cells.data());
+		blocks++;
+
+		bool send_frame = cells != last_cells && stream_t - last_frame >= min_frame_ns;
+		if (send_frame) pack_encode(layout, cells.data(), packed.data(), wire.data(), opt.isa);
+
+		// Brighter sound taps faster, louder sound gets longer pulses
+		bool send_conf = false;
+		uint8_t conf[9];
+		if (opt.drive_conf) {
+			float centroid_hz = (float)(weighted / total) * in.rate / opt.block;
+			float bright = logf(std::max(centroid_hz, opt.fmin) / opt.fmin) / logf(opt.fmax / opt.fmin);
+			bright = std::min(1.0f, std::max(0.0f, bright));
+			float hz = opt.min_hz * powf(opt.max_hz / opt.min_hz, bright);
+			float duty = 0.1f + 0.3f * (float)loudness;
+
+			bool changed = fabsf(hz - conf_hz) > CONF_MIN_CHANGE * conf_hz || fabsf(duty - conf_duty) > CONF_MIN_CHANGE;
+			if (changed && stream_t - last_conf >= CONF_MIN_INTERVAL_NS) {
+				// Period and pulse lengths in 10us units, up and down pulses of the same length
+				uint32_t period = (uint32_t)(100000 / hz);
+				uint16_t pulse = (uint16_t)std::min(65535.0f, period * duty);
+				uint16_t gap = (uint16_t)std::min(65535u, (period - 2 * pulse) / 2);
+				link_encode_conf(conf, pulse, gap, pulse, gap);
+				send_conf = true;
+				conf_hz = hz;
+				conf_duty = duty;
+				last_conf = stream_t;
+			}
+		}
+
+		int64_t t1 = now_ns();
+		hist_add(&process, t1 - t0);
+
+		if (have_link) {
+			if (send_conf) {
+				link_send_control(&link, conf, sizeof(conf), true);
+				confs++;
+			}
+			if (send_frame) {
+				uint32_t id = link_send_state(&link, wire.data(), wire.size());
+				if (link.enabled) {
+					acks.sent.push_back({id, available});
+				} else {
+					// Without flow control wait for the bytes to actually leave
+					if (link.tty) tcdrain(link.fd);
+					hist_add(&audio_to_tap, now_ns() - available);
+				}
+			}
+			link_poll(&link, 0);
+		} else if (send_conf) {
+			confs++;
+		}
+
+		if (send_frame) {
+			last_cells = cells;
+			last_frame = stream_t;
+			frames++;
+			if (!have_link) hist_add(&audio_to_tap, now_ns() - available);
+		}
+	}
+
+	double secs = (now_ns() - start) / 1e9;
+	if (have_link) {
+		// Collect the acks for the last frames
+		int64_t deadline = now_ns() + 1000000000;
+		while ((link_busy(&link) || (link.enabled && !acks.sent.empty() && link.unacked > 0)) && !link.failed && now_ns() < deadline) {
+			link_poll(&link, 1);
+		}
+	}
+
+	double audio_secs = (double)samples / in.rate;
+	fprintf(stderr, "\n%.1f s of audio in %.2f s (%.1fx real time), %llu blocks, %llu frames, %llu conf updates, %llu late blocks\n",
+		audio_secs, secs, audio_secs / secs, (unsigned long long)blocks, (unsigned long long)frames,
+		(unsigned long long)confs, (unsigned long long)late);
+	if (have_link && link.enabled) {
+		fprintf(stderr, "%llu frames replaced by newer ones before they went out, %zu never acked\n",
+			(unsigned long long)acks.replaced, acks.sent.size());
+	}
+	fprintf(stderr, "\n");
+	hist_print(stderr, "process", &process, 1000, "us");
+	hist_print(stderr, "audio-to-tap", &audio_to_tap, 1e6, "ms");
+	if (have_link && link.enabled) hist_print(stderr, "link ack", &link.ack_latency, 1e6, "ms");
+
+	fprintf(stderr, "\nblock processing uses %.1f%% of a core at %d Hz, the FFT window adds up to %.1f ms\n",
+		100 * hist_mean(&process) / (hop_s * 1e9), in.rate, 1000.0 * opt.block / in.rate);
+
+	if (have_link) link_close(&link);
+	return 0;
+}
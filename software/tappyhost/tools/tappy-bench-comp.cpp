@@ -0,0 +1,251 @@
+// Benchmark of the layer compositor against composing and encoding everything every tick
+//
+//   tappy-bench-comp [options]
+//
+// Runs two made up apps on the compositor (src/compositor.h) for --ticks ticks of a
+// --rate Hz loop, on simulated time so lifetimes are the same every run:
+//
+//   touches   a static background texture, alerts popping up at random with lifetimes of
+//             50-500 ms, and two masked XOR touch points moving every tick
+//   animated  the same with the background scrolling, so every tile is dirty every tick
+//
+// Every tick comp_update() and comp_encode() are timed, and the canvas and wire frame are
+// checked against comp_compose_all() and a full pack_encode(). The same full composition
+// and encode is timed as the baseline.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "clock.h"
+#include "compositor.h"
+#include "layout.h"
+#include "pack.h"
+#include "stats.h"
+
+#define TOUCHES 2
+#define TOUCH_SIZE 7
+
+typedef struct {
+	int width, height;
+	int layers;
+	int ticks;
+	double rate;
+	const char* layout_spec;
+	pack_isa_t isa;
+	unsigned seed;
+} options_t;
+
+typedef struct {
+	hist_t update, encode, tick, baseline;
+	uint64_t tiles_composed, bytes_encoded;
+} bench_stats_t;
+
+static void draw_texture(compositor_t* comp, comp_layer_t* layer, int shift, std::vector<uint8_t>* scratch) {
+	scratch->resize((size_t)layer->w * layer->h);
+	for (int y = 0; y < layer->h; y++) {
+		for (int x = 0; x < layer->w; x++) (*scratch)[(size_t)y * layer->w + x] = ((x + shift) / 3 + y / 5) % 4 == 0;
+	}
+	comp_rect_t all = {0, 0, layer->w, layer->h};
+	comp_draw(comp, layer, all, scratch->data());
+}
+
+static bool run(const options_t& opt, const layout_t& layout, bool animated, bench_stats_t* s) {
+	compositor_t comp;
+	comp_init(&comp, opt.width, opt.height);
+
+	std::mt19937 rng(opt.seed);
+	std::vector<uint8_t> scratch;
+	int64_t period = (int64_t)(1e9 / opt.rate);
+
+	comp_layer_t* background = comp_add_layer(&comp, 0, 0, opt.width, opt.height, 0, COMP_OR, 0);
+	draw_texture(&comp, background, 0, &scratch);
+
+	// Round touch points on top of everything
+	std::vector<uint8_t> disc(TOUCH_SIZE * TOUCH_SIZE);
+	for (int y = 0; y < TOUCH_SIZE; y++) {
+		for (int x = 0; x < TOUCH_SIZE; x++) {
+			int dx = 2 * x - (TOUCH_SIZE - 1), dy = 2 * y - (TOUCH_SIZE - 1);
+			disc[y * TOUCH_SIZE + x] = dx * dx + dy * dy <= TOUCH_SIZE * TOUCH_SIZE;
+		}
+	}
+	comp_layer_t* touches[TOUCHES];
+	for (int i = 0; i < TOUCHES; i++) {
+		touches[i] = comp_add_layer(&comp, 0, 0, TOUCH_SIZE, TOUCH_SIZE, 100, COMP_XOR, 0);
+		comp_set_mask(&comp, touches[i], disc.data());
+		comp_fill(&comp, touches[i], {0, 0, TOUCH_SIZE, TOUCH_SIZE}, 1);
+	}
+
+	comp_update(&comp, 0);
+	comp_encoder_t enc;
+	comp_encoder_init(&enc, &comp, &layout, 0, 0, opt.isa);
+
+	int alerts = std::max(opt.layers - 1 - TOUCHES, 0);
+	std::vector<uint8_t> full(comp.canvas.size()), cells((size_t)layout.width * layout.height);
+	std::vector<uint8_t> packed(layout.packed_len), wire(layout.frame_len);
+	bool ok = true;
+
+	for (int tick = 0; tick < opt.ticks && ok; tick++) {
+		int64_t now = tick * period;
+
+		// What the apps do this tick, not timed
+		if (animated) draw_texture(&comp, background, tick, &scratch);
+		while ((int)comp.layers.size() < 1 + TOUCHES + alerts) {
+			int w = 10 + rng() % 11, h = 10 + rng() % 11;
+			comp_blend_t blend = (comp_blend_t)(rng() % 3);
+			comp_layer_t* alert = comp_add_layer(&comp, rng() % opt.width - w / 2, rng() % opt.height - h / 2, w, h,
+				1 + rng() % 50, blend, now + (50 + rng() % 451) * 1000000LL);
+			scratch.resize((size_t)w * h);
+			for (uint8_t& v : scratch) v = rng() % 2;
+			comp_draw(&comp, alert, {0, 0, w, h}, scratch.data());
+		}
+		for (int i = 0; i < TOUCHES; i++) {
+			double a = tick * 0.05 + i * 3.0;
+			int cx = (int)(opt.width / 2 + opt.width / 3 * cos(a)), cy = (int)(opt.height / 2 + opt.height / 3 * sin(a * 1.3));
+			comp_move(&comp, touches[i], cx - TOUCH_SIZE / 2, cy - TOUCH_SIZE / 2);
+		}
+
+		int64_t t0 = now_ns();
+		comp_update(&comp, now);
+		int64_t t1 = now_ns();
+		s->bytes_encoded += comp_encode(&enc, &comp, opt.isa);
+		int64_t t2 = now_ns();
+
+		hist_add(&s->update, t1 - t0);
+		hist_add(&s->encode, t2 - t1);
+		hist_add(&s->tick, t2 - t0);
+
+		// Baseline and check
+		int64_t b0 = now_ns();
+		comp_compose_all(&comp, full.data());
+		for (int y = 0; y < std::min(layout.height, opt.height); y++) {
+			memcpy(&cells[(size_t)y * layout.width], &full[(size_t)y * opt.width], std::min(layout.width, opt.width));
+		}
+		pack_encode(layout, cells.data(), packed.data(), wire.data(), opt.isa);
+		hist_add(&s->baseline, now_ns() - b0);
+
+		if (full != comp.canvas) {
+			fprintf(stderr, "tick %d: canvas doesn't match the full composition\n", tick);
+			ok = false;
+		} else if (wire != enc.wire) {
+			fprintf(stderr, "tick %d: wire frame doesn't match a full encode\n", tick);
+			ok = false;
+		}
+	}
+
+	s->tiles_composed = comp.tiles_composed;
+	comp_free(&comp);
+	return ok;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-bench-comp [options]\n"
+		"\n"
+		"  --size WxH           canvas in tappers (default 100x100)\n"
+		"  --layers N           layers on the canvas (default 32)\n"
+		"  --ticks N            (default 2000)\n"
+		"  --rate HZ            tick rate the lifetimes and the budget are based on (default 200)\n"
+		"  --layout SPEC        layout to encode (default: v6 boards covering the canvas)\n"
+		"  --isa ISA            scalar, sse2 or avx2 (default: best supported)\n"
+		"  --seed N\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.width = 100;
+	opt.height = 100;
+	opt.layers = 32;
+	opt.ticks = 2000;
+	opt.rate = 200;
+	opt.layout_spec = NULL;
+	opt.isa = pack_best_isa();
+	opt.seed = 1;
+
+	static struct option long_options[] = {
+		{"size", required_argument, 0, 's'},
+		{"layers", required_argument, 0, 'n'},
+		{"ticks", required_argument, 0, 't'},
+		{"rate", required_argument, 0, 'r'},
+		{"layout", required_argument, 0, 'l'},
+		{"isa", required_argument, 0, 'I'},
+		{"seed", required_argument, 0, 'S'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 's': {
+				if (sscanf(optarg, "%dx%d", &opt.width, &opt.height) != 2 || opt.width <= 0 || opt.height <= 0) {
+					usage();
+					return 1;
+				}
+				break;
+			}
+			case 'n': opt.layers = atoi(optarg); break;
+			case 't': opt.ticks = atoi(optarg); break;
+			case 'r': opt.rate = atof(optarg); break;
+			case 'l': opt.layout_spec = optarg; break;
+			case 'I': {
+				if (!pack_parse_isa(optarg, &opt.isa) || !pack_isa_supported(opt.isa)) {
+					fprintf(stderr, "Unsupported isa %s\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			case 'S': opt.seed = atoi(optarg); break;
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+
+	char spec[64];
+	if (!opt.layout_spec) {
+		snprintf(spec, sizeof(spec), "v6:%dx%d", (opt.width + 5) / 6, (opt.height + 5) / 6);
+		opt.layout_spec = spec;
+	}
+	layout_desc_t desc;
+	layout_t layout;
+	if (!layout_parse(opt.layout_spec, &desc) || !layout_compile(desc, &layout)) {
+		fprintf(stderr, "Bad layout %s\n", opt.layout_spec);
+		return 1;
+	}
+
+	double budget_us = 1e6 / opt.rate;
+	printf("%dx%d canvas, %d layers, %d ticks at %.0f Hz (%.0f us budget), %s %dx%d tappers %zu bytes/frame, %s\n\n",
+		opt.width, opt.height, opt.layers, opt.ticks, opt.rate, budget_us, layout_format_name(desc.format),
+		layout.width, layout.height, layout.frame_len, pack_isa_name(opt.isa));
+
+	bool ok = true;
+	for (int animated = 0; animated < 2; animated++) {
+		bench_stats_t s;
+		hist_reset(&s.update);
+		hist_reset(&s.encode);
+		hist_reset(&s.tick);
+		hist_reset(&s.baseline);
+		s.tiles_composed = s.bytes_encoded = 0;
+
+		ok = run(opt, layout, animated, &s) && ok;
+
+		int tiles = ((opt.width + COMP_TILE - 1) / COMP_TILE) * ((opt.height + COMP_TILE - 1) / COMP_TILE);
+		printf("%s: %.1f of %d tiles recomposed and %.0f of %zu bytes re-encoded per tick\n", animated ? "animated" : "touches",
+			(double)s.tiles_composed / opt.ticks, tiles, (double)s.bytes_encoded / opt.ticks, layout.frame_len);
+		hist_print(stdout, "  update", &s.update, 1000, "us");
+		hist_print(stdout, "  encode", &s.encode, 1000, "us");
+		hist_print(stdout, "  tick", &s.tick, 1000, "us");
+		hist_print(stdout, "  full redo", &s.baseline, 1000, "us");
+		printf("  p99 tick is %.2f%% of the budget, %.1fx faster than redoing everything\n\n",
+			100.0 * hist_percentile(&s.tick, 99) / 1e3 / budget_us, hist_mean(&s.baseline) / std::max(hist_mean(&s.tick), 1.0));
+	}
+
+	return ok ? 0 : 1;
+}
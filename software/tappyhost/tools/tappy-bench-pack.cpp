@@ -0,0 +1,118 @@
+// Benchmark of the layout packing kernels against the nested loop reference encoder
+//
+//   tappy-bench-pack [format ...]
+//
+// For every format (default: all of them) and roughly 1k, 10k and 100k tappers it checks
+// that every kernel produces the same frame as the reference and prints the time per frame.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "clock.h"
+#include "layout.h"
+#include "pack.h"
+
+static const int TAPPER_COUNTS[] = {1000, 10000, 100000};
+static const int64_t MIN_BENCH_NS = 200000000;
+
+// Keeps the compiler from optimising the frames away
+static volatile uint8_t sink;
+
+template <typename F>
+static double bench(F f, const std::vector<uint8_t>& out) {
+	int64_t start = now_ns();
+	int64_t iterations = 0;
+	int64_t elapsed;
+
+	do {
+		for (int i = 0; i < 16; i++) f();
+		iterations += 16;
+		sink = out[0];
+		elapsed = now_ns() - start;
+	} while (elapsed < MIN_BENCH_NS);
+
+	return (double)elapsed / iterations;
+}
+
+static void bench_layout(format_t format, int tappers) {
+	layout_desc_t desc;
+	desc.format = format;
+	desc.order = format == FORMAT_V6 ? ORDER_SERPENTINE_COLUMNS : format == FORMAT_BRIDGE_V1 ? ORDER_SERPENTINE_ROWS : ORDER_ROWS;
+
+	int per_board = format == FORMAT_V6 ? 36 : 9;
+	int boards = (tappers + per_board - 1) / per_board;
+	desc.boards_x = (int)ceil(sqrt((double)boards));
+	desc.boards_y = (boards + desc.boards_x - 1) / desc.boards_x;
+
+	layout_t layout;
+	layout_compile(desc, &layout);
+
+	size_t cells_len = (size_t)layout.width * layout.height;
+	std::vector<uint8_t> cells(cells_len);
+	for (size_t i = 0; i < cells_len; i++) cells[i] = rand() % 2;
+
+	std::vector<uint8_t> packed(layout.packed_len);
+	std::vector<uint8_t> expected(layout.frame_len), out(layout.frame_len);
+
+	layout_encode_reference(layout, cells.data(), expected.data());
+
+	double reference = bench([&]() { layout_encode_reference(layout, cells.data(), out.data()); }, out);
+
+	printf("%-9s %3dx%-3d %7zu %7zu %10.0f", layout_format_name(format), desc.boards_x, desc.boards_y,
+		cells_len, layout.frame_len, reference);
+
+	for (int isa = PACK_SCALAR; isa <= PACK_AVX2; isa++) {
+		if (!pack_isa_supported((pack_isa_t)isa)) {
+			printf(" %10s %10s", "-", "-");
+			continue;
+		}
+
+		memset(out.data(), 0, out.size());
+		pack_encode(layout, cells.data(), packed.data(), out.data(), (pack_isa_t)isa);
+		if (out != expected) {
+			printf("\n%s kernel doesn't match the reference encoder\n", pack_isa_name((pack_isa_t)isa));
+			exit(1);
+		}
+
+		double encode = bench([&]() { pack_encode(layout, cells.data(), packed.data(), out.data(), (pack_isa_t)isa); }, out);
+		double frame = bench([&]() { pack_frame(layout, packed.data(), out.data(), (pack_isa_t)isa); }, out);
+
+		printf(" %10.0f %10.0f", encode, frame);
+	}
+
+	printf("\n");
+}
+
+int main(int argc, char** argv) {
+	std::vector<format_t> formats;
+	for (int i = 1; i < argc; i++) {
+		layout_desc_t desc;
+		char spec[64];
+		snprintf(spec, sizeof(spec), "%s:1x1", argv[i]);
+		if (!layout_parse(spec, &desc)) {
+			fprintf(stderr, "Unknown format %s\n", argv[i]);
+			return 1;
+		}
+		formats.push_back(desc.format);
+	}
+	if (formats.empty()) formats = {FORMAT_V6, FORMAT_BRIDGE_V1, FORMAT_DAISY};
+
+	printf("Times in ns per frame. 'cells' encodes from one byte per tapper, 'bits' from a packed bitmap\n\n");
+	printf("%-9s %-7s %7s %7s %10s", "format", "boards", "tappers", "bytes", "reference");
+	for (int isa = PACK_SCALAR; isa <= PACK_AVX2; isa++) {
+		char cells[32], bits[32];
+		snprintf(cells, sizeof(cells), "%s cells", pack_isa_name((pack_isa_t)isa));
+		snprintf(bits, sizeof(bits), "%s bits", pack_isa_name((pack_isa_t)isa));
+		printf(" %10s %10s", cells, bits);
+	}
+	printf("\n");
+
+	for (format_t format : formats) {
+		for (int tappers : TAPPER_COUNTS) bench_layout(format, tappers);
+	}
+
+	return 0;
+}
@@ -0,0 +1,299 @@
+// Benchmark of the shared memory frame ring (src/shm_ring.h)
+//
+//   tappy-bench-shm [options]
+//
+// Every frame is a packed bitmap for --layout with its number stamped into its first and
+// last 8 bytes, which the consumer checks for every frame it reads intact. Four runs:
+//
+//   inline     one thread claims, fills, publishes, peeks and consumes each frame in turn,
+//              the cost of the ring itself per frame with warm caches
+//   spin       a forked consumer process spins on the ring and the producer publishes the
+//              next frame once the last one was consumed, one way latency between cores
+//   stream     the producer publishes back to back into a consumer reading every frame in
+//              order, per frame cost when both sides are busy, and the overruns when the
+//              consumer can't keep up
+//   futex      the consumer sleeps in shm_ring_wait() and the producer publishes every
+//              --interval us, latency including the wakeup
+//
+// With a single CPU both processes share it, the spinning sides yield and the cross
+// process numbers mostly measure the scheduler.
+
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include "clock.h"
+#include "layout.h"
+#include "shm_ring.h"
+#include "stats.h"
+
+typedef struct {
+	const char* layout_spec;
+	int slots;
+	int frames;
+	int interval_us;
+	int cpu[2]; // producer, consumer, -1 to leave alone
+} options_t;
+
+// Results the consumer process hands back, in an anonymous shared mapping
+typedef struct {
+	hist_t latency;
+	uint64_t frames, torn, corrupt, overruns;
+	int64_t first_ns, last_ns;
+	std::atomic<bool> ready;
+} consumer_result_t;
+
+typedef enum {
+	RUN_SPIN,
+	RUN_STREAM,
+	RUN_FUTEX
+} run_t;
+
+static bool single_cpu;
+
+static void pin(int cpu) {
+	if (cpu < 0) return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) perror("sched_setaffinity");
+}
+
+static inline void relax() {
+	if (single_cpu) sched_yield();
+}
+
+static void fill(uint8_t* packed, const std::vector<uint8_t>& pattern, uint64_t n) {
+	memcpy(packed, pattern.data(), pattern.size());
+	memcpy(packed, &n, 8);
+	memcpy(packed + pattern.size() - 8, &n, 8);
+}
+
+static bool check(const uint8_t* packed, size_t len, uint64_t n) {
+	uint64_t a, b;
+	memcpy(&a, packed, 8);
+	memcpy(&b, packed + len - 8, 8);
+	return a == n && b == n;
+}
+
+static void run_inline(const options_t& opt, shm_ring_t* ring, const std::vector<uint8_t>& pattern) {
+	const int BATCH = 256;
+	hist_t per_frame;
+	hist_reset(&per_frame);
+	uint64_t corrupt = 0;
+
+	for (int done = 0; done < opt.frames; done += BATCH) {
+		int64_t t0 = now_ns();
+		for (int i = 0; i < BATCH; i++) {
+			fill(shm_ring_claim(ring), pattern, ring->head);
+			shm_ring_publish(ring, 0);
+
+			shm_frame_t frame;
+			if (!shm_ring_peek(ring, &frame, false) || !check(frame.packed, pattern.size(), frame.seq) ||
+				!shm_ring_consume(ring, &frame)) {
+				corrupt++;
+			}
+		}
+		// Per frame average of the batch, a clock read per frame would be most of it
+		hist_add(&per_frame, (now_ns() - t0) / BATCH);
+	}
+
+	printf("inline: claim + fill + publish + peek + check + consume, %d frame batches%s\n", BATCH, corrupt ? ", CORRUPT FRAMES" : "");
+	hist_print(stdout, "  per frame", &per_frame, 1, "ns");
+}
+
+static void consume(const options_t& opt, run_t run, const char* name, size_t packed_len, consumer_result_t* r) {
+	pin(opt.cpu[1]);
+
+	shm_ring_t ring;
+	if (!shm_ring_open(&ring, name)) _exit(1);
+	r->ready = true;
+
+	while (ring.tail < (uint64_t)opt.frames) {
+		shm_frame_t frame;
+		if (run == RUN_FUTEX) {
+			if (!shm_ring_wait(&ring, 1000)) break;
+		}
+		if (!shm_ring_peek(&ring, &frame, false)) {
+			relax();
+			continue;
+		}
+		int64_t now = now_ns();
+
+		bool ok = check(frame.packed, packed_len, frame.seq);
+		if (!shm_ring_consume(&ring, &frame)) {
+			r->torn++;
+			continue;
+		}
+		if (!ok) r->corrupt++;
+		if (r->frames == 0) r->first_ns = now;
+		r->last_ns = now;
+		r->frames++;
+		if (run != RUN_STREAM) hist_add(&r->latency, now - frame.t_ns);
+	}
+
+	r->overruns = ring.header->overruns.load();
+	shm_ring_close(&ring);
+	_exit(0);
+}
+
+static bool run_procs(const options_t& opt, run_t run, const std::vector<uint8_t>& pattern) {
+	char name[64];
+	snprintf(name, sizeof(name), "/tappy-bench-%d", (int)getpid());
+	shm_ring_t ring;
+	if (!shm_ring_create(&ring, name, opt.layout_spec, pattern.size(), opt.slots)) return false;
+
+	consumer_result_t* r = new (mmap(NULL, sizeof(consumer_result_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0))
+		consumer_result_t();
+	hist_reset(&r->latency);
+
+	pid_t pid = fork();
+	if (pid == 0) consume(opt, run, name, pattern.size(), r);
+	pin(opt.cpu[0]);
+	while (!r->ready) usleep(100);
+
+	hist_t publish;
+	hist_reset(&publish);
+	int64_t start = now_ns();
+	uint64_t lapped = 0;
+
+	for (int i = 0; i < opt.frames; i++) {
+		if (run == RUN_SPIN) {
+			// Wait for the consumer so every frame finds it idle and spinning
+			while (ring.header->tail.load(std::memory_order_acquire) < ring.head) relax();
+		} else if (run == RUN_FUTEX) {
+			int64_t due = start + (int64_t)i * opt.interval_us * 1000;
+			struct timespec ts = {(time_t)(due / 1000000000), (long)(due % 1000000000)};
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		int64_t t0 = now_ns();
+		fill(shm_ring_claim(&ring), pattern, ring.head);
+		if (!shm_ring_publish(&ring, t0)) lapped++;
+		if (run != RUN_STREAM) hist_add(&publish, now_ns() - t0);
+	}
+	int64_t end = now_ns();
+
+	int status;
+	waitpid(pid, &status, 0);
+	bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && r->corrupt == 0;
+
+	if (run == RUN_SPIN) {
+		printf("spin: consumer spinning in another process, one frame in flight\n");
+		hist_print(stdout, "  publish", &publish, 1, "ns");
+		hist_print(stdout, "  handoff", &r->latency, 1, "ns");
+	} else if (run == RUN_STREAM) {
+		printf("stream: producer flat out, consumer reading every frame in order\n");
+		printf("  producer %.0f ns/frame, consumer %.0f ns/frame, %llu frames read, %llu overwritten before (%llu seen by the producer) and %llu while being read\n",
+			(double)(end - start) / opt.frames, (double)(r->last_ns - start) / opt.frames, (unsigned long long)r->frames,
+			(unsigned long long)(r->overruns - r->torn), (unsigned long long)lapped, (unsigned long long)r->torn);
+	} else {
+		printf("futex: consumer asleep in shm_ring_wait(), a frame every %d us\n", opt.interval_us);
+		hist_print(stdout, "  publish", &publish, 1, "ns");
+		hist_print(stdout, "  handoff", &r->latency, 1000, "us");
+	}
+	if (run != RUN_STREAM && r->overruns) printf("  %llu frames lost to overruns\n", (unsigned long long)r->overruns);
+	if (r->corrupt) printf("  %llu CORRUPT FRAMES\n", (unsigned long long)r->corrupt);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) printf("  consumer failed\n");
+	printf("\n");
+
+	munmap(r, sizeof(*r));
+	shm_ring_close(&ring);
+	return ok;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-bench-shm [options]\n"
+		"\n"
+		"  --layout SPEC        layout the frames are packed for (default v6:4x4)\n"
+		"  --slots N            (default 8)\n"
+		"  --frames N           per run (default 200000)\n"
+		"  --interval US        between frames of the futex run (default 200)\n"
+		"  --cpu P,C            pin producer and consumer to these CPUs\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.layout_spec = "v6:4x4";
+	opt.slots = SHM_RING_DEFAULT_SLOTS;
+	opt.frames = 200000;
+	opt.interval_us = 200;
+	opt.cpu[0] = opt.cpu[1] = -1;
+
+	static struct option long_options[] = {
+		{"layout", required_argument, 0, 'l'},
+		{"slots", required_argument, 0, 'n'},
+		{"frames", required_argument, 0, 'f'},
+		{"interval", required_argument, 0, 'i'},
+		{"cpu", required_argument, 0, 'c'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'l': opt.layout_spec = optarg; break;
+			case 'n': opt.slots = atoi(optarg); break;
+			case 'f': opt.frames = atoi(optarg); break;
+			case 'i': opt.interval_us = atoi(optarg); break;
+			case 'c': {
+				if (sscanf(optarg, "%d,%d", &opt.cpu[0], &opt.cpu[1]) != 2) {
+					usage();
+					return 1;
+				}
+				break;
+			}
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+
+	layout_desc_t desc;
+	layout_t layout;
+	if (!layout_parse(opt.layout_spec, &desc) || !layout_compile(desc, &layout)) {
+		fprintf(stderr, "Bad layout %s\n", opt.layout_spec);
+		return 1;
+	}
+	if (layout.packed_len < 8) {
+		fprintf(stderr, "Frames of %zu bytes are too small to stamp\n", layout.packed_len);
+		return 1;
+	}
+
+	single_cpu = sysconf(_SC_NPROCESSORS_ONLN) == 1;
+	std::vector<uint8_t> pattern(layout.packed_len);
+	for (size_t i = 0; i < pattern.size(); i++) pattern[i] = (uint8_t)(i * 37);
+
+	printf("%s %dx%d tappers, %zu byte frames, %d slots, %d frames per run%s\n\n", layout_format_name(desc.format),
+		layout.width, layout.height, layout.packed_len, opt.slots, opt.frames, single_cpu ? ", single CPU" : "");
+
+	char name[64];
+	snprintf(name, sizeof(name), "/tappy-bench-%d", (int)getpid());
+	shm_ring_t ring;
+	if (!shm_ring_create(&ring, name, opt.layout_spec, layout.packed_len, opt.slots)) return 1;
+	pin(opt.cpu[0]);
+	run_inline(opt, &ring, pattern);
+	printf("\n");
+	shm_ring_close(&ring);
+
+	bool ok = run_procs(opt, RUN_SPIN, pattern);
+	ok = run_procs(opt, RUN_STREAM, pattern) && ok;
+	options_t futex_opt = opt;
+	futex_opt.frames = std::min(opt.frames, 1000000 / std::max(opt.interval_us, 1) * 2); // ~2 s
+	ok = run_procs(futex_opt, RUN_FUTEX, pattern) && ok;
+
+	return ok ? 0 : 1;
+}
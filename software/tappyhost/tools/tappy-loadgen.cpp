@@ -0,0 +1,371 @@
+// Load generator for tappyd
+//
+//   tappy-loadgen [options]
+//
+// Starts a number of clients, each on its own thread and socket, that send frames to
+// tappyd at a fixed rate and ask for acks. Every client draws a moving bar into its own
+// vertical strip of the canvas, or with --overlap all of them draw over the whole canvas
+// with increasing priority. The round trip from sending a frame until tappyd says it has
+// been merged and handed to the serial writers goes into a latency histogram.
+
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "clock.h"
+#include "stats.h"
+#include "tappy_msg.h"
+
+// How long to wait for outstanding acks at the end
+#define DRAIN_NS 200000000LL
+
+typedef enum _transport_t {
+	TRANSPORT_UDP,
+	TRANSPORT_TCP,
+	TRANSPORT_UNIX
+} transport_t;
+
+typedef struct {
+	transport_t transport;
+	int port;
+	const char* unix_path;
+	int clients;
+	double rate;
+	int width, height;
+	int priority;
+	bool overlap;
+	bool bits;
+	double duration;
+} options_t;
+
+typedef struct {
+	int index;
+	int x, y, w, h;
+	int priority;
+
+	uint64_t sent, acked, send_errors;
+	hist_t rtt;
+	// How late each send was against its schedule, to tell a slow loadgen from a slow tappyd
+	hist_t send_lag;
+} client_stats_t;
+
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int) {
+	stopping = true;
+}
+
+static int connect_client(const options_t& opt) {
+	int fd;
+	if (opt.transport == TRANSPORT_UNIX) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		struct sockaddr_un un;
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, opt.unix_path, sizeof(un.sun_path) - 1);
+		if (connect(fd, (struct sockaddr*)&un, sizeof(un)) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	fd = socket(AF_INET, opt.transport == TRANSPORT_UDP ? SOCK_DGRAM : SOCK_STREAM, 0);
+	struct sockaddr_in in;
+	memset(&in, 0, sizeof(in));
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	in.sin_port = htons(opt.port);
+	if (connect(fd, (struct sockaddr*)&in, sizeof(in)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	int one = 1;
+	if (opt.transport == TRANSPORT_TCP) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static bool send_message(int fd, const msg_header_t& h, const uint8_t* payload, std::vector<uint8_t>& buf) {
+	// Header and payload in one datagram or one write
+	buf.resize(MSG_HEADER_LEN + h.len);
+	msg_encode_header(&h, buf.data());
+	if (payload) memcpy(buf.data() + MSG_HEADER_LEN, payload, h.len);
+
+	size_t off = 0;
+	while (off < buf.size()) {
+		ssize_t n = send(fd, &buf[off], buf.size() - off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		off += n;
+	}
+	return true;
+}
+
+// Read acks, returns false if the connection is gone
+static bool read_acks(int fd, client_stats_t* s, std::vector<uint8_t>& rx, size_t* rx_len) {
+	while (true) {
+		ssize_t n = recv(fd, &rx[*rx_len], rx.size() - *rx_len, MSG_DONTWAIT);
+		if (n == 0) return false;
+		if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+		int64_t now = now_ns();
+		*rx_len += n;
+
+		size_t off = 0;
+		while (*rx_len - off >= MSG_HEADER_LEN) {
+			msg_header_t h;
+			if (msg_decode_header(&rx[off], &h) && h.type == MSG_ACK) {
+				hist_add(&s->rtt, now - h.t_ns);
+				s->acked++;
+			}
+			off += MSG_HEADER_LEN;
+		}
+		memmove(&rx[0], &rx[off], *rx_len - off);
+		*rx_len -= off;
+	}
+}
+
+// Moving bar, one tapper wide, sweeping across the region
+static void draw(const client_stats_t* s, uint64_t frame, bool bits, std::vector<uint8_t>& payload) {
+	int bar = (int)(frame % s->w);
+	std::fill(payload.begin(), payload.end(), 0);
+
+	for (int y = 0; y < s->h; y++) {
+		size_t i = (size_t)y * s->w + bar;
+		if (bits) {
+			payload[i / 8] |= 1 << (i % 8);
+		} else {
+			payload[i] = 1;
+		}
+	}
+}
+
+static void run_client(const options_t& opt, client_stats_t* s) {
+	int fd = connect_client(opt);
+	if (fd < 0) {
+		fprintf(stderr, "client %d: can't connect: %s\n", s->index, strerror(errno));
+		return;
+	}
+
+	msg_header_t h;
+	memset(&h, 0, sizeof(h));
+	h.type = MSG_FRAME;
+	h.priority = s->priority;
+	h.flags = MSG_FLAG_ACK | (opt.bits ? MSG_FLAG_BITS : 0);
+	h.x = s->x;
+	h.y = s->y;
+	h.w = s->w;
+	h.h = s->h;
+	h.len = msg_frame_len(&h);
+
+	std::vector<uint8_t> payload(h.len), tx;
+	std::vector<uint8_t> rx(4096);
+	size_t rx_len = 0;
+
+	// Default timer slack would make every wakeup ~50us late
+	prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+
+	int64_t period = (int64_t)(1e9 / opt.rate);
+	// Spread the clients over the period so they don't all send at once
+	int64_t start = now_ns() + period * s->index / opt.clients;
+	int64_t end = start + (int64_t)(opt.duration * 1e9);
+	int64_t next = start;
+
+	while (!stopping) {
+		int64_t now = now_ns();
+
+		if (now >= next && next < end) {
+			draw(s, s->sent, opt.bits, payload);
+			h.seq = (uint32_t)s->sent;
+			h.t_ns = now_ns();
+			if (!send_message(fd, h, payload.data(), tx)) s->send_errors++;
+			hist_add(&s->send_lag, now - next);
+			s->sent++;
+			next += period;
+			// Don't try to catch up after a stall, just carry on from now
+			if (next < now) next = now + period;
+			continue;
+		}
+
+		if (now >= end && (s->acked >= s->sent || now >= end + DRAIN_NS)) break;
+
+		int64_t wait = (next < end ? next : end + DRAIN_NS) - now;
+		struct timespec ts = {(time_t)(wait / 1000000000), (long)(wait % 1000000000)};
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if (ppoll(&pfd, 1, &ts, NULL) > 0 && !read_acks(fd, s, rx, &rx_len)) break;
+	}
+
+	// Give the region back
+	msg_header_t r;
+	memset(&r, 0, sizeof(r));
+	r.type = MSG_RELEASE;
+	send_message(fd, r, NULL, tx);
+	close(fd);
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-loadgen [options]\n"
+		"\n"
+		"  --udp PORT           send datagrams to tappyd on PORT (default, to port 7171)\n"
+		"  --tcp PORT           use a tcp connection per client to PORT\n"
+		"  --unix PATH          use a unix stream socket per client at PATH\n"
+		"  --clients N          concurrent clients (default 4)\n"
+		"  --rate HZ            frames per second per client (default 200)\n"
+		"  --size WxH           canvas to cover in tappers (default 12x12)\n"
+		"  --priority N         priority of the first client (default 0)\n"
+		"  --overlap            every client draws the whole canvas, each one priority higher\n"
+		"  --bits               send bitmaps instead of a byte per tapper\n"
+		"  --duration S         seconds to run (default 5)\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.transport = TRANSPORT_UDP;
+	opt.port = MSG_DEFAULT_PORT;
+	opt.unix_path = MSG_DEFAULT_UNIX_PATH;
+	opt.clients = 4;
+	opt.rate = 200;
+	opt.width = 12;
+	opt.height = 12;
+	opt.priority = 0;
+	opt.overlap = false;
+	opt.bits = false;
+	opt.duration = 5;
+
+	static struct option long_options[] = {
+		{"udp", required_argument, 0, 'u'},
+		{"tcp", required_argument, 0, 't'},
+		{"unix", required_argument, 0, 'x'},
+		{"clients", required_argument, 0, 'c'},
+		{"rate", required_argument, 0, 'r'},
+		{"size", required_argument, 0, 's'},
+		{"priority", required_argument, 0, 'p'},
+		{"overlap", no_argument, 0, 'o'},
+		{"bits", no_argument, 0, 'B'},
+		{"duration", required_argument, 0, 'd'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'u': {
+				opt.transport = TRANSPORT_UDP;
+				opt.port = atoi(optarg);
+				break;
+			}
+			case 't': {
+				opt.transport = TRANSPORT_TCP;
+				opt.port = atoi(optarg);
+				break;
+			}
+			case 'x': {
+				opt.transport = TRANSPORT_UNIX;
+				opt.unix_path = optarg;
+				break;
+			}
+			case 'c': opt.clients = std::max(1, atoi(optarg)); break;
+			case 'r': opt.rate = atof(optarg); break;
+			case 's': {
+				if (sscanf(optarg, "%dx%d", &opt.width, &opt.height) != 2) {
+					usage();
+					return 1;
+				}
+				break;
+			}
+			case 'p': opt.priority = atoi(optarg); break;
+			case 'o': opt.overlap = true; break;
+			case 'B': opt.bits = true; break;
+			case 'd': opt.duration = atof(optarg); break;
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+	if (optind != argc || opt.rate <= 0 || opt.width <= 0 || opt.height <= 0 || (!opt.overlap && opt.clients > opt.width)) {
+		usage();
+		return 1;
+	}
+
+	std::vector<client_stats_t> stats(opt.clients);
+	for (int i = 0; i < opt.clients; i++) {
+		client_stats_t& s = stats[i];
+		s.index = i;
+		if (opt.overlap) {
+			s.x = 0;
+			s.w = opt.width;
+			s.priority = std::min(255, opt.priority + i);
+		} else {
+			s.x = opt.width * i / opt.clients;
+			s.w = opt.width * (i + 1) / opt.clients - s.x;
+			s.priority = opt.priority;
+		}
+		s.y = 0;
+		s.h = opt.height;
+		s.sent = s.acked = s.send_errors = 0;
+		hist_reset(&s.rtt);
+		hist_reset(&s.send_lag);
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	static const char* TRANSPORT_NAMES[] = {"udp", "tcp", "unix"};
+	fprintf(stderr, "%d %s clients at %.0f Hz for %.1f s, %dx%d tappers%s\n", opt.clients,
+		TRANSPORT_NAMES[opt.transport], opt.rate, opt.duration, opt.width, opt.height,
+		opt.overlap ? " each, overlapping" : " split into strips");
+
+	int64_t start = now_ns();
+	std::vector<std::thread> threads;
+	for (client_stats_t& s : stats) threads.push_back(std::thread(run_client, std::cref(opt), &s));
+	for (std::thread& t : threads) t.join();
+	double secs = (now_ns() - start) / 1e9;
+
+	client_stats_t total;
+	total.sent = total.acked = total.send_errors = 0;
+	hist_reset(&total.rtt);
+	hist_reset(&total.send_lag);
+	for (const client_stats_t& s : stats) {
+		total.sent += s.sent;
+		total.acked += s.acked;
+		total.send_errors += s.send_errors;
+		hist_merge(&total.rtt, &s.rtt);
+		hist_merge(&total.send_lag, &s.send_lag);
+	}
+
+	fprintf(stderr, "\n%llu frames sent (%.0f/s), %llu acked, %llu lost, %llu send errors\n\n",
+		(unsigned long long)total.sent, total.sent / secs, (unsigned long long)total.acked,
+		(unsigned long long)(total.sent - std::min(total.sent, total.acked)), (unsigned long long)total.send_errors);
+	hist_print(stderr, "ack rtt", &total.rtt, 1000, "us");
+	hist_print(stderr, "send lag", &total.send_lag, 1000, "us");
+	if (opt.clients > 1) {
+		for (const client_stats_t& s : stats) {
+			char name[32];
+			snprintf(name, sizeof(name), "  client %d", s.index);
+			hist_print(stderr, name, &s.rtt, 1000, "us");
+		}
+	}
+
+	return total.acked < total.sent ? 2 : 0;
+}
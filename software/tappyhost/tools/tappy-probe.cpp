@@ -0,0 +1,392 @@
+// Measure how long a state change takes from the host to the chips
+//
+//   tappy-probe [options] --port PATH
+//
+// Each probe sends 0x88 <tag> followed by a state frame that turns on the next tapper, and
+// the master answers "probe <tag> <receipt> <apply> <spi>" with its micros() when it read
+// the frame's first byte, when the whole frame was in bstates and when the first SPI byte
+// of the write carrying it went out (v6 and processing-bridge-v1 firmware). In between
+// probes the master's clock is queried with 0x86 and fitted against the host clock like
+// tappy-sync does, without disciplining it, so the master's stamps can be put on the host
+// clock. That splits the latency into
+//
+//   link    host write of the state frame until the master read its 0x81
+//   parse   0x81 until 0x82, the rest of the frame on the wire and in the parser
+//   phase   0x82 until the next pulse write() starts on SPI
+//   total   host write until the change is on SPI
+//
+// Probes are spread randomly over the pulse period so the phase wait is sampled evenly.
+// With --onset the master starts every tapper's cycle as soon as it's enabled (0x8A 1), so
+// phase is only the wait for the SPI bus.
+// Percentiles of each are printed at the end, --csv appends them as one row per run so
+// firmware variants and baud rates can be lined up.
+
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <vector>
+
+#include "clock.h"
+#include "clock_sync.h"
+#include "layout.h"
+#include "pack.h"
+#include "serial_port.h"
+#include "stats.h"
+#include "tap_link.h"
+
+// How long to wait for a time query answer
+#define QUERY_TIMEOUT_NS 50000000LL
+// Time queries per clock fit round, one goes out before every probe
+#define QUERIES_PER_ROUND 8
+// Rounds before the first probe, enough for a rate
+#define WARMUP_ROUNDS 3
+#define SYNC_WINDOW 30
+
+typedef enum _probe_stage_t {
+	PROBE_LINK,
+	PROBE_PARSE,
+	PROBE_PHASE,
+	PROBE_TOTAL,
+	PROBE_RTT,
+	NUM_PROBE_STAGES
+} probe_stage_t;
+
+static const char* PROBE_STAGE_NAMES[NUM_PROBE_STAGES] = {"link", "parse", "phase", "total", "round_trip"};
+
+typedef struct {
+	const char* port;
+	const char* layout_spec;
+	const char* csv;
+	const char* label;
+	int baud;
+	int count;
+	bool has_conf;
+	bool onset;
+	uint16_t conf[4]; // 10us units
+	double timeout_ms;
+	unsigned seed;
+} options_t;
+
+typedef struct {
+	int baud;
+	clock_sync_t sync;
+
+	// Time query in flight
+	int time_tag;
+	int64_t time_sent_ns;
+	bool time_answered;
+
+	// Probe in flight
+	int probe_tag;
+	bool probe_answered;
+	int64_t probe_reply_ns;
+	uint32_t receipt_us, apply_us, spi_us;
+} probe_ctx_t;
+
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int) {
+	stopping = true;
+}
+
+// Wire time of the query and its answer comes out of the round trip, as in tappy-sync
+static int64_t wire_ns(size_t len, int baud) {
+	return (int64_t)(serial_wire_time(len, baud) * 1e9);
+}
+
+static void on_line(void* p, const char* line, int64_t t) {
+	probe_ctx_t* ctx = (probe_ctx_t*)p;
+
+	int tag;
+	unsigned long a, b, c;
+	if (sscanf(line, "time %d %lu %lu", &tag, &a, &b) == 3) {
+		if (tag != ctx->time_tag || ctx->time_answered) return;
+		ctx->time_answered = true;
+		sync_add_sample(&ctx->sync, ctx->time_sent_ns + wire_ns(2, ctx->baud), t - wire_ns(strlen(line) + 2, ctx->baud), (uint32_t)a);
+	} else if (sscanf(line, "probe %d %lu %lu %lu", &tag, &a, &b, &c) == 4) {
+		if (tag != ctx->probe_tag || ctx->probe_answered) return;
+		ctx->probe_answered = true;
+		ctx->probe_reply_ns = t;
+		ctx->receipt_us = (uint32_t)a;
+		ctx->apply_us = (uint32_t)b;
+		ctx->spi_us = (uint32_t)c;
+	}
+}
+
+static bool wait_for(tap_link_t* link, const bool* flag, int64_t timeout_ns) {
+	int64_t deadline = now_ns() + timeout_ns;
+	while (!*flag && !stopping && now_ns() < deadline) link_poll(link, 1);
+	return *flag;
+}
+
+static void time_query(tap_link_t* link, probe_ctx_t* ctx) {
+	ctx->time_tag = (ctx->time_tag + 1) % 0x80;
+	ctx->time_answered = false;
+	uint8_t cmd[2] = {0x86, (uint8_t)ctx->time_tag};
+	ctx->time_sent_ns = now_ns();
+	link_send_control(link, cmd, sizeof(cmd), false);
+	wait_for(link, &ctx->time_answered, QUERY_TIMEOUT_NS);
+}
+
+static void end_round(tap_link_t* link, probe_ctx_t* ctx) {
+	sync_end_round(&ctx->sync);
+	// Nothing but the state frames is acked, refresh the credit
+	uint8_t window_query = 0x84;
+	link_send_control(link, &window_query, 1, false);
+}
+
+static void sleep_ns(int64_t ns) {
+	struct timespec ts = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+	nanosleep(&ts, NULL);
+}
+
+static void append_csv(const options_t& opt, const layout_desc_t& desc, const hist_t* hists, uint64_t lost) {
+	FILE* f = fopen(opt.csv, "a");
+	if (!f) {
+		fprintf(stderr, "Can't open %s\n", opt.csv);
+		return;
+	}
+
+	// Header for a new file
+	if (ftell(f) == 0) {
+		fprintf(f, "label,format,baud,probes,lost");
+		for (int s = 0; s < NUM_PROBE_STAGES; s++) {
+			fprintf(f, ",%s_p50_us,%s_p90_us,%s_p99_us,%s_max_us", PROBE_STAGE_NAMES[s], PROBE_STAGE_NAMES[s],
+				PROBE_STAGE_NAMES[s], PROBE_STAGE_NAMES[s]);
+		}
+		fprintf(f, "\n");
+	}
+
+	fprintf(f, "%s,%s,%d,%llu,%llu", opt.label ? opt.label : "", layout_format_name(desc.format), opt.baud,
+		(unsigned long long)hists[PROBE_TOTAL].count, (unsigned long long)lost);
+	for (int s = 0; s < NUM_PROBE_STAGES; s++) {
+		const hist_t* h = &hists[s];
+		fprintf(f, ",%.1f,%.1f,%.1f,%.1f", hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+			hist_percentile(h, 99) / 1e3, h->max / 1e3);
+	}
+	fprintf(f, "\n");
+	fclose(f);
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-probe [options] --port PATH\n"
+		"\n"
+		"  --port PATH          serial port of a v6 or processing-bridge-v1 master\n"
+		"  --baud N             (default 115200)\n"
+		"  --layout SPEC        wire format and boards, e.g. v6:2x2, bridge-v1:3x3 (default v6:2x2)\n"
+		"  --count N            probes to send (default 2000)\n"
+		"  --conf U,I,D,P       set the pulse timing in ms first (default: leave it as the\n"
+		"                       master reports it)\n"
+		"  --onset              probe in immediate onset mode rather than on the global cycle\n"
+		"  --timeout-ms N       give up on a probe after N ms (default: two periods + 200)\n"
+		"  --csv PATH           append the percentiles to PATH\n"
+		"  --label TEXT         name of the run in the csv, e.g. the firmware variant\n"
+		"  --seed N             seed for the spacing of the probes\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.port = NULL;
+	opt.layout_spec = "v6:2x2";
+	opt.csv = NULL;
+	opt.label = NULL;
+	opt.baud = 115200;
+	opt.count = 2000;
+	opt.has_conf = false;
+	opt.onset = false;
+	// The firmware defaults
+	for (int i = 0; i < 4; i++) opt.conf[i] = 500;
+	opt.timeout_ms = 0;
+	opt.seed = 1;
+
+	static struct option long_options[] = {
+		{"port", required_argument, 0, 'p'},
+		{"baud", required_argument, 0, 'b'},
+		{"layout", required_argument, 0, 'l'},
+		{"count", required_argument, 0, 'n'},
+		{"conf", required_argument, 0, 'c'},
+		{"onset", no_argument, 0, 'o'},
+		{"timeout-ms", required_argument, 0, 't'},
+		{"csv", required_argument, 0, 'C'},
+		{"label", required_argument, 0, 'L'},
+		{"seed", required_argument, 0, 'S'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'p': opt.port = optarg; break;
+			case 'b': opt.baud = atoi(optarg); break;
+			case 'l': opt.layout_spec = optarg; break;
+			case 'n': opt.count = atoi(optarg); break;
+			case 'c': {
+				float ms[4];
+				if (sscanf(optarg, "%f,%f,%f,%f", &ms[0], &ms[1], &ms[2], &ms[3]) != 4) {
+					usage();
+					return 1;
+				}
+				for (int i = 0; i < 4; i++) opt.conf[i] = (uint16_t)(ms[i] * 100);
+				opt.has_conf = true;
+				break;
+			}
+			case 'o': opt.onset = true; break;
+			case 't': opt.timeout_ms = atof(optarg); break;
+			case 'C': opt.csv = optarg; break;
+			case 'L': opt.label = optarg; break;
+			case 'S': opt.seed = atoi(optarg); break;
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+	if (!opt.port || optind != argc || opt.count <= 0) {
+		usage();
+		return 1;
+	}
+
+	layout_desc_t desc;
+	layout_t layout;
+	if (!layout_parse(opt.layout_spec, &desc) || !layout_compile(desc, &layout)) {
+		fprintf(stderr, "Bad layout %s\n", opt.layout_spec);
+		return 1;
+	}
+	if (desc.format == FORMAT_DAISY) {
+		fprintf(stderr, "Daisy chain masters don't answer probes\n");
+		return 1;
+	}
+
+	tap_link_t link;
+	if (!link_open(&link, opt.port, opt.baud)) return 1;
+	if (!link.tty) {
+		fprintf(stderr, "%s isn't a serial port, there is nobody to answer\n", opt.port);
+		return 1;
+	}
+	fprintf(stderr, "Waiting for master on %s\n", opt.port);
+	fprintf(stderr, "Flow control %s\n", link_handshake(&link, 3000) ? "on" : "off");
+
+	probe_ctx_t ctx;
+	sync_reset(&ctx.sync, SYNC_WINDOW);
+	ctx.time_tag = 0;
+	ctx.probe_tag = 0;
+	ctx.baud = opt.baud;
+	link.on_line = on_line;
+	link.on_line_ctx = &ctx;
+
+	if (opt.has_conf) {
+		uint8_t conf[9];
+		link_encode_conf(conf, opt.conf[0], opt.conf[1], opt.conf[2], opt.conf[3]);
+		link_send_control(&link, conf, sizeof(conf), true);
+	}
+	if (opt.onset) {
+		uint8_t cmd[2] = {0x8A, 1};
+		link_send_control(&link, cmd, sizeof(cmd), false);
+	}
+	if (!opt.has_conf) {
+		// Space the probes over the period the master actually runs
+		if (link.master.valid) memcpy(opt.conf, link.master.conf, sizeof(opt.conf));
+		else fprintf(stderr, "The master didn't say its conf, assuming the firmware defaults\n");
+	}
+	int64_t period_ns = (int64_t)(opt.conf[0] + opt.conf[1] + opt.conf[2] + opt.conf[3]) * 10000;
+	int64_t timeout_ns = opt.timeout_ms > 0 ? (int64_t)(opt.timeout_ms * 1e6) : 2 * period_ns + 200000000;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	for (int r = 0; r < WARMUP_ROUNDS && !stopping; r++) {
+		for (int q = 0; q < QUERIES_PER_ROUND; q++) time_query(&link, &ctx);
+		end_round(&link, &ctx);
+	}
+	if (!ctx.sync.valid) {
+		fprintf(stderr, "The master doesn't answer time queries, is it running v6 or processing-bridge-v1 firmware?\n");
+		return 1;
+	}
+
+	std::vector<uint8_t> cells((size_t)layout.width * layout.height, 0), packed(layout.packed_len), frame(layout.frame_len);
+	// 0x88 <tag>, and the 0x83 <seq> the link puts in front of the state frame
+	int64_t prefix_ns = wire_ns(link.enabled ? 4 : 2, opt.baud);
+
+	hist_t hists[NUM_PROBE_STAGES];
+	for (int s = 0; s < NUM_PROBE_STAGES; s++) hist_reset(&hists[s]);
+	uint64_t lost = 0;
+	std::mt19937 rng(opt.seed);
+	std::uniform_int_distribution<int64_t> spacing(0, period_ns);
+
+	fprintf(stderr, "%d probes, %s at %d baud, pulse period %.1f ms\n", opt.count, layout_format_name(desc.format), opt.baud,
+		period_ns / 1e6);
+
+	for (int i = 0; i < opt.count && !stopping; i++) {
+		time_query(&link, &ctx);
+		if ((i + 1) % QUERIES_PER_ROUND == 0) end_round(&link, &ctx);
+
+		// Turn on one tapper at a time so every probe is a change
+		std::fill(cells.begin(), cells.end(), 0);
+		cells[i % cells.size()] = 1;
+		pack_encode(layout, cells.data(), packed.data(), frame.data(), pack_best_isa());
+
+		ctx.probe_tag = (ctx.probe_tag + 1) % 0x80;
+		ctx.probe_answered = false;
+		uint8_t cmd[2] = {0x88, (uint8_t)ctx.probe_tag};
+
+		while (link_busy(&link) && !stopping) link_poll(&link, 1);
+		int64_t sent = now_ns();
+		link_send_control(&link, cmd, sizeof(cmd), false);
+		link_send_state(&link, frame.data(), frame.size());
+
+		if (!wait_for(&link, &ctx.probe_answered, timeout_ns)) {
+			if (!stopping) lost++;
+			continue;
+		}
+
+		int64_t reply = ctx.probe_reply_ns;
+		int64_t frame_sent = sent + prefix_ns;
+		int64_t receipt = sync_host_at(&ctx.sync, sync_unwrap(&ctx.sync, reply, ctx.receipt_us));
+		int64_t spi = sync_host_at(&ctx.sync, sync_unwrap(&ctx.sync, reply, ctx.spi_us));
+
+		hist_add(&hists[PROBE_LINK], std::max(receipt - frame_sent, (int64_t)0));
+		hist_add(&hists[PROBE_PARSE], (int64_t)(uint32_t)(ctx.apply_us - ctx.receipt_us) * 1000);
+		hist_add(&hists[PROBE_PHASE], (int64_t)(uint32_t)(ctx.spi_us - ctx.apply_us) * 1000);
+		hist_add(&hists[PROBE_TOTAL], std::max(spi - frame_sent, (int64_t)0));
+		hist_add(&hists[PROBE_RTT], reply - sent);
+
+		if ((i + 1) % 100 == 0) {
+			fprintf(stderr, "%d probes, total p50 %.2f ms p99 %.2f ms, %llu lost\n", i + 1,
+				hist_percentile(&hists[PROBE_TOTAL], 50) / 1e6, hist_percentile(&hists[PROBE_TOTAL], 99) / 1e6,
+				(unsigned long long)lost);
+		}
+
+		sleep_ns(spacing(rng));
+	}
+
+	// Leave the array off
+	std::fill(cells.begin(), cells.end(), 0);
+	pack_encode(layout, cells.data(), packed.data(), frame.data(), pack_best_isa());
+	link_send_state(&link, frame.data(), frame.size());
+	if (opt.onset) {
+		uint8_t cmd[2] = {0x8A, 0};
+		link_send_control(&link, cmd, sizeof(cmd), false);
+	}
+	int64_t give_up = now_ns() + 1000000000;
+	while (link_busy(&link) && now_ns() < give_up) link_poll(&link, 1);
+
+	fprintf(stderr, "\n%s at %d baud: %llu probes answered, %llu lost, clock fit within %.0f us\n",
+		layout_format_name(desc.format), opt.baud, (unsigned long long)hists[PROBE_TOTAL].count, (unsigned long long)lost,
+		ctx.sync.fit_residual_us);
+	for (int s = 0; s < NUM_PROBE_STAGES; s++) hist_print(stderr, PROBE_STAGE_NAMES[s], &hists[s], 1000, "us");
+
+	if (opt.csv) append_csv(opt, desc, hists, lost);
+
+	link_close(&link);
+	return 0;
+}
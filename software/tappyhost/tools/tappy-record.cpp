@@ -0,0 +1,167 @@
+// Record a serial session between a host app and a master with exact byte timing
+//
+//   tappy-record [options] output.cap
+//
+// Creates a pseudo terminal and links it to --link (default /tmp/ttyTAPPY). Point the
+// host app (a processing sketch, tappy-video, ...) at that path instead of the real port
+// and everything it writes is passed on to --port and logged with a CLOCK_MONOTONIC
+// stamp, as is everything the master answers. Without --port only the host side is
+// recorded. Stop with ctrl-c, then look at the log with tappy-replay, which only prints
+// its summary when run without --port.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "capture.h"
+#include "clock.h"
+#include "serial_port.h"
+
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int) {
+	stopping = true;
+}
+
+// Master side of a raw pty, with the slave kept open by us too so the master doesn't see
+// a hangup every time the host app closes and reopens the port
+static int open_pty(const char* link_path, int* slave_fd) {
+	int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+		fprintf(stderr, "Can't create a pty: %s\n", strerror(errno));
+		return -1;
+	}
+
+	const char* name = ptsname(master);
+	*slave_fd = open(name, O_RDWR | O_NOCTTY);
+	if (*slave_fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	struct termios tio;
+	tcgetattr(*slave_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(*slave_fd, TCSANOW, &tio);
+
+	unlink(link_path);
+	if (symlink(name, link_path) != 0) {
+		fprintf(stderr, "Can't link %s to %s: %s\n", link_path, name, strerror(errno));
+		return -1;
+	}
+
+	return master;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-record [options] output.cap\n"
+		"\n"
+		"  --port PATH          master to pass the host's bytes on to (default: record only)\n"
+		"  --baud N             (default 115200)\n"
+		"  --link PATH          where the host app should connect (default /tmp/ttyTAPPY)\n");
+}
+
+int main(int argc, char** argv) {
+	const char* port = NULL;
+	const char* link_path = "/tmp/ttyTAPPY";
+	int baud = 115200;
+
+	static struct option long_options[] = {
+		{"port", required_argument, 0, 'p'},
+		{"baud", required_argument, 0, 'b'},
+		{"link", required_argument, 0, 'l'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'p': port = optarg; break;
+			case 'b': baud = atoi(optarg); break;
+			case 'l': link_path = optarg; break;
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 1;
+	}
+
+	int device = -1;
+	if (port) {
+		device = serial_open(port, baud);
+		if (device < 0) return 1;
+	}
+
+	int slave;
+	int pty = open_pty(link_path, &slave);
+	if (pty < 0) return 1;
+
+	capture_t cap;
+	if (!capture_create(&cap, argv[optind], baud)) {
+		fprintf(stderr, "Can't create %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	fprintf(stderr, "Recording %s <-> %s into %s, ctrl-c to stop\n", link_path, port ? port : "nothing", argv[optind]);
+
+	uint64_t bytes[2] = {0, 0};
+	uint64_t records = 0;
+	uint64_t dropped = 0;
+	uint8_t buf[4096];
+
+	while (!stopping) {
+		struct pollfd fds[2] = {{pty, POLLIN, 0}, {device, POLLIN, 0}};
+		if (poll(fds, device >= 0 && isatty(device) ? 2 : 1, 100) <= 0) continue;
+
+		if (fds[0].revents & POLLIN) {
+			ssize_t n = read(pty, buf, sizeof(buf));
+			if (n > 0) {
+				int64_t t = now_ns();
+				if (device >= 0) serial_write_all(device, buf, n);
+				capture_write(&cap, CAPTURE_TO_DEVICE, t, buf, n);
+				bytes[CAPTURE_TO_DEVICE] += n;
+				records++;
+			}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			ssize_t n = read(device, buf, sizeof(buf));
+			if (n > 0) {
+				int64_t t = now_ns();
+				// Nobody may have the pty open yet, don't wait for a reader
+				if (write(pty, buf, n) != n) dropped += n;
+				capture_write(&cap, CAPTURE_FROM_DEVICE, t, buf, n);
+				bytes[CAPTURE_FROM_DEVICE] += n;
+				records++;
+			}
+		}
+	}
+
+	capture_close(&cap);
+	unlink(link_path);
+	close(slave);
+	close(pty);
+
+	fprintf(stderr, "\n%llu records, %llu bytes to the master, %llu from it, %llu dropped while the host wasn't reading\n",
+		(unsigned long long)records, (unsigned long long)bytes[CAPTURE_TO_DEVICE],
+		(unsigned long long)bytes[CAPTURE_FROM_DEVICE], (unsigned long long)dropped);
+	return 0;
+}
@@ -0,0 +1,324 @@
+// Replay a tappy-record log and summarise its timing
+//
+//   tappy-replay [options] input.cap
+//
+// With --port the bytes the host sent are written out again on their original schedule,
+// --speed times faster, or with --fast as fast as the port takes them. Whatever the
+// master answers is read and thrown away (or printed with --echo). How far each write
+// landed from its schedule is reported at the end.
+//
+// Either way the log itself is summarised: frames/s, the gaps between state frames, and
+// bursts where the host offered more bytes than the link can carry so they piled up in
+// the serial driver. The link is modelled as draining baud/10 bytes per second.
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "capture.h"
+#include "clock.h"
+#include "serial_port.h"
+#include "stats.h"
+
+// How long before a write is due replay stops sleeping and starts spinning
+#define SPIN_NS 200000
+
+typedef enum _parse_state_t {
+	PARSE_NONE,
+	PARSE_CONF,
+	PARSE_STATE,
+	PARSE_ARG
+} parse_state_t;
+
+typedef struct {
+	int baud;
+	int64_t burst_ns; // queueing delay that counts as a burst
+
+	parse_state_t state;
+	int remaining;
+
+	uint64_t bytes_to, bytes_from;
+	uint64_t state_frames, conf_frames, commands;
+	int64_t last_frame_ns;
+	hist_t gaps;
+	std::vector<uint32_t> frames_per_second;
+
+	// Link model
+	double backlog; // bytes queued in front of the wire
+	int64_t backlog_ns;
+	hist_t queue_delay;
+	uint64_t bursts;
+	bool in_burst;
+	int64_t burst_start, longest_burst, burst_total;
+	uint64_t burst_bytes, peak_burst_bytes;
+} log_stats_t;
+
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int) {
+	stopping = true;
+}
+
+static void stats_init(log_stats_t* s, int baud, int64_t burst_ns) {
+	s->baud = baud;
+	s->burst_ns = burst_ns;
+	s->state = PARSE_NONE;
+	s->remaining = 0;
+	s->bytes_to = s->bytes_from = 0;
+	s->state_frames = s->conf_frames = s->commands = 0;
+	s->last_frame_ns = -1;
+	hist_reset(&s->gaps);
+	s->frames_per_second.clear();
+	s->backlog = 0;
+	s->backlog_ns = 0;
+	hist_reset(&s->queue_delay);
+	s->bursts = 0;
+	s->in_burst = false;
+	s->burst_start = s->longest_burst = s->burst_total = 0;
+	s->burst_bytes = s->peak_burst_bytes = 0;
+}
+
+static void frame_done(log_stats_t* s, int64_t t_ns) {
+	s->state_frames++;
+	if (s->last_frame_ns >= 0) hist_add(&s->gaps, t_ns - s->last_frame_ns);
+	s->last_frame_ns = t_ns;
+
+	size_t second = t_ns / 1000000000;
+	if (s->frames_per_second.size() <= second) s->frames_per_second.resize(second + 1, 0);
+	s->frames_per_second[second]++;
+}
+
+// Same framing as the v6 and bridge-v1 masters, 0x80 conf, 0x81 ... 0x82 state, and the
+// other v6 commands
+static void parse(log_stats_t* s, int64_t t_ns, const uint8_t* data, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		uint8_t b = data[i];
+
+		if (s->state == PARSE_CONF || s->state == PARSE_ARG) {
+			if (--s->remaining == 0) s->state = PARSE_NONE;
+			continue;
+		}
+
+		if (b & 0x80) {
+			if (b == 0x82 && s->state == PARSE_STATE) frame_done(s, t_ns);
+			s->state = PARSE_NONE;
+
+			switch (b) {
+				case 0x80: s->conf_frames++; s->state = PARSE_CONF; s->remaining = 8; break;
+				case 0x81: s->state = PARSE_STATE; break;
+				case 0x83:
+				case 0x86:
+				case 0x88:
+				case 0x8A:
+				case 0x8B: s->commands++; s->state = PARSE_ARG; s->remaining = 1; break;
+				case 0x87: s->commands++; s->state = PARSE_ARG; s->remaining = 12; break;
+				case 0x84:
+				case 0x85:
+				case 0x89: s->commands++; break;
+			}
+		}
+	}
+}
+
+static void drain(log_stats_t* s, int64_t t_ns) {
+	s->backlog = std::max(0.0, s->backlog - (t_ns - s->backlog_ns) * 1e-9 * s->baud / 10);
+	s->backlog_ns = t_ns;
+
+	if (s->in_burst && s->backlog * 10 / s->baud * 1e9 < s->burst_ns) {
+		// The burst ended when the queue got back under the threshold
+		int64_t end = t_ns - (int64_t)((s->burst_ns - s->backlog * 10 / s->baud * 1e9));
+		int64_t length = std::max(end - s->burst_start, (int64_t)0);
+		s->longest_burst = std::max(s->longest_burst, length);
+		s->burst_total += length;
+		s->peak_burst_bytes = std::max(s->peak_burst_bytes, s->burst_bytes);
+		s->in_burst = false;
+	}
+}
+
+static void stats_add(log_stats_t* s, const capture_record_t& rec) {
+	if (rec.dir == CAPTURE_FROM_DEVICE) {
+		s->bytes_from += rec.data.size();
+		return;
+	}
+
+	s->bytes_to += rec.data.size();
+	parse(s, rec.t_ns, rec.data.data(), rec.data.size());
+
+	drain(s, rec.t_ns);
+	s->backlog += rec.data.size();
+	// How long the last byte of this write waits for the wire
+	int64_t delay = (int64_t)(s->backlog * 10 / s->baud * 1e9);
+	hist_add(&s->queue_delay, delay);
+
+	if (delay >= s->burst_ns) {
+		if (!s->in_burst) {
+			s->in_burst = true;
+			s->burst_start = rec.t_ns;
+			s->burst_bytes = 0;
+			s->bursts++;
+		}
+		s->burst_bytes += rec.data.size();
+	}
+}
+
+static void stats_print(log_stats_t* s, int64_t duration_ns) {
+	// Close a burst still running at the end of the log
+	drain(s, duration_ns + (int64_t)(s->backlog * 10 / s->baud * 1e9));
+
+	double secs = std::max(duration_ns / 1e9, 1e-9);
+	double capacity = s->baud / 10.0;
+	// A log shorter than its bytes take to send (a single frame, say) is rated over the time
+	// the link needs for them, not its own few microseconds
+	double link_secs = std::max(secs, s->bytes_to / capacity);
+
+	printf("%.2f s at %d baud: %llu bytes to the master (%.0f%% of the link), %llu from it\n", secs, s->baud,
+		(unsigned long long)s->bytes_to, 100.0 * s->bytes_to / link_secs / capacity, (unsigned long long)s->bytes_from);
+	printf("%llu state frames, %llu conf frames, %llu other commands\n", (unsigned long long)s->state_frames,
+		(unsigned long long)s->conf_frames, (unsigned long long)s->commands);
+
+	// Leave out the last second if the log stops part way through it
+	size_t whole = std::min(s->frames_per_second.size(), std::max((size_t)1, (size_t)secs));
+	if (whole > 0) {
+		uint32_t lo = *std::min_element(s->frames_per_second.begin(), s->frames_per_second.begin() + whole);
+		uint32_t hi = *std::max_element(s->frames_per_second.begin(), s->frames_per_second.begin() + whole);
+		// Over at least the one second bucket, like the slowest and fastest
+		printf("frames/s: mean %.1f, slowest second %u, fastest second %u\n", s->state_frames / std::max(secs, 1.0), lo, hi);
+	}
+
+	hist_print(stdout, "frame gap", &s->gaps, 1e6, "ms");
+	if (s->gaps.count) {
+		// Gaps well above the usual one are what a stutter looks like
+		int64_t p50 = hist_percentile(&s->gaps, 50);
+		printf("%14s %llu gaps over 2x the median, longest %.1f ms\n", "", (unsigned long long)hist_count_above(&s->gaps, 2 * p50),
+			s->gaps.max / 1e6);
+	}
+
+	hist_print(stdout, "queue delay", &s->queue_delay, 1e6, "ms");
+	printf("%llu bursts over the link capacity (queue delay >= %.1f ms), %.0f ms in total, longest %.1f ms, "
+		"most bytes in one burst %llu\n", (unsigned long long)s->bursts, s->burst_ns / 1e6, s->burst_total / 1e6,
+		s->longest_burst / 1e6, (unsigned long long)s->peak_burst_bytes);
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-replay [options] input.cap\n"
+		"\n"
+		"  --port PATH          replay the host's bytes to this port (default: only print stats)\n"
+		"  --baud N             port and link model baud rate (default: the recorded one)\n"
+		"  --speed X            replay X times faster (default 1)\n"
+		"  --fast               replay as fast as possible\n"
+		"  --echo               print what the master answers\n"
+		"  --burst-ms N         queueing delay that counts as a burst (default 5)\n");
+}
+
+int main(int argc, char** argv) {
+	const char* port = NULL;
+	int baud = 0;
+	double speed = 1;
+	bool fast = false;
+	bool echo = false;
+	double burst_ms = 5;
+
+	static struct option long_options[] = {
+		{"port", required_argument, 0, 'p'},
+		{"baud", required_argument, 0, 'b'},
+		{"speed", required_argument, 0, 's'},
+		{"fast", no_argument, 0, 'f'},
+		{"echo", no_argument, 0, 'e'},
+		{"burst-ms", required_argument, 0, 'B'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'p': port = optarg; break;
+			case 'b': baud = atoi(optarg); break;
+			case 's': speed = atof(optarg); break;
+			case 'f': fast = true; break;
+			case 'e': echo = true; break;
+			case 'B': burst_ms = atof(optarg); break;
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+	if (optind != argc - 1 || speed <= 0) {
+		usage();
+		return 1;
+	}
+
+	capture_t cap;
+	if (!capture_open(&cap, argv[optind])) {
+		fprintf(stderr, "Can't read %s\n", argv[optind]);
+		return 1;
+	}
+	if (baud == 0) baud = cap.baud;
+
+	int fd = -1;
+	if (port) {
+		fd = serial_open(port, baud);
+		if (fd < 0) return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	log_stats_t stats;
+	stats_init(&stats, baud, (int64_t)(burst_ms * 1e6));
+
+	hist_t lateness;
+	hist_reset(&lateness);
+
+	capture_record_t rec;
+	int64_t start = now_ns() + 10000000;
+	int64_t duration = 0;
+	uint8_t buf[4096];
+
+	while (!stopping && capture_read(&cap, &rec)) {
+		stats_add(&stats, rec);
+		duration = rec.t_ns;
+
+		if (fd < 0 || rec.dir != CAPTURE_TO_DEVICE) continue;
+
+		int64_t due = start + (int64_t)(rec.t_ns / speed);
+		if (!fast) {
+			// Sleep until shortly before the write is due and spin the rest of the way,
+			// wakeups alone are tens of us late
+			int64_t wake = due - SPIN_NS;
+			struct timespec ts = {(time_t)(wake / 1000000000), (long)(wake % 1000000000)};
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 && !stopping) {}
+			while (now_ns() < due) {}
+		}
+
+		if (!fast) hist_add(&lateness, now_ns() - due);
+		serial_write_all(fd, rec.data.data(), rec.data.size());
+
+		// Keep the master's answers from piling up
+		ssize_t n;
+		while ((n = read(fd, buf, sizeof(buf))) > 0) {
+			if (echo) fwrite(buf, 1, n, stdout);
+		}
+	}
+
+	if (fd >= 0) {
+		double secs = (now_ns() - start) / 1e9;
+		fprintf(stderr, "Replayed %.2f s of log in %.2f s\n", duration / 1e9, secs);
+		if (!fast) hist_print(stderr, "lateness", &lateness, 1000, "us");
+		close(fd);
+	}
+
+	stats_print(&stats, duration);
+	capture_close(&cap);
+	return 0;
+}
@@ -0,0 +1,468 @@
+// Play a tapper pattern against absolute deadlines
+//
+//   tappy-seq [options] pattern.txt
+//
+// The native counterpart of animate() in testerflexv6.pde. Frame i is due at
+// start + the durations of frames 0..i-1, so time spent packing and writing never stretches
+// the pattern the way delay() after every frame does. All frames are encoded once up
+// front and the loop only hands finished wire frames to the link. It sleeps with
+// clock_nanosleep(TIMER_ABSTIME) until shortly before a deadline and spins the rest of
+// the way, optionally as SCHED_FIFO (--rt).
+//
+// A frame that can't make its deadline is handled by --late:
+//
+//   drop     skip to the newest frame that is due, the schedule stays put (default)
+//   catchup  send every frame, back to back until the schedule is caught up
+//   slip     send it late and shift the rest of the schedule by as much, like delay()
+//
+// How far each send landed from its deadline, and how far the end of every loop drifted
+// from where the pattern says it should be, is reported per loop and at the end.
+//
+// Pattern files are plain text:
+//
+//   # comment
+//   conf 20 20 20 20     optional TapConf up, inter, down and pause in ms
+//   frame 100            starts a frame shown for 100 ms (--rate overrides it)
+//   .X..X.               one row per line from the top, X # or 1 is on, . 0 or space off
+//   X....X
+//
+// Every line after a frame line is a row, blank ones too, up to the next frame, conf or
+// comment line. Empty lines between frames are ignored. Rows and columns the pattern
+// leaves out are off.
+
+#include <errno.h>
+#include <getopt.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "clock.h"
+#include "layout.h"
+#include "pack.h"
+#include "serial_port.h"
+#include "stats.h"
+#include "tap_link.h"
+
+// How long before a deadline the sequencer stops sleeping and starts spinning, wakeups
+// alone are tens of us late
+#define SPIN_NS 200000
+// Sends later than this count as late
+#define LATE_NS 1000000
+
+typedef enum _late_policy_t {
+	LATE_DROP,
+	LATE_CATCHUP,
+	LATE_SLIP
+} late_policy_t;
+
+typedef struct {
+	int64_t duration_ns;
+	std::vector<std::string> rows;
+} pattern_frame_t;
+
+typedef struct {
+	bool has_conf;
+	float conf_ms[4];
+	std::vector<pattern_frame_t> frames;
+} pattern_t;
+
+typedef struct {
+	const char* port;
+	const char* layout_spec;
+	int baud;
+	double rate_ms; // 0 to use the pattern's durations
+	int loops; // 0 loops forever
+	late_policy_t late;
+	bool rt;
+	int rt_priority;
+	pack_isa_t isa;
+} options_t;
+
+typedef struct {
+	uint64_t sent, late, dropped, caught_up;
+	int64_t slipped_ns;
+	hist_t jitter; // send time minus deadline
+	hist_t drift; // end of each loop minus where it should have been
+} seq_stats_t;
+
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int) {
+	stopping = true;
+}
+
+static bool load_pattern(const char* path, pattern_t* pattern) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Can't open %s\n", path);
+		return false;
+	}
+
+	pattern->has_conf = false;
+	pattern->frames.clear();
+
+	char line[4096];
+	int line_num = 0;
+	bool ok = true;
+	bool in_rows = false;
+	while (ok && fgets(line, sizeof(line), f)) {
+		line_num++;
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == '#') {
+			in_rows = false;
+			continue;
+		}
+
+		float ms[4];
+		if (strncmp(line, "conf", 4) == 0) {
+			if (sscanf(line + 4, "%f %f %f %f", &ms[0], &ms[1], &ms[2], &ms[3]) != 4) {
+				fprintf(stderr, "%s:%d: conf needs up, inter, down and pause in ms\n", path, line_num);
+				ok = false;
+			}
+			pattern->has_conf = true;
+			memcpy(pattern->conf_ms, ms, sizeof(ms));
+			in_rows = false;
+		} else if (strncmp(line, "frame", 5) == 0) {
+			pattern_frame_t frame;
+			frame.duration_ns = 0;
+			if (sscanf(line + 5, "%f", &ms[0]) == 1) frame.duration_ns = (int64_t)(ms[0] * 1e6);
+			pattern->frames.push_back(frame);
+			in_rows = true;
+		} else if (in_rows) {
+			pattern->frames.back().rows.push_back(line);
+		} else if (line[strspn(line, " ")] != 0) {
+			fprintf(stderr, "%s:%d: row outside a frame, rows go right after a frame line\n", path, line_num);
+			ok = false;
+		}
+	}
+	fclose(f);
+
+	// Blank lines at the end of a frame are off rows anyway, don't let them count against
+	// the height of the layout
+	for (pattern_frame_t& frame : pattern->frames) {
+		while (!frame.rows.empty() && frame.rows.back()[strspn(frame.rows.back().c_str(), " ")] == 0) frame.rows.pop_back();
+	}
+
+	if (ok && pattern->frames.empty()) {
+		fprintf(stderr, "%s: no frames\n", path);
+		ok = false;
+	}
+	return ok;
+}
+
+// Encode every frame of the pattern into frame_len bytes each
+static bool encode_pattern(const pattern_t& pattern, const layout_t& layout, pack_isa_t isa, std::vector<uint8_t>* wire) {
+	std::vector<uint8_t> cells((size_t)layout.width * layout.height);
+	std::vector<uint8_t> packed(layout.packed_len);
+	wire->resize(pattern.frames.size() * layout.frame_len);
+
+	for (size_t i = 0; i < pattern.frames.size(); i++) {
+		const pattern_frame_t& frame = pattern.frames[i];
+		if ((int)frame.rows.size() > layout.height) {
+			fprintf(stderr, "Frame %zu has %zu rows, the layout has %d\n", i, frame.rows.size(), layout.height);
+			return false;
+		}
+
+		std::fill(cells.begin(), cells.end(), 0);
+		for (size_t y = 0; y < frame.rows.size(); y++) {
+			const std::string& row = frame.rows[y];
+			if ((int)row.size() > layout.width) {
+				fprintf(stderr, "Frame %zu row %zu has %zu columns, the layout has %d\n", i, y, row.size(), layout.width);
+				return false;
+			}
+			for (size_t x = 0; x < row.size(); x++) {
+				char c = row[x];
+				cells[y * layout.width + x] = c == 'X' || c == 'x' || c == '#' || c == '1';
+			}
+		}
+
+		pack_encode(layout, cells.data(), packed.data(), wire->data() + i * layout.frame_len, isa);
+	}
+	return true;
+}
+
+static void stats_reset(seq_stats_t* s) {
+	s->sent = s->late = s->dropped = s->caught_up = 0;
+	s->slipped_ns = 0;
+	hist_reset(&s->jitter);
+	hist_reset(&s->drift);
+}
+
+static void go_realtime(int priority) {
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+		fprintf(stderr, "Can't switch to SCHED_FIFO (%s), running with normal priority\n", strerror(errno));
+		return;
+	}
+	// Keep page faults out of the loop
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		fprintf(stderr, "Can't lock memory (%s)\n", strerror(errno));
+	}
+}
+
+// Wait until due, looking after the link meanwhile
+static void wait_until(tap_link_t* link, int64_t due) {
+	int64_t wake = due - SPIN_NS;
+	while (!stopping) {
+		int64_t left = wake - now_ns();
+		if (left <= 0) break;
+		if (link && left > 2000000) {
+			// Leave a ms of slack, poll() only has ms resolution
+			link_poll(link, (int)(left / 1000000) - 1);
+		} else {
+			struct timespec ts = {(time_t)(wake / 1000000000), (long)(wake % 1000000000)};
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+	}
+	while (!stopping && now_ns() < due) {}
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-seq [options] pattern.txt\n"
+		"\n"
+		"  --layout SPEC        wire format and boards, e.g. v6:2x2, bridge-v1:3x3 (default v6:2x2)\n"
+		"  --port PATH          serial port, file or '-' for stdout (default: dry run)\n"
+		"  --baud N             (default 115200)\n"
+		"  --rate MS            show every frame for MS ms, like patternPlaybackSpeed\n"
+		"  --loop N             play the pattern N times, 0 until ctrl-c (default 1)\n"
+		"  --late POLICY        drop, catchup or slip (default drop)\n"
+		"  --rt [PRIO]          run as SCHED_FIFO (default priority 50)\n"
+		"  --isa ISA            scalar, sse2 or avx2 (default: best supported)\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.port = NULL;
+	opt.layout_spec = "v6:2x2";
+	opt.baud = 115200;
+	opt.rate_ms = 0;
+	opt.loops = 1;
+	opt.late = LATE_DROP;
+	opt.rt = false;
+	opt.rt_priority = 50;
+	opt.isa = pack_best_isa();
+
+	static struct option long_options[] = {
+		{"layout", required_argument, 0, 'l'},
+		{"port", required_argument, 0, 'p'},
+		{"baud", required_argument, 0, 'b'},
+		{"rate", required_argument, 0, 'r'},
+		{"loop", required_argument, 0, 'L'},
+		{"late", required_argument, 0, 'a'},
+		{"rt", optional_argument, 0, 'R'},
+		{"isa", required_argument, 0, 'I'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'l': opt.layout_spec = optarg; break;
+			case 'p': opt.port = optarg; break;
+			case 'b': opt.baud = atoi(optarg); break;
+			case 'r': opt.rate_ms = atof(optarg); break;
+			case 'L': opt.loops = atoi(optarg); break;
+			case 'a': {
+				if (strcmp(optarg, "drop") == 0) opt.late = LATE_DROP;
+				else if (strcmp(optarg, "catchup") == 0) opt.late = LATE_CATCHUP;
+				else if (strcmp(optarg, "slip") == 0) opt.late = LATE_SLIP;
+				else {
+					usage();
+					return 1;
+				}
+				break;
+			}
+			case 'R': {
+				opt.rt = true;
+				if (optarg) opt.rt_priority = atoi(optarg);
+				break;
+			}
+			case 'I': {
+				if (!pack_parse_isa(optarg, &opt.isa) || !pack_isa_supported(opt.isa)) {
+					fprintf(stderr, "Unsupported isa %s\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+	if (optind != argc - 1 || opt.loops < 0) {
+		usage();
+		return 1;
+	}
+
+	layout_desc_t desc;
+	layout_t layout;
+	if (!layout_parse(opt.layout_spec, &desc) || !layout_compile(desc, &layout)) {
+		fprintf(stderr, "Bad layout %s\n", opt.layout_spec);
+		return 1;
+	}
+
+	pattern_t pattern;
+	if (!load_pattern(argv[optind], &pattern)) return 1;
+
+	size_t num_frames = pattern.frames.size();
+	std::vector<int64_t> durations(num_frames);
+	int64_t loop_ns = 0;
+	for (size_t i = 0; i < num_frames; i++) {
+		durations[i] = opt.rate_ms > 0 ? (int64_t)(opt.rate_ms * 1e6) : pattern.frames[i].duration_ns;
+		if (durations[i] <= 0) {
+			fprintf(stderr, "Frame %zu has no duration, give it one or use --rate\n", i);
+			return 1;
+		}
+		loop_ns += durations[i];
+	}
+
+	std::vector<uint8_t> wire;
+	if (!encode_pattern(pattern, layout, opt.isa, &wire)) return 1;
+
+	// What animate() leaves behind when it stops
+	std::vector<uint8_t> cells((size_t)layout.width * layout.height, 0), packed(layout.packed_len), all_off(layout.frame_len);
+	pack_encode(layout, cells.data(), packed.data(), all_off.data(), opt.isa);
+
+	int64_t shortest = *std::min_element(durations.begin(), durations.end());
+	double wire_ms = serial_wire_time(layout.frame_len, opt.baud) * 1e3;
+	fprintf(stderr, "%zu frames, %.1f ms per loop, %dx%d tappers (%s, %zu bytes/frame, %.2f ms on the wire)\n",
+		num_frames, loop_ns / 1e6, layout.width, layout.height, layout_format_name(desc.format), layout.frame_len, wire_ms);
+	if (wire_ms > shortest / 1e6) {
+		fprintf(stderr, "The link can't carry a frame in the shortest frame time (%.1f ms), expect late frames\n", shortest / 1e6);
+	}
+
+	tap_link_t link;
+	bool have_link = opt.port != NULL;
+	if (have_link) {
+		if (!link_open(&link, opt.port, opt.baud)) return 1;
+		if (link.tty && layout_has_commands(desc.format)) {
+			fprintf(stderr, "Waiting for master on %s\n", opt.port);
+			fprintf(stderr, "Flow control %s\n", link_handshake(&link, 3000) ? "on" : "off");
+		}
+
+		if (pattern.has_conf && layout_has_commands(desc.format)) {
+			uint8_t conf[9];
+			const float* ms = pattern.conf_ms;
+			link_encode_conf(conf, (uint16_t)(ms[0] * 100), (uint16_t)(ms[1] * 100), (uint16_t)(ms[2] * 100), (uint16_t)(ms[3] * 100));
+			link_send_control(&link, conf, sizeof(conf), true);
+			while (link_busy(&link) && !stopping) link_poll(&link, 1);
+		}
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (opt.rt) go_realtime(opt.rt_priority);
+
+	seq_stats_t total, loop;
+	stats_reset(&total);
+	tap_link_t* plink = have_link ? &link : NULL;
+
+	// Deadlines are kept relative to start so rounding never accumulates
+	int64_t start = now_ns() + 10000000;
+	int64_t offset = 0; // schedule time of the frame about to go out
+	int64_t slip = 0; // what --late slip has shifted the schedule by
+	int loop_num = 0;
+
+	while (!stopping && (opt.loops == 0 || loop_num < opt.loops)) {
+		stats_reset(&loop);
+		int64_t loop_start = offset;
+
+		size_t i = 0;
+		while (i < num_frames && !stopping) {
+			int64_t due = start + slip + offset;
+			wait_until(plink, due);
+			if (stopping) break;
+
+			int64_t now = now_ns();
+			int64_t late = now - due;
+
+			if (late > LATE_NS) {
+				loop.late++;
+				if (opt.late == LATE_DROP) {
+					// Skip to the newest frame whose time has come, the last one of the loop
+					// always gets shown so every loop ends where the pattern does
+					while (i + 1 < num_frames && start + slip + offset + durations[i] <= now) {
+						offset += durations[i];
+						i++;
+						loop.dropped++;
+					}
+					due = start + slip + offset;
+				} else if (opt.late == LATE_CATCHUP) {
+					loop.caught_up++;
+				} else {
+					slip += late;
+					loop.slipped_ns += late;
+					due = now;
+				}
+			}
+
+			hist_add(&loop.jitter, std::max(now_ns() - due, (int64_t)0));
+			if (plink) {
+				link_send_state(plink, wire.data() + i * layout.frame_len, layout.frame_len);
+				link_poll(plink, 0);
+			}
+			loop.sent++;
+
+			offset += durations[i];
+			i++;
+		}
+		if (stopping) break;
+
+		// The loop is over once its last frame has had its time
+		int64_t end = start + loop_start + loop_ns;
+		wait_until(plink, end);
+		int64_t drift = now_ns() - end;
+		hist_add(&loop.drift, drift);
+
+		fprintf(stderr, "loop %d: %llu sent, %llu late, %llu dropped, %llu caught up, jitter p50 %.1f us p99 %.1f us max %.1f us, drift %+.1f us",
+			loop_num + 1, (unsigned long long)loop.sent, (unsigned long long)loop.late, (unsigned long long)loop.dropped,
+			(unsigned long long)loop.caught_up, hist_percentile(&loop.jitter, 50) / 1e3, hist_percentile(&loop.jitter, 99) / 1e3,
+			loop.jitter.max / 1e3, drift / 1e3);
+		if (opt.late == LATE_SLIP) fprintf(stderr, ", slipped %.1f ms", loop.slipped_ns / 1e6);
+		fprintf(stderr, "\n");
+
+		total.sent += loop.sent;
+		total.late += loop.late;
+		total.dropped += loop.dropped;
+		total.caught_up += loop.caught_up;
+		total.slipped_ns += loop.slipped_ns;
+		hist_merge(&total.jitter, &loop.jitter);
+		hist_merge(&total.drift, &loop.drift);
+		loop_num++;
+	}
+
+	int64_t elapsed = now_ns() - start;
+
+	if (have_link) {
+		link_send_state(&link, all_off.data(), all_off.size());
+		int64_t give_up = now_ns() + 1000000000;
+		while (link_busy(&link) && now_ns() < give_up) link_poll(&link, 1);
+	}
+
+	fprintf(stderr, "\n%d loops, %llu frames sent in %.3f s (pattern time %.3f s), %llu late, %llu dropped, %llu caught up",
+		loop_num, (unsigned long long)total.sent, elapsed / 1e9, (offset + slip) / 1e9, (unsigned long long)total.late,
+		(unsigned long long)total.dropped, (unsigned long long)total.caught_up);
+	if (opt.late == LATE_SLIP) fprintf(stderr, ", schedule slipped %.1f ms", total.slipped_ns / 1e6);
+	fprintf(stderr, "\n");
+	hist_print(stderr, "jitter", &total.jitter, 1000, "us");
+	hist_print(stderr, "loop drift", &total.drift, 1000, "us");
+	if (have_link && link.enabled) hist_print(stderr, "link ack", &link.ack_latency, 1e6, "ms");
+
+	if (have_link) link_close(&link);
+	return 0;
+}
@@ -0,0 +1,219 @@
+// Drive a tappy tap array from frames another local process puts in shared memory
+//
+//   tappy-shm [options]
+//
+// Creates a frame ring (src/shm_ring.h) named --ring for --layout and streams whatever a
+// producer publishes in it to the master. A producer opens the ring, compiles the layout
+// named in its header and packs each frame straight into the ring:
+//
+//   shm_ring_t ring;
+//   shm_ring_open(&ring, SHM_RING_DEFAULT_NAME);
+//   layout_parse(ring.header->layout, &desc);
+//   layout_compile(desc, &layout);
+//   ...
+//   pack_cells(layout, cells, shm_ring_claim(&ring), pack_best_isa());
+//   shm_ring_publish(&ring, now_ns());
+//
+// The driver sleeps on the ring's futex while there is nothing to send, always takes the
+// newest frame and encodes it out of the ring into its wire frame. Frames published
+// faster than the link can take them are skipped, not queued.
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <vector>
+
+#include "clock.h"
+#include "layout.h"
+#include "pack.h"
+#include "shm_ring.h"
+#include "stats.h"
+#include "tap_link.h"
+
+typedef struct {
+	const char* ring_name;
+	int slots;
+	const char* layout_spec;
+	const char* port;
+	int baud;
+	uint16_t conf[4];
+	pack_isa_t isa;
+} options_t;
+
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int) {
+	stopping = true;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-shm [options]\n"
+		"\n"
+		"  --ring NAME          shared memory to create (default " SHM_RING_DEFAULT_NAME ")\n"
+		"  --slots N            frames in the ring, a power of two (default 8)\n"
+		"  --layout SPEC        array layout (default v6:2x2), see README\n"
+		"  --port PATH          serial port, file or '-' for stdout (default: dry run)\n"
+		"  --baud N             (default 115200)\n"
+		"  --conf U,I,D,P       pulse timing in ms (default 20,20,20,20)\n"
+		"  --isa ISA            scalar, sse2 or avx2 (default: best supported)\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.ring_name = SHM_RING_DEFAULT_NAME;
+	opt.slots = SHM_RING_DEFAULT_SLOTS;
+	opt.layout_spec = "v6:2x2";
+	opt.port = NULL;
+	opt.baud = 115200;
+	for (int i = 0; i < 4; i++) opt.conf[i] = 2000;
+	opt.isa = pack_best_isa();
+
+	static struct option long_options[] = {
+		{"ring", required_argument, 0, 'r'},
+		{"slots", required_argument, 0, 'n'},
+		{"layout", required_argument, 0, 'l'},
+		{"port", required_argument, 0, 'p'},
+		{"baud", required_argument, 0, 'b'},
+		{"conf", required_argument, 0, 'c'},
+		{"isa", required_argument, 0, 'I'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'r': opt.ring_name = optarg; break;
+			case 'n': opt.slots = atoi(optarg); break;
+			case 'l': opt.layout_spec = optarg; break;
+			case 'p': opt.port = optarg; break;
+			case 'b': opt.baud = atoi(optarg); break;
+			case 'c': {
+				float ms[4];
+				if (sscanf(optarg, "%f,%f,%f,%f", &ms[0], &ms[1], &ms[2], &ms[3]) != 4) {
+					usage();
+					return 1;
+				}
+				for (int i = 0; i < 4; i++) opt.conf[i] = (uint16_t)(ms[i] * 100);
+				break;
+			}
+			case 'I': {
+				if (!pack_parse_isa(optarg, &opt.isa) || !pack_isa_supported(opt.isa)) {
+					fprintf(stderr, "Unsupported isa %s\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+
+	layout_desc_t desc;
+	layout_t layout;
+	if (!layout_parse(opt.layout_spec, &desc) || !layout_compile(desc, &layout)) {
+		fprintf(stderr, "Bad layout %s\n", opt.layout_spec);
+		return 1;
+	}
+
+	tap_link_t link;
+	bool have_link = opt.port != NULL;
+	if (have_link) {
+		if (!link_open(&link, opt.port, opt.baud)) return 1;
+		if (link.tty && layout_has_commands(desc.format)) {
+			fprintf(stderr, "Waiting for master on %s\n", opt.port);
+			fprintf(stderr, "Flow control %s\n", link_handshake(&link, 3000) ? "on" : "off");
+		}
+
+		if (layout_has_commands(desc.format)) {
+			uint8_t conf[LINK_CONF_LEN];
+			link_encode_conf(conf, opt.conf[0], opt.conf[1], opt.conf[2], opt.conf[3]);
+			link_send_control(&link, conf, sizeof(conf), true);
+		}
+	}
+
+	shm_ring_t ring;
+	if (!shm_ring_create(&ring, opt.ring_name, opt.layout_spec, layout.packed_len, opt.slots)) return 1;
+	fprintf(stderr, "Ring %s: %d slots of %zu bytes for %s %dx%d tappers\n", ring.name, opt.slots, layout.packed_len,
+		layout_format_name(desc.format), layout.width, layout.height);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	std::vector<uint8_t> wire(layout.frame_len);
+	// Publish until picked up here, and until the wire frame is ready
+	hist_t handoff, encode;
+	hist_reset(&handoff);
+	hist_reset(&encode);
+	uint64_t taken = 0, skipped = 0, torn = 0, last_published = 0, last_taken = 0;
+	int64_t start = now_ns(), last_report = start;
+	int64_t last_seq = -1;
+
+	while (!stopping) {
+		shm_frame_t frame;
+		if (shm_ring_peek(&ring, &frame, true)) {
+			int64_t t0 = now_ns();
+			pack_frame(layout, frame.packed, wire.data(), opt.isa);
+			bool intact = shm_ring_consume(&ring, &frame);
+			int64_t t1 = now_ns();
+
+			skipped += frame.seq - (uint64_t)(last_seq + 1);
+			last_seq = frame.seq;
+			if (intact) {
+				taken++;
+				hist_add(&handoff, t0 - frame.t_ns);
+				hist_add(&encode, t1 - t0);
+				// Replaces a state frame still waiting for the link
+				if (have_link) link_send_state(&link, wire.data(), wire.size());
+			} else {
+				torn++;
+			}
+		}
+
+		if (have_link && link_busy(&link)) {
+			link_poll(&link, 1);
+		} else {
+			shm_ring_wait(&ring, 10);
+			if (have_link) link_poll(&link, 0);
+		}
+
+		int64_t now = now_ns();
+		if (now - last_report >= 1000000000) {
+			double secs = (now - last_report) / 1e9;
+			uint64_t published = ring.header->head.load(std::memory_order_relaxed);
+			fprintf(stderr, "in %.1f fps, taken %.1f fps, %llu skipped, %llu torn, handoff p50 %.1f us p99 %.1f us",
+				(published - last_published) / secs, (taken - last_taken) / secs, (unsigned long long)skipped,
+				(unsigned long long)torn, hist_percentile(&handoff, 50) / 1e3, hist_percentile(&handoff, 99) / 1e3);
+			if (have_link && link.enabled) {
+				fprintf(stderr, ", link %llu acked %llu retries", (unsigned long long)link.frames_acked, (unsigned long long)link.retries);
+			}
+			fprintf(stderr, "\n");
+			last_published = published;
+			last_taken = taken;
+			last_report = now;
+		}
+	}
+
+	if (have_link) {
+		int64_t deadline = now_ns() + 1000000000;
+		while (link_busy(&link) && now_ns() < deadline) link_poll(&link, 10);
+	}
+
+	double secs = (now_ns() - start) / 1e9;
+	fprintf(stderr, "\n%llu frames published, %llu taken in %.1f s, %llu skipped for newer ones, %llu overwritten while encoding\n",
+		(unsigned long long)ring.header->head.load(), (unsigned long long)taken, secs, (unsigned long long)skipped, (unsigned long long)torn);
+	hist_print(stderr, "handoff", &handoff, 1000, "us");
+	hist_print(stderr, "encode", &encode, 1000, "us");
+	if (have_link && link.enabled) hist_print(stderr, "link ack", &link.ack_latency, 1e6, "ms");
+
+	shm_ring_close(&ring);
+	if (have_link) link_close(&link);
+	return 0;
+}
@@ -0,0 +1,452 @@
+// Keep several v6 masters pulsing in phase
+//
+//   tappy-sync [options] --port PATH [--port PATH ...]
+//   tappy-sync [options] --simulate N
+//
+// Every --interval-ms it asks each master for its clock a few times (0x86), fits offset
+// and rate against the host clock and steers the master onto the host clock (0x87), so
+// all of them run their pulse periods off the same time base. Each round prints how far
+// every master's synced clock is from the host's and the spread between them, which is
+// how far apart their pulse edges are. The masters keep their correction when it exits,
+// so running it for a minute before a show keeps them close for a good while after.
+//
+// --simulate runs the same estimator against N simulated masters with random boot
+// offsets, crystal errors that wander over time and a jittery USB serial link, and
+// checks that their pulse edges stay within --tolerance-us of each other.
+
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <vector>
+
+#include "clock.h"
+#include "clock_sync.h"
+#include "serial_port.h"
+#include "stats.h"
+#include "tap_link.h"
+
+// How long to wait for the answers to one query
+#define QUERY_TIMEOUT_NS 50000000LL
+// Gap between the queries of a round
+#define QUERY_GAP_NS 5000000LL
+
+typedef struct {
+	int baud;
+	int interval_ms;
+	int queries;
+	int window;
+	double duration;
+
+	// Simulation
+	int simulate;
+	double drift_ppm;
+	double wander_ppm;
+	double jitter_us;
+	double busy_us;
+	double tolerance_us;
+	unsigned seed;
+} options_t;
+
+typedef struct {
+	const char* path;
+	tap_link_t link;
+	clock_sync_t sync;
+	bool disciplined;
+
+	// Query in flight
+	int tag;
+	int64_t sent_ns;
+	bool answered;
+
+	// Synced clock minus host clock of the round's best answer, us
+	int64_t best_rtt_ns;
+	double best_error_us;
+	hist_t error;
+} master_t;
+
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int) {
+	stopping = true;
+}
+
+// The query is two bytes and "time <tag> <micros> <synced>" about 30, so the answer spends
+// far longer on the wire than the query. Count the wire time out of the round trip so the
+// master's stamp ends up in the middle of what's left.
+static int64_t query_wire_ns(int baud) {
+	return (int64_t)(serial_wire_time(2, baud) * 1e9);
+}
+
+static int64_t answer_wire_ns(size_t line_len, int baud) {
+	return (int64_t)(serial_wire_time(line_len + 2, baud) * 1e9);
+}
+
+static void on_line(void* ctx, const char* line, int64_t t) {
+	master_t* m = (master_t*)ctx;
+
+	int tag;
+	unsigned long local, synced;
+	if (sscanf(line, "time %d %lu %lu", &tag, &local, &synced) != 3 || tag != m->tag || m->answered) return;
+	m->answered = true;
+
+	int64_t sent = m->sent_ns + query_wire_ns(m->link.baud);
+	int64_t received = t - answer_wire_ns(strlen(line), m->link.baud);
+	sync_add_sample(&m->sync, sent, received, (uint32_t)local);
+
+	int64_t rtt = received - sent;
+	if (rtt < m->best_rtt_ns) {
+		m->best_rtt_ns = rtt;
+		m->best_error_us = (int32_t)((uint32_t)synced - sync_host_us(sent + rtt / 2));
+	}
+}
+
+static void print_round(int round, const std::vector<double>& errors, const std::vector<double>& ppm,
+		const std::vector<double>& rtt_us, double spread) {
+	printf("round %4d:", round);
+	for (size_t i = 0; i < errors.size(); i++) {
+		printf("  [%zu] %+8.0f us %+7.1f ppm rtt %5.0f us", i, errors[i], ppm[i], rtt_us[i]);
+	}
+	if (errors.size() > 1) printf("  spread %.0f us", spread);
+	printf("\n");
+}
+
+static int run_ports(const options_t& opt, std::vector<const char*>& ports) {
+	std::vector<master_t> masters(ports.size());
+
+	for (size_t i = 0; i < ports.size(); i++) {
+		master_t* m = &masters[i];
+		m->path = ports[i];
+		if (!link_open(&m->link, m->path, opt.baud)) return 1;
+		if (!link_handshake(&m->link, 3000)) {
+			fprintf(stderr, "%s doesn't speak the v6 protocol\n", m->path);
+			return 1;
+		}
+		m->link.on_line = on_line;
+		m->link.on_line_ctx = m;
+		sync_reset(&m->sync, opt.window);
+		m->disciplined = false;
+		m->tag = 0;
+		hist_reset(&m->error);
+	}
+
+	hist_t spread_hist;
+	hist_reset(&spread_hist);
+
+	int64_t start = now_ns();
+	int64_t next_round = start;
+	int round = 0;
+	uint8_t tag = 0;
+
+	while (!stopping && (opt.duration <= 0 || now_ns() - start < opt.duration * 1e9)) {
+		for (master_t& m : masters) m.best_rtt_ns = INT64_MAX;
+
+		for (int q = 0; q < opt.queries && !stopping; q++) {
+			tag = (tag + 1) % 0x80;
+			for (master_t& m : masters) {
+				uint8_t cmd[2] = {0x86, tag};
+				m.tag = tag;
+				m.answered = false;
+				m.sent_ns = now_ns();
+				link_send_control(&m.link, cmd, sizeof(cmd), false);
+			}
+
+			int64_t deadline = now_ns() + QUERY_TIMEOUT_NS;
+			while (now_ns() < deadline) {
+				bool all = true;
+				for (master_t& m : masters) {
+					link_poll(&m.link, 0);
+					all = all && m.answered;
+				}
+				if (all) break;
+
+				std::vector<struct pollfd> fds;
+				for (master_t& m : masters) fds.push_back({m.link.fd, POLLIN, 0});
+				poll(fds.data(), fds.size(), 1);
+			}
+
+			struct timespec gap = {0, QUERY_GAP_NS};
+			nanosleep(&gap, NULL);
+		}
+
+		std::vector<double> errors, ppm, rtt_us;
+		for (master_t& m : masters) {
+			if (m.best_rtt_ns == INT64_MAX) {
+				fprintf(stderr, "%s didn't answer any time query this round\n", m.path);
+				errors.push_back(NAN);
+				ppm.push_back(NAN);
+				rtt_us.push_back(NAN);
+				continue;
+			}
+
+			// Only errors measured under a discipline say anything about alignment
+			if (m.disciplined) hist_add(&m.error, (int64_t)(fabs(m.best_error_us) * 1000));
+			errors.push_back(m.best_error_us);
+			rtt_us.push_back(m.best_rtt_ns / 1e3);
+
+			if (sync_end_round(&m.sync)) {
+				sync_discipline_t d;
+				uint8_t frame[SYNC_FRAME_LEN];
+				sync_discipline(&m.sync, now_ns(), &d);
+				sync_encode(&d, frame);
+				link_send_control(&m.link, frame, sizeof(frame), false);
+				m.disciplined = true;
+			}
+			ppm.push_back((m.sync.fit_rate - 1) * 1e6);
+
+			// Nothing we send here is acked, a window query tells the link how much of it
+			// the master has read so it doesn't run out of credit
+			uint8_t window_query = 0x84;
+			link_send_control(&m.link, &window_query, 1, false);
+		}
+
+		double lo = *std::min_element(errors.begin(), errors.end());
+		double hi = *std::max_element(errors.begin(), errors.end());
+		bool all_disciplined = true;
+		for (master_t& m : masters) all_disciplined = all_disciplined && m.disciplined && m.error.count > 0;
+		if (all_disciplined && masters.size() > 1 && !isnan(hi - lo)) hist_add(&spread_hist, (int64_t)((hi - lo) * 1000));
+
+		print_round(round++, errors, ppm, rtt_us, hi - lo);
+		fflush(stdout);
+
+		next_round += (int64_t)opt.interval_ms * 1000000;
+		while (!stopping && now_ns() < next_round) {
+			for (master_t& m : masters) link_poll(&m.link, 10);
+		}
+	}
+
+	fprintf(stderr, "\n");
+	for (master_t& m : masters) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s error", m.path);
+		hist_print(stderr, name, &m.error, 1000, "us");
+		link_close(&m.link);
+	}
+	if (masters.size() > 1) hist_print(stderr, "edge spread", &spread_hist, 1000, "us");
+	return 0;
+}
+
+// A master with a clock that's off by a random offset and rate, behind a USB serial link
+typedef struct {
+	double offset_us;
+	double rate;
+	clock_sync_t sync;
+	sync_discipline_t discipline;
+	bool disciplined;
+	hist_t error;
+} sim_master_t;
+
+static uint32_t sim_micros(const sim_master_t& m, int64_t host_ns) {
+	// micros() counts in steps of 4us on a 16MHz AVR
+	double local = m.offset_us + m.rate * host_ns / 1000.0;
+	return (uint32_t)(uint64_t)(floor(local / 4) * 4);
+}
+
+static uint32_t sim_synced(const sim_master_t& m, int64_t host_ns) {
+	uint32_t local = sim_micros(m, host_ns);
+	return m.disciplined ? sync_apply(&m.discipline, local) : local;
+}
+
+static int run_simulation(const options_t& opt) {
+	std::mt19937_64 rng(opt.seed);
+	std::uniform_real_distribution<double> unit(0, 1);
+	std::normal_distribution<double> normal(0, 1);
+	std::exponential_distribution<double> dwell(1 / 30.0);
+
+	std::vector<sim_master_t> masters(opt.simulate);
+	for (sim_master_t& m : masters) {
+		// Booted anywhere in the last hour
+		m.offset_us = -unit(rng) * 3.6e9;
+		m.rate = 1 + (unit(rng) * 2 - 1) * opt.drift_ppm * 1e-6;
+		sync_reset(&m.sync, opt.window);
+		m.disciplined = false;
+		hist_reset(&m.error);
+	}
+
+	double free_drift = 0;
+	for (size_t i = 0; i < masters.size(); i++) {
+		for (size_t j = 0; j < masters.size(); j++) free_drift = std::max(free_drift, masters[i].rate - masters[j].rate);
+	}
+
+	// Time for a one way trip: USB polling jitter, and on the way in the time until the
+	// main loop reads the byte, which is sometimes a whole write() long
+	auto usb = [&]() { return (int64_t)(unit(rng) * opt.jitter_us * 1000); };
+	auto loop_delay = [&]() {
+		double us = dwell(rng);
+		if (unit(rng) < 0.2) us += unit(rng) * opt.busy_us;
+		return (int64_t)(us * 1000);
+	};
+	const size_t answer_len = strlen("time 12 1234567890 1234567890");
+
+	hist_t spread;
+	hist_reset(&spread);
+
+	int rounds = (int)(opt.duration * 1000 / opt.interval_ms);
+	int64_t t = 10000000000LL;
+	int64_t interval = (int64_t)opt.interval_ms * 1000000;
+	int warmup = 3;
+
+	for (int round = 0; round < rounds && !stopping; round++) {
+		int64_t round_start = t;
+
+		for (int q = 0; q < opt.queries; q++) {
+			for (sim_master_t& m : masters) {
+				int64_t sent = t;
+				int64_t arrived = sent + query_wire_ns(opt.baud) + usb() + loop_delay();
+				uint32_t local = sim_micros(m, arrived);
+				int64_t received = arrived + answer_wire_ns(answer_len, opt.baud) + usb();
+
+				sync_add_sample(&m.sync, sent + query_wire_ns(opt.baud), received - answer_wire_ns(answer_len, opt.baud), local);
+			}
+			t += QUERY_GAP_NS;
+		}
+
+		for (sim_master_t& m : masters) {
+			if (sync_end_round(&m.sync)) {
+				// Takes effect when it arrives, but is anchored at the host time it was computed for
+				sync_discipline(&m.sync, t, &m.discipline);
+				m.disciplined = true;
+			}
+		}
+
+		// Walk to the next round, watching the synced clocks every ms. Pulse edges of two
+		// masters are as far apart as their synced clocks.
+		int64_t next = round_start + interval;
+		for (; t < next; t += 1000000) {
+			double lo = 1e18, hi = -1e18;
+			for (sim_master_t& m : masters) {
+				double e = (int32_t)(sim_synced(m, t) - sync_host_us(t));
+				lo = std::min(lo, e);
+				hi = std::max(hi, e);
+				if (round >= warmup) hist_add(&m.error, (int64_t)(fabs(e) * 1000));
+			}
+			if (round >= warmup) hist_add(&spread, (int64_t)((hi - lo) * 1000));
+		}
+
+		// Crystals wander with temperature
+		for (sim_master_t& m : masters) {
+			m.offset_us += m.rate * t / 1000.0;
+			m.rate += normal(rng) * opt.wander_ppm * 1e-6 * sqrt(opt.interval_ms / 1000.0);
+			m.offset_us -= m.rate * t / 1000.0;
+		}
+	}
+
+	printf("%d masters, crystals within +-%.0f ppm wandering %.2f ppm/sqrt(s), %.0f us of USB jitter each way, "
+		"up to %.0f us before the master reads a query, %d queries every %d ms, fit over %d rounds\n",
+		opt.simulate, opt.drift_ppm, opt.wander_ppm, opt.jitter_us, opt.busy_us, opt.queries, opt.interval_ms, opt.window);
+	printf("free running their pulse edges would drift apart by up to %.1f ms per minute\n", free_drift * 60e3);
+
+	for (size_t i = 0; i < masters.size(); i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "master %zu error", i);
+		hist_print(stdout, name, &masters[i].error, 1000, "us");
+	}
+	hist_print(stdout, "edge spread", &spread, 1000, "us");
+
+	double worst = spread.max / 1000.0;
+	bool ok = spread.count > 0 && worst <= opt.tolerance_us;
+	printf("%s: edges %s within %.0f us of each other (worst %.0f us)\n", ok ? "PASS" : "FAIL", ok ? "stayed" : "did not stay",
+		opt.tolerance_us, worst);
+	return ok ? 0 : 1;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-sync [options] --port PATH [--port PATH ...]\n"
+		"       tappy-sync [options] --simulate N\n"
+		"\n"
+		"  --port PATH          v6 master to keep in sync, repeat for every master\n"
+		"  --baud N             (default 115200)\n"
+		"  --interval-ms N      time between sync rounds (default 1000)\n"
+		"  --queries N          time queries per round, the fastest answer counts (default 8)\n"
+		"  --window N           rounds in the offset and rate fit (default 30)\n"
+		"  --duration S         stop after S seconds (default: until ctrl-c, 600 simulated)\n"
+		"\n"
+		"  --simulate N         run against N simulated masters instead\n"
+		"  --drift-ppm X        simulated crystal error range (default 500)\n"
+		"  --wander-ppm X       simulated crystal random walk per sqrt(s) (default 0.05)\n"
+		"  --jitter-us X        simulated USB latency jitter each way (default 1000)\n"
+		"  --busy-us X          longest simulated wait for the master's loop (default 900)\n"
+		"  --tolerance-us X     edge spread the simulation must stay within (default 500)\n"
+		"  --seed N\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.baud = 115200;
+	opt.interval_ms = 1000;
+	opt.queries = 8;
+	opt.window = 30;
+	opt.duration = 0;
+	opt.simulate = 0;
+	opt.drift_ppm = 500;
+	opt.wander_ppm = 0.05;
+	opt.jitter_us = 1000;
+	opt.busy_us = 900;
+	opt.tolerance_us = 500;
+	opt.seed = 1;
+
+	std::vector<const char*> ports;
+
+	static struct option long_options[] = {
+		{"port", required_argument, 0, 'p'},
+		{"baud", required_argument, 0, 'b'},
+		{"interval-ms", required_argument, 0, 'i'},
+		{"queries", required_argument, 0, 'q'},
+		{"window", required_argument, 0, 'w'},
+		{"duration", required_argument, 0, 'd'},
+		{"simulate", required_argument, 0, 'S'},
+		{"drift-ppm", required_argument, 0, 'D'},
+		{"wander-ppm", required_argument, 0, 'W'},
+		{"jitter-us", required_argument, 0, 'J'},
+		{"busy-us", required_argument, 0, 'B'},
+		{"tolerance-us", required_argument, 0, 'T'},
+		{"seed", required_argument, 0, 'R'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'p': ports.push_back(optarg); break;
+			case 'b': opt.baud = atoi(optarg); break;
+			case 'i': opt.interval_ms = atoi(optarg); break;
+			case 'q': opt.queries = atoi(optarg); break;
+			case 'w': opt.window = atoi(optarg); break;
+			case 'd': opt.duration = atof(optarg); break;
+			case 'S': opt.simulate = atoi(optarg); break;
+			case 'D': opt.drift_ppm = atof(optarg); break;
+			case 'W': opt.wander_ppm = atof(optarg); break;
+			case 'J': opt.jitter_us = atof(optarg); break;
+			case 'B': opt.busy_us = atof(optarg); break;
+			case 'T': opt.tolerance_us = atof(optarg); break;
+			case 'R': opt.seed = atoi(optarg); break;
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+	if (optind != argc || (ports.empty() == (opt.simulate <= 0)) || opt.interval_ms <= 0 || opt.queries <= 0) {
+		usage();
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (opt.simulate > 0) {
+		if (opt.duration <= 0) opt.duration = 600;
+		return run_simulation(opt);
+	}
+	return run_ports(opt, ports);
+}
@@ -0,0 +1,651 @@
+// Stream grayscale video onto a tappy tap array
+//
+//   tappy-video [options] [input]
+//
+// Frames go through five threads connected by bounded lock-free queues:
+//
+//   decode -> downsample -> quantize -> pack -> write
+//
+// decode reads raw gray8 or y4m frames (file or stdin, '-'), downsample box filters
+// them to one value per tapper, quantize turns those into on/off tappers, pack encodes
+// the wire frame for the layout and write streams it to the master.
+//
+// Latency is kept bounded at both ends: decode drops a frame when the pipeline is still
+// busy with the previous ones, and write skips ahead to the newest packed frame. Files
+// read with --fps 0 go through without drops instead.
+// Per stage latency, sustained fps and glass-to-tap latency (frame decoded until its
+// last byte is on the wire) are reported every second and as percentiles at the end.
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "clock.h"
+#include "layout.h"
+#include "pack.h"
+#include "serial_port.h"
+#include "spsc_queue.h"
+#include "stats.h"
+#include "tap_link.h"
+
+#define QUEUE_DEPTH 2
+#define NUM_STAGES 5
+
+typedef enum _stage_t {
+	STAGE_DECODE,
+	STAGE_DOWNSAMPLE,
+	STAGE_QUANTIZE,
+	STAGE_PACK,
+	STAGE_WRITE
+} stage_t;
+
+static const char* STAGE_NAMES[NUM_STAGES] = {"decode", "downsample", "quantize", "pack", "write"};
+
+typedef enum _quant_mode_t {
+	QUANT_THRESHOLD,
+	QUANT_DITHER,
+	QUANT_LEVELS
+} quant_mode_t;
+
+typedef struct {
+	uint64_t index;
+	bool eos;
+
+	// When each stage picked the frame up and when it was done with it
+	int64_t t_in[NUM_STAGES];
+	int64_t t_out[NUM_STAGES];
+
+	std::vector<uint8_t> luma; // source frame
+	std::vector<uint8_t> grid; // one intensity per tapper
+	std::vector<uint8_t> cells; // one on/off per tapper
+	std::vector<uint8_t> packed;
+	std::vector<uint8_t> wire;
+} video_frame_t;
+
+typedef spsc_queue_t<video_frame_t*> frame_queue_t;
+
+typedef struct {
+	const char* input;
+	const char* port;
+	const char* layout_spec;
+	int width, height; // source size
+	bool y4m;
+	int chroma_len;
+	double fps;
+	// Paced or piped input keeps going in real time, so frames get dropped rather than queued
+	bool live;
+	bool loop;
+	quant_mode_t mode;
+	int threshold;
+	int levels;
+	bool invert;
+	int baud;
+	uint16_t conf[4]; // 10us units
+	pack_isa_t isa;
+} options_t;
+
+static std::atomic<bool> stopping(false);
+static std::atomic<uint64_t> decoded(0), dropped_decode(0);
+
+static void on_signal(int) {
+	stopping = true;
+}
+
+// Input
+
+static bool read_full(FILE* f, uint8_t* buf, size_t len) {
+	return fread(buf, 1, len, f) == len;
+}
+
+// Parse a YUV4MPEG2 stream header, leaving f at the first FRAME
+static bool read_y4m_header(FILE* f, options_t* opt) {
+	char header[512];
+	if (!fgets(header, sizeof(header), f) || strncmp(header, "YUV4MPEG2 ", 10) != 0) return false;
+
+	int fps_num = 0, fps_den = 1;
+	const char* chroma = "420";
+
+	for (char* tok = strtok(header + 10, " \n"); tok; tok = strtok(NULL, " \n")) {
+		switch (tok[0]) {
+			case 'W': opt->width = atoi(tok + 1); break;
+			case 'H': opt->height = atoi(tok + 1); break;
+			case 'F': sscanf(tok + 1, "%d:%d", &fps_num, &fps_den); break;
+			case 'C': chroma = tok + 1; break;
+		}
+	}
+
+	if (opt->fps < 0 && fps_num > 0 && fps_den > 0) opt->fps = (double)fps_num / fps_den;
+
+	int cw = (opt->width + 1) / 2, ch = (opt->height + 1) / 2;
+	if (strncmp(chroma, "mono", 4) == 0) {
+		opt->chroma_len = 0;
+	} else if (strncmp(chroma, "444", 3) == 0) {
+		opt->chroma_len = 2 * opt->width * opt->height;
+	} else if (strncmp(chroma, "422", 3) == 0) {
+		opt->chroma_len = 2 * cw * opt->height;
+	} else {
+		opt->chroma_len = 2 * cw * ch;
+	}
+
+	opt->y4m = true;
+	return opt->width > 0 && opt->height > 0;
+}
+
+static bool read_frame(FILE* f, const options_t& opt, video_frame_t* frame, std::vector<uint8_t>& scratch) {
+	if (opt.y4m) {
+		char tag[256];
+		if (!fgets(tag, sizeof(tag), f) || strncmp(tag, "FRAME", 5) != 0) return false;
+	}
+
+	if (!read_full(f, frame->luma.data(), frame->luma.size())) return false;
+	if (opt.chroma_len > 0 && !read_full(f, scratch.data(), opt.chroma_len)) return false;
+	return true;
+}
+
+// Stages
+
+static void run_decode(const options_t& opt, FILE* in, long data_start, frame_queue_t& out, frame_queue_t& free_frames) {
+	std::vector<video_frame_t*> spare;
+	std::vector<uint8_t> scratch(opt.chroma_len);
+	uint64_t index = 0;
+	int64_t start = now_ns();
+	backoff_t backoff;
+
+	while (true) {
+		video_frame_t* frame;
+		while (free_frames.try_pop(&frame)) spare.push_back(frame);
+
+		backoff_reset(&backoff);
+		while (spare.empty()) {
+			if (free_frames.try_pop(&frame)) spare.push_back(frame);
+			else backoff_wait(&backoff);
+		}
+
+		frame = spare.back();
+		spare.pop_back();
+
+		if (opt.fps > 0) {
+			int64_t due = start + (int64_t)(index * 1e9 / opt.fps);
+			struct timespec ts = {(time_t)(due / 1000000000), (long)(due % 1000000000)};
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		frame->t_in[STAGE_DECODE] = now_ns();
+		bool ok = !stopping && read_frame(in, opt, frame, scratch);
+		if (!ok && !stopping && opt.loop && data_start >= 0 && fseek(in, data_start, SEEK_SET) == 0) {
+			ok = read_frame(in, opt, frame, scratch);
+		}
+
+		frame->index = index++;
+		frame->eos = !ok;
+		frame->t_out[STAGE_DECODE] = now_ns();
+
+		if (frame->eos) {
+			backoff_reset(&backoff);
+			while (!out.try_push(frame)) backoff_wait(&backoff);
+			return;
+		}
+
+		decoded++;
+		if (!opt.live) {
+			backoff_reset(&backoff);
+			while (!out.try_push(frame)) backoff_wait(&backoff);
+		} else if (!out.try_push(frame)) {
+			// The pipeline is still busy, sending this one later would only add latency
+			dropped_decode++;
+			spare.push_back(frame);
+		}
+	}
+}
+
+// Runs work on every frame between two queues until the end of stream marker goes through
+template <typename F>
+static void run_stage(stage_t stage, frame_queue_t& in, frame_queue_t& out, F work) {
+	backoff_t backoff;
+	backoff_reset(&backoff);
+
+	while (true) {
+		video_frame_t* frame;
+		if (!in.try_pop(&frame)) {
+			backoff_wait(&backoff);
+			continue;
+		}
+		backoff_reset(&backoff);
+
+		frame->t_in[stage] = now_ns();
+		if (!frame->eos) work(frame);
+		frame->t_out[stage] = now_ns();
+
+		while (!out.try_push(frame)) backoff_wait(&backoff);
+		backoff_reset(&backoff);
+
+		if (frame->eos) return;
+	}
+}
+
+// Box filter the source down to one value per tapper
+typedef struct {
+	std::vector<int> x0, x1, y0, y1;
+} boxes_t;
+
+static void make_boxes(int src_w, int src_h, int w, int h, boxes_t* b) {
+	b->x0.resize(w);
+	b->x1.resize(w);
+	b->y0.resize(h);
+	b->y1.resize(h);
+
+	for (int x = 0; x < w; x++) {
+		b->x0[x] = (int)((int64_t)x * src_w / w);
+		b->x1[x] = std::max(b->x0[x] + 1, (int)((int64_t)(x + 1) * src_w / w));
+	}
+	for (int y = 0; y < h; y++) {
+		b->y0[y] = (int)((int64_t)y * src_h / h);
+		b->y1[y] = std::max(b->y0[y] + 1, (int)((int64_t)(y + 1) * src_h / h));
+	}
+}
+
+static void downsample(const uint8_t* src, int src_w, const boxes_t& b, uint8_t* grid, int w, int h, std::vector<uint32_t>& sums) {
+	for (int y = 0; y < h; y++) {
+		std::fill(sums.begin(), sums.end(), 0);
+
+		for (int sy = b.y0[y]; sy < b.y1[y]; sy++) {
+			const uint8_t* row = src + (size_t)sy * src_w;
+			for (int x = 0; x < w; x++) {
+				uint32_t s = 0;
+				for (int sx = b.x0[x]; sx < b.x1[x]; sx++) s += row[sx];
+				sums[x] += s;
+			}
+		}
+
+		for (int x = 0; x < w; x++) {
+			uint32_t area = (uint32_t)(b.x1[x] - b.x0[x]) * (b.y1[y] - b.y0[y]);
+			grid[y * w + x] = (sums[x] + area / 2) / area;
+		}
+	}
+}
+
+static const uint8_t BAYER4[4][4] = {
+	{0, 8, 2, 10},
+	{12, 4, 14, 6},
+	{3, 11, 1, 9},
+	{15, 7, 13, 5}
+};
+
+static void quantize(const options_t& opt, const uint8_t* grid, uint8_t* cells, int w, int h, std::vector<uint16_t>& acc) {
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			int i = y * w + x;
+			int v = opt.invert ? 255 - grid[i] : grid[i];
+
+			switch (opt.mode) {
+				case QUANT_THRESHOLD: {
+					cells[i] = v >= opt.threshold;
+					break;
+				}
+				case QUANT_DITHER: {
+					cells[i] = v > BAYER4[y % 4][x % 4] * 16 + 8;
+					break;
+				}
+				case QUANT_LEVELS: {
+					// Quantize to a few intensities, then spread each one over time: a tapper
+					// at level 1 of 4 taps every third frame, at level 3 on every frame
+					int level = (v * (opt.levels - 1) + 127) / 255;
+					acc[i] += level * 255 / (opt.levels - 1);
+					cells[i] = acc[i] >= 255;
+					if (cells[i]) acc[i] -= 255;
+					break;
+				}
+			}
+		}
+	}
+}
+
+// Reporting
+
+typedef struct {
+	hist_t work[NUM_STAGES];
+	hist_t wait[NUM_STAGES];
+	hist_t glass_to_tap;
+	uint64_t written;
+	uint64_t dropped_write;
+} video_stats_t;
+
+static void record_frame(video_stats_t* stats, const video_frame_t* f, int64_t wire_ns) {
+	for (int s = 0; s < NUM_STAGES; s++) {
+		hist_add(&stats->work[s], f->t_out[s] - f->t_in[s]);
+		if (s > 0) hist_add(&stats->wait[s], f->t_in[s] - f->t_out[s - 1]);
+	}
+	hist_add(&stats->glass_to_tap, f->t_out[STAGE_WRITE] + wire_ns - f->t_out[STAGE_DECODE]);
+	stats->written++;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappy-video [options] [input]\n"
+		"\n"
+		"  input                raw gray8 or y4m video, '-' for stdin (default)\n"
+		"  --size WxH           frame size of raw input\n"
+		"  --fps N              pace input at N fps, 0 for as fast as possible (without drops\n"
+		"                       for files, stdin still skips ahead)\n"
+		"                       (default: y4m frame rate, 30 for raw files, unpaced stdin)\n"
+		"  --loop               restart file input at the end\n"
+		"  --layout SPEC        array layout (default v6:2x2), see README\n"
+		"  --mode MODE          threshold, dither (default) or levels\n"
+		"  --threshold N        on level for threshold mode (default 128)\n"
+		"  --levels N           intensities for levels mode (default 4)\n"
+		"  --invert             dark is on\n"
+		"  --port PATH          serial port, file or '-' for stdout (default: dry run)\n"
+		"  --baud N             (default 115200)\n"
+		"  --conf U,I,D,P       pulse timing in ms (default 20,20,20,20)\n"
+		"  --isa ISA            scalar, sse2 or avx2 (default: best supported)\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.input = "-";
+	opt.port = NULL;
+	opt.layout_spec = "v6:2x2";
+	opt.width = 0;
+	opt.height = 0;
+	opt.y4m = false;
+	opt.chroma_len = 0;
+	opt.fps = -1;
+	opt.live = false;
+	opt.loop = false;
+	opt.mode = QUANT_DITHER;
+	opt.threshold = 128;
+	opt.levels = 4;
+	opt.invert = false;
+	opt.baud = 115200;
+	for (int i = 0; i < 4; i++) opt.conf[i] = 2000;
+	opt.isa = pack_best_isa();
+
+	static struct option long_options[] = {
+		{"size", required_argument, 0, 's'},
+		{"fps", required_argument, 0, 'f'},
+		{"loop", no_argument, 0, 'L'},
+		{"layout", required_argument, 0, 'l'},
+		{"mode", required_argument, 0, 'm'},
+		{"threshold", required_argument, 0, 't'},
+		{"levels", required_argument, 0, 'v'},
+		{"invert", no_argument, 0, 'i'},
+		{"port", required_argument, 0, 'p'},
+		{"baud", required_argument, 0, 'b'},
+		{"conf", required_argument, 0, 'c'},
+		{"isa", required_argument, 0, 'I'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 's': {
+				if (sscanf(optarg, "%dx%d", &opt.width, &opt.height) != 2) {
+					usage();
+					return 1;
+				}
+				break;
+			}
+			case 'f': opt.fps = atof(optarg); break;
+			case 'L': opt.loop = true; break;
+			case 'l': opt.layout_spec = optarg; break;
+			case 'm': {
+				if (strcmp(optarg, "threshold") == 0) opt.mode = QUANT_THRESHOLD;
+				else if (strcmp(optarg, "dither") == 0) opt.mode = QUANT_DITHER;
+				else if (strcmp(optarg, "levels") == 0) opt.mode = QUANT_LEVELS;
+				else {
+					usage();
+					return 1;
+				}
+				break;
+			}
+			case 't': opt.threshold = atoi(optarg); break;
+			case 'v': opt.levels = std::max(2, atoi(optarg)); break;
+			case 'i': opt.invert = true; break;
+			case 'p': opt.port = optarg; break;
+			case 'b': opt.baud = atoi(optarg); break;
+			case 'c': {
+				float ms[4];
+				if (sscanf(optarg, "%f,%f,%f,%f", &ms[0], &ms[1], &ms[2], &ms[3]) != 4) {
+					usage();
+					return 1;
+				}
+				for (int i = 0; i < 4; i++) opt.conf[i] = (uint16_t)(ms[i] * 100);
+				break;
+			}
+			case 'I': {
+				if (!pack_parse_isa(optarg, &opt.isa) || !pack_isa_supported(opt.isa)) {
+					fprintf(stderr, "Unsupported isa %s\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+	if (optind < argc) opt.input = argv[optind];
+
+	layout_desc_t desc;
+	layout_t layout;
+	if (!layout_parse(opt.layout_spec, &desc) || !layout_compile(desc, &layout)) {
+		fprintf(stderr, "Bad layout %s\n", opt.layout_spec);
+		return 1;
+	}
+
+	bool from_stdin = strcmp(opt.input, "-") == 0;
+	FILE* in = from_stdin ? stdin : fopen(opt.input, "rb");
+	if (!in) {
+		fprintf(stderr, "Can't open %s\n", opt.input);
+		return 1;
+	}
+
+	// y4m is recognised by its header, anything else is raw gray8 of --size
+	int first = fgetc(in);
+	if (first == EOF) {
+		fprintf(stderr, "Empty input\n");
+		return 1;
+	}
+	ungetc(first, in);
+	if (first == 'Y') {
+		if (!read_y4m_header(in, &opt)) {
+			fprintf(stderr, "Bad y4m header\n");
+			return 1;
+		}
+	} else if (opt.width <= 0 || opt.height <= 0) {
+		fprintf(stderr, "Raw input needs --size\n");
+		return 1;
+	}
+	if (opt.fps < 0) opt.fps = from_stdin ? 0 : 30;
+	opt.live = from_stdin || opt.fps > 0;
+	long data_start = from_stdin ? -1 : ftell(in);
+
+	tap_link_t link;
+	bool have_link = opt.port != NULL;
+	if (have_link) {
+		if (!link_open(&link, opt.port, opt.baud)) return 1;
+		if (link.tty && layout_has_commands(desc.format)) {
+			fprintf(stderr, "Waiting for master on %s\n", opt.port);
+			fprintf(stderr, "Flow control %s\n", link_handshake(&link, 3000) ? "on" : "off");
+		}
+
+		if (layout_has_commands(desc.format)) {
+			uint8_t conf[9];
+			link_encode_conf(conf, opt.conf[0], opt.conf[1], opt.conf[2], opt.conf[3]);
+			link_send_control(&link, conf, sizeof(conf), true);
+		}
+	}
+
+	double period_ms = (opt.conf[0] + opt.conf[1] + opt.conf[2] + opt.conf[3]) / 100.0;
+	fprintf(stderr, "%dx%d %s -> %dx%d tappers (%s, %zu bytes/frame), %.1f fps, pulse period %.1f ms\n",
+		opt.width, opt.height, opt.y4m ? "y4m" : "raw", layout.width, layout.height,
+		layout_format_name(desc.format), layout.frame_len, opt.fps, period_ms);
+
+	// Enough frames for every queue to be full and every stage to hold one
+	const int pool_size = (NUM_STAGES - 1) * QUEUE_DEPTH + NUM_STAGES + 1;
+	std::vector<video_frame_t> pool(pool_size);
+	frame_queue_t free_frames(pool_size);
+	for (video_frame_t& f : pool) {
+		f.luma.resize((size_t)opt.width * opt.height);
+		f.grid.resize((size_t)layout.width * layout.height);
+		f.cells.resize(f.grid.size());
+		f.packed.resize(layout.packed_len);
+		f.wire.resize(layout.frame_len);
+		free_frames.try_push(&f);
+	}
+
+	frame_queue_t q_decoded(QUEUE_DEPTH), q_downsampled(QUEUE_DEPTH), q_quantized(QUEUE_DEPTH), q_packed(QUEUE_DEPTH);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	std::thread decode_thread(run_decode, std::cref(opt), in, data_start, std::ref(q_decoded), std::ref(free_frames));
+
+	std::thread downsample_thread([&]() {
+		boxes_t boxes;
+		make_boxes(opt.width, opt.height, layout.width, layout.height, &boxes);
+		std::vector<uint32_t> sums(layout.width);
+		run_stage(STAGE_DOWNSAMPLE, q_decoded, q_downsampled, [&](video_frame_t* f) {
+			downsample(f->luma.data(), opt.width, boxes, f->grid.data(), layout.width, layout.height, sums);
+		});
+	});
+
+	std::thread quantize_thread([&]() {
+		std::vector<uint16_t> acc((size_t)layout.width * layout.height, 0);
+		run_stage(STAGE_QUANTIZE, q_downsampled, q_quantized, [&](video_frame_t* f) {
+			quantize(opt, f->grid.data(), f->cells.data(), layout.width, layout.height, acc);
+		});
+	});
+
+	std::thread pack_thread([&]() {
+		run_stage(STAGE_PACK, q_quantized, q_packed, [&](video_frame_t* f) {
+			pack_encode(layout, f->cells.data(), f->packed.data(), f->wire.data(), opt.isa);
+		});
+	});
+
+	// Write runs on the main thread
+	video_stats_t stats, interval;
+	memset(&stats, 0, sizeof(stats));
+	memset(&interval, 0, sizeof(interval));
+	for (int s = 0; s < NUM_STAGES; s++) {
+		hist_reset(&stats.work[s]);
+		hist_reset(&stats.wait[s]);
+	}
+	hist_reset(&stats.glass_to_tap);
+	interval = stats;
+
+	int64_t wire_ns = (int64_t)(serial_wire_time(layout.frame_len, opt.baud) * 1e9);
+	int64_t start = now_ns(), last_report = start;
+	uint64_t last_decoded = 0, last_dropped = 0;
+	backoff_t backoff;
+	backoff_reset(&backoff);
+
+	while (true) {
+		// Live input skips ahead to the newest packed frame, but never past the last one
+		// before the end of stream
+		video_frame_t* frame = NULL;
+		video_frame_t* next;
+		bool eos = false;
+		while (!eos && (!frame || opt.live) && q_packed.try_pop(&next)) {
+			if (next->eos) {
+				eos = true;
+				free_frames.try_push(next);
+			} else {
+				if (frame) {
+					stats.dropped_write++;
+					interval.dropped_write++;
+					free_frames.try_push(frame);
+				}
+				frame = next;
+			}
+		}
+
+		if (frame) {
+			backoff_reset(&backoff);
+			frame->t_in[STAGE_WRITE] = now_ns();
+
+			if (have_link) {
+				link_send_state(&link, frame->wire.data(), frame->wire.size());
+				while (link_busy(&link)) link_poll(&link, 1);
+				// Without flow control wait for the bytes to actually leave
+				if (link.tty && !link.enabled) tcdrain(link.fd);
+			}
+
+			frame->t_out[STAGE_WRITE] = now_ns();
+			// With flow control everything but the last window is already on the wire
+			int64_t on_wire = have_link && link.enabled ? (int64_t)(serial_wire_time(std::min((size_t)link.window, frame->wire.size()), opt.baud) * 1e9) : 0;
+			if (!have_link || !link.tty) on_wire = wire_ns;
+			record_frame(&stats, frame, on_wire);
+			record_frame(&interval, frame, on_wire);
+			free_frames.try_push(frame);
+			if (eos) break;
+		} else if (eos) {
+			break;
+		} else if (have_link) {
+			link_poll(&link, 1);
+		} else {
+			backoff_wait(&backoff);
+		}
+
+		int64_t now = now_ns();
+		if (now - last_report >= 1000000000) {
+			double secs = (now - last_report) / 1e9;
+			uint64_t d = decoded, dd = dropped_decode;
+			fprintf(stderr, "in %.1f fps, out %.1f fps, dropped %llu decode %llu write, glass-to-tap p50 %.2f ms p99 %.2f ms",
+				(d - last_decoded) / secs, interval.written / secs,
+				(unsigned long long)(dd - last_dropped), (unsigned long long)interval.dropped_write,
+				hist_percentile(&interval.glass_to_tap, 50) / 1e6, hist_percentile(&interval.glass_to_tap, 99) / 1e6);
+			if (have_link && link.enabled) {
+				fprintf(stderr, ", link %llu acked %llu retries, master %u%% util",
+					(unsigned long long)link.frames_acked, (unsigned long long)link.retries, link.master_util);
+				uint8_t cmd = 0x85;
+				link_send_control(&link, &cmd, 1, false);
+			}
+			fprintf(stderr, "\n");
+
+			last_decoded = d;
+			last_dropped = dd;
+			last_report = now;
+			memset(&interval, 0, sizeof(interval));
+		}
+	}
+
+	stopping = true;
+	decode_thread.join();
+	downsample_thread.join();
+	quantize_thread.join();
+	pack_thread.join();
+
+	double secs = (now_ns() - start) / 1e9;
+	fprintf(stderr, "\n%llu frames in, %llu written in %.1f s: %.1f fps sustained, %llu dropped at decode, %llu at write\n\n",
+		(unsigned long long)decoded.load(), (unsigned long long)stats.written, secs, stats.written / secs,
+		(unsigned long long)dropped_decode.load(), (unsigned long long)stats.dropped_write);
+
+	for (int s = 0; s < NUM_STAGES; s++) {
+		char name[32];
+		hist_print(stderr, STAGE_NAMES[s], &stats.work[s], 1000, "us");
+		if (s > 0) {
+			snprintf(name, sizeof(name), "  queue");
+			hist_print(stderr, name, &stats.wait[s], 1000, "us");
+		}
+	}
+	hist_print(stderr, "glass-to-tap", &stats.glass_to_tap, 1e6, "ms");
+	if (have_link && link.enabled) hist_print(stderr, "link ack", &link.ack_latency, 1e6, "ms");
+
+	double p99 = hist_percentile(&stats.glass_to_tap, 99) / 1e6;
+	fprintf(stderr, "\nglass-to-tap p99 %.2f ms is %s the %.1f ms pulse period\n", p99, p99 <= period_ms ? "within" : "OVER", period_ms);
+
+	if (have_link) link_close(&link);
+	return 0;
+}
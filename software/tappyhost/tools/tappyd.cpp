@@ -0,0 +1,1034 @@
+// Frame ingestion daemon, lets any number of local apps share one array
+//
+//   tappyd [options]
+//
+// tappyd owns the serial port(s) and accepts messages (src/tappy_msg.h) on localhost over
+// UDP and over TCP and Unix stream sockets. All sockets are non blocking and serviced by
+// one epoll loop, which also does the merging:
+//
+//  * every client draws into its own copy of the canvas, each cell remembering the
+//    priority and arrival order of the message that drew it
+//  * a canvas cell shows the client with the highest priority there, and between equal
+//    priorities whoever drew it last, so each region is latest wins
+//  * leaving (closing the stream, idle UDP clients timing out) or a release message gives
+//    the region back to whoever is underneath
+//
+// Payloads are merged straight out of the receive buffers. Once a batch of events is
+// handled every port whose part of the canvas changed is packed straight into the back
+// buffer of that port's triple buffer and published to its writer thread, which streams
+// the newest frame with the same flow control as the other tools. Neither side ever waits
+// for the other, frames the serial port is too slow for are overwritten.
+//
+// Ingest latency (datagram or stream data read until the frame is with the writer) and
+// sender-to-writer latency (the t_ns stamped by the sender) are kept as histograms.
+//
+// A port that goes away (unplugged, USB reset) is reopened by its writer once it's back.
+// Masters that kept running are picked up where they were, only the conf and frame they
+// don't already have are resent.
+
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "clock.h"
+#include "layout.h"
+#include "pack.h"
+#include "serial_port.h"
+#include "spsc_queue.h"
+#include "stats.h"
+#include "tap_link.h"
+#include "tappy_msg.h"
+#include "triple_buffer.h"
+
+#define UDP_BATCH 32
+#define UDP_MAX_DATAGRAM 65536
+#define STREAM_BUFFER 65536
+#define MAX_EVENTS 64
+#define RECONNECT_MS 500
+
+typedef struct {
+	int x0, y0, x1, y1; // x1, y1 exclusive
+} rect_t;
+
+static bool rect_empty(const rect_t& r) {
+	return r.x0 >= r.x1 || r.y0 >= r.y1;
+}
+
+static void rect_union(rect_t* r, const rect_t& o) {
+	if (rect_empty(o)) return;
+	if (rect_empty(*r)) {
+		*r = o;
+		return;
+	}
+	r->x0 = std::min(r->x0, o.x0);
+	r->y0 = std::min(r->y0, o.y0);
+	r->x1 = std::max(r->x1, o.x1);
+	r->y1 = std::max(r->y1, o.y1);
+}
+
+static bool rect_intersects(const rect_t& a, const rect_t& b) {
+	return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+}
+
+static const rect_t NO_RECT = {0, 0, 0, 0};
+
+typedef struct {
+	int64_t t_ready; // handed to the writer
+	std::vector<uint8_t> wire;
+} out_frame_t;
+
+typedef struct {
+	uint8_t bytes[LINK_CONF_LEN];
+} conf_frame_t;
+
+typedef struct {
+	const char* path; // NULL for a dry run
+	layout_t layout;
+	int x, y; // position of the port's layout on the canvas
+	rect_t rect;
+
+	tap_link_t link;
+	bool have_link;
+	int baud;
+
+	triple_buffer_t<out_frame_t>* frames;
+	spsc_queue_t<conf_frame_t>* confs;
+
+	// Epoll thread side
+	std::vector<uint8_t> cells, packed;
+	bool dirty;
+
+	// Frames overwritten before the writer got to them
+	std::atomic<uint64_t> skipped;
+
+	// Writer side, the histogram is only read once the writer has stopped
+	std::thread writer;
+	std::atomic<uint64_t> written;
+	hist_t write_latency;
+	// Last conf and frame sent, and whether the next ones should be checked against
+	// what the master already has
+	conf_frame_t conf;
+	bool have_conf;
+	std::vector<uint8_t> last_wire;
+	bool resync;
+	uint64_t reconnects;
+	// Thermal governor budget to set on the master, -1 to leave it alone, and how many
+	// tappers it throttled when we last said
+	int thermal;
+	int throttled;
+} port_t;
+
+typedef enum _endpoint_kind_t {
+	ENDPOINT_UDP,
+	ENDPOINT_LISTEN,
+	ENDPOINT_STREAM
+} endpoint_kind_t;
+
+struct client_t;
+
+// What an epoll event refers to
+typedef struct {
+	endpoint_kind_t kind;
+	int fd;
+	struct client_t* client;
+} endpoint_t;
+
+typedef struct client_t {
+	endpoint_t ep; // fd is -1 for UDP clients
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int64_t last_seen;
+
+	// Per canvas cell: priority << 48 | arrival order of the message that drew it, 0 if
+	// the client hasn't drawn there
+	std::vector<uint64_t> keys;
+	std::vector<uint8_t> cells;
+	rect_t drawn;
+	int max_priority;
+
+	std::vector<uint8_t> rx;
+	size_t rx_len;
+} client_t;
+
+// A message waiting for the frames it changed to reach the writers
+typedef struct {
+	int fd; // -1 for UDP
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	bool ack;
+	uint32_t seq;
+	int64_t t_ns;
+	int64_t t_recv;
+} pending_t;
+
+typedef struct {
+	int udp_port, tcp_port;
+	const char* unix_path;
+	const char* layout_spec;
+	int baud;
+	uint16_t conf[4]; // 10us units
+	int thermal;
+	double client_timeout;
+	double stats_interval;
+	pack_isa_t isa;
+} options_t;
+
+typedef struct {
+	int width, height;
+	std::vector<uint8_t> canvas;
+	std::vector<client_t*> clients;
+	std::vector<port_t*> ports;
+	pack_isa_t isa;
+
+	uint64_t serial;
+	rect_t dirty;
+	std::vector<pending_t> pending;
+
+	client_t* conf_owner;
+	int conf_priority;
+
+	int epoll_fd;
+	endpoint_t udp, tcp, unix_stream;
+
+	std::vector<uint8_t> udp_buffers;
+
+	// Counters, reset every stats interval
+	uint64_t messages, bad_messages, acks_dropped;
+	hist_t ingest, sender_to_writer;
+	hist_t interval_ingest;
+} daemon_t;
+
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int) {
+	stopping = true;
+}
+
+// Writers
+
+static void print_master(const port_t* port) {
+	const link_master_t* m = &port->link.master;
+	fprintf(stderr, "Flow control %s", port->link.enabled ? "on" : "off");
+	if (m->valid) {
+		fprintf(stderr, ", firmware %s with %d boards%s", m->version, m->boards, port->link.resumed ? " still running" : "");
+		if (port->layout.desc.format == FORMAT_V6 && m->boards != port->layout.desc.boards_x * port->layout.desc.boards_y) {
+			fprintf(stderr, " (the layout has %d)", port->layout.desc.boards_x * port->layout.desc.boards_y);
+		}
+	}
+	fprintf(stderr, "\n");
+}
+
+// Set the master's thermal governor, it's lost when the master resets. Only v6 and
+// bridge-v1 ports get one, see main().
+static void send_thermal(port_t* port) {
+	if (port->thermal < 0) return;
+	uint8_t cmd[2] = {0x8B, (uint8_t)port->thermal};
+	link_send_control(&port->link, cmd, sizeof(cmd), false);
+}
+
+// The port went away, try to open it again every RECONNECT_MS and carry on from the
+// last conf and frame
+static void reconnect(port_t* port) {
+	if (port->link.fd >= 0) {
+		link_close(&port->link);
+		fprintf(stderr, "Lost %s, waiting for it to come back\n", port->path);
+	}
+
+	if (access(port->path, F_OK) != 0 || !link_open(&port->link, port->path, port->baud)) {
+		for (int i = 0; i < RECONNECT_MS / 10 && !stopping; i++) usleep(10000);
+		return;
+	}
+
+	if (layout_has_commands(port->layout.desc.format)) {
+		link_handshake(&port->link, 3000);
+		fprintf(stderr, "%s is back. ", port->path);
+		print_master(port);
+	} else {
+		fprintf(stderr, "%s is back\n", port->path);
+	}
+	port->resync = true;
+	port->reconnects++;
+
+	int queued = link_resync(&port->link, port->have_conf ? port->conf.bytes : NULL,
+		port->last_wire.empty() ? NULL : port->last_wire.data(), port->last_wire.size());
+	if (queued & LINK_RESYNC_STATE) port->resync = false;
+	send_thermal(port);
+	fprintf(stderr, "Resent %s\n", queued == (LINK_RESYNC_CONF | LINK_RESYNC_STATE) ? "conf and frame" :
+		queued == LINK_RESYNC_CONF ? "conf" : queued == LINK_RESYNC_STATE ? "frame" : "nothing, the master is up to date");
+}
+
+static void run_writer(port_t* port) {
+	backoff_t backoff;
+	backoff_reset(&backoff);
+
+	while (!stopping) {
+		if (port->have_link && port->link.failed) {
+			reconnect(port);
+			continue;
+		}
+
+		bool work = false;
+
+		conf_frame_t conf;
+		while (port->confs->try_pop(&conf)) {
+			if (port->have_link) link_resync(&port->link, conf.bytes, NULL, 0);
+			port->conf = conf;
+			port->have_conf = true;
+			work = true;
+		}
+
+		out_frame_t* frame = port->frames->take();
+		if (frame) {
+			port->last_wire = frame->wire;
+			if (port->have_link && port->resync) {
+				// The master may already show this from before we (re)connected
+				link_resync(&port->link, NULL, frame->wire.data(), frame->wire.size());
+				port->resync = false;
+			} else if (port->have_link) {
+				link_send_state(&port->link, frame->wire.data(), frame->wire.size());
+				while (link_busy(&port->link) && !stopping) link_poll(&port->link, 1);
+				if (port->link.tty && !port->link.enabled) tcdrain(port->link.fd);
+			}
+			hist_add(&port->write_latency, now_ns() - frame->t_ready);
+			port->written++;
+			work = true;
+		} else if (port->have_link && link_busy(&port->link)) {
+			link_poll(&port->link, 1);
+			work = true;
+		} else if (port->have_link) {
+			// Pick up acks and master lines without sleeping on them
+			link_poll(&port->link, 0);
+		}
+
+		if (port->have_link && port->link.master_throttled != port->throttled) {
+			port->throttled = port->link.master_throttled;
+			fprintf(stderr, "%s: %d tappers throttled by the thermal governor, %u cycles skipped so far\n", port->path,
+				port->throttled, port->link.master_skipped);
+		}
+
+		if (work) {
+			backoff_reset(&backoff);
+		} else {
+			backoff_wait(&backoff);
+		}
+	}
+}
+
+// Merging
+
+static client_t* new_client(daemon_t* d, int fd) {
+	client_t* c = new client_t();
+	c->ep.kind = ENDPOINT_STREAM;
+	c->ep.fd = fd;
+	c->ep.client = c;
+	c->addr_len = 0;
+	c->last_seen = now_ns();
+	c->drawn = NO_RECT;
+	c->max_priority = -1;
+	c->rx_len = 0;
+	if (fd >= 0) c->rx.resize(STREAM_BUFFER);
+	d->clients.push_back(c);
+	return c;
+}
+
+static void update_top_priority(daemon_t* d, int* top) {
+	*top = -1;
+	for (client_t* c : d->clients) *top = std::max(*top, c->max_priority);
+}
+
+// Show the topmost client in every cell of r
+static void recompose(daemon_t* d, const rect_t& r) {
+	for (int y = r.y0; y < r.y1; y++) {
+		for (int x = r.x0; x < r.x1; x++) {
+			size_t i = (size_t)y * d->width + x;
+			uint64_t best = 0;
+			uint8_t v = 0;
+			for (client_t* c : d->clients) {
+				if (!c->keys.empty() && c->keys[i] > best) {
+					best = c->keys[i];
+					v = c->cells[i];
+				}
+			}
+			d->canvas[i] = v;
+		}
+	}
+	rect_union(&d->dirty, r);
+}
+
+static rect_t clip(const daemon_t* d, const msg_header_t& h) {
+	rect_t r;
+	r.x0 = std::min((int)h.x, d->width);
+	r.y0 = std::min((int)h.y, d->height);
+	r.x1 = std::min((int)h.x + h.w, d->width);
+	r.y1 = std::min((int)h.y + h.h, d->height);
+	return r;
+}
+
+static void merge_frame(daemon_t* d, client_t* c, const msg_header_t& h, const uint8_t* payload) {
+	rect_t r = clip(d, h);
+	if (rect_empty(r)) return;
+
+	if (c->keys.empty()) {
+		c->keys.assign(d->canvas.size(), 0);
+		c->cells.assign(d->canvas.size(), 0);
+	}
+
+	int top;
+	update_top_priority(d, &top);
+	// Nobody can be above a message at least as important as everything else, which is
+	// the common case and lets it go straight onto the canvas
+	bool on_top = h.priority >= top;
+
+	uint64_t key = (uint64_t)h.priority << 48 | ++d->serial;
+	bool bits = h.flags & MSG_FLAG_BITS;
+
+	for (int y = r.y0; y < r.y1; y++) {
+		size_t src = (size_t)(y - h.y) * h.w + (r.x0 - h.x);
+		size_t dst = (size_t)y * d->width + r.x0;
+		for (int x = r.x0; x < r.x1; x++, src++, dst++) {
+			uint8_t v = bits ? (payload[src / 8] >> (src % 8)) & 1 : payload[src] != 0;
+			c->keys[dst] = key;
+			c->cells[dst] = v;
+			if (on_top) d->canvas[dst] = v;
+		}
+	}
+
+	rect_union(&c->drawn, r);
+	c->max_priority = std::max(c->max_priority, (int)h.priority);
+
+	if (on_top) {
+		rect_union(&d->dirty, r);
+	} else {
+		recompose(d, r);
+	}
+}
+
+static void release(daemon_t* d, client_t* c, rect_t r) {
+	if (c->keys.empty()) return;
+
+	bool all = rect_empty(r);
+	if (all) r = c->drawn;
+
+	for (int y = r.y0; y < r.y1; y++) {
+		memset(&c->keys[(size_t)y * d->width + r.x0], 0, (r.x1 - r.x0) * sizeof(uint64_t));
+	}
+	if (all) {
+		c->drawn = NO_RECT;
+		c->max_priority = -1;
+	}
+
+	recompose(d, r);
+}
+
+static void send_conf(daemon_t* d, const uint16_t* conf) {
+	conf_frame_t frame;
+	link_encode_conf(frame.bytes, conf[0], conf[1], conf[2], conf[3]);
+	for (port_t* port : d->ports) {
+		// Daisy masters would take it for state bytes
+		if (!layout_has_commands(port->layout.desc.format)) continue;
+		if (!port->confs->try_push(frame)) fprintf(stderr, "Conf queue full on %s\n", port->path);
+	}
+}
+
+static void handle_message(daemon_t* d, client_t* c, const msg_header_t& h, const uint8_t* payload, int64_t t_recv) {
+	d->messages++;
+	c->last_seen = t_recv;
+
+	switch (h.type) {
+		case MSG_FRAME: {
+			if (h.len != msg_frame_len(&h)) {
+				d->bad_messages++;
+				return;
+			}
+			merge_frame(d, c, h, payload);
+			break;
+		}
+		case MSG_CONF: {
+			if (h.len != MSG_CONF_LEN) {
+				d->bad_messages++;
+				return;
+			}
+			// The most important client decides the timing
+			if (d->conf_owner && h.priority < d->conf_priority) break;
+			uint16_t conf[4];
+			for (int i = 0; i < 4; i++) conf[i] = payload[i*2] | payload[i*2 + 1] << 8;
+			send_conf(d, conf);
+			d->conf_owner = c;
+			d->conf_priority = h.priority;
+			break;
+		}
+		case MSG_RELEASE: {
+			release(d, c, h.w && h.h ? clip(d, h) : NO_RECT);
+			break;
+		}
+		default: {
+			d->bad_messages++;
+			return;
+		}
+	}
+
+	pending_t p;
+	p.fd = c->ep.fd;
+	p.addr = c->addr;
+	p.addr_len = c->addr_len;
+	p.ack = h.flags & MSG_FLAG_ACK;
+	p.seq = h.seq;
+	p.t_ns = h.t_ns;
+	p.t_recv = t_recv;
+	d->pending.push_back(p);
+}
+
+static void remove_client(daemon_t* d, client_t* c) {
+	release(d, c, NO_RECT);
+	if (d->conf_owner == c) d->conf_owner = NULL;
+
+	d->clients.erase(std::find(d->clients.begin(), d->clients.end(), c));
+
+	if (c->ep.fd >= 0) {
+		for (size_t i = 0; i < d->pending.size(); i++) {
+			if (d->pending[i].fd == c->ep.fd) d->pending[i].ack = false;
+		}
+		epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, c->ep.fd, NULL);
+		close(c->ep.fd);
+	}
+	delete c;
+}
+
+// Handing frames to the writers
+
+static void send_ack(daemon_t* d, const pending_t& p) {
+	msg_header_t h;
+	memset(&h, 0, sizeof(h));
+	h.type = MSG_ACK;
+	h.seq = p.seq;
+	h.t_ns = p.t_ns;
+
+	uint8_t buf[MSG_HEADER_LEN];
+	msg_encode_header(&h, buf);
+
+	ssize_t n;
+	if (p.fd < 0) {
+		n = sendto(d->udp.fd, buf, sizeof(buf), MSG_DONTWAIT, (const struct sockaddr*)&p.addr, p.addr_len);
+	} else {
+		n = send(p.fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	// A client that doesn't read its acks loses them rather than stalling everyone else
+	if (n != (ssize_t)sizeof(buf)) d->acks_dropped++;
+}
+
+static void encode_port(daemon_t* d, port_t* port, out_frame_t* frame) {
+	const layout_t& layout = port->layout;
+	const uint8_t* cells;
+
+	if (port->x == 0 && layout.width == d->width) {
+		// Whole rows of the canvas are already laid out the way the packer wants them
+		cells = &d->canvas[(size_t)port->y * d->width];
+	} else {
+		for (int y = 0; y < layout.height; y++) {
+			memcpy(&port->cells[(size_t)y * layout.width], &d->canvas[(size_t)(port->y + y) * d->width + port->x], layout.width);
+		}
+		cells = port->cells.data();
+	}
+
+	pack_encode(layout, cells, port->packed.data(), frame->wire.data(), d->isa);
+}
+
+static void flush(daemon_t* d) {
+	if (!rect_empty(d->dirty)) {
+		for (port_t* port : d->ports) {
+			if (rect_intersects(port->rect, d->dirty)) port->dirty = true;
+		}
+		d->dirty = NO_RECT;
+	}
+
+	for (port_t* port : d->ports) {
+		if (!port->dirty) continue;
+
+		out_frame_t* frame = &port->frames->back_buffer();
+		encode_port(d, port, frame);
+		frame->t_ready = now_ns();
+		if (!port->frames->publish()) port->skipped++;
+		port->dirty = false;
+	}
+
+	if (d->pending.empty()) return;
+
+	int64_t now = now_ns();
+	for (const pending_t& p : d->pending) {
+		hist_add(&d->ingest, now - p.t_recv);
+		hist_add(&d->interval_ingest, now - p.t_recv);
+		// Only meaningful for senders on this machine
+		if (p.t_ns > 0 && p.t_ns <= now) hist_add(&d->sender_to_writer, now - p.t_ns);
+		if (p.ack) send_ack(d, p);
+	}
+	d->pending.clear();
+}
+
+// Sockets
+
+static void receive_udp(daemon_t* d) {
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	struct sockaddr_storage addrs[UDP_BATCH];
+
+	while (true) {
+		for (int i = 0; i < UDP_BATCH; i++) {
+			iovs[i].iov_base = &d->udp_buffers[(size_t)i * UDP_MAX_DATAGRAM];
+			iovs[i].iov_len = UDP_MAX_DATAGRAM;
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+
+		int n = recvmmsg(d->udp.fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0) return;
+		int64_t t_recv = now_ns();
+
+		for (int i = 0; i < n; i++) {
+			const uint8_t* data = (const uint8_t*)iovs[i].iov_base;
+			size_t len = msgs[i].msg_len;
+
+			msg_header_t h;
+			if (len < MSG_HEADER_LEN || !msg_decode_header(data, &h) || h.len != len - MSG_HEADER_LEN) {
+				d->bad_messages++;
+				continue;
+			}
+
+			client_t* c = NULL;
+			for (client_t* other : d->clients) {
+				if (other->ep.fd < 0 && other->addr_len == msgs[i].msg_hdr.msg_namelen &&
+						memcmp(&other->addr, &addrs[i], other->addr_len) == 0) {
+					c = other;
+					break;
+				}
+			}
+			if (!c) {
+				c = new_client(d, -1);
+				c->ep.kind = ENDPOINT_UDP;
+				memcpy(&c->addr, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+				c->addr_len = msgs[i].msg_hdr.msg_namelen;
+			}
+
+			handle_message(d, c, h, data + MSG_HEADER_LEN, t_recv);
+		}
+
+		if (n < UDP_BATCH) return;
+	}
+}
+
+static void accept_clients(daemon_t* d, int listen_fd) {
+	while (true) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) return;
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		client_t* c = new_client(d, fd);
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &c->ep;
+		epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+// Returns false once the client has gone away or sent garbage
+static bool receive_stream(daemon_t* d, client_t* c) {
+	while (true) {
+		if (c->rx_len == c->rx.size()) break;
+
+		ssize_t n = read(c->ep.fd, &c->rx[c->rx_len], c->rx.size() - c->rx_len);
+		if (n == 0) return false;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			return false;
+		}
+		c->rx_len += n;
+
+		// Handle every complete message in place
+		int64_t t_recv = now_ns();
+		size_t off = 0;
+		while (c->rx_len - off >= MSG_HEADER_LEN) {
+			msg_header_t h;
+			if (!msg_decode_header(&c->rx[off], &h)) {
+				d->bad_messages++;
+				return false;
+			}
+
+			size_t need = MSG_HEADER_LEN + h.len;
+			if (need > c->rx.size()) {
+				memmove(&c->rx[0], &c->rx[off], c->rx_len - off);
+				c->rx_len -= off;
+				off = 0;
+				c->rx.resize(need);
+			}
+			if (c->rx_len - off < need) break;
+
+			handle_message(d, c, h, &c->rx[off + MSG_HEADER_LEN], t_recv);
+			off += need;
+		}
+
+		memmove(&c->rx[0], &c->rx[off], c->rx_len - off);
+		c->rx_len -= off;
+	}
+	return true;
+}
+
+static void expire_clients(daemon_t* d, int64_t timeout_ns) {
+	int64_t now = now_ns();
+	for (size_t i = 0; i < d->clients.size();) {
+		client_t* c = d->clients[i];
+		if (c->ep.fd < 0 && now - c->last_seen > timeout_ns) {
+			remove_client(d, c);
+		} else {
+			i++;
+		}
+	}
+}
+
+static int listen_on(daemon_t* d, endpoint_t* ep, endpoint_kind_t kind, int domain, int type, const struct sockaddr* addr, socklen_t addr_len) {
+	int fd = socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+
+	int one = 1;
+	if (domain == AF_INET) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, addr, addr_len) < 0 || (type == SOCK_STREAM && listen(fd, 16) < 0)) {
+		close(fd);
+		return -1;
+	}
+
+	ep->kind = kind;
+	ep->fd = fd;
+	ep->client = NULL;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = ep;
+	epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	return fd;
+}
+
+static bool open_sockets(daemon_t* d, const options_t& opt) {
+	d->udp.fd = d->tcp.fd = d->unix_stream.fd = -1;
+
+	// Localhost only, there's no authentication
+	struct sockaddr_in in;
+	memset(&in, 0, sizeof(in));
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (opt.udp_port > 0) {
+		in.sin_port = htons(opt.udp_port);
+		if (listen_on(d, &d->udp, ENDPOINT_UDP, AF_INET, SOCK_DGRAM, (struct sockaddr*)&in, sizeof(in)) < 0) {
+			fprintf(stderr, "Can't listen on udp port %d: %s\n", opt.udp_port, strerror(errno));
+			return false;
+		}
+		int size = 4 << 20;
+		setsockopt(d->udp.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		d->udp_buffers.resize((size_t)UDP_BATCH * UDP_MAX_DATAGRAM);
+	}
+
+	if (opt.tcp_port > 0) {
+		in.sin_port = htons(opt.tcp_port);
+		if (listen_on(d, &d->tcp, ENDPOINT_LISTEN, AF_INET, SOCK_STREAM, (struct sockaddr*)&in, sizeof(in)) < 0) {
+			fprintf(stderr, "Can't listen on tcp port %d: %s\n", opt.tcp_port, strerror(errno));
+			return false;
+		}
+	}
+
+	if (opt.unix_path && opt.unix_path[0]) {
+		struct sockaddr_un un;
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, opt.unix_path, sizeof(un.sun_path) - 1);
+		unlink(opt.unix_path);
+		if (listen_on(d, &d->unix_stream, ENDPOINT_LISTEN, AF_UNIX, SOCK_STREAM, (struct sockaddr*)&un, sizeof(un)) < 0) {
+			fprintf(stderr, "Can't listen on %s: %s\n", opt.unix_path, strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Setup
+
+// PATH[=LAYOUT[@X,Y]]
+static bool parse_port(const char* spec, const char* default_layout, port_t* port) {
+	std::string s(spec);
+	std::string layout_spec = default_layout;
+	port->x = port->y = 0;
+
+	size_t eq = s.find('=');
+	if (eq != std::string::npos) {
+		layout_spec = s.substr(eq + 1);
+		s = s.substr(0, eq);
+
+		size_t at = layout_spec.find('@');
+		if (at != std::string::npos) {
+			if (sscanf(layout_spec.c_str() + at + 1, "%d,%d", &port->x, &port->y) != 2 || port->x < 0 || port->y < 0) return false;
+			layout_spec = layout_spec.substr(0, at);
+		}
+	}
+
+	layout_desc_t desc;
+	if (!layout_parse(layout_spec.c_str(), &desc) || !layout_compile(desc, &port->layout)) return false;
+
+	port->path = s.empty() ? NULL : strdup(s.c_str());
+	port->rect.x0 = port->x;
+	port->rect.y0 = port->y;
+	port->rect.x1 = port->x + port->layout.width;
+	port->rect.y1 = port->y + port->layout.height;
+	return true;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: tappyd [options]\n"
+		"\n"
+		"  --port PATH[=LAYOUT[@X,Y]]  serial port driving the part of the canvas starting at\n"
+		"                              X,Y, can be given several times (default: dry run)\n"
+		"  --layout SPEC               layout of ports that don't give one (default v6:2x2)\n"
+		"  --baud N                    (default 115200)\n"
+		"  --conf U,I,D,P              initial pulse timing in ms (default 20,20,20,20)\n"
+		"  --thermal PCT               have the masters hold every tapper's duty cycle under\n"
+		"                              PCT percent, 0 for off (default: leave them alone),\n"
+		"                              v6 and bridge-v1 ports only\n"
+		"  --udp PORT                  localhost udp port, 0 to disable (default 7171)\n"
+		"  --tcp PORT                  localhost tcp port, 0 to disable (default 7171)\n"
+		"  --unix PATH                 unix stream socket, '' to disable (default /tmp/tappyd.sock)\n"
+		"  --client-timeout S          drop udp clients idle for S seconds (default 5)\n"
+		"  --stats S                   print stats every S seconds, 0 for never (default 10)\n"
+		"  --isa ISA                   scalar, sse2 or avx2 (default: best supported)\n");
+}
+
+int main(int argc, char** argv) {
+	options_t opt;
+	opt.udp_port = MSG_DEFAULT_PORT;
+	opt.tcp_port = MSG_DEFAULT_PORT;
+	opt.unix_path = MSG_DEFAULT_UNIX_PATH;
+	opt.layout_spec = "v6:2x2";
+	opt.baud = 115200;
+	for (int i = 0; i < 4; i++) opt.conf[i] = 2000;
+	opt.thermal = -1;
+	opt.client_timeout = 5;
+	opt.stats_interval = 10;
+	opt.isa = pack_best_isa();
+
+	std::vector<const char*> port_specs;
+
+	static struct option long_options[] = {
+		{"port", required_argument, 0, 'p'},
+		{"layout", required_argument, 0, 'l'},
+		{"baud", required_argument, 0, 'b'},
+		{"conf", required_argument, 0, 'c'},
+		{"thermal", required_argument, 0, 'H'},
+		{"udp", required_argument, 0, 'u'},
+		{"tcp", required_argument, 0, 't'},
+		{"unix", required_argument, 0, 'x'},
+		{"client-timeout", required_argument, 0, 'T'},
+		{"stats", required_argument, 0, 's'},
+		{"isa", required_argument, 0, 'I'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'p': port_specs.push_back(optarg); break;
+			case 'l': opt.layout_spec = optarg; break;
+			case 'b': opt.baud = atoi(optarg); break;
+			case 'c': {
+				float ms[4];
+				if (sscanf(optarg, "%f,%f,%f,%f", &ms[0], &ms[1], &ms[2], &ms[3]) != 4) {
+					usage();
+					return 1;
+				}
+				for (int i = 0; i < 4; i++) opt.conf[i] = (uint16_t)(ms[i] * 100);
+				break;
+			}
+			case 'H': opt.thermal = std::min(std::max(atoi(optarg), 0), 100); break;
+			case 'u': opt.udp_port = atoi(optarg); break;
+			case 't': opt.tcp_port = atoi(optarg); break;
+			case 'x': opt.unix_path = optarg; break;
+			case 'T': opt.client_timeout = atof(optarg); break;
+			case 's': opt.stats_interval = atof(optarg); break;
+			case 'I': {
+				if (!pack_parse_isa(optarg, &opt.isa) || !pack_isa_supported(opt.isa)) {
+					fprintf(stderr, "Unsupported isa %s\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			default: {
+				usage();
+				return c == 'h' ? 0 : 1;
+			}
+		}
+	}
+	if (port_specs.empty()) port_specs.push_back("");
+
+	daemon_t d;
+	d.width = d.height = 0;
+	d.isa = opt.isa;
+	d.serial = 0;
+	d.dirty = NO_RECT;
+	d.conf_owner = NULL;
+	d.conf_priority = 0;
+	d.messages = d.bad_messages = d.acks_dropped = 0;
+	hist_reset(&d.ingest);
+	hist_reset(&d.sender_to_writer);
+	hist_reset(&d.interval_ingest);
+
+	for (const char* spec : port_specs) {
+		port_t* port = new port_t();
+		if (!parse_port(spec, opt.layout_spec, port)) {
+			fprintf(stderr, "Bad port %s\n", spec);
+			return 1;
+		}
+		d.width = std::max(d.width, port->rect.x1);
+		d.height = std::max(d.height, port->rect.y1);
+		d.ports.push_back(port);
+	}
+	d.canvas.assign((size_t)d.width * d.height, 0);
+
+	for (port_t* port : d.ports) {
+		port->have_link = port->path != NULL;
+		port->baud = opt.baud;
+		port->thermal = opt.thermal;
+		if (port->thermal >= 0 && !layout_has_commands(port->layout.desc.format)) {
+			fprintf(stderr, "Ignoring --thermal for %s, daisy masters have no thermal governor\n", port->path ? port->path : "dry run");
+			port->thermal = -1;
+		}
+		port->throttled = 0;
+		if (port->have_link) {
+			if (!link_open(&port->link, port->path, opt.baud)) return 1;
+			if (port->link.tty && layout_has_commands(port->layout.desc.format)) {
+				fprintf(stderr, "Waiting for master on %s\n", port->path);
+				link_handshake(&port->link, 3000);
+				print_master(port);
+			}
+			send_thermal(port);
+		}
+
+		port->frames = new triple_buffer_t<out_frame_t>();
+		for (int i = 0; i < 3; i++) port->frames->at(i).wire.resize(port->layout.frame_len);
+		port->confs = new spsc_queue_t<conf_frame_t>(16);
+		port->cells.resize((size_t)port->layout.width * port->layout.height);
+		port->packed.resize(port->layout.packed_len);
+		port->dirty = true;
+		port->written = 0;
+		port->skipped = 0;
+		port->have_conf = false;
+		port->resync = true;
+		port->reconnects = 0;
+		hist_reset(&port->write_latency);
+
+		fprintf(stderr, "%s: %s %dx%d boards at %d,%d, %zu bytes/frame\n", port->path ? port->path : "dry run",
+			layout_format_name(port->layout.desc.format), port->layout.desc.boards_x, port->layout.desc.boards_y,
+			port->x, port->y, port->layout.frame_len);
+	}
+
+	send_conf(&d, opt.conf);
+
+	d.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (!open_sockets(&d, opt)) return 1;
+
+	fprintf(stderr, "Canvas %dx%d tappers, listening on", d.width, d.height);
+	if (d.udp.fd >= 0) fprintf(stderr, " udp 127.0.0.1:%d", opt.udp_port);
+	if (d.tcp.fd >= 0) fprintf(stderr, " tcp 127.0.0.1:%d", opt.tcp_port);
+	if (d.unix_stream.fd >= 0) fprintf(stderr, " unix %s", opt.unix_path);
+	fprintf(stderr, "\n");
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (port_t* port : d.ports) port->writer = std::thread(run_writer, port);
+
+	int64_t timeout_ns = (int64_t)(opt.client_timeout * 1e9);
+	int64_t stats_ns = (int64_t)(opt.stats_interval * 1e9);
+	int64_t last_expire = now_ns(), last_stats = last_expire;
+	uint64_t last_messages = 0;
+	std::vector<uint64_t> last_written(d.ports.size(), 0);
+	while (!stopping) {
+		struct epoll_event events[MAX_EVENTS];
+		int n = epoll_wait(d.epoll_fd, events, MAX_EVENTS, 100);
+
+		for (int i = 0; i < n; i++) {
+			endpoint_t* ep = (endpoint_t*)events[i].data.ptr;
+			switch (ep->kind) {
+				case ENDPOINT_UDP: receive_udp(&d); break;
+				case ENDPOINT_LISTEN: accept_clients(&d, ep->fd); break;
+				case ENDPOINT_STREAM: {
+					if (!receive_stream(&d, ep->client) || (events[i].events & (EPOLLHUP | EPOLLERR))) remove_client(&d, ep->client);
+					break;
+				}
+			}
+		}
+
+		flush(&d);
+
+		int64_t now = now_ns();
+		if (now - last_expire >= 1000000000) {
+			expire_clients(&d, timeout_ns);
+			last_expire = now;
+		}
+
+		if (stats_ns > 0 && now - last_stats >= stats_ns) {
+			double secs = (now - last_stats) / 1e9;
+			fprintf(stderr, "%zu clients, %.0f msg/s, ingest p50 %.1f us p99 %.1f us", d.clients.size(),
+				(d.messages - last_messages) / secs, hist_percentile(&d.interval_ingest, 50) / 1e3,
+				hist_percentile(&d.interval_ingest, 99) / 1e3);
+			for (size_t i = 0; i < d.ports.size(); i++) {
+				uint64_t w = d.ports[i]->written;
+				fprintf(stderr, ", port %zu %.0f fps", i, (w - last_written[i]) / secs);
+				last_written[i] = w;
+			}
+			fprintf(stderr, "\n");
+
+			last_messages = d.messages;
+			hist_reset(&d.interval_ingest);
+			last_stats = now;
+		}
+	}
+
+	for (port_t* port : d.ports) port->writer.join();
+
+	fprintf(stderr, "\n%llu messages, %llu bad, %llu acks dropped\n", (unsigned long long)d.messages,
+		(unsigned long long)d.bad_messages, (unsigned long long)d.acks_dropped);
+	hist_print(stderr, "ingest", &d.ingest, 1000, "us");
+	hist_print(stderr, "sender-writer", &d.sender_to_writer, 1000, "us");
+	for (port_t* port : d.ports) {
+		char name[32];
+		snprintf(name, sizeof(name), "write %s", port->path ? port->path : "-");
+		hist_print(stderr, name, &port->write_latency, 1000, "us");
+		fprintf(stderr, "%14s %llu frames written, %llu skipped, %llu reconnects\n", "", (unsigned long long)port->written.load(),
+			(unsigned long long)port->skipped.load(), (unsigned long long)port->reconnects);
+		if (port->have_link) link_close(&port->link);
+	}
+
+	if (d.unix_stream.fd >= 0) unlink(opt.unix_path);
+	return 0;
+}
@@ -66,6 +66,7 @@ boolean debugSerial = false;
 boolean confd = false;
 
 TapConf tapConf;
+TapLink tapLink;
 
 boolean[][] states = new boolean[tapDimX][tapDimY];
 
@@ -89,6 +90,9 @@ PulseDragPoint pdp = PulseDragPoint.UP_END;
 public void setup() {
 	size(1000, 500);
 
+	// Needs to exist before the port opens, the master says "ready" as soon as it boots
+	tapLink = new TapLink(115200);
+
 	int targetIndex = 0;
 
 	if(enableConnection){
@@ -115,11 +119,17 @@ public void setup() {
 	}
 
 	tapConf = new TapConf(arduinoMaster, (int) (intialUpPulseLen*100), (int) (initialInterPulseDelay*100), (int) (initialDownPulseLen*100), (int) (initialPauseLen*100));
+
+	// If opening the port didn't reset the master it's still running and won't say
+	// "ready", ask it what it has instead (see docs/README-v6.md)
+	if (enableConnection) tapLink.resume();
 }
 
 public void draw() {
 	background(0);
 
+	tapLink.tick();
+
 	drawTapInteraction();	
 
 	translate(width/2, 0);
@@ -185,6 +195,13 @@ public void drawWaveAndConf() {
 	text(String.format("pauseLen : %.2f ms", (float)tapConf.pauseLen / 100), 20, 20+spacing*count++);
 	count++;
 	text(String.format("period/freq : %.2f * ms / %.2f * Hz", tapConf.period() / 100f, 100000f / tapConf.period()), 20, 20+spacing*count++);
+	count++;
+	if (tapLink.enabled) {
+		text(String.format("link host : %d%% util / %d retries", tapLink.hostUtil, tapLink.retries), 20, 20+spacing*count++);
+		text(String.format("link master : %d%% util / %d frames / %d bad / %d throttled", tapLink.masterUtil, tapLink.masterFrames, tapLink.masterBadFrames, tapLink.masterThrottled), 20, 20+spacing*count++);
+	} else {
+		text("link : no flow control", 20, 20+spacing*count++);
+	}
 
 	fill(255);
 	stroke(255);
@@ -357,8 +374,14 @@ public void setAllStates(boolean state) {
 }
 
 public void pushStates() {
-	writeArduinoMaster(0x81);
-	for (int boardIx = 0; boardIx < tapDimX * tapDimY / (boardTappersX*boardTappersY); boardIx++) {
+	tapLink.sendState(stateFrame());
+}
+
+public byte[] stateFrame() {
+	int numBoards = tapDimX * tapDimY / (boardTappersX*boardTappersY);
+	byte[] frame = new byte[numBoards*chipsPerBoard + 2];
+	frame[0] = (byte)0x81;
+	for (int boardIx = 0; boardIx < numBoards; boardIx++) {
 
 		// one state variable per chip
 		byte[] out = new byte[chipsPerBoard];
@@ -383,9 +406,10 @@ public void pushStates() {
 					}
 				}	 
 		}
-		writeArduinoMaster(out);
+		System.arraycopy(out, 0, frame, 1 + boardIx*chipsPerBoard, chipsPerBoard);
 	}
-	writeArduinoMaster(0x82);
+	frame[frame.length-1] = (byte)0x82;
+	return frame;
 }
 
 public byte setBit(byte val, int pos) {
@@ -419,16 +443,268 @@ public void writeArduinoMaster(byte[] bytes) {
 }
 
 void serialEvent(Serial port) {
-	if (!confd) {
-		String in = port.readString();
-		if (in == null) return;
-		if (trim(in).equals("ready")) tapConf.sendConf();
+	String in = port.readString();
+	if (in == null) return;
+
+	if (trim(in).equals("ready")) {
+		// The master (re)booted, start flow control from scratch
+		tapLink.reset();
+		tapConf.sendConf();
 		confd = true;
 		return;
 	}
 
+	String[] msg = splitTokens(trim(in), " ");
+	if (msg.length == 9 && msg[0].equals("info")) {
+		// The master kept running, only send what it doesn't already have
+		tapLink.reset();
+		if (!tapConf.matches(int(msg[4]), int(msg[5]), int(msg[6]), int(msg[7]))) tapConf.sendConf();
+		if (Long.parseLong(msg[8]) != TapLink.stateHash(stateFrame())) pushStates();
+		confd = true;
+		return;
+	}
+
+	if (tapLink.handle(msg)) return;
+
 	if (!debugSerial) return;
-	print(port.readString());
+	print(in);
+}
+
+// Link
+
+/*
+Credit based flow control with the master. Every frame is tagged with a sequence
+number (0x83 <seq>) and the master acknowledges it with "ack <seq> <consumed>" once
+latched, where <consumed> is how many bytes it has read from the UART so far (mod 2^16).
+The master also tells us its receive window in reply to 0x84, so we always know how
+many bytes can still be in flight and never send more than fit in its buffer.
+
+Conf frames are queued, state frames are latest wins: if a newer state comes in
+while we're waiting for credit, the older one is simply never sent. Against firmware
+that doesn't answer 0x84 we fall back to writing everything straight away.
+
+A master that didn't reset when we opened the port answers 0x89 with its conf and a
+hash of its states (stateHash()), so we only resend what differs.
+*/
+class TapLink {
+
+	final int timeoutMs = 250;
+	final int statsIntervalMs = 1000;
+
+	int baud;
+
+	// True once the master answered our window query
+	boolean enabled = false;
+	int window = 0;
+
+	// Bytes we've written and bytes the master has read, both mod 2^16
+	int sent = 0, consumed = 0;
+	// Value of sent right after our last window query, or -1 if none is pending
+	int sentAtQuery = -1;
+
+	int nextSeq = 0;
+	// Tagged frames sent but not acked or nacked yet
+	int unacked = 0;
+	int lastStateSeq = -1;
+	byte[] lastState;
+
+	byte[] current;
+	int currentOff = 0;
+	byte[] pendingConf, pendingState;
+
+	long lastProgressMs = 0;
+
+	// Live counters
+	int retries = 0;
+	int hostUtil = 0;
+	int masterFrames = 0, masterBadFrames = 0, masterUtil = 0;
+	// Tappers held back by the master's thermal governor (0x8B), from its "thermal" lines
+	int masterThrottled = 0;
+	int statsBytes = 0;
+	long statsStartMs = 0;
+
+	public TapLink(int baud) {
+		this.baud = baud;
+	}
+
+	public synchronized void reset() {
+		enabled = false;
+		sent = 0;
+		consumed = 0;
+		current = null;
+		pendingConf = null;
+		pendingState = null;
+		queryWindow();
+	}
+
+	// Flush whatever frame the last host may have left the master in the middle of, then
+	// ask for its info
+	public synchronized void resume() {
+		byte[] bytes = new byte[13];
+		java.util.Arrays.fill(bytes, (byte)0x82);
+		bytes[12] = (byte)0x89;
+		writeRaw(bytes);
+	}
+
+	// 32 bit FNV-1a over the chip bytes of a state frame, what the master reports in "info"
+	static long stateHash(byte[] frame) {
+		long hash = 2166136261L;
+		for (int i = 1; i < frame.length - 1; i++) hash = ((hash ^ (frame[i] & 0xFF)) * 16777619L) & 0xFFFFFFFFL;
+		return hash;
+	}
+
+	public synchronized void sendConf(byte[] frame) {
+		if (!enabled) {
+			writeRaw(frame);
+			return;
+		}
+		pendingConf = frame;
+		pump();
+	}
+
+	public synchronized void sendState(byte[] frame) {
+		if (!enabled) {
+			writeRaw(frame);
+			return;
+		}
+		pendingState = frame;
+		pump();
+	}
+
+	public int inFlight() {
+		return (sent - consumed) & 0xFFFF;
+	}
+
+	// Write as much of the queued frames as the master has room for
+	void pump() {
+		while (true) {
+			if (current == null) {
+				byte[] next;
+				boolean isState = false;
+				if (pendingConf != null) {
+					next = pendingConf;
+					pendingConf = null;
+				} else if (pendingState != null) {
+					next = pendingState;
+					pendingState = null;
+					isState = true;
+				} else {
+					return;
+				}
+
+				int seq = nextSeq;
+				nextSeq = (nextSeq + 1) % 0x80;
+				unacked++;
+				if (isState) {
+					lastStateSeq = seq;
+					lastState = next;
+				}
+
+				current = new byte[next.length + 2];
+				current[0] = (byte)0x83;
+				current[1] = (byte)seq;
+				System.arraycopy(next, 0, current, 2, next.length);
+				currentOff = 0;
+			}
+
+			int credit = window - inFlight();
+			if (credit <= 0) return;
+
+			int n = min(credit, current.length - currentOff);
+			writeRaw(subset(current, currentOff, n));
+			currentOff += n;
+			if (currentOff == current.length) current = null;
+		}
+	}
+
+	void queryWindow() {
+		writeRaw(new byte[] {(byte)0x84});
+		sentAtQuery = sent;
+		lastProgressMs = millis();
+	}
+
+	void writeRaw(byte[] bytes) {
+		writeArduinoMaster(bytes);
+		sent = (sent + bytes.length) & 0xFFFF;
+		statsBytes += bytes.length;
+	}
+
+	void progress(String consumedField) {
+		consumed = int(consumedField) & 0xFFFF;
+		lastProgressMs = millis();
+	}
+
+	// Returns true if the line was a link message
+	public synchronized boolean handle(String[] msg) {
+		if (msg.length == 0) return false;
+
+		if (msg[0].equals("window") && msg.length == 3) {
+			progress(msg[1]);
+			window = int(msg[2]);
+			if (sentAtQuery >= 0) {
+				// The master read everything up to and including our query, so whatever
+				// it didn't count before that never made it and is no longer in flight
+				int lost = (sentAtQuery - consumed) & 0xFFFF;
+				sent = (sent - lost) & 0xFFFF;
+				sentAtQuery = -1;
+			}
+			enabled = true;
+			pump();
+			return true;
+		} else if (msg[0].equals("credit") && msg.length == 2) {
+			progress(msg[1]);
+			pump();
+			return true;
+		} else if (msg[0].equals("ack") && msg.length == 3) {
+			progress(msg[2]);
+			unacked = max(0, unacked - 1);
+			pump();
+			return true;
+		} else if (msg[0].equals("nak") && msg.length == 3) {
+			progress(msg[2]);
+			unacked = max(0, unacked - 1);
+			retries++;
+			// Only the newest state matters, resend it unless something newer is queued
+			if (int(msg[1]) == lastStateSeq && pendingState == null) pendingState = lastState;
+			pump();
+			return true;
+		} else if (msg[0].equals("stats") && msg.length == 4) {
+			masterFrames = int(msg[1]);
+			masterBadFrames = int(msg[2]);
+			masterUtil = int(msg[3]);
+			return true;
+		} else if (msg[0].equals("thermal") && msg.length == 4) {
+			masterThrottled = int(msg[1]);
+			return true;
+		}
+
+		return false;
+	}
+
+	// Called every frame to refresh the counters and recover from lost bytes
+	public synchronized void tick() {
+		long now = millis();
+
+		if (now - statsStartMs >= statsIntervalMs) {
+			hostUtil = (int)(statsBytes * 100L * 1000 / (baud / 10) / (now - statsStartMs));
+			statsBytes = 0;
+			statsStartMs = now;
+			if (enabled) writeRaw(new byte[] {(byte)0x85});
+		}
+
+		if (!enabled) return;
+
+		// Stats queries are never acked, only wait on frames and on running out of credit
+		boolean waiting = unacked > 0 || current != null || sentAtQuery >= 0;
+		if (waiting && now - lastProgressMs > timeoutMs) {
+			// Bytes went missing on the way, work out how many and resend the latest state
+			retries++;
+			unacked = 0;
+			current = null;
+			if (pendingState == null) pendingState = lastState;
+			queryWindow();
+		}
+	}
 }
 
 // Conf
@@ -448,23 +724,30 @@ class TapConf {
 	}
 
 	public void sendConf() {
-		writeArduinoMaster(0x80);
+		byte[] frame = new byte[] {
+			(byte)0x80,
 
-		writeArduinoMaster((byte)(upPulseLen & 0xFF));
-		writeArduinoMaster((byte)((upPulseLen & 0xFF00) >> 8));
+			(byte)(upPulseLen & 0xFF),
+			(byte)((upPulseLen & 0xFF00) >> 8),
 
-		writeArduinoMaster((byte)(interPulseDelay & 0xFF));
-		writeArduinoMaster((byte)((interPulseDelay & 0xFF00) >> 8));
+			(byte)(interPulseDelay & 0xFF),
+			(byte)((interPulseDelay & 0xFF00) >> 8),
 
-		writeArduinoMaster((byte)(downPulseLen & 0xFF));
-		writeArduinoMaster((byte)((downPulseLen & 0xFF00) >> 8));
+			(byte)(downPulseLen & 0xFF),
+			(byte)((downPulseLen & 0xFF00) >> 8),
 
-		writeArduinoMaster((byte)(pauseLen & 0xFF));
-		writeArduinoMaster((byte)((pauseLen & 0xFF00) >> 8));
+			(byte)(pauseLen & 0xFF),
+			(byte)((pauseLen & 0xFF00) >> 8)
+		};
+		tapLink.sendConf(frame);
 
 		dirty = false;
 	}
 
+	public boolean matches(int up, int inter, int down, int pause) {
+		return up == upPulseLen && inter == interPulseDelay && down == downPulseLen && pause == pauseLen;
+	}
+
 	public int period() {
 		return upPulseLen+interPulseDelay+downPulseLen+pauseLen;
 	}